@@ -1,5 +1,6 @@
 """
 For parsing data files downloaded from National Library of Medicine (for e.g., https://www.ncbi.nlm.nih.gov/nuccore/HQ287898.1)
+Note: FASTA/FASTQ files can also be loaded directly with read_fasta()/read_fastq(), see the README
 """
 def extract_dna_sequences(input_file, output_file):
     with open(input_file, 'r') as infile, open(output_file, 'w') as outfile:
@@ -49,3 +50,51 @@ output_file = 'random_nucleotides_1K_100Kb.txt'
 generate_random_nucleotides(output_file, 1000)
 
 # Side note: place the output files in /tmp/ or some other place (not home dir), otherwise postgres cannot access them!
+
+"""
+Writing sequences to a UCSC .2bit file, for trying out dna_ref without the UCSC tools (faToTwoBit)
+Runs of N become N blocks and lowercase nucleotides become mask blocks, like faToTwoBit does
+"""
+import struct
+
+def write_2bit(output_file, sequences):
+    def blocks(sequence, wanted):
+        found, start = [], None
+        for i, nucleotide in enumerate(sequence):
+            if wanted(nucleotide) and start is None:
+                start = i
+            elif not wanted(nucleotide) and start is not None:
+                found.append((start, i - start))
+                start = None
+        if start is not None:
+            found.append((start, len(sequence) - start))
+        return found
+
+    def uint32s(values):
+        return b''.join(struct.pack('<I', value) for value in values)
+
+    codes = {'T': 0, 'C': 1, 'A': 2, 'G': 3, 'N': 0}  # N is stored as T, the N blocks say where they really are
+    header = struct.pack('<IIII', 0x1A412743, 0, len(sequences), 0)
+    offset = len(header) + sum(1 + len(name) + 4 for name in sequences)
+    index, records = b'', b''
+    for name, sequence in sequences.items():
+        index += struct.pack('<B', len(name)) + name.encode() + struct.pack('<I', offset + len(records))
+        n_blocks = blocks(sequence, lambda nucleotide: nucleotide in 'Nn')
+        mask_blocks = blocks(sequence, str.islower)
+        records += struct.pack('<II', len(sequence), len(n_blocks))
+        records += uint32s(start for start, _ in n_blocks) + uint32s(size for _, size in n_blocks)
+        records += struct.pack('<I', len(mask_blocks))
+        records += uint32s(start for start, _ in mask_blocks) + uint32s(size for _, size in mask_blocks)
+        records += struct.pack('<I', 0)  # Reserved
+        sequence = sequence.upper()
+        for i in range(0, len(sequence), 4):  # 4 nucleotides per byte, first one in the top 2 bits
+            byte = 0
+            for nucleotide in sequence[i:i + 4].ljust(4, 'T'):
+                byte = (byte << 2) | codes[nucleotide]
+            records += struct.pack('<B', byte)
+
+    with open(output_file, 'wb') as outfile:
+        outfile.write(header + index + records)
+
+# The N block fixture used in test.sql (also checked in as data/n_blocks.2bit)
+write_2bit('n_blocks.2bit', {'chr1': 'ACGTACGTACNNNNNGATTACAGG'})
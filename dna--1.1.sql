@@ -0,0 +1,1075 @@
+\echo Use "CREATE EXTENSION dna" to load this file. \quit
+
+--Input/Output
+
+CREATE OR REPLACE FUNCTION dna_in(cstring)
+  RETURNS dna
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_out(dna)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_recv(internal)
+  RETURNS dna
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_send(dna)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE dna (
+  internallength = variable,
+  input          = dna_in,
+  output         = dna_out,
+  receive        = dna_recv,
+  send           = dna_send,
+  alignment      = int,
+  storage        = extended -- Required for passing in large strings, otherwise postgres doesn't allow more than 8kb
+);
+
+CREATE OR REPLACE FUNCTION dna(text)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'dna_cast_from_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION text(dna)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'dna_cast_to_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text as dna) WITH FUNCTION dna(text) AS IMPLICIT;
+CREATE CAST (dna as text) WITH FUNCTION text(dna);
+
+
+--Constructor
+
+CREATE FUNCTION dna_construct(text)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'dna_constructor'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Operators
+
+CREATE FUNCTION equals(dna, dna)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'equals'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_ne(dna, dna)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_ne'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+
+CREATE OPERATOR ~= (
+  LEFTARG = dna, RIGHTARG = dna,
+  PROCEDURE = equals,
+  COMMUTATOR = ~=, NEGATOR = <>
+);
+
+CREATE OPERATOR = (
+    LEFTARG = dna, RIGHTARG = dna,
+    PROCEDURE = equals,
+    COMMUTATOR = ~=, NEGATOR = <>
+);
+
+CREATE OPERATOR <> (
+  LEFTARG = dna, RIGHTARG = dna,
+  PROCEDURE = dna_ne,
+  COMMUTATOR = <>, NEGATOR = ~=
+);
+
+--Functions
+
+ CREATE FUNCTION length(dna)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'length'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--K-mers
+
+--Input/Output functions
+CREATE OR REPLACE FUNCTION kmer_in(cstring)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_out(kmer)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_recv(internal)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_send(kmer)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Type definition
+ -- Fixed size: 4 bytes for length + 8 bytes for bit_sequence (total 12 bytes, aligned to 16 bytes)
+CREATE TYPE kmer (
+  internallength = 16,
+  input          = kmer_in,
+  output         = kmer_out,
+  receive        = kmer_recv,
+  send           = kmer_send,
+  alignment      = int
+);
+
+--Casting Functions
+CREATE OR REPLACE FUNCTION kmer(text)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'kmer_cast_from_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION text(kmer)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'kmer_cast_to_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text AS kmer) WITH FUNCTION kmer(text) AS IMPLICIT;
+CREATE CAST (kmer AS text) WITH FUNCTION text(kmer);
+
+--Constructor
+CREATE FUNCTION kmer_construct(text)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'kmer_constructor'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Operators
+CREATE FUNCTION kmer_eq(kmer, kmer)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'kmer_eq'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_ne(kmer, kmer)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'kmer_ne'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ~= (
+  LEFTARG = kmer,
+  RIGHTARG = kmer,
+  PROCEDURE = kmer_eq,
+  COMMUTATOR = ~=, NEGATOR = <>
+);
+
+CREATE OPERATOR = (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_eq,
+    COMMUTATOR = ~=, NEGATOR = <>
+);
+
+CREATE OPERATOR <> (
+  LEFTARG = kmer, RIGHTARG = kmer,
+  PROCEDURE = kmer_ne,
+  COMMUTATOR = <>, NEGATOR = ~=
+);
+
+--Length
+CREATE FUNCTION length(kmer)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'kmer_length'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Generate K-mers from DNA
+--First arg is cast from string to DNA with "dna_cast_from_text" directly
+--Returns a set of k-mers (of type kmer!)
+CREATE FUNCTION generate_kmers(dna dna, k int)
+RETURNS SETOF kmer
+AS 'MODULE_PATHNAME', 'generate_kmers'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION starts_with(kmer, kmer) RETURNS boolean
+AS 'MODULE_PATHNAME', 'starts_with'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR ^@ (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = starts_with
+);
+
+--For defining the hash function for the kmer type
+CREATE FUNCTION kmer_hash(kmer)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME', 'kmer_hash'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS kmer_hash_ops
+DEFAULT FOR TYPE kmer USING HASH AS
+    OPERATOR 1 = (kmer, kmer),
+    FUNCTION 1 kmer_hash(kmer);
+
+-- Qkmer type
+CREATE FUNCTION qkmer_in(cstring) RETURNS qkmer
+    AS 'MODULE_PATHNAME', 'qkmer_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qkmer_out(qkmer) RETURNS cstring
+    AS 'MODULE_PATHNAME', 'qkmer_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qkmer_recv(internal) RETURNS qkmer
+    AS 'MODULE_PATHNAME', 'qkmer_recv'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qkmer_send(qkmer) RETURNS bytea
+    AS 'MODULE_PATHNAME', 'qkmer_send'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- Fixed size: 4 bytes for length + 2 * 8 bytes of 4-bit masks, one per position (24 bytes with padding)
+CREATE TYPE qkmer (
+    INTERNALLENGTH = 24,
+    INPUT = qkmer_in,
+    OUTPUT = qkmer_out,
+    RECEIVE = qkmer_recv,
+    SEND = qkmer_send,
+    ALIGNMENT = double
+);
+
+CREATE FUNCTION length(qkmer) RETURNS int
+    AS 'MODULE_PATHNAME', 'qkmer_length'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION equals(qkmer, qkmer) RETURNS boolean
+    AS 'MODULE_PATHNAME', 'qkmer_eq'
+     LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION qkmer(text)
+  RETURNS qkmer
+  AS 'MODULE_PATHNAME', 'qkmer_cast_from_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION text(qkmer)
+    RETURNS text
+    AS 'MODULE_PATHNAME', 'qkmer_cast_to_text'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text AS qkmer) WITH FUNCTION qkmer(text) AS IMPLICIT;
+CREATE CAST (qkmer AS text) WITH FUNCTION text(qkmer);
+
+CREATE OPERATOR = (
+    LEFTARG = qkmer,
+    RIGHTARG = qkmer,
+    PROCEDURE = equals
+);
+
+--For Qkmer pattern search
+CREATE FUNCTION contains(qkmer, kmer) RETURNS boolean
+AS 'MODULE_PATHNAME', 'contains'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR @> (
+    LEFTARG = qkmer,
+    RIGHTARG = kmer,
+    PROCEDURE = contains
+);
+
+-- For the SpGiST index
+CREATE FUNCTION get_oid(kmer)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'get_oid'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION spgist_kmer_config(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer_config'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer_choose(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer_choose'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer_picksplit(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer_picksplit'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer_inner_consistent(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer_inner_consistent'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer_leaf_consistent(internal, internal) RETURNS bool
+    AS 'MODULE_PATHNAME', 'spgist_kmer_leaf_consistent'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR CLASS spgist_kmer_ops
+DEFAULT FOR TYPE kmer USING spgist AS
+    OPERATOR 1 = (kmer, kmer),
+    OPERATOR 2 ^@ (kmer, kmer),
+    OPERATOR 3 @> (qkmer, kmer), -- DOES NOT WORK
+    FUNCTION 1 spgist_kmer_config(internal, internal),
+    FUNCTION 2 spgist_kmer_choose(internal, internal),
+    FUNCTION 3 spgist_kmer_picksplit(internal, internal),
+    FUNCTION 4 spgist_kmer_inner_consistent(internal, internal),
+    FUNCTION 5 spgist_kmer_leaf_consistent(internal, internal),
+    STORAGE kmer;
+
+
+-- DNA batch type: many sequences packed into one value
+
+CREATE OR REPLACE FUNCTION dna_batch_in(cstring)
+  RETURNS dna_batch
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_batch_out(dna_batch)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_batch_recv(internal)
+  RETURNS dna_batch
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_batch_send(dna_batch)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE dna_batch (
+  internallength = variable,
+  input          = dna_batch_in,
+  output         = dna_batch_out,
+  receive        = dna_batch_recv,
+  send           = dna_batch_send,
+  alignment      = double, -- The bit stream is read as 64-bit chunks
+  storage        = extended
+);
+
+CREATE FUNCTION cardinality(dna_batch)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'dna_batch_cardinality'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION unnest(dna_batch)
+  RETURNS SETOF dna
+  AS 'MODULE_PATHNAME', 'dna_batch_unnest'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--K-mers of every sequence in the batch (k-mers never span two sequences)
+CREATE FUNCTION generate_kmers_batch(batch dna_batch, k int)
+  RETURNS SETOF kmer
+  AS 'MODULE_PATHNAME', 'generate_kmers_batch'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_batch_agg_transfn(internal, dna)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION dna_batch_agg_finalfn(internal)
+  RETURNS dna_batch
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE dna_batch_agg(dna) (
+  SFUNC     = dna_batch_agg_transfn,
+  STYPE     = internal,
+  FINALFUNC = dna_batch_agg_finalfn
+);
+
+-- DNA reference type: a region of a sequence in a UCSC .2bit file on the server
+
+CREATE OR REPLACE FUNCTION dna_ref_in(cstring)
+  RETURNS dna_ref
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_ref_out(dna_ref)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_ref_recv(internal)
+  RETURNS dna_ref
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_ref_send(dna_ref)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE dna_ref (
+  internallength = variable,
+  input          = dna_ref_in,
+  output         = dna_ref_out,
+  receive        = dna_ref_recv,
+  send           = dna_ref_send,
+  alignment      = double
+);
+
+CREATE FUNCTION dna_ref(file text, name text, start bigint, length bigint)
+  RETURNS dna_ref
+  AS 'MODULE_PATHNAME', 'dna_ref_constructor'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION length(dna_ref)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'dna_ref_length'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Start is 0-based and relative to the region
+CREATE FUNCTION "substring"(ref dna_ref, start bigint, length bigint)
+  RETURNS dna_ref
+  AS 'MODULE_PATHNAME', 'dna_ref_substring'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--These read the .2bit file, so they are only STABLE
+CREATE FUNCTION dna(dna_ref)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'dna_ref_to_dna'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (dna_ref AS dna) WITH FUNCTION dna(dna_ref);
+
+CREATE FUNCTION generate_kmers_ref(ref dna_ref, k int)
+  RETURNS SETOF kmer
+  AS 'MODULE_PATHNAME', 'generate_kmers_ref'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+-- FASTA/FASTQ readers, stream records from a file on the server
+-- (needs superuser or pg_read_server_files, same as COPY FROM a file)
+-- skip_invalid drops the records with anything but A, C, G, T (e.g. N) instead of failing
+
+CREATE FUNCTION read_fasta(path text, skip_invalid bool DEFAULT false)
+  RETURNS TABLE (name text, sequence dna)
+  AS 'MODULE_PATHNAME', 'read_fasta'
+  LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION read_fastq(path text, skip_invalid bool DEFAULT false)
+  RETURNS TABLE (name text, sequence dna, quality text)
+  AS 'MODULE_PATHNAME', 'read_fastq'
+  LANGUAGE C VOLATILE STRICT;
+
+--Reverse complement
+
+CREATE FUNCTION revcomp(dna)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'dna_revcomp'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION revcomp(kmer)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'kmer_revcomp'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Base composition, counted with popcounts on the packed chunks
+--Out of line values are read a TOAST slice at a time
+
+CREATE FUNCTION gc_content(dna)
+  RETURNS double precision
+  AS 'MODULE_PATHNAME', 'dna_gc_content'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gc_content(kmer)
+  RETURNS double precision
+  AS 'MODULE_PATHNAME', 'kmer_gc_content'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION base_counts(dna, OUT a bigint, OUT c bigint, OUT g bigint, OUT t bigint)
+  RETURNS record
+  AS 'MODULE_PATHNAME', 'dna_base_counts'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--GC content of every window that fits in the sequence, non-overlapping unless a step is given
+CREATE FUNCTION gc_content(dna dna, window_size int)
+  RETURNS TABLE (start bigint, gc_content double precision)
+  AS 'MODULE_PATHNAME', 'dna_gc_content_windows'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION gc_content(dna dna, window_size int, step int)
+  RETURNS TABLE (start bigint, gc_content double precision)
+  AS 'MODULE_PATHNAME', 'dna_gc_content_windows'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Approximate matching (Myers' bit-vector algorithm)
+
+--Every position where pattern occurs in haystack with at most max_edits edits, end_pos is end-exclusive
+CREATE FUNCTION dna_find_approx(haystack dna, pattern dna, max_edits int)
+  RETURNS TABLE (end_pos bigint, edits int)
+  AS 'MODULE_PATHNAME', 'dna_find_approx'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Edit distance, anything over max_dist comes back as max_dist + 1
+--Not STRICT so that max_dist can default to NULL (no limit)
+CREATE FUNCTION dna_edit_distance(a dna, b dna, max_dist int DEFAULT NULL)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'dna_edit_distance'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION dna_distance(dna, dna)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'dna_edit_distance'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <~> (
+  LEFTARG = dna, RIGHTARG = dna,
+  PROCEDURE = dna_distance,
+  COMMUTATOR = <~>
+);
+
+--Pairwise alignment with affine gaps, mode is local (Smith-Waterman), global (Needleman-Wunsch) or semiglobal
+--Penalties are positive numbers, a gap of length L costs gap_open + (L - 1) * gap_extend
+CREATE FUNCTION dna_align(query dna, target dna, mode text DEFAULT 'local',
+                          match int DEFAULT 2, mismatch int DEFAULT 3, gap_open int DEFAULT 5, gap_extend int DEFAULT 2,
+                          OUT score bigint, OUT query_start bigint, OUT query_end bigint,
+                          OUT target_start bigint, OUT target_end bigint, OUT cigar text)
+  RETURNS record
+  AS 'MODULE_PATHNAME', 'dna_align'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Hamming distance of sequences/k-mers of the same length, hamming_le stops counting once it's over d
+
+CREATE FUNCTION hamming(dna, dna)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'dna_hamming'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hamming_le(a dna, b dna, d int)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_hamming_le'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hamming(kmer, kmer)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'kmer_hamming'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hamming_le(a kmer, b kmer, d int)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'kmer_hamming_le'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Concatenation on the packed words
+
+CREATE FUNCTION dna_concat(dna, dna)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'dna_concat'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR || (
+  LEFTARG = dna, RIGHTARG = dna,
+  PROCEDURE = dna_concat
+);
+
+CREATE FUNCTION dna_agg_transfn(internal, dna)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION dna_agg_finalfn(internal)
+  RETURNS dna
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+--Use ORDER BY inside the call to pick the order, e.g. dna_agg(chunk ORDER BY position)
+CREATE AGGREGATE dna_agg(dna) (
+  SFUNC     = dna_agg_transfn,
+  STYPE     = internal,
+  FINALFUNC = dna_agg_finalfn
+);
+
+--Translation to protein, table is an NCBI genetic code id (1 is the standard code)
+--Frames 1, 2, 3 read the sequence from its first, second, third nucleotide, -1, -2, -3 the reverse complement
+
+CREATE FUNCTION translate(dna dna, frame int, "table" int DEFAULT 1)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'dna_translate'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION six_frame_translate(dna dna, "table" int DEFAULT 1)
+  RETURNS TABLE (frame int, protein text)
+  AS 'MODULE_PATHNAME', 'dna_six_frame_translate'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Open reading frames from ATG to a stop codon, start and "end" are 0 based and end exclusive on the forward strand
+--min_len is in nucleotides and includes the stop codon
+
+CREATE FUNCTION find_orfs(dna dna, min_len int, both_strands bool)
+  RETURNS TABLE (start bigint, "end" bigint, frame int, strand text)
+  AS 'MODULE_PATHNAME', 'dna_find_orfs'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Low complexity (symmetric DUST), scores are 10 * sum(c_t * (c_t - 1) / 2) / (l - 1) over the l triplets of a window
+--20 is the usual threshold, as in dustmasker and minimap2
+
+CREATE FUNCTION dust_score(dna dna, window_size int DEFAULT 64)
+  RETURNS float8
+  AS 'MODULE_PATHNAME', 'dna_dust_score'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION low_complexity_regions(dna dna, window_size int DEFAULT 64, threshold int DEFAULT 20)
+  RETURNS TABLE (start bigint, "end" bigint)
+  AS 'MODULE_PATHNAME', 'dna_low_complexity_regions'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--K-mers that don't overlap any low complexity region
+CREATE FUNCTION generate_kmers(dna dna, k int, dust_window int, dust_threshold int)
+  RETURNS SETOF kmer
+  AS 'MODULE_PATHNAME', 'generate_kmers_unmasked'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--FM-index of one sequence: BWT in cache line sized rank blocks plus a sampled suffix array
+--It has no text input, build it with dna_fmindex(), e.g. in a generated column
+
+CREATE OR REPLACE FUNCTION fm_index_in(cstring)
+  RETURNS fm_index
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION fm_index_out(fm_index)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE fm_index (
+  internallength = variable,
+  input          = fm_index_in,
+  output         = fm_index_out,
+  alignment      = double,
+  storage        = external -- Not worth compressing, and fm_count()/fm_locate() cache the index by its TOAST pointer
+);
+
+CREATE FUNCTION dna_fmindex(dna dna, sample_rate int DEFAULT 32)
+  RETURNS fm_index
+  AS 'MODULE_PATHNAME', 'dna_fmindex'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION fm_count(fm_index, dna)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'fm_count'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION fm_locate(fm_index, dna)
+  RETURNS bigint[]
+  AS 'MODULE_PATHNAME', 'fm_locate'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Exact substring search, indexable with the dna_fm access method (FM-indexes of the concatenated sequences)
+
+CREATE FUNCTION dna_contains(dna, dna)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_contains'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+  LEFTARG = dna,
+  RIGHTARG = dna,
+  PROCEDURE = dna_contains,
+  RESTRICT = contsel,
+  JOIN = contjoinsel
+);
+
+CREATE FUNCTION dna_fm_handler(internal)
+  RETURNS index_am_handler
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C;
+
+CREATE ACCESS METHOD dna_fm TYPE INDEX HANDLER dna_fm_handler;
+
+CREATE OPERATOR CLASS dna_fm_ops
+DEFAULT FOR TYPE dna USING dna_fm AS
+    OPERATOR 1 @> (dna, dna);
+
+--Read mapping against a table of references, through a table of their minimizers (ref_id, minimizer, pos, strand)
+--built once with minimizers() and the same k and w
+
+CREATE FUNCTION minimizers(sequence dna, k int DEFAULT 15, w int DEFAULT 10)
+  RETURNS TABLE (minimizer bigint, pos bigint, strand text)
+  AS 'MODULE_PATHNAME', 'dna_minimizers'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION map_read(read dna, refs regclass, ref_minimizers regclass, k int DEFAULT 15, w int DEFAULT 10,
+                         id_column name DEFAULT 'id', sequence_column name DEFAULT 'sequence',
+                         OUT ref_id bigint, OUT pos bigint, OUT strand text, OUT score bigint, OUT cigar text)
+  RETURNS record
+  AS 'MODULE_PATHNAME', 'dna_map_read'
+  LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+--De Bruijn graph of the k-mers of the reads, compacted into unitigs (coverage is the mean count of their k-mers)
+
+CREATE FUNCTION dbg_unitigs(reads dna[], k int, canonical bool DEFAULT true)
+  RETURNS TABLE (unitig dna, coverage float8)
+  AS 'MODULE_PATHNAME', 'dna_dbg_unitigs'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--K-mer frequencies as dense feature vectors: element i is the i-th k-mer in lexicographic order (AA..A first, TT..T last),
+--canonical vectors only have the k-mers that aren't bigger than their reverse complement
+
+CREATE FUNCTION kmer_frequency_vector(dna dna, k int, canonical bool DEFAULT false)
+  RETURNS float4[]
+  AS 'MODULE_PATHNAME', 'dna_kmer_frequency_vector'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--One vector per window that fits in the sequence, non-overlapping unless a step is given
+CREATE FUNCTION kmer_frequency_vector(dna dna, k int, canonical bool, window_size int)
+  RETURNS TABLE (start bigint, frequencies float4[])
+  AS 'MODULE_PATHNAME', 'dna_kmer_frequency_windows'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_frequency_vector(dna dna, k int, canonical bool, window_size int, step int)
+  RETURNS TABLE (start bigint, frequencies float4[])
+  AS 'MODULE_PATHNAME', 'dna_kmer_frequency_windows'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--ntHash rolling hashes of every k-mer, for any k (also longer than a kmer can hold)
+
+CREATE FUNCTION generate_kmer_hashes(dna dna, k int, canonical bool DEFAULT false)
+  RETURNS SETOF bigint
+  AS 'MODULE_PATHNAME', 'generate_kmer_hashes'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Greedy clustering at an identity threshold, longest sequences first. Returns the cluster of every input in input order,
+--as the 1-based position of the input representing it, so use ORDER BY and line it up with array_agg() in the same order
+
+CREATE FUNCTION dna_cluster_agg_transfn(internal, dna, float8)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION dna_cluster_agg_finalfn(internal)
+  RETURNS int[]
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE dna_cluster_agg(dna, identity float8) (
+  SFUNC     = dna_cluster_agg_transfn,
+  STYPE     = internal,
+  FINALFUNC = dna_cluster_agg_finalfn
+);
+
+-- 128-bit K-mer type: k-mers of up to 64 nucleotides (kmer stays the smaller, faster type for k <= 32)
+
+CREATE OR REPLACE FUNCTION kmer128_in(cstring)
+  RETURNS kmer128
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer128_out(kmer128)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer128_recv(internal)
+  RETURNS kmer128
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer128_send(kmer128)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+ -- Fixed size: 4 bytes for length + 2 * 8 bytes for bit_sequence (24 bytes with padding)
+CREATE TYPE kmer128 (
+  internallength = 24,
+  input          = kmer128_in,
+  output         = kmer128_out,
+  receive        = kmer128_recv,
+  send           = kmer128_send,
+  alignment      = double
+);
+
+CREATE OR REPLACE FUNCTION kmer128(text)
+  RETURNS kmer128
+  AS 'MODULE_PATHNAME', 'kmer128_cast_from_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION text(kmer128)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'kmer128_cast_to_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer128(kmer)
+  RETURNS kmer128
+  AS 'MODULE_PATHNAME', 'kmer128_from_kmer'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Fails for k-mers longer than 32
+CREATE OR REPLACE FUNCTION kmer(kmer128)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'kmer_from_kmer128'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text AS kmer128) WITH FUNCTION kmer128(text) AS ASSIGNMENT;
+CREATE CAST (kmer128 AS text) WITH FUNCTION text(kmer128);
+CREATE CAST (kmer AS kmer128) WITH FUNCTION kmer128(kmer) AS ASSIGNMENT;
+CREATE CAST (kmer128 AS kmer) WITH FUNCTION kmer(kmer128);
+
+CREATE FUNCTION length(kmer128)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'kmer128_length'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Comparison follows the text of the k-mers (A < C < G < T, a prefix comes first)
+CREATE FUNCTION kmer128_eq(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_ne(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_lt(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_le(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_gt(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_ge(kmer128, kmer128) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer128_cmp(kmer128, kmer128) RETURNS int
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR = (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_eq,
+  COMMUTATOR = =, NEGATOR = <>, RESTRICT = eqsel, JOIN = eqjoinsel, HASHES, MERGES
+);
+CREATE OPERATOR <> (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_ne,
+  COMMUTATOR = <>, NEGATOR = =, RESTRICT = neqsel, JOIN = neqjoinsel
+);
+CREATE OPERATOR < (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_lt,
+  COMMUTATOR = >, NEGATOR = >=, RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+CREATE OPERATOR <= (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_le,
+  COMMUTATOR = >=, NEGATOR = >, RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+CREATE OPERATOR > (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_gt,
+  COMMUTATOR = <, NEGATOR = <=, RESTRICT = scalargtsel, JOIN = scalargtjoinsel
+);
+CREATE OPERATOR >= (
+  LEFTARG = kmer128, RIGHTARG = kmer128, PROCEDURE = kmer128_ge,
+  COMMUTATOR = <=, NEGATOR = <, RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+
+CREATE OPERATOR CLASS kmer128_btree_ops
+DEFAULT FOR TYPE kmer128 USING btree AS
+    OPERATOR 1 < ,
+    OPERATOR 2 <= ,
+    OPERATOR 3 = ,
+    OPERATOR 4 >= ,
+    OPERATOR 5 > ,
+    FUNCTION 1 kmer128_cmp(kmer128, kmer128);
+
+--Same value as kmer_hash() for k <= 32
+CREATE FUNCTION kmer128_hash(kmer128)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME', 'kmer128_hash'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS kmer128_hash_ops
+DEFAULT FOR TYPE kmer128 USING HASH AS
+    OPERATOR 1 = (kmer128, kmer128),
+    FUNCTION 1 kmer128_hash(kmer128);
+
+CREATE FUNCTION starts_with(kmer128, kmer128) RETURNS boolean
+AS 'MODULE_PATHNAME', 'kmer128_starts_with'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ^@ (
+    LEFTARG = kmer128,
+    RIGHTARG = kmer128,
+    PROCEDURE = starts_with
+);
+
+CREATE FUNCTION generate_kmers128(dna dna, k int)
+RETURNS SETOF kmer128
+AS 'MODULE_PATHNAME', 'generate_kmers128'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--SP-GiST trie on the nucleotides, for = and ^@
+CREATE FUNCTION spgist_kmer128_config(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer128_config'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer128_choose(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer128_choose'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer128_picksplit(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer128_picksplit'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer128_inner_consistent(internal, internal) RETURNS void
+    AS 'MODULE_PATHNAME', 'spgist_kmer128_inner_consistent'
+    LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION spgist_kmer128_leaf_consistent(internal, internal) RETURNS bool
+    AS 'MODULE_PATHNAME', 'spgist_kmer128_leaf_consistent'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR CLASS spgist_kmer128_ops
+DEFAULT FOR TYPE kmer128 USING spgist AS
+    OPERATOR 1 = (kmer128, kmer128),
+    OPERATOR 2 ^@ (kmer128, kmer128),
+    FUNCTION 1 spgist_kmer128_config(internal, internal),
+    FUNCTION 2 spgist_kmer128_choose(internal, internal),
+    FUNCTION 3 spgist_kmer128_picksplit(internal, internal),
+    FUNCTION 4 spgist_kmer128_inner_consistent(internal, internal),
+    FUNCTION 5 spgist_kmer128_leaf_consistent(internal, internal),
+    STORAGE kmer128;
+
+-- 8-byte K-mer type: up to 31 nucleotides in one word passed by value, no allocation per k-mer
+
+CREATE OR REPLACE FUNCTION kmer64_in(cstring)
+  RETURNS kmer64
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer64_out(kmer64)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer64_recv(internal)
+  RETURNS kmer64
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer64_send(kmer64)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+ -- Fixed size: 2 bits per nucleotide plus a marker bit above the last one (needs 64-bit Datums)
+CREATE TYPE kmer64 (
+  internallength = 8,
+  input          = kmer64_in,
+  output         = kmer64_out,
+  receive        = kmer64_recv,
+  send           = kmer64_send,
+  passedbyvalue,
+  alignment      = double
+);
+
+CREATE OR REPLACE FUNCTION kmer64(text)
+  RETURNS kmer64
+  AS 'MODULE_PATHNAME', 'kmer64_cast_from_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION text(kmer64)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'kmer64_cast_to_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Fails for 32-mers
+CREATE OR REPLACE FUNCTION kmer64(kmer)
+  RETURNS kmer64
+  AS 'MODULE_PATHNAME', 'kmer64_from_kmer'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer(kmer64)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'kmer_from_kmer64'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (text AS kmer64) WITH FUNCTION kmer64(text) AS ASSIGNMENT;
+CREATE CAST (kmer64 AS text) WITH FUNCTION text(kmer64);
+CREATE CAST (kmer AS kmer64) WITH FUNCTION kmer64(kmer);
+CREATE CAST (kmer64 AS kmer) WITH FUNCTION kmer(kmer64) AS ASSIGNMENT;
+
+CREATE FUNCTION length(kmer64)
+  RETURNS int
+  AS 'MODULE_PATHNAME', 'kmer64_length'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Comparison follows the text of the k-mers, like kmer128
+CREATE FUNCTION kmer64_eq(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_ne(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_lt(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_le(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_gt(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_ge(kmer64, kmer64) RETURNS boolean
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION kmer64_cmp(kmer64, kmer64) RETURNS int
+  AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR = (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_eq,
+  COMMUTATOR = =, NEGATOR = <>, RESTRICT = eqsel, JOIN = eqjoinsel, HASHES, MERGES
+);
+CREATE OPERATOR <> (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_ne,
+  COMMUTATOR = <>, NEGATOR = =, RESTRICT = neqsel, JOIN = neqjoinsel
+);
+CREATE OPERATOR < (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_lt,
+  COMMUTATOR = >, NEGATOR = >=, RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+CREATE OPERATOR <= (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_le,
+  COMMUTATOR = >=, NEGATOR = >, RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+CREATE OPERATOR > (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_gt,
+  COMMUTATOR = <, NEGATOR = <=, RESTRICT = scalargtsel, JOIN = scalargtjoinsel
+);
+CREATE OPERATOR >= (
+  LEFTARG = kmer64, RIGHTARG = kmer64, PROCEDURE = kmer64_ge,
+  COMMUTATOR = <=, NEGATOR = <, RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+
+CREATE OPERATOR CLASS kmer64_btree_ops
+DEFAULT FOR TYPE kmer64 USING btree AS
+    OPERATOR 1 < ,
+    OPERATOR 2 <= ,
+    OPERATOR 3 = ,
+    OPERATOR 4 >= ,
+    OPERATOR 5 > ,
+    FUNCTION 1 kmer64_cmp(kmer64, kmer64);
+
+--Same value as kmer_hash()
+CREATE FUNCTION kmer64_hash(kmer64)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME', 'kmer64_hash'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS kmer64_hash_ops
+DEFAULT FOR TYPE kmer64 USING HASH AS
+    OPERATOR 1 = (kmer64, kmer64),
+    FUNCTION 1 kmer64_hash(kmer64);
+
+CREATE FUNCTION starts_with(kmer64, kmer64) RETURNS boolean
+AS 'MODULE_PATHNAME', 'kmer64_starts_with'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ^@ (
+    LEFTARG = kmer64,
+    RIGHTARG = kmer64,
+    PROCEDURE = starts_with
+);
+
+CREATE FUNCTION generate_kmers64(dna dna, k int)
+RETURNS SETOF kmer64
+AS 'MODULE_PATHNAME', 'generate_kmers64'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Hamming neighbourhood of a k-mer: every k-mer with at most d substitutions, itself first, closest first
+CREATE FUNCTION kmer_neighbors(kmer kmer, d int)
+  RETURNS TABLE (neighbor kmer, distance int)
+  AS 'MODULE_PATHNAME', 'kmer_neighbors'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+--Only the neighbours found in a table of k-mers, with their count (an integer column, or the number of rows when
+--count_column is NULL). The table is read once per query
+CREATE FUNCTION kmer_neighbors(kmer kmer, d int, kmers regclass, kmer_column name DEFAULT 'kmer', count_column name DEFAULT NULL)
+  RETURNS TABLE (neighbor kmer, distance int, count bigint)
+  AS 'MODULE_PATHNAME', 'kmer_neighbors_present'
+  LANGUAGE C STABLE PARALLEL RESTRICTED;
@@ -1,1738 +1,9986 @@
-#include "postgres.h"
-#include "utils/varlena.h"
-#include "varatt.h" // For SET_VARSIZE!
-#include "fmgr.h"
-#include "libpq/pqformat.h"
-#include "utils/fmgrprotos.h"
-#include <stddef.h>  // Include for offsetof
-#include "funcapi.h"
-#include "utils/builtins.h" // For cstring_to_text
-#include "common/hashfn.h" // For hash_any() in kmer_hash
-#include <inttypes.h>
-#include "access/spgist.h"
-#include "parser/parse_type.h"
-#include "utils/lsyscache.h"
-#include "nodes/nodes.h"
-#include "nodes/makefuncs.h"
-#include "nodes/parsenodes.h"
-#include "common/int.h" // For pg_cmp_s16()
-
-#include "utils/pg_locale.h"
-#include "utils/datum.h"
-#include "utils/fmgrprotos.h"
-#include "mb/pg_wchar.h"
-#include "utils/sortsupport.h"
-
-#include <math.h>
-#include <float.h>
-#include <stdlib.h>
-#include <stdint.h>
-
-PG_MODULE_MAGIC;
-
-/**
- * DNA structure
- *
- * We store the DNA sequence as a bit sequence, each nucleotide takes 2 bits
- * This is done to save space since DNA sequences can be very long (~3 billion nucleotides in the human genome)
- *
- * Also, we store the length of the DNA sequence in nucleotides so that we can decode it properly
- * The vl_len_ header is required for PostgreSQL variable-length types
- */
-typedef struct Dna
-{
-    char vl_len_[4];                    // Required header for PostgreSQL variable-length types
-    uint64_t length;                     // Length of the DNA sequence in nucleotides
-    uint64_t bit_sequence[FLEXIBLE_ARRAY_MEMBER];  // Array to store packed bits
-} Dna;
-
-// In simple words, datum is like void * with additional size header and here we define macros.
-#define DatumGetDnaP(X)  ((Dna *) DatumGetPointer(X)) // We convert the datum pointer into a dna pointer
-#define DnaPGetDatum(X)  PointerGetDatum(X) // We covert the dna pointer into a Datum pointer
-#define PG_GETARG_DNA_P(n) DatumGetDnaP(PG_GETARG_DATUM(n)) // We get the nth argument given to a function
-#define PG_RETURN_DNA_P(x) return DnaPGetDatum(x) // ¯\_(ツ)_/¯
-
-/**
- * K-mer structure
- *
- * We store the K-mer as a bit sequence, each nucleotide takes 2 bits
- * Maximum length of a K-mer is 32 nucleotides, which is 64 bits, so one single 64-bit integer is enough
- */
-typedef struct Kmer {
-    int32 length;     // Length of the K-mer in nucleotides (each is 2 bits)
-    uint64_t bit_sequence;  // Encoded bit sequence K-mer of max length 64 bits
-    // Here, we don't need vl_len_ since the max length of a kmer is 32 nucleotides, which is 64 bits!
-} Kmer;
-
-#define DatumGetKmerP(X)  ((Kmer *) DatumGetPointer(X)) // We convert the datum pointer into a dna pointer
-#define KmerPGetDatum(X)  PointerGetDatum(X) // We covert the dna pointer into a Datum pointer
-#define PG_GETARG_KMER_P(n) DatumGetKmerP(PG_GETARG_DATUM(n)) // We get the nth argument given to a function
-#define PG_RETURN_KMER_P(x) return KmerPGetDatum(x) // ¯\_(ツ)_/¯
-
-/**
- * Qkmer structure
- *
- * We store the Qkmer as a string, each character is a nucleotide
- * We later enforce that the Qkmer must contain valid IUPAC nucleotide codes, and is at most 32 characters long
- * (since the maximum length of a K-mer is 32 nucleotides)
- *
- * The vl_len_ header is required for PostgreSQL variable-length types
- */
-typedef struct Qkmer {
-    char vl_len_[4];    // Again, required header for PostgreSQL variable-length types
-    char sequence[FLEXIBLE_ARRAY_MEMBER]; // Flexible array for storing the sequence
-} Qkmer;
-
-// Macros for Qkmer
-#define DatumGetQkmerP(X) ((Qkmer *) DatumGetPointer(X))
-#define QkmerPGetDatum(X) PointerGetDatum(X)
-#define PG_GETARG_QKMER_P(n) DatumGetQkmerP(PG_GETARG_DATUM(n))
-#define PG_RETURN_QKMER_P(x) return QkmerPGetDatum(x)
-
-
-/**
-Great reference for pg functions:
-https://doxygen.postgresql.org/varatt_8h.html (For SET_VARSIZE)
-https://www.postgresql.org/docs/16/index.html
-
-SPGiST refs:
-https://www.postgresql.org/docs/16/indexes-types.html#INDEXES-TYPE-SPGIST
-https://www.postgresql.org/docs/current/spgist.html
-https://doxygen.postgresql.org/spgtextproc_8c_source.html
-*/
-
-/********************************************************************************************
-* DNA functions
-********************************************************************************************/
-
-/**
- * Encoding function
- *
- * Calculate number of 64-bit chunks we need, since rest of the int will be padded with zeros,
- * we also store the length so that we can decode it later properly without decoding extra "00"s as "A"s
- */
-static void encode_dna(const char *sequence, uint64_t *bit_sequence, uint64_t length) {
-    for (uint64_t i = 0; i < length; i++) {
-        uint64_t offset = (i * 2) % 64;      // Offset for 2 bits per base
-        uint64_t index = i / 32;             // Each uint64_t holds 32 bases (64 bits)
-
-        switch (sequence[i]) {
-            case 'A': /* 00 */ break;
-            case 'T': bit_sequence[index] |= ((uint64_t)0x1 << offset); break; // 01 for T
-            case 'C': bit_sequence[index] |= ((uint64_t)0x2 << offset); break; // 10 for C
-            case 'G': bit_sequence[index] |= ((uint64_t)0x3 << offset); break; // 11 for G
-            default:
-                ereport(ERROR, (errmsg("Invalid character in DNA sequence: %c", sequence[i])));
-        }
-    }
-}
-
-/**
- * Decoding function
- *
- * We decode the sequence by shifting the bits to the right and then reading the last 2 bits to get the nucleotide
- */
-static char* decode_dna(const uint64_t *bit_sequence, uint64_t length) {
-    char *sequence = palloc0(length + 1);  // +1 for the null terminator which is added automatically by palloc0
-
-    for (uint64_t i = 0; i < length; i++) {
-        uint64_t offset = (i * 2) % 64; // Offset of the current nucleotide since it's 2 bits long
-        uint64_t index = i / 32;
-        uint64_t bits = (bit_sequence[index] >> offset) & 0x3;
-
-        switch (bits) {
-            case 0x0: sequence[i] = 'A'; break;
-            case 0x1: sequence[i] = 'T'; break;
-            case 0x2: sequence[i] = 'C'; break;
-            case 0x3: sequence[i] = 'G'; break;
-        }
-    }
-
-    return sequence;
-}
-
-/**
- * Validates the DNA sequence
- *
- * Checks if the sequence is not empty and contains only A, T, C, G
- */
-static bool validate_dna_sequence(const char *sequence) {
-    if (sequence == NULL || *sequence == '\0') {
-        ereport(ERROR, (errmsg("DNA sequence cannot be empty")));
-        return false;
-    }
-    for (const char *p = sequence; *p; p++) {
-        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G') {
-            ereport(ERROR, (errmsg("Invalid character in DNA sequence: %c", *p)));
-            return false;
-        }
-    }
-    return true;
-}
-
-/**
- * Creates and returns a new Dna struct by encoding the provided DNA sequence string "ATCG" into binary format (2 bits per nucleotide)
- *
- * It checks the input, calculates required memory, and calls encode_dna which stores the enocded sequence in bit_sequence
- */
-static Dna * dna_make(const char *sequence)
-{
-    uint64_t length = (uint64_t) strlen(sequence);
-    uint64_t num_bits = length * 2;  // 2 bits per nucleotide
-    uint64_t bit_length = (num_bits + 63) / 64;  // Number of 64-bit chunks we need, rest will be padded with zeros
-    Size dna_size = offsetof(Dna, bit_sequence) + bit_length * sizeof(uint64_t);
-
-    // Allocate memory for Dna struct and bit_sequence, set all bits to 0 (which is why we use palloc0 and not palloc)
-    Dna *dna = (Dna *) palloc0(dna_size);
-
-    if (sequence != NULL) {
-        if (!validate_dna_sequence(sequence)) {
-            ereport(ERROR, (errmsg("Invalid DNA sequence: must contain only A, T, C, G")));
-            return NULL;
-        }
-    }
-
-    SET_VARSIZE(dna, dna_size); // No need to add VARHDRSZ since the library does it for us!
-    //dna->vl_len_ = VARHDRSZ + dna_size;
-    dna->length = length;
-
-    // Encode the DNA sequence directly into bit_sequence, pointer magic
-    encode_dna(sequence, dna->bit_sequence, length);
-    return dna;
-}
-
-/**
- * Converts a Dna struct to a string
- *
- * We decode the bit_sequence to a string and return it
- */
-static char * dna_to_str(const Dna *dna)
-{
-    if (dna->length == 0) {
-        return pstrdup("");
-    }
-    return decode_dna(dna->bit_sequence, dna->length);
-}
-
-/**
- * General functions for DNA
- */
-PG_FUNCTION_INFO_V1(dna_in);
-Datum
-dna_in(PG_FUNCTION_ARGS)
-{
-    char *str = PG_GETARG_CSTRING(0);
-    Dna *dna = dna_make(str);  // Use dna_make to create the encoded binary sequence
-
-    PG_RETURN_DNA_P(dna);
-}
-
-PG_FUNCTION_INFO_V1(dna_out);
-Datum
-dna_out(PG_FUNCTION_ARGS)
-{
-  Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
-  char *result = dna_to_str(dna);
-  PG_FREE_IF_COPY(dna, 0);
-  PG_RETURN_CSTRING(result);
-}
-
-/*
- * This function is supposed to take in an existing DNA sequence and return a new DNA sequence with the same values!
- * An existing sequence means it's a binary encoded sequence in String format; just Postgres things!
- */
-PG_FUNCTION_INFO_V1(dna_recv);
-Datum
-dna_recv(PG_FUNCTION_ARGS)
-{
-    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-
-    uint64_t length = pq_getmsgint(buf, sizeof(uint64_t));
-    uint64_t num_bits = length * 2;  // Each DNA nucleotide is 2 bits
-    uint64_t bit_length = (num_bits + 63) / 64;  // Number of 64-bit chunks needed, rounding up
-
-    Size dna_size = offsetof(Dna, bit_sequence) + bit_length * sizeof(uint64_t);
-
-    Dna *dna = (Dna *) palloc0(dna_size);
-    SET_VARSIZE(dna, dna_size);
-    //dna->vl_len_ = VARHDRSZ + dna_size;
-	
-    dna->length = length;
-
-    for (uint64_t i = 0; i < bit_length; i++) {
-        dna->bit_sequence[i] = pq_getmsgint64(buf);
-    }
-
-    PG_RETURN_POINTER(dna);
-}
-
-/*
- * Does the same but in reverse, takes a DNA sequence and encodes it into a binary format
- *
- * We can't use dna_to_str here because
- * dna_to_str converts the binary data back to a string format which is not what we want here!
- */
-PG_FUNCTION_INFO_V1(dna_send);
-Datum
-dna_send(PG_FUNCTION_ARGS)
-{
-    Dna *dna = (Dna *) PG_GETARG_POINTER(0);
-    StringInfoData buf;
-
-    uint64_t bit_length = (dna->length * 2 + 63) / 64;
-
-    pq_begintypsend(&buf);
-    pq_sendint(&buf, dna->length, sizeof(uint64_t));
-
-    for (uint64_t i = 0; i < bit_length; i++) {
-        pq_sendint64(&buf, dna->bit_sequence[i]);
-    }
-    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
-}
-
-PG_FUNCTION_INFO_V1(dna_cast_from_text);
-Datum
-dna_cast_from_text(PG_FUNCTION_ARGS)
-{
-    text *txt = PG_GETARG_TEXT_P(0);
-    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));
-    Dna *dna = dna_make(str);  // Use dna_make for binary encoding
-    PG_RETURN_DNA_P(dna);
-}
-
-PG_FUNCTION_INFO_V1(dna_cast_to_text);
-Datum
-dna_cast_to_text(PG_FUNCTION_ARGS)
-{
-  Dna *dna  = (Dna *) PG_GETARG_VARLENA_P(0);
-  text *out = (text *)DirectFunctionCall1(textin,
-            PointerGetDatum(dna_to_str(dna)));
-  PG_FREE_IF_COPY(dna, 0);
-  PG_RETURN_TEXT_P(out);
-}
-
-PG_FUNCTION_INFO_V1(dna_constructor);
-Datum
-dna_constructor(PG_FUNCTION_ARGS){
-  char *sequence = PG_GETARG_CSTRING(0); 
-  PG_RETURN_DNA_P(dna_make(sequence));
-}
-
-PG_FUNCTION_INFO_V1(dna_to_string);
-Datum
-dna_to_string(PG_FUNCTION_ARGS)
-{
-    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
-    char *result = decode_dna(dna->bit_sequence, dna->length);  // Decode bit_sequence to a readable string
-    PG_FREE_IF_COPY(dna, 0);
-    PG_RETURN_CSTRING(result);
-}
-
-/**
-* Magically faster than strcmp!
-*/
-static bool dna_eq_internal(Dna *dna1, Dna *dna2)
-{
-    uint64_t bit_length = (dna1->length * 2 + 63) / 64;  // Number of 64-bit chunks needed
-
-    if (dna1->length != dna2->length) {
-        return false;  // Different lengths mean they can't be equal
-    }
-
-    // Compare each 64-bit chunk in the bit_sequence array
-    for (uint64_t i = 0; i < bit_length; i++) {
-        if (dna1->bit_sequence[i] != dna2->bit_sequence[i]) {
-            return false;  // If any chunk differs, the sequences are not equal
-        }
-    }
-
-    return true;  // All chunks are equal, phew!
-}
-
-PG_FUNCTION_INFO_V1(equals);
-Datum
-equals(PG_FUNCTION_ARGS)
-{
-  Dna *dna1 = (Dna *) PG_GETARG_VARLENA_P(0);
-  Dna *dna2 = (Dna *) PG_GETARG_VARLENA_P(1);
-  bool result = dna_eq_internal(dna1, dna2);
-  PG_FREE_IF_COPY(dna1, 0);
-  PG_FREE_IF_COPY(dna2, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(length);
-Datum
-length(PG_FUNCTION_ARGS)
-{
-    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
-    uint64_t length = dna->length;  // Directly get the length field
-    PG_FREE_IF_COPY(dna, 0);
-    PG_RETURN_INT32(length);
-}
-
-PG_FUNCTION_INFO_V1(dna_ne);
-Datum
-dna_ne(PG_FUNCTION_ARGS)
-{
-    Dna *dna1 = (Dna *) PG_GETARG_VARLENA_P(0);
-    Dna *dna2 = (Dna *) PG_GETARG_VARLENA_P(1);
-    bool result = !dna_eq_internal(dna1, dna2);  // ~ the result of dna_eq_internal, viola!
-    PG_FREE_IF_COPY(dna1, 0);
-    PG_FREE_IF_COPY(dna2, 1);
-    PG_RETURN_BOOL(result);
-}
-
-
-/********************************************************************************************
-* Kmer functions
-********************************************************************************************/
-
-/**
- * Encoding function for K-mers
- *
- * Store the k-mer in a single 64-bit variable, each nucleotide takes 2 bits
- * Encoding 'A' as 00, 'T' as 01, 'C' as 10, and 'G' as 11
-*/
-static uint64_t encode_kmer(const char *sequence, int length) {
-    uint64_t bit_sequence = 0;  // Single 64-bit variable to store the k-mer!
-    //elog(INFO, "Encoding K-mer: %s, length: %d", sequence, length);
-
-    if (length <= 0 || length > 32) { // Literally cannot store a k-mer longer than 32 nucleotides
-        ereport(ERROR, (errmsg("K-mer length must be between 1 and 32 nucleotides")));
-    }
-
-    for (int i = 0; i < length; i++) {
-        int offset = i * 2;  // Each nucleotide takes 2 bits
-
-        switch (sequence[i]) {
-            case 'A': /* 00 for A */ break;  // No operation needed for 'A'
-            case 'T': bit_sequence |= ((uint64_t)0x1 << offset); break; // 01 for T
-            case 'C': bit_sequence |= ((uint64_t)0x2 << offset); break; // 10 for C
-            case 'G': bit_sequence |= ((uint64_t)0x3 << offset); break; // 11 for G
-            case 'X': /* 00 for X */ break;  // Allow 'X' as a dummy value, will always occur at the end of a k-mer
-            default:
-                ereport(ERROR, (errmsg("Invalid character in K-mer: '%c'", sequence[i])));
-        }
-    }
-
-    return bit_sequence;  // Return the encoded k-mer
-}
-
-
-/*
- * Decoding function for K-mers
- *
- * We decode the sequence by shifting the bits to the right and then reading the last 2 bits to get the nucleotide
- */
-static char* decode_kmer(uint64_t bit_sequence, int length) {
-    // Allocate memory for the k-mer string (+1 for null terminator)
-    char *sequence = palloc(length + 1);
-    sequence[length] = '\0';
-
-    if (length <= 0 || length > 32) { // Ideally, nobody should pass invalid lengths, but just in case
-        ereport(ERROR, (errmsg("K-mer length must be between 1 and 32 nucleotides")));
-    }
-
-    for (int i = 0; i < length; i++) {
-        int offset = i * 2;  // Each nucleotide is 2 bits
-        uint64_t bits = (bit_sequence >> offset) & 0x3;  // Get the 2 bits we care about in this iteration
-
-        switch (bits) {
-            case 0x0: sequence[i] = 'A'; break;  // 00 -> A
-            case 0x1: sequence[i] = 'T'; break;  // 01 -> T
-            case 0x2: sequence[i] = 'C'; break;  // 10 -> C
-            case 0x3: sequence[i] = 'G'; break;  // 11 -> G
-            default:
-                ereport(ERROR, (errmsg("Unexpected bit pattern in K-mer: %lu", bits)));
-        }
-    }
-
-    return sequence;
-}
-
-/*
- * Only difference here (from DNA) is that we also check the length of the k-mer
- */
-static bool validate_kmer_sequence(const char *sequence) {
-    int length;
-
-    if (sequence == NULL || *sequence == '\0') {
-        ereport(ERROR, (errmsg("K-mer sequence cannot be empty")));
-        return false;
-    }
-    length = strlen(sequence);
-
-    if (length > 32) {
-        ereport(ERROR, (errmsg("K-mer length cannot exceed 32 nucleotides")));
-        return false;
-    }
-
-    for (const char *p = sequence; *p; p++) {
-        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G' && *p != 'X') { // We also allow 'X' for unknown nucleotides/dummy values
-            ereport(ERROR, (errmsg("Invalid character in K-mer sequence: '%c'", *p)));
-            return false;
-        }
-    }
-
-    return true;
-}
-
-
-/*
- * Creates and returns a new Kmer struct by encoding the provided DNA/K-mer sequence string "ATCG" into binary format (2 bits per nucleotide)
- *
- * It checks the input, calculates required memory, and calls encode_kmer which stores the encoded sequence in bit_sequence
- */
-static Kmer *kmer_make(const char *sequence)
-{
-   int length;
-
-   // Allocate memory for Kmer struct
-   Kmer *kmer = (Kmer *) palloc0(sizeof(Kmer));
-
-   // Validate input
-   if (sequence == NULL) {
-       ereport(ERROR, (errmsg("K-mer sequence cannot be NULL")));
-       pfree(kmer);
-       return NULL;
-   }
-   length = strlen(sequence);
-   kmer->length = length;
-   //elog(INFO, "K-mer length: %d, kmer->length: %d", length, kmer->length);
-
-   if (!validate_kmer_sequence(sequence)) {
-       ereport(ERROR, (errmsg("Invalid K-mer sequence: must contain only A, T, C, G and be at most 32 nucleotides long")));
-       pfree(kmer);
-       return NULL;
-   }
-
-   // Encode the K-mer sequence into the 64-bit bit_sequence
-   ////elog(INFO, "Encoding K-mer: %s, length: %d", sequence, length);
-   kmer->bit_sequence = encode_kmer(sequence, length);
-
-   return kmer;
-}
-
-/*
- * String representation of a K-mer
- */
-static char *kmer_to_str(const Kmer *kmer)
-{
-    if (kmer->length == 0) {
-        return pstrdup("");  // Return an empty string if the k-mer has no nucleotides
-    }
-    return decode_kmer(kmer->bit_sequence, kmer->length);  // Decode the k-mer and return the result
-}
-
-PG_FUNCTION_INFO_V1(kmer_in);
-Datum
-kmer_in(PG_FUNCTION_ARGS)
-{
-    char *str = PG_GETARG_CSTRING(0);  // Get the input string
-    Kmer *kmer = kmer_make(str);       // Use kmer_make to create the encoded Kmer object
-
-    PG_RETURN_POINTER(kmer);          // Return the Kmer as a Datum
-}
-
-PG_FUNCTION_INFO_V1(kmer_out);
-Datum
-kmer_out(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
-    char *result = kmer_to_str(kmer);            // Convert the Kmer to a string
-    PG_FREE_IF_COPY(kmer, 0);                    // Free memory if needed
-    PG_RETURN_CSTRING(result);                   // Return the string
-}
-
-/*
- * This function is supposed to take in an existing K-mer sequence and return a new K-mer sequence with the same values!
- * An existing sequence means it's a binary encoded sequence in String format; just Postgres things!
- */
-PG_FUNCTION_INFO_V1(kmer_recv);
-Datum
-kmer_recv(PG_FUNCTION_ARGS)
-{
-    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-
-    // Read the length of the K-mer
-    int length = pq_getmsgint(buf, sizeof(int));
-
-    // Allocate memory for the Kmer object
-    Kmer *kmer = (Kmer *) palloc0(sizeof(Kmer));
-    kmer->length = length;
-
-    if (length <= 0 || length > 32) {
-        ereport(ERROR, (errmsg("Invalid K-mer length: must be between 1 and 32")));
-    }
-
-    // Read the encoded bit_sequence from the message buffer
-    kmer->bit_sequence = pq_getmsgint64(buf);
-
-    PG_RETURN_POINTER(kmer);
-}
-
-/*
- * Does the same but in reverse, takes a DNA/K-mer sequence and encodes it into a binary format
- *
- * We can't use kmer_to_str here because
- * kmer_to_str converts the binary data back to a string format which is not what we want here!
- */
-PG_FUNCTION_INFO_V1(kmer_send);
-Datum
-kmer_send(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);
-    StringInfoData buf;
-
-    pq_begintypsend(&buf);
-
-    // Serialize the length of the K-mer
-    pq_sendint(&buf, kmer->length, sizeof(int));
-
-    // Serialize the 64-bit bit_sequence
-    pq_sendint64(&buf, kmer->bit_sequence);
-
-    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
-}
-
-/*
- * Convert a text object to a Kmer object
- */
-PG_FUNCTION_INFO_V1(kmer_cast_from_text);
-Datum
-kmer_cast_from_text(PG_FUNCTION_ARGS)
-{
-    text *txt = PG_GETARG_TEXT_P(0);  // Get the input text
-    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));  // Convert to C string
-    Kmer *kmer = kmer_make(str);  // Encode the string as a Kmer
-    PG_RETURN_POINTER(kmer);  // Return the Kmer object
-}
-
-/*
- * Convert a Kmer object to a text object
- */
-PG_FUNCTION_INFO_V1(kmer_cast_to_text);
-Datum
-kmer_cast_to_text(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
-    text *out = (text *) DirectFunctionCall1(textin,
-                    PointerGetDatum(kmer_to_str(kmer)));  // Convert the Kmer to a string and then to text
-    PG_FREE_IF_COPY(kmer, 0);  // Free memory if the Kmer was copied
-    PG_RETURN_TEXT_P(out);  // Return the text object
-}
-
-/*
- * Get the input C string and create a Kmer object
- *
- * These are somehow required by Postgres to create a new Kmer object
- */
-PG_FUNCTION_INFO_V1(kmer_constructor);
-Datum
-kmer_constructor(PG_FUNCTION_ARGS)
-{
-    char *sequence = PG_GETARG_CSTRING(0);
-    PG_RETURN_POINTER(kmer_make(sequence));
-}
-
-PG_FUNCTION_INFO_V1(kmer_to_string);
-Datum
-kmer_to_string(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0); // Get the Kmer object
-    char *result = decode_kmer(kmer->bit_sequence, kmer->length);  // Decode the bit_sequence into a string
-    result[kmer->length] = '\0';  // Null-terminate the string
-    PG_FREE_IF_COPY(kmer, 0);  // Free memory if the Kmer was copied
-    PG_RETURN_CSTRING(result);  // Return the decoded string
-}
-
-/**
- * Compare two Kmers for equality
- *
- * We compare the lengths and the bit sequences
- */
-static bool kmer_eq_internal(Kmer *kmer1, Kmer *kmer2)
-{
-    // Check if lengths are different
-    if (kmer1->length != kmer2->length) {
-        return false;
-    }
-
-    // Now compare the bit sequences
-    if (kmer1->bit_sequence != kmer2->bit_sequence) {
-        return false;  // Sequences are different
-    }
-
-    return true;  // Both lengths and sequences are equal
-}
-
-/*
-starts_with function, takes in two char* and returns a boolean
-*/
-static bool starts_with_internal(const char *prefix, const char *kmer)
-{
-    int prefix_length = strlen(prefix);
-    int kmer_length = strlen(kmer);
-
-    if (prefix_length > kmer_length) {
-        ereport(ERROR, (errmsg("Prefix length cannot exceed kmer length")));
-    }
-
-    return strncmp(prefix, kmer, prefix_length) == 0;
-}
-
-
-PG_FUNCTION_INFO_V1(kmer_eq);
-Datum
-kmer_eq(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer1 = (Kmer *) PG_GETARG_POINTER(0);  // Get the first Kmer object
-    Kmer *kmer2 = (Kmer *) PG_GETARG_POINTER(1);  // Get the second Kmer object
-    bool result = kmer_eq_internal(kmer1, kmer2); // Compare the two Kmers
-    PG_FREE_IF_COPY(kmer1, 0);
-    PG_FREE_IF_COPY(kmer2, 1);
-    PG_RETURN_BOOL(result);  // Return the result
-}
-
-PG_FUNCTION_INFO_V1(kmer_length);
-Datum
-kmer_length(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
-    int length = kmer->length;  // Retrieve the length
-    PG_FREE_IF_COPY(kmer, 0);
-    PG_RETURN_INT32(length);  // Return the length as an integer
-}
-
-PG_FUNCTION_INFO_V1(kmer_ne);
-Datum
-kmer_ne(PG_FUNCTION_ARGS)
-{
-    Kmer *kmer1 = (Kmer *) PG_GETARG_POINTER(0);  // Get the first Kmer object
-    Kmer *kmer2 = (Kmer *) PG_GETARG_POINTER(1);  // Get the second Kmer object
-
-    bool result = !kmer_eq_internal(kmer1, kmer2);  // Negate the result of kmer_eq_internal
-
-    PG_FREE_IF_COPY(kmer1, 0);
-    PG_FREE_IF_COPY(kmer2, 1);
-    PG_RETURN_BOOL(result);  // Return the result
-}
-
-PG_FUNCTION_INFO_V1(kmer_hash);
-Datum
-kmer_hash(PG_FUNCTION_ARGS)
-{
-    Kmer *input = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer input
-    const unsigned char *data;
-    uint32 hash;
-
-    // Use hash_any to hash the bit_sequence field (8 bytes)
-    data = (unsigned char *) &input->bit_sequence;
-    hash = hash_any(data, sizeof(input->bit_sequence));  // 64-bit input, 32-bit output
-
-    PG_RETURN_UINT32(hash);  // Return the hash as uint32
-}
-
-/*
- * This is a set returning function that generates all possible k-mers from a given DNA sequence
- *
- * We don't return all kmers at once, we return them one by one, this is why we use SRF_RETURN_NEXT
- * Reference: https://www.postgresql.org/docs/current/xfunc-c.html#XFUNC-C-RETURN-SET
- */
-PG_FUNCTION_INFO_V1(generate_kmers);
-Datum
-generate_kmers(PG_FUNCTION_ARGS)
-{
-    FuncCallContext *funcctx;
-    MemoryContext oldcontext;
-
-    // Declare state and vars
-    struct {
-        Dna *dna;
-        int k;
-    } *state; // We use this to store the DNA sequence and k value, seems counter-intuitive but there's no other way to store state in a SRF
-    Dna *dna; // Just used to receive the DNA sequence (it's a pointer so we don't copy the whole thing)
-    int k; // Input k value
-    int current_index; // Current kmer index we're generating, part of the state
-    char *kmer_sequence; // Even though we store kmers as binary, we have them as strings in the intermediate stage
-    Kmer *kmer; // The Kmer object we will return
-
-    // First call initialization
-    if (SRF_IS_FIRSTCALL())
-    {
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-        // Extract arguments
-        dna = (Dna *) PG_GETARG_VARLENA_P(0); // We know the first argument is a DNA sequence (and not just text)
-        k = PG_GETARG_INT32(1);
-
-        // Validate k
-        if (k <= 0 || k > 32)  // k should not exceed 32, that's usually the limit of the usefulness of k in dna sequences in practice
-            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and 32")));
-
-        // Save DNA and k in funcctx
-        state = palloc(sizeof(*state));
-        state->dna = dna;
-        state->k = k;
-
-        funcctx->user_fctx = state;
-        funcctx->max_calls = dna->length - k + 1;  // Total number of kmers to generate
-
-        MemoryContextSwitchTo(oldcontext);
-    }
-
-    // Per-call processing
-    funcctx = SRF_PERCALL_SETUP();
-
-    // Next, we get the state from the function context and run it as if we were in
-    state = funcctx->user_fctx;
-    // Current kmer index, we maintain "state" this way - the number of times we/they have called the function
-    current_index = funcctx->call_cntr;
-
-    if (current_index < funcctx->max_calls)
-    {
-        dna = state->dna;
-        k = state->k;
-
-        // Allocate memory for the kmer we will return
-        kmer_sequence = palloc0(k + 1);
-
-        // Decode kmer directly from the bit_sequence
-        for (int i = 0; i < k; i++)
-        {
-            int nucleotide_index = current_index + i;  // Nucleotide/character index in the DNA sequence
-            int bit_offset = (nucleotide_index * 2) % 64;  // Offset within the uint64_t
-            int chunk_index = nucleotide_index / 32;      // Where is it in the bit_sequence array
-            uint64_t bits = (dna->bit_sequence[chunk_index] >> bit_offset) & 0x3;  // AND with 0x3 to filter out just the last 2 bits
-
-            // Decode bits to string nucleotide for n00b users who can't read binary B)
-            switch (bits)
-            {
-                case 0x0: kmer_sequence[i] = 'A'; break;
-                case 0x1: kmer_sequence[i] = 'T'; break;
-                case 0x2: kmer_sequence[i] = 'C'; break;
-                case 0x3: kmer_sequence[i] = 'G'; break;
-                default:
-                    ereport(ERROR, (errmsg("Unexpected bit pattern in DNA sequence - this shouldn't ever happen!")));
-            }
-        }
-        kmer_sequence[k] = '\0';  // Null-terminate the kmer, since it's a string
-
-        Assert(strlen(kmer_sequence) == k);  // Just to be sure
-        // Encode the decoded k-mer as a Kmer object
-        kmer = kmer_make(kmer_sequence);
-        pfree(kmer_sequence);  // Free the temporary k-mer string
-
-        // Return just this kmer
-        SRF_RETURN_NEXT(funcctx, PointerGetDatum(kmer));
-    }
-    else
-    {
-        // Finish and cleanup
-        pfree(state);
-        SRF_RETURN_DONE(funcctx);
-    }
-}
-
-/*
- * Basically just checks if the prefix is the same as the first n nucleotides of the kmer
- */
-PG_FUNCTION_INFO_V1(starts_with);
-Datum
-starts_with(PG_FUNCTION_ARGS)
-{
-    int prefix_bits;
-    uint64_t mask;
-    bool result;
-
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the prefix Kmer
-    Kmer *prefix = (Kmer *) PG_GETARG_POINTER(1);    // Get the target Kmer
-
-    // Prefix length must not exceed Kmer length
-    if (prefix->length > kmer->length) {
-        ereport(ERROR, (errmsg("Prefix length cannot exceed kmer length")));
-    }
-
-    // Calculate the number of bits to compare
-    prefix_bits = prefix->length * 2;
-
-    // Check if the first prefix_bits match in both Kmers
-    mask = ((uint64_t)1 << prefix_bits) - 1;  // Mask for prefix_bits
-    result = (prefix->bit_sequence == (kmer->bit_sequence & mask));
-
-    PG_RETURN_BOOL(result);
-}
-
-/********************************************************************************************
-* Qkmer functions
-********************************************************************************************/
-
-/*
- * Enforces that the qkmer pattern is valid and contains only IUPAC nucleotide codes
- * Also, the pattern must not be empty and must not exceed 32 characters
- */
-static bool validate_qkmer_pattern(const char *pattern) {
-    if (pattern == NULL || *pattern == '\0') {
-        ereport(ERROR, (errmsg("qkmer pattern cannot be empty")));
-        return false;
-    }
-
-    // Check length
-    if (strlen(pattern) > 32) {
-        ereport(ERROR, (errmsg("Qkmer pattern length cannot exceed 32 characters")));
-        return false;
-    }
-
-    for (const char *p = pattern; *p; p++) {
-        switch (*p) {
-            case 'A': case 'T': case 'C': case 'G': case 'U': case 'W': case 'S': case 'M': case 'K':
-            case 'R': case 'Y': case 'B': case 'D': case 'H': case 'V': case 'N':
-                break;
-            default:
-                ereport(ERROR, (errmsg("Invalid character in qkmer pattern: %c", *p)));
-                return false;
-        }
-    }
-
-    return true;
-}
-
-/**
- * Encoding function for Q-kmers
- *
- * Store the q-kmer in a char array, each nucleotide takes 1 byte
- * There's also potential to use shorter header with SET_VARSIZE_SHORT, but it's harder to work with somehow
- */
-static Qkmer *qkmer_make(const char *sequence)
-{
-    int length = strlen(sequence);
-    Size qkmer_size;
-    Qkmer *qkmer;
-
-    // Validate sequence characters
-    if (!validate_qkmer_pattern(sequence)) {
-        ereport(ERROR, (errmsg("Invalid Qkmer sequence: must contain valid IUPAC nucleotide codes")));
-        return NULL;
-    }
-
-    qkmer_size = offsetof(Qkmer, sequence) + length + 1;  // +1 for null terminator
-    qkmer = (Qkmer *) palloc0(qkmer_size);
-
-    SET_VARSIZE(qkmer, qkmer_size);
-
-    // Copy the sequence
-    strncpy(qkmer->sequence, sequence, length);
-    qkmer->sequence[length] = '\0'; // Null-terminate the char sequence
-
-    return qkmer;
-}
-
-PG_FUNCTION_INFO_V1(qkmer_in);
-Datum
-qkmer_in(PG_FUNCTION_ARGS)
-{
-    char *str = PG_GETARG_CSTRING(0);
-    Qkmer *qkmer = qkmer_make(str);
-    PG_RETURN_QKMER_P(qkmer);
-}
-
-PG_FUNCTION_INFO_V1(qkmer_out);
-Datum
-qkmer_out(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
-    char *result = pstrdup(qkmer->sequence); // Duplicate the string for output
-    PG_RETURN_CSTRING(result);
-}
-
-PG_FUNCTION_INFO_V1(qkmer_length);
-Datum
-qkmer_length(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
-    int length = strlen(qkmer->sequence); // Compute length
-    PG_RETURN_INT32(length);
-}
-
-PG_FUNCTION_INFO_V1(qkmer_eq);
-Datum
-qkmer_eq(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer1 = PG_GETARG_QKMER_P(0);
-    Qkmer *qkmer2 = PG_GETARG_QKMER_P(1);
-    bool result = strcmp(qkmer1->sequence, qkmer2->sequence) == 0;
-    PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(qkmer_recv);
-Datum
-qkmer_recv(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer;
-    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-
-    // Read the length of the sequence
-    int length = pq_getmsgint(buf, sizeof(int));
-
-    // Allocate a temporary buffer for the sequence
-    char *sequence = (char *) palloc(length + 1);
-    pq_copymsgbytes(buf, sequence, length);
-    sequence[length] = '\0'; // Null-terminate
-
-    // Use qkmer_make to create the Qkmer
-    qkmer = qkmer_make(sequence);
-    pfree(sequence); // Free the temp buffer!
-
-    PG_RETURN_QKMER_P(qkmer);
-}
-
-PG_FUNCTION_INFO_V1(qkmer_send);
-Datum
-qkmer_send(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
-    StringInfoData buf;
-
-    // Get the length of the Qkmer sequence
-    int length = strlen(qkmer->sequence);
-
-    // Start constructing the binary representation
-    pq_begintypsend(&buf);
-
-    // Write the length of the sequence as a 4-byte integer
-    pq_sendint(&buf, length, sizeof(int));
-
-    // Write the sequence as raw bytes (excluding the null terminator)
-    pq_sendbytes(&buf, qkmer->sequence, length);
-
-    // Return the serialized bytea
-    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
-}
-
-
-/*
- * Convert a text object to a Qkmer object
- */
-PG_FUNCTION_INFO_V1(qkmer_cast_from_text);
-Datum
-qkmer_cast_from_text(PG_FUNCTION_ARGS)
-{
-    text *txt = PG_GETARG_TEXT_P(0);  // Get the input text
-    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));  // Convert to C string
-    Qkmer *qkmer = qkmer_make(str);  // Encode the string as a Qkmer
-    PG_RETURN_POINTER(qkmer);  // Return the Qkmer object
-}
-
-/*
- * Convert a Qkmer object to a text object
- */
-PG_FUNCTION_INFO_V1(qkmer_cast_to_text);
-Datum
-qkmer_cast_to_text(PG_FUNCTION_ARGS)
-{
-    Qkmer *qkmer = PG_GETARG_QKMER_P(0);  // Get the Qkmer object
-    text *out = (text *) DirectFunctionCall1(textin,
-                    PointerGetDatum(qkmer->sequence));  // Convert the Qkmer to a string and then to text
-    PG_RETURN_TEXT_P(out);  // Return the text object
-}
-
-/*
-* Uses the output of generate_kmers to generate qkmers that match a given pattern
-*
-* List of IUPAC nucleotide codes we are using:
-* https://en.wikipedia.org/wiki/Nucleic_acid_notation
-* Symbol   Bases Represented
-* A        A
-* C        C
-* G        G
-* T        T
-* U        U
-* W        A, T
-* S        C, G
-* M        A, C
-* K        G, T
-* R        A, G
-* Y        C, T
-* B        C, G, T
-* D        A, G, T
-* H        A, C, T
-* V        A, C, G
-* N        A, C, G, T
-*/
-static bool nucleotide_matches(char nucleotide, char iupac) {
-    switch (iupac) {
-        case 'A': return nucleotide == 'A';
-        case 'T': return nucleotide == 'T';
-        case 'C': return nucleotide == 'C';
-        case 'G': return nucleotide == 'G';
-        case 'U': return nucleotide == 'U';  // Uracil (RNA equivalent of T)
-        case 'W': return nucleotide == 'A' || nucleotide == 'T'; // Weak: A or T
-        case 'S': return nucleotide == 'C' || nucleotide == 'G'; // Strong: C or G
-        case 'M': return nucleotide == 'A' || nucleotide == 'C'; // Amino: A or C
-        case 'K': return nucleotide == 'G' || nucleotide == 'T'; // Keto: G or T
-        case 'R': return nucleotide == 'A' || nucleotide == 'G'; // Purine: A or G
-        case 'Y': return nucleotide == 'C' || nucleotide == 'T'; // Pyrimidine: C or T
-        case 'B': return nucleotide == 'C' || nucleotide == 'G' || nucleotide == 'T'; // Not A: C, G, or T
-        case 'D': return nucleotide == 'A' || nucleotide == 'G' || nucleotide == 'T'; // Not C: A, G, or T
-        case 'H': return nucleotide == 'A' || nucleotide == 'C' || nucleotide == 'T'; // Not G: A, C, or T
-        case 'V': return nucleotide == 'A' || nucleotide == 'C' || nucleotide == 'G'; // Not T: A, C, or G
-        case 'N': return true; // Any nucleotide: A, C, G, or T, assume that these are the only valid nucleotides (which we have enforced)
-        default:
-            ereport(ERROR, (errmsg("Invalid character in pattern: %c!", iupac)));
-            return false;
-    }
-}
-
-/*
- * Just checks if a kmer contains a given qkmer pattern using nucleotide_matches()
- */
-PG_FUNCTION_INFO_V1(contains);
-Datum
-contains(PG_FUNCTION_ARGS)
-{
-    // Get args
-    Qkmer *qkmer = (Qkmer *) PG_GETARG_POINTER(0); // Qkmer query pattern
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(1);    // kmer to match, iteratively generated from generate_kmers()
-    int qkmer_length, kmer_length;
-
-    // Validations for both types is already done in their respective types! We wouldn't even be here if they weren't valid!
-
-    qkmer_length = strlen(qkmer->sequence);
-    kmer_length = kmer->length;
-
-    // Fail if lengths do not match
-    if (qkmer_length != kmer_length) {
-        ereport(ERROR, (errmsg("Qkmer pattern and kmer lengths do not match")));
-    }
-
-    // Compare the pattern with the encoded kmer bit sequence
-    for (int i = 0; i < qkmer_length; i++) {
-        // Decode the nucleotide at position i from the Kmer bit_sequence
-        int bit_offset = i * 2; // Offset in the 64-bit bit_sequence
-        uint64_t nucleotide_bits = (kmer->bit_sequence >> bit_offset) & 0x3; // Extract 2 bits for the nucleotide
-        char nucleotide;
-
-        // Map the decoded bits to a nucleotide character
-        switch (nucleotide_bits) {
-            case 0x0: nucleotide = 'A'; break;
-            case 0x1: nucleotide = 'T'; break;
-            case 0x2: nucleotide = 'C'; break;
-            case 0x3: nucleotide = 'G'; break;
-            default:
-                ereport(ERROR, (errmsg("Unexpected bit pattern in Kmer")));
-        }
-
-        // Compare the nucleotide with the pattern using nucleotide_matches()
-        if (!nucleotide_matches(nucleotide, qkmer->sequence[i])) {
-            PG_RETURN_BOOL(false); // Return false if there's a mismatch
-        }
-    }
-
-    // If we get here, the kmer matches the pattern!
-    PG_RETURN_BOOL(true);
-}
-
-/********************************************************************************************
-* SpGIST Indexing Functions
-*
-* These functions are used to create a SpGIST index on the Kmer type
-* Modelled from: https://doxygen.postgresql.org/spgtextproc_8c_source.html
-********************************************************************************************/
-
-// Helper macro for forming Kmer datums
-#define FORM_KMER_DATUM(kmer_ptr) KmerPGetDatum(kmer_ptr)
-
-/*
-* Struct for sorting values in picksplit
-*/
-typedef struct spgNodePtr
-{
-    Datum       d;
-    int         i;
-    int16       c;
-} spgNodePtr;
-
-/*
-* Find the length of the common prefix of a and b
-*/
-static int
-commonPrefix(const char *a, const char *b, int lena, int lenb)
-{
-    int         i = 0;
-
-    while (i < lena && i < lenb && *a == *b)
-    {
-        a++;
-        b++;
-        i++;
-    }
-
-    return i;
-}
-
-/*
-* Binary search an array of int16 datums for a match to c
-*
-* On success, *i gets the match location; on failure, it gets where to insert
-*/
-static bool
-searchChar(Datum *nodeLabels, int nNodes, int16 c, int *i)
-{
-    int StopLow = 0,
-    StopHigh = nNodes;
-
-    while (StopLow < StopHigh)
-    {
-        int StopMiddle = (StopLow + StopHigh) >> 1;
-        int16 middle = DatumGetInt16(nodeLabels[StopMiddle]);
-
-        if (c < middle)
-            StopHigh = StopMiddle;
-        else if (c > middle)
-            StopLow = StopMiddle + 1;
-        else
-        {
-            *i = StopMiddle;
-            return true;
-        }
-    }
-
-    *i = StopHigh;
-    return false;
-}
-
-static int pg_cmp_s16(int16 a, int16 b)
-{
-    return (int32) a - (int32) b;
-}
-
-/*
-qsort comparator to sort spgNodePtr structs by "c"
- */
-static int
-cmpNodePtr(const void *a, const void *b)
-{
-    const spgNodePtr *aa = (const spgNodePtr *) a;
-    const spgNodePtr *bb = (const spgNodePtr *) b;
-
-    return pg_cmp_s16(aa->c, bb->c);
-}
-
-/*
- A function to test and get the Oid of the Postgres type kmer
- Required for SP-GiST implementation (and is called from Sql)
-*/
-PG_FUNCTION_INFO_V1(get_oid);
-Datum
-get_oid(PG_FUNCTION_ARGS){
-    Oid int4_oid = typenameTypeId(NULL, makeTypeName("kmer"));
-    PG_RETURN_INT32(int4_oid);
-}
-
-PG_FUNCTION_INFO_V1(spgist_kmer_config);
-Datum
-spgist_kmer_config(PG_FUNCTION_ARGS)
-{
-    //spgConfigIn not needed!
-    spgConfigOut *cfgout = (spgConfigOut *) PG_GETARG_POINTER(1);
-
-    Oid KMEROID = typenameTypeId(NULL, makeTypeName("kmer"));
-
-    cfgout->prefixType = KMEROID;
-    cfgout->leafType = KMEROID;
-    cfgout->labelType = INT2OID;
-
-    cfgout->canReturnData = true; // A node may contain already the value that we want without it being a leaf
-    cfgout->longValuesOK = false;
-
-    PG_RETURN_VOID();
-}
-
-PG_FUNCTION_INFO_V1(spgist_kmer_choose);
-Datum
-spgist_kmer_choose(PG_FUNCTION_ARGS)
-{
-    spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
-    spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
-
-    Kmer *input_kmer = DatumGetKmerP(in->datum);
-    Kmer *prefix_kmer = NULL;
-    Kmer *new_prefix, *new_postfix, *rest_kmer;
-    const char *input_sequence = kmer_to_str(input_kmer);
-    const char *prefix_sequence = NULL;
-    char *truncated_prefix, *postfix_prefix;
-
-    int input_length = input_kmer->length;
-    int prefix_length = 0;
-    int common_length = 0;
-    int16 next_char = 0;
-    int idx = 0;
-
-    if (in->hasPrefix)
-    {
-        prefix_kmer = DatumGetKmerP(in->prefixDatum);
-        prefix_sequence = kmer_to_str(prefix_kmer);
-        prefix_length = prefix_kmer->length;
-
-        common_length = commonPrefix(input_sequence + in->level, prefix_sequence, input_length - in->level, prefix_length);
-
-        if (common_length == prefix_length)
-        {
-            if (input_length - in->level > common_length)
-                next_char = *(unsigned char *) input_sequence + in->level + common_length;
-            else
-                next_char = -1;
-        }
-        else
-        {
-            // Must split tuple because incoming value doesn't match prefix
-            out->resultType = spgSplitTuple;
-
-            if (common_length == 0)
-                out->result.splitTuple.prefixHasPrefix = false;
-            else
-            {
-                truncated_prefix = palloc0(common_length + 1);
-                memcpy(truncated_prefix, prefix_sequence, common_length);
-                truncated_prefix[common_length] = '\0';
-
-                new_prefix = kmer_make(truncated_prefix);
-
-                out->result.splitTuple.prefixHasPrefix = true;
-                out->result.splitTuple.prefixPrefixDatum = FORM_KMER_DATUM(new_prefix);
-
-                pfree(truncated_prefix);
-            }
-            out->result.splitTuple.prefixNNodes = 1;
-            out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
-            out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(*(unsigned char *)(prefix_sequence + common_length));
-
-            out->result.splitTuple.childNodeN = 0;
-            if (prefix_length - common_length == 1)
-            {
-                out->result.splitTuple.postfixHasPrefix = false;
-            }
-            else
-            {
-                postfix_prefix = palloc0(prefix_length - common_length);
-                memcpy(postfix_prefix, prefix_sequence + common_length + 1, prefix_length - common_length - 1);
-                postfix_prefix[prefix_length - common_length - 1] = '\0';
-
-                new_postfix = kmer_make(postfix_prefix);
-
-                out->result.splitTuple.postfixHasPrefix = true;
-                out->result.splitTuple.postfixPrefixDatum = FORM_KMER_DATUM(new_postfix);
-
-                pfree(postfix_prefix);
-            }
-            PG_RETURN_VOID();
-        }
-    }
-    else if (input_length > in->level)
-    {
-        next_char = *(unsigned char *)(input_sequence + in->level);
-    }
-    else
-    {
-        next_char = -1;
-    }
-
-    // Look up next_char in the node label array
-    if (searchChar(in->nodeLabels, in->nNodes, next_char, &idx))
-    {
-        // Match found: descend to the existing node
-        int level_add;
-        out->resultType = spgMatchNode;
-        out->result.matchNode.nodeN = idx;
-        level_add = common_length;
-        if (next_char >= 0)
-            level_add++;
-
-        out->result.matchNode.levelAdd = level_add;
-        if (input_length - in->level - level_add > 0)
-        {
-            char *rest_sequence = palloc0(input_length - in->level - level_add + 1); // +1 for null terminator
-            memcpy(rest_sequence, input_sequence + in->level + level_add, input_length - in->level - level_add);
-            rest_sequence[input_length - in->level - level_add] = '\0';
-
-            rest_kmer = kmer_make(rest_sequence);
-            out->result.matchNode.restDatum = FORM_KMER_DATUM(rest_kmer);
-
-            pfree(rest_sequence);
-        }
-        else
-        {
-            out->result.matchNode.restDatum = FORM_KMER_DATUM(kmer_make("X")); // Dummy value!
-        }
-    }
-    else if (in->allTheSame)
-    {
-        // Can't use AddNode, so split the tuple
-        out->resultType = spgSplitTuple;
-        out->result.splitTuple.prefixHasPrefix = in->hasPrefix;
-        out->result.splitTuple.prefixPrefixDatum = in->prefixDatum;
-        out->result.splitTuple.prefixNNodes = 1;
-        out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
-        out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(next_char);
-        out->result.splitTuple.childNodeN = 0;
-        out->result.splitTuple.postfixHasPrefix = false;
-    }
-    else
-    {
-        // Add a node for the not-previously-seen next_char value
-        out->resultType = spgAddNode;
-        out->result.addNode.nodeLabel = Int16GetDatum(next_char);
-        out->result.addNode.nodeN = idx;
-    }
-
-    PG_RETURN_VOID();
-}
-
-PG_FUNCTION_INFO_V1(spgist_kmer_picksplit);
-Datum
-spgist_kmer_picksplit(PG_FUNCTION_ARGS)
-{
-    spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
-    spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
-
-    Kmer *first_kmer = DatumGetKmerP(in->datums[0]);
-    Kmer *new_prefix, *kmer;
-    char *first_sequence = kmer_to_str(first_kmer);
-    char *sequence, *truncated_prefix;
-
-    int common_length = first_kmer->length; // Start with the full length of the first Kmer
-    int i, len;
-
-    spgNodePtr *nodes;
-
-    // Find the longest common prefix
-    for (i = 1; i < in->nTuples; i++)
-    {
-        kmer = DatumGetKmerP(in->datums[i]);
-        sequence = kmer_to_str(kmer);
-        len = commonPrefix(first_sequence, sequence, common_length, kmer->length);
-
-        if (len < common_length)
-        {
-            common_length = len;
-        }
-    }
-
-    common_length = Min(common_length, 32);
-
-    if (common_length == 0)
-    {
-        out->hasPrefix = false;
-    }
-    else
-    {
-        truncated_prefix = palloc0(common_length + 1);
-        memcpy(truncated_prefix, first_sequence, common_length);
-        truncated_prefix[common_length] = '\0';
-
-        new_prefix = kmer_make(truncated_prefix);
-        out->hasPrefix = true;
-        out->prefixDatum = FORM_KMER_DATUM(new_prefix);
-
-        pfree(truncated_prefix);
-    }
-
-    // Extract the node label (first non-common character) for each tuple
-    nodes = (spgNodePtr *) palloc(sizeof(spgNodePtr) * in->nTuples);
-    for (i = 0; i < in->nTuples; i++)
-    {
-        const char *sequence;
-        kmer = DatumGetKmerP(in->datums[i]);
-        sequence = kmer_to_str(kmer);
-        if (common_length < kmer->length) {
-            nodes[i].c = *(unsigned char *)(sequence + common_length);
-        } else {
-            nodes[i].c = -1; // Dummy value because we don't have a suffix
-        }
-        nodes[i].i = i;
-        nodes[i].d = in->datums[i];
-    }
-
-    // Sort label values so we can group them into nodes
-    qsort(nodes, in->nTuples, sizeof(*nodes), cmpNodePtr);
-
-    // And emit results
-    out->nNodes = 0;
-    out->nodeLabels = (Datum *) palloc(sizeof(Datum) * in->nTuples);
-    out->mapTuplesToNodes = (int *) palloc(sizeof(int) * in->nTuples);
-    out->leafTupleDatums = (Datum *) palloc(sizeof(Datum) * in->nTuples);
-
-    for (i = 0; i < in->nTuples; i++)
-    {
-        Datum leafDatum;
-        const char *sequence;
-        kmer = DatumGetKmerP(nodes[i].d);
-        sequence = kmer_to_str(kmer);
-
-        if (i == 0 || nodes[i].c != nodes[i - 1].c)
-        {
-            out->nodeLabels[out->nNodes] = Int16GetDatum(nodes[i].c);
-            out->nNodes++;
-        }
-
-        if (common_length < kmer->length)
-        {
-            Kmer *suffix;
-            char *suffix_sequence = palloc0(kmer->length - common_length + 1);
-            memcpy(suffix_sequence, sequence + common_length, kmer->length - common_length);
-            suffix_sequence[kmer->length - common_length] = '\0';
-
-            suffix = kmer_make(suffix_sequence);
-            leafDatum = FORM_KMER_DATUM(suffix);
-            pfree(suffix_sequence);
-        }
-        else
-        {
-            leafDatum = FORM_KMER_DATUM(kmer_make(strdup("X"))); // Dummy value
-        }
-
-        out->leafTupleDatums[nodes[i].i] = leafDatum;
-        out->mapTuplesToNodes[nodes[i].i] = out->nNodes - 1;
-    }
-
-    pfree(nodes);
-    PG_RETURN_VOID();
-}
-
-PG_FUNCTION_INFO_V1(spgist_kmer_inner_consistent);
-Datum
-spgist_kmer_inner_consistent(PG_FUNCTION_ARGS)
-{
-    spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
-    spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
-
-    Kmer *reconstructed_kmer; // Reconstructed Value
-    Kmer *prefixKmer = NULL;
-
-    char *reconstructed_sequence = NULL;
-    char *full_reconstructed_sequence = NULL;
-    char *prefixSequence = NULL;
-
-    int prefixLength = 0;
-    int maxReconstrLen;
-    int i;
-
-    reconstructed_kmer = (Kmer *) DatumGetKmerP(in->reconstructedValue);
-    Assert(reconstructed_kmer == NULL ? in->level == 0 : reconstructed_kmer->length == in->level);
-
-    maxReconstrLen = in->level + 1;
-    if (in->hasPrefix)
-    {
-        prefixKmer = DatumGetKmerP(in->prefixDatum);
-        prefixSequence = kmer_to_str(prefixKmer);
-        prefixLength = prefixKmer->length;
-        maxReconstrLen += prefixLength;
-    }
-
-    full_reconstructed_sequence = palloc0(maxReconstrLen);
-
-    if (in->level)
-    {
-        reconstructed_sequence = kmer_to_str(reconstructed_kmer);
-        memcpy(full_reconstructed_sequence, reconstructed_sequence, in->level);
-    }
-
-    if (prefixLength)
-    {
-        memcpy(full_reconstructed_sequence + in->level, prefixSequence, prefixLength);
-    }
-
-    // Last byte will be filled in below
-
-    // Scan the child nodes, for each one, complete the reconstructed sequence and check if it's consistent,
-    // if it is, add it to the output arrays
-
-    out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
-    out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
-    out->reconstructedValues = (Datum *) palloc(sizeof(Datum) * in->nNodes);
-    out->nNodes = 0;
-
-    for (i = 0; i < in->nNodes; i++)
-    {
-        int16 next_char = DatumGetInt16(in->nodeLabels[i]);
-        int thisLen;
-        bool res = true;
-        int j;
-
-        // If next_char is not a dummy value, append it to the reconstructed sequence
-        if (next_char <= 0)
-        { // Dummy value of either -1 or -2! From the choose/picksplit function
-            thisLen = maxReconstrLen - 1;
-            full_reconstructed_sequence[thisLen] = '\0';
-        }
-        else
-        {
-            full_reconstructed_sequence[maxReconstrLen - 1] = (char) next_char; // Append the next_char
-            thisLen = maxReconstrLen;
-            full_reconstructed_sequence[thisLen] = '\0';
-        }
-
-        for (j = 0; j < in->nkeys; j++)
-        {
-            StrategyNumber strategy = in->scankeys[j].sk_strategy;
-            Kmer *inKmer;
-            int inSize;
-            int r;
-
-            // We don't deal with collation aware strategies - we don't know why :)
-
-            inKmer = DatumGetKmerP(in->scankeys[j].sk_argument);
-            inSize = inKmer->length;
-
-            r = memcmp(full_reconstructed_sequence, kmer_to_str(inKmer), Min(thisLen, inSize)); // Compare the reconstructed sequence with the query sequence
-
-            switch (strategy)
-            {
-                case 1: // Equality operator from our index definition
-                    res = (r == 0);
-                    break;
-                case 2: // starts_with() or ^@ operator from our index definition
-                    if (in->level >= inSize)
-                    {
-                        res = 1;
-                    }
-                    else
-                    {
-                        res = starts_with_internal(full_reconstructed_sequence, kmer_to_str(inKmer));
-                    }
-                    break;
-                default:
-                    res = false;
-                    break;
-            }
-        }
-
-        if (res)
-        {
-            out->nodeNumbers[out->nNodes] = i;
-            out->levelAdds[out->nNodes] = thisLen - in->level;
-            full_reconstructed_sequence[thisLen] = '\0';
-            out->reconstructedValues[out->nNodes] = FORM_KMER_DATUM(kmer_make(full_reconstructed_sequence));
-            out->nNodes++;
-        }
-    }
-    pfree(full_reconstructed_sequence);
-    PG_RETURN_VOID();
-}
-
-PG_FUNCTION_INFO_V1(spgist_kmer_leaf_consistent);
-Datum
-spgist_kmer_leaf_consistent(PG_FUNCTION_ARGS)
-{
-    spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
-    spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
-    int level = in->level;
-
-    Kmer *leaf_kmer = DatumGetKmerP(in->leafDatum);
-    Kmer *reconstructed_kmer = NULL;
-    Kmer *fullKmer;
-    const char *leaf_sequence = kmer_to_str(leaf_kmer);
-    char *full_reconstructed_sequence = NULL;
-    char *full_seq = NULL;
-    int full_len, j;
-    bool res;
-
-    // If leaf_sequence is NULL, then just return since it's a null node
-    if (leaf_sequence == NULL || leaf_sequence[0] == 'X')
-    {
-        PG_RETURN_BOOL(false);
-    }
-
-    out->recheck = false;
-
-    if (DatumGetPointer(in->reconstructedValue))
-    {
-        reconstructed_kmer = DatumGetKmerP(in->reconstructedValue);
-        full_reconstructed_sequence = kmer_to_str(reconstructed_kmer);
-    }
-    Assert(full_reconstructed_sequence == NULL ? level == 0 : reconstructed_kmer->length == level);
-
-    // Reconstruct the full string represented by this leaf tuple
-    full_len = level + leaf_kmer->length - 1;
-
-    if ((leaf_sequence == NULL || leaf_sequence[0] == 'X') && level > 0)
-    {
-        full_seq = full_reconstructed_sequence;
-        out->leafValue = PointerGetDatum(reconstructed_kmer);
-    }
-    else
-    {
-        full_seq = palloc(full_len + 1);
-        if (level > 0)
-        {
-            memcpy(full_seq, full_reconstructed_sequence, level);
-        }
-
-        if (leaf_kmer->length > 0)
-        {
-            int copy_start = 0;
-            int copy_len = leaf_kmer->length;
-
-            if (level > 0 && full_reconstructed_sequence[level - 1] == leaf_sequence[0])
-            {
-                copy_start = 1;
-                copy_len = leaf_kmer->length - 1;
-                full_len--;
-            }
-
-            if (copy_len > 0)
-            {
-                memcpy(full_seq + level, leaf_sequence + copy_start, copy_len);
-            }
-        }
-        full_seq[full_len] = '\0';
-
-        fullKmer = kmer_make(full_seq);
-
-        out->leafValue = FORM_KMER_DATUM(fullKmer);
-    }
-
-    // Perform the required comparisons
-    res = true;
-    for (j = 0; j < in->nkeys; j++)
-    {
-        StrategyNumber strategy = in->scankeys[j].sk_strategy;
-        Kmer *query_kmer = DatumGetKmerP(in->scankeys[j].sk_argument);
-        const char *query_sequence = kmer_to_str(query_kmer);
-        int query_len = query_kmer->length;
-        int r;
-
-        r = strncmp(full_seq, query_sequence, Min(full_len, query_len));
-
-        switch (strategy)
-        {
-            case 1:
-                res = (r == 0);
-                if (full_len != query_len)
-                { // We do not store kmers of this length, so partial matches are not possible
-                    res = false;
-                }
-                break;
-            case 2:
-                if (level >= query_len)
-                {
-                    res = 1;
-                }
-                else
-                {
-                    res = starts_with_internal(full_seq, query_sequence);
-                }
-                break;
-            default:
-                res = false;
-                break;
-        }
-
-        if (!res)
-            break;
-    }
-
-    PG_RETURN_BOOL(res);
-}
\ No newline at end of file
+#include "postgres.h"
+#include "utils/varlena.h"
+#include "varatt.h" // For SET_VARSIZE!
+#include "fmgr.h"
+#include "libpq/pqformat.h"
+#include "utils/fmgrprotos.h"
+#include <stddef.h>  // Include for offsetof
+#include "funcapi.h"
+#include "utils/builtins.h" // For cstring_to_text
+#include "common/hashfn.h" // For hash_any() in kmer_hash
+#include <inttypes.h>
+#include "access/spgist.h"
+#include "parser/parse_type.h"
+#include "utils/lsyscache.h"
+#include "nodes/nodes.h"
+#include "nodes/makefuncs.h"
+#include "nodes/parsenodes.h"
+#include "common/int.h" // For pg_cmp_s16()
+
+#include "utils/pg_locale.h"
+#include "utils/datum.h"
+#include "utils/fmgrprotos.h"
+#include "mb/pg_wchar.h"
+#include "utils/sortsupport.h"
+#include "utils/memutils.h" // For MaxAllocSize
+#include "utils/acl.h" // For has_privs_of_role()
+#include "catalog/pg_authid.h" // For ROLE_PG_READ_SERVER_FILES
+#include "miscadmin.h" // For GetUserId()
+#include "storage/fd.h" // For OpenTransientFile() and AllocateFile()
+#include "access/htup_details.h" // For heap_form_tuple()
+#include "access/detoast.h" // For VARATT_EXTERNAL_GET_POINTER()
+#include "utils/array.h" // For construct_array_builtin()
+#include "utils/tuplestore.h" // For tuplestore_putvalues()
+#include "port/pg_bitutils.h" // For pg_popcount64() and pg_leftmost_one_pos64()
+#include "catalog/pg_type.h" // For INT8OID
+#include "access/amapi.h" // For the dna_fm index access method
+#include "access/generic_xlog.h"
+#include "access/relscan.h"
+#include "access/tableam.h"
+#include "access/xloginsert.h"
+#include "commands/vacuum.h"
+#include "nodes/nodeFuncs.h" // For get_rightop()
+#include "nodes/tidbitmap.h"
+#include "optimizer/optimizer.h"
+#include "storage/bufmgr.h"
+#include "utils/selfuncs.h"
+#include "access/stratnum.h"
+#include "executor/spi.h" // For reading the references of map_read()
+
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h> // For the striped Smith-Waterman
+#endif
+
+PG_MODULE_MAGIC;
+
+/**
+ * DNA structure
+ *
+ * We store the DNA sequence as a bit sequence, each nucleotide takes 2 bits
+ * This is done to save space since DNA sequences can be very long (~3 billion nucleotides in the human genome)
+ *
+ * Also, we store the length of the DNA sequence in nucleotides so that we can decode it properly
+ * The vl_len_ header is required for PostgreSQL variable-length types
+ */
+typedef struct Dna
+{
+    char vl_len_[4];                    // Required header for PostgreSQL variable-length types
+    uint64_t length;                     // Length of the DNA sequence in nucleotides
+    uint64_t bit_sequence[FLEXIBLE_ARRAY_MEMBER];  // Array to store packed bits
+} Dna;
+
+// In simple words, datum is like void * with additional size header and here we define macros.
+#define DatumGetDnaP(X)  ((Dna *) DatumGetPointer(X)) // We convert the datum pointer into a dna pointer
+#define DnaPGetDatum(X)  PointerGetDatum(X) // We covert the dna pointer into a Datum pointer
+#define PG_GETARG_DNA_P(n) DatumGetDnaP(PG_GETARG_DATUM(n)) // We get the nth argument given to a function
+#define PG_RETURN_DNA_P(x) return DnaPGetDatum(x) // ¯\_(ツ)_/¯
+
+/**
+ * K-mer structure
+ *
+ * We store the K-mer as a bit sequence, each nucleotide takes 2 bits
+ * Maximum length of a K-mer is 32 nucleotides, which is 64 bits, so one single 64-bit integer is enough
+ */
+typedef struct Kmer {
+    int32 length;     // Length of the K-mer in nucleotides (each is 2 bits)
+    uint64_t bit_sequence;  // Encoded bit sequence K-mer of max length 64 bits
+    // Here, we don't need vl_len_ since the max length of a kmer is 32 nucleotides, which is 64 bits!
+} Kmer;
+
+#define DatumGetKmerP(X)  ((Kmer *) DatumGetPointer(X)) // We convert the datum pointer into a dna pointer
+#define KmerPGetDatum(X)  PointerGetDatum(X) // We covert the dna pointer into a Datum pointer
+#define PG_GETARG_KMER_P(n) DatumGetKmerP(PG_GETARG_DATUM(n)) // We get the nth argument given to a function
+#define PG_RETURN_KMER_P(x) return KmerPGetDatum(x) // ¯\_(ツ)_/¯
+
+/**
+ * 128-bit K-mer structure, for k up to 64
+ *
+ * Same packing as Kmer over two chunks: nucleotides 0..31 in bit_sequence[0], 32..63 in bit_sequence[1],
+ * unused bits are zero. Kmer stays the type to use for k <= 32, this one only pays for the second chunk when needed
+ */
+typedef struct Kmer128 {
+    int32 length;               // Length of the K-mer in nucleotides, 0 only for SP-GiST suffixes
+    uint64_t bit_sequence[2];
+} Kmer128;
+
+#define KMER128_MAX_LENGTH 64
+#define DatumGetKmer128P(X)  ((Kmer128 *) DatumGetPointer(X))
+#define Kmer128PGetDatum(X)  PointerGetDatum(X)
+#define PG_GETARG_KMER128_P(n) DatumGetKmer128P(PG_GETARG_DATUM(n))
+#define PG_RETURN_KMER128_P(x) return Kmer128PGetDatum(x)
+
+/**
+ * 8-byte K-mer, passed by value, for k up to 31
+ *
+ * Kmer's 2-bit codes (first nucleotide in the lowest bits) with a 1 bit right above the last nucleotide, so the
+ * length is the position of the highest set bit divided by two and the word is never 0
+ */
+typedef uint64 Kmer64;
+
+#define KMER64_MAX_LENGTH 31
+#define KMER64_LENGTH(x) (pg_leftmost_one_pos64(x) / 2)
+#define KMER64_BITS(x) ((x) & ~(UINT64CONST(1) << (2 * KMER64_LENGTH(x))))
+#define KMER64_MAKE(bits, length) ((Kmer64) (bits) | (UINT64CONST(1) << (2 * (length))))
+#define PG_GETARG_KMER64(n) ((Kmer64) PG_GETARG_INT64(n))
+#define PG_RETURN_KMER64(x) return Int64GetDatum((int64) (x))
+
+/**
+ * Qkmer structure
+ *
+ * A Qkmer is a pattern of at most 32 IUPAC nucleotide codes, stored as one 4-bit mask of allowed nucleotides per
+ * position: bit c of the mask is set when the nucleotide with 2-bit code c matches (A = 0, T = 1, C = 2, G = 3), so
+ * a k-mer's codes index the masks directly. Positions 0..15 are in masks[0], 16..31 in masks[1], 4 bits each from the
+ * lowest, positions past the length are 0xF (anything matches there)
+ */
+typedef struct Qkmer {
+    int32 length;           // Length of the pattern in nucleotides
+    uint64_t masks[2];
+} Qkmer;
+
+// Macros for Qkmer
+#define DatumGetQkmerP(X) ((Qkmer *) DatumGetPointer(X))
+#define QkmerPGetDatum(X) PointerGetDatum(X)
+#define PG_GETARG_QKMER_P(n) DatumGetQkmerP(PG_GETARG_DATUM(n))
+#define PG_RETURN_QKMER_P(x) return QkmerPGetDatum(x)
+
+/**
+ * DNA batch structure
+ *
+ * For short reads the per-row overhead (tuple header, varlena header, length) is bigger than the read itself,
+ * so we also let people pack many sequences into one value: a single bit stream with all reads back to back
+ * (same 2 bits per nucleotide as Dna), plus count + 1 offsets telling us where each read starts.
+ * Read i is nucleotides offsets[i] .. offsets[i + 1] - 1 of the bit stream, offsets[count] is the total length.
+ *
+ * Offsets are 32 bits, which is enough: a varlena can't be bigger than 1GB, i.e. less than 2^32 nucleotides
+ * The bit stream starts at the next 8-byte boundary after the offsets, use DNA_BATCH_BITS() to get to it
+ */
+typedef struct DnaBatch
+{
+    char vl_len_[4];                    // Required header for PostgreSQL variable-length types
+    uint32 count;                       // Number of sequences in the batch
+    uint32 offsets[FLEXIBLE_ARRAY_MEMBER]; // count + 1 start offsets (in nucleotides), followed by the bit stream
+} DnaBatch;
+
+#define DNA_BATCH_BITS_OFFSET(count) TYPEALIGN(sizeof(uint64_t), offsetof(DnaBatch, offsets) + ((Size) (count) + 1) * sizeof(uint32))
+#define DNA_BATCH_BITS(b) ((uint64_t *) ((char *) (b) + DNA_BATCH_BITS_OFFSET((b)->count)))
+
+#define DatumGetDnaBatchP(X) ((DnaBatch *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_DNA_BATCH_P(n) DatumGetDnaBatchP(PG_GETARG_DATUM(n))
+#define PG_RETURN_DNA_BATCH_P(x) return PointerGetDatum(x)
+
+/**
+ * DNA reference structure
+ *
+ * Instead of copying a reference genome into a table (and through the WAL), we can just point into a
+ * UCSC .2bit file on the server: file, sequence name, start (0-based) and length in nucleotides.
+ * The file is only looked at when the sequence is actually needed, see the .2bit functions below.
+ *
+ * data holds the file path and the sequence name, both null terminated, one after the other
+ */
+typedef struct DnaRef
+{
+    char vl_len_[4];                    // Required header for PostgreSQL variable-length types
+    uint64_t start;                     // 0-based start of the region in the .2bit sequence
+    uint64_t length;                    // Length of the region in nucleotides
+    char data[FLEXIBLE_ARRAY_MEMBER];   // "<file>\0<sequence name>\0"
+} DnaRef;
+
+#define DNA_REF_FILE(r) ((r)->data)
+#define DNA_REF_NAME(r) ((r)->data + strlen((r)->data) + 1)
+
+#define DatumGetDnaRefP(X) ((DnaRef *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_DNA_REF_P(n) DatumGetDnaRefP(PG_GETARG_DATUM(n))
+#define PG_RETURN_DNA_REF_P(x) return PointerGetDatum(x)
+
+/**
+ * FM-index structure
+ *
+ * Burrows-Wheeler transform of a sequence plus a sampled suffix array, for counting and locating any substring
+ * in time proportional to its length. The BWT has length + 1 rows, the extra one is the end of the sequence ($),
+ * which sorts before A. The BWT is cut into 64-byte (one cache line) blocks of 192 nucleotides that start
+ * with the number of each nucleotide in the rows before the block, so rank() reads one block and never more.
+ *
+ * After the header, at the 64th byte: the blocks, then one mark bit per row (set when the row's suffix array
+ * entry is sampled), the number of marked rows before each 64-bit mark word, and the samples in row order.
+ * Every sample_rate-th position of the sequence is sampled, so locating an occurrence takes < sample_rate steps
+ */
+typedef struct FmIndex
+{
+    char vl_len_[4];                    // Required header for PostgreSQL variable-length types
+    uint32 sample_rate;                 // Positions 0, sample_rate, 2 * sample_rate, ... have their row sampled
+    uint64_t length;                    // Length of the indexed sequence in nucleotides
+    uint64_t primary;                   // Row whose BWT character is $ (stored as an A in its block)
+    uint64_t num_samples;
+    uint64_t counts[4];                 // C array: rows starting with a smaller character than each nucleotide
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} FmIndex;
+
+#define FM_BLOCK_BASES 192
+
+typedef struct FmBlock
+{
+    uint32 counts[4];                   // Occurrences of each nucleotide in the BWT before the block
+    uint64_t bits[FM_BLOCK_BASES / 32]; // BWT characters, 2 bits each like Dna
+} FmBlock;
+
+#define FM_NUM_ROWS(fm) ((fm)->length + 1)
+#define FM_NUM_BLOCKS(length) ((length) / FM_BLOCK_BASES + 1)
+#define FM_NUM_MARK_WORDS(length) ((length) / 64 + 1)
+#define FM_BLOCKS(fm) ((const FmBlock *) (fm)->data)
+#define FM_MARKS(fm) ((const uint64_t *) (FM_BLOCKS(fm) + FM_NUM_BLOCKS(FM_NUM_ROWS(fm))))
+#define FM_MARK_RANKS(fm) ((const uint32 *) (FM_MARKS(fm) + FM_NUM_MARK_WORDS(FM_NUM_ROWS(fm))))
+#define FM_SAMPLES(fm) ((const uint32 *) (FM_MARK_RANKS(fm) + FM_NUM_MARK_WORDS(FM_NUM_ROWS(fm))))
+#define FM_INDEX_SIZE(length, num_samples) (offsetof(FmIndex, data) + FM_NUM_BLOCKS((length) + 1) * sizeof(FmBlock) \
+    + FM_NUM_MARK_WORDS((length) + 1) * (sizeof(uint64_t) + sizeof(uint32)) + (num_samples) * sizeof(uint32))
+
+
+/**
+Great reference for pg functions:
+https://doxygen.postgresql.org/varatt_8h.html (For SET_VARSIZE)
+https://www.postgresql.org/docs/16/index.html
+
+SPGiST refs:
+https://www.postgresql.org/docs/16/indexes-types.html#INDEXES-TYPE-SPGIST
+https://www.postgresql.org/docs/current/spgist.html
+https://doxygen.postgresql.org/spgtextproc_8c_source.html
+*/
+
+/********************************************************************************************
+* DNA functions
+********************************************************************************************/
+
+// Number of 64-bit chunks needed to hold n nucleotides, rest of the last chunk is padded with zeros
+#define DNA_NUM_WORDS(n) (((uint64_t) (n) * 2 + 63) / 64)
+
+// 2-bit code of the nucleotide at position pos of a packed bit sequence
+#define DNA_BASE_AT(bits, pos) (((bits)[(pos) / 32] >> (((pos) % 32) * 2)) & 0x3)
+
+// 2-bit code of every input character, 0xFF for anything that isn't a nucleotide, see init_base_codes()
+static uint8 base_codes[256];
+static bool base_codes_ready = false;
+
+/**
+ * Fills in the character -> 2-bit code lookup table (A: 00, T: 01, C: 10, G: 11)
+ *
+ * Lowercase is in there too since FASTA files use it for soft-masking, validate_dna_sequence() still
+ * only lets uppercase through for dna input.
+ */
+static void init_base_codes(void)
+{
+    if (base_codes_ready) {
+        return;
+    }
+    memset(base_codes, 0xFF, sizeof(base_codes));
+    base_codes['A'] = base_codes['a'] = 0x0;
+    base_codes['T'] = base_codes['t'] = 0x1;
+    base_codes['C'] = base_codes['c'] = 0x2;
+    base_codes['G'] = base_codes['g'] = 0x3;
+    base_codes_ready = true;
+}
+
+/**
+ * Encoding function
+ *
+ * Calculate number of 64-bit chunks we need, since rest of the int will be padded with zeros,
+ * we also store the length so that we can decode it later properly without decoding extra "00"s as "A"s
+ *
+ * We build every 64-bit chunk in a register from the lookup table and store it once, instead of
+ * going through a switch and a read-modify-write of the array for every single nucleotide
+ */
+static void encode_dna(const char *sequence, uint64_t *bit_sequence, uint64_t length) {
+    uint64_t num_words = DNA_NUM_WORDS(length);
+
+    init_base_codes();
+    for (uint64_t index = 0; index < num_words; index++) {
+        uint64_t word = 0;
+        uint64_t first = index * 32;
+        int count = (int) Min((uint64_t) 32, length - first);
+
+        for (int i = 0; i < count; i++) {
+            uint8 code = base_codes[(unsigned char) sequence[first + i]];
+            if (code > 0x3) {
+                ereport(ERROR, (errmsg("Invalid character in DNA sequence: %c", sequence[first + i])));
+            }
+            word |= (uint64_t) code << (2 * i);
+        }
+        bit_sequence[index] = word;
+    }
+}
+
+/**
+ * Decoding function
+ *
+ * We decode the sequence by shifting the bits to the right and then reading the last 2 bits to get the nucleotide
+ */
+static char* decode_dna(const uint64_t *bit_sequence, uint64_t length) {
+    char *sequence = palloc0(length + 1);  // +1 for the null terminator which is added automatically by palloc0
+
+    for (uint64_t i = 0; i < length; i++) {
+        uint64_t offset = (i * 2) % 64; // Offset of the current nucleotide since it's 2 bits long
+        uint64_t index = i / 32;
+        uint64_t bits = (bit_sequence[index] >> offset) & 0x3;
+
+        switch (bits) {
+            case 0x0: sequence[i] = 'A'; break;
+            case 0x1: sequence[i] = 'T'; break;
+            case 0x2: sequence[i] = 'C'; break;
+            case 0x3: sequence[i] = 'G'; break;
+        }
+    }
+
+    return sequence;
+}
+
+/**
+ * Reads n (at most 32) consecutive nucleotides starting at pos from a packed bit sequence
+ *
+ * The result is packed the same way a k-mer is (first nucleotide in the lowest 2 bits), so this
+ * is also how we pull k-mers out of a sequence without decoding anything to characters.
+ * We never touch the next chunk unless the run actually crosses into it, so this can't read past the end.
+ */
+static inline uint64_t read_bases(const uint64_t *bit_sequence, uint64_t pos, int n)
+{
+    uint64_t index = pos / 32;
+    int offset = (pos % 32) * 2;
+    uint64_t bits = bit_sequence[index] >> offset;
+
+    if (offset + 2 * n > 64) {
+        bits |= bit_sequence[index + 1] << (64 - offset); // offset > 0 here, so the shift is well defined
+    }
+    if (n < 32) {
+        bits &= ((uint64_t) 1 << (2 * n)) - 1;
+    }
+    return bits;
+}
+
+/**
+ * Copies n nucleotides from src (starting at src_pos) to dst (starting at dst_pos)
+ *
+ * Works a whole 64-bit chunk of dst at a time: each step reads as many nucleotides as are left in the
+ * current dst chunk and shift-merges them in. dst must be zeroed in the target range (palloc0 does that).
+ */
+static void copy_bases(uint64_t *dst, uint64_t dst_pos, const uint64_t *src, uint64_t src_pos, uint64_t n)
+{
+    while (n > 0) {
+        int dst_offset = dst_pos % 32;
+        int chunk = (int) Min((uint64_t) (32 - dst_offset), n);
+
+        dst[dst_pos / 32] |= read_bases(src, src_pos, chunk) << (2 * dst_offset);
+        dst_pos += chunk;
+        src_pos += chunk;
+        n -= chunk;
+    }
+}
+
+/**
+ * Allocates a zeroed Dna struct big enough for length nucleotides and fills in the header
+ */
+static Dna *dna_alloc(uint64_t length)
+{
+    Size dna_size = offsetof(Dna, bit_sequence) + DNA_NUM_WORDS(length) * sizeof(uint64_t);
+    Dna *dna;
+
+    if (dna_size > MaxAllocSize) {
+        ereport(ERROR, (errmsg("DNA sequence of %" PRIu64 " nucleotides is too long", length)));
+    }
+
+    dna = (Dna *) palloc0(dna_size);
+    SET_VARSIZE(dna, dna_size);
+    dna->length = length;
+    return dna;
+}
+
+/**
+ * Appends the 64-bit chunks of a packed bit sequence to a binary message
+ *
+ * On the wire every chunk is little-endian, which is what we have in memory on pretty much every
+ * machine Postgres runs on, so the whole payload goes out with a single memcpy
+ */
+static void pq_send_bits(StringInfo buf, const uint64_t *bits, uint64_t num_words)
+{
+#ifdef WORDS_BIGENDIAN
+    for (uint64_t i = 0; i < num_words; i++) {
+        uint64_t word = pg_bswap64(bits[i]);
+        pq_sendbytes(buf, &word, sizeof(uint64_t));
+    }
+#else
+    pq_sendbytes(buf, bits, num_words * sizeof(uint64_t));
+#endif
+}
+
+/**
+ * Counterpart of pq_send_bits(), reads num_words little-endian chunks of a binary message into bits
+ *
+ * Clears the padding bits after length nucleotides, otherwise equal sequences wouldn't compare equal
+ */
+static void pq_copy_bits(StringInfo buf, uint64_t *bits, uint64_t num_words, uint64_t length)
+{
+    if (num_words > (uint64_t) (buf->len - buf->cursor) / sizeof(uint64_t)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                        errmsg("Insufficient data left in message for %" PRIu64 " nucleotides", length)));
+    }
+    pq_copymsgbytes(buf, (char *) bits, num_words * sizeof(uint64_t));
+#ifdef WORDS_BIGENDIAN
+    for (uint64_t i = 0; i < num_words; i++) {
+        bits[i] = pg_bswap64(bits[i]);
+    }
+#endif
+    if (length % 32 != 0) {
+        bits[num_words - 1] &= ((uint64_t) 1 << (2 * (length % 32))) - 1;
+    }
+}
+
+/**
+ * Validates the DNA sequence
+ *
+ * Checks if the sequence is not empty and contains only A, T, C, G
+ */
+static bool validate_dna_sequence(const char *sequence) {
+    if (sequence == NULL || *sequence == '\0') {
+        ereport(ERROR, (errmsg("DNA sequence cannot be empty")));
+        return false;
+    }
+    for (const char *p = sequence; *p; p++) {
+        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G') {
+            ereport(ERROR, (errmsg("Invalid character in DNA sequence: %c", *p)));
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Creates and returns a new Dna struct by encoding the provided DNA sequence string "ATCG" into binary format (2 bits per nucleotide)
+ *
+ * It checks the input, calculates required memory, and calls encode_dna which stores the enocded sequence in bit_sequence
+ */
+static Dna * dna_make(const char *sequence)
+{
+    uint64_t length = (uint64_t) strlen(sequence);
+    uint64_t num_bits = length * 2;  // 2 bits per nucleotide
+    uint64_t bit_length = (num_bits + 63) / 64;  // Number of 64-bit chunks we need, rest will be padded with zeros
+    Size dna_size = offsetof(Dna, bit_sequence) + bit_length * sizeof(uint64_t);
+
+    // Allocate memory for Dna struct and bit_sequence, set all bits to 0 (which is why we use palloc0 and not palloc)
+    Dna *dna = (Dna *) palloc0(dna_size);
+
+    if (sequence != NULL) {
+        if (!validate_dna_sequence(sequence)) {
+            ereport(ERROR, (errmsg("Invalid DNA sequence: must contain only A, T, C, G")));
+            return NULL;
+        }
+    }
+
+    SET_VARSIZE(dna, dna_size); // No need to add VARHDRSZ since the library does it for us!
+    //dna->vl_len_ = VARHDRSZ + dna_size;
+    dna->length = length;
+
+    // Encode the DNA sequence directly into bit_sequence, pointer magic
+    encode_dna(sequence, dna->bit_sequence, length);
+    return dna;
+}
+
+/**
+ * Converts a Dna struct to a string
+ *
+ * We decode the bit_sequence to a string and return it
+ */
+static char * dna_to_str(const Dna *dna)
+{
+    if (dna->length == 0) {
+        return pstrdup("");
+    }
+    return decode_dna(dna->bit_sequence, dna->length);
+}
+
+/**
+ * General functions for DNA
+ */
+PG_FUNCTION_INFO_V1(dna_in);
+Datum
+dna_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    Dna *dna = dna_make(str);  // Use dna_make to create the encoded binary sequence
+
+    PG_RETURN_DNA_P(dna);
+}
+
+PG_FUNCTION_INFO_V1(dna_out);
+Datum
+dna_out(PG_FUNCTION_ARGS)
+{
+  Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+  char *result = dna_to_str(dna);
+  PG_FREE_IF_COPY(dna, 0);
+  PG_RETURN_CSTRING(result);
+}
+
+/*
+ * Binary wire format of a DNA sequence, version 1:
+ *
+ *   1 byte   format version (DNA_BINARY_VERSION)
+ *   8 bytes  number of nucleotides, network byte order like every other pq integer
+ *   payload  the ceil(length / 32) 64-bit chunks of the packed sequence, each one little-endian
+ *
+ * The payload is exactly the in-memory bit_sequence on little-endian machines, so both directions are
+ * a single memcpy instead of one call per chunk. Bump the version if the layout ever changes!
+ */
+#define DNA_BINARY_VERSION 1
+
+/*
+ * This function is supposed to take in an existing DNA sequence and return a new DNA sequence with the same values!
+ * An existing sequence means it's a binary encoded sequence in String format; just Postgres things!
+ */
+PG_FUNCTION_INFO_V1(dna_recv);
+Datum
+dna_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    int version = pq_getmsgbyte(buf);
+    int64 length;
+    Dna *dna;
+
+    if (version != DNA_BINARY_VERSION) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                        errmsg("Unsupported DNA binary format version %d", version)));
+    }
+
+    length = pq_getmsgint64(buf);
+    if (length <= 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                        errmsg("Invalid DNA sequence length %" PRId64 " in binary data", length)));
+    }
+    // Check the payload is really there before allocating, a bogus length shouldn't make us palloc a gigabyte
+    if (DNA_NUM_WORDS(length) > (uint64_t) (buf->len - buf->cursor) / sizeof(uint64_t)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                        errmsg("Insufficient data left in message for %" PRId64 " nucleotides", length)));
+    }
+
+    dna = dna_alloc((uint64_t) length);
+    pq_copy_bits(buf, dna->bit_sequence, DNA_NUM_WORDS(length), (uint64_t) length);
+
+    PG_RETURN_DNA_P(dna);
+}
+
+/*
+ * Does the same but in reverse, takes a DNA sequence and encodes it into a binary format
+ *
+ * We can't use dna_to_str here because
+ * dna_to_str converts the binary data back to a string format which is not what we want here!
+ */
+PG_FUNCTION_INFO_V1(dna_send);
+Datum
+dna_send(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    uint64_t num_words = DNA_NUM_WORDS(dna->length);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    // Reserve the whole message up front so the payload copy never has to grow the buffer
+    enlargeStringInfo(&buf, 1 + sizeof(int64) + num_words * sizeof(uint64_t));
+    pq_sendbyte(&buf, DNA_BINARY_VERSION);
+    pq_sendint64(&buf, dna->length);
+    pq_send_bits(&buf, dna->bit_sequence, num_words);
+
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(dna_cast_from_text);
+Datum
+dna_cast_from_text(PG_FUNCTION_ARGS)
+{
+    text *txt = PG_GETARG_TEXT_P(0);
+    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));
+    Dna *dna = dna_make(str);  // Use dna_make for binary encoding
+    PG_RETURN_DNA_P(dna);
+}
+
+PG_FUNCTION_INFO_V1(dna_cast_to_text);
+Datum
+dna_cast_to_text(PG_FUNCTION_ARGS)
+{
+  Dna *dna  = (Dna *) PG_GETARG_VARLENA_P(0);
+  text *out = (text *)DirectFunctionCall1(textin,
+            PointerGetDatum(dna_to_str(dna)));
+  PG_FREE_IF_COPY(dna, 0);
+  PG_RETURN_TEXT_P(out);
+}
+
+PG_FUNCTION_INFO_V1(dna_constructor);
+Datum
+dna_constructor(PG_FUNCTION_ARGS){
+  char *sequence = PG_GETARG_CSTRING(0); 
+  PG_RETURN_DNA_P(dna_make(sequence));
+}
+
+PG_FUNCTION_INFO_V1(dna_to_string);
+Datum
+dna_to_string(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    char *result = decode_dna(dna->bit_sequence, dna->length);  // Decode bit_sequence to a readable string
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_CSTRING(result);
+}
+
+/**
+* Magically faster than strcmp!
+*/
+static bool dna_eq_internal(Dna *dna1, Dna *dna2)
+{
+    uint64_t bit_length = (dna1->length * 2 + 63) / 64;  // Number of 64-bit chunks needed
+
+    if (dna1->length != dna2->length) {
+        return false;  // Different lengths mean they can't be equal
+    }
+
+    // Compare each 64-bit chunk in the bit_sequence array
+    for (uint64_t i = 0; i < bit_length; i++) {
+        if (dna1->bit_sequence[i] != dna2->bit_sequence[i]) {
+            return false;  // If any chunk differs, the sequences are not equal
+        }
+    }
+
+    return true;  // All chunks are equal, phew!
+}
+
+PG_FUNCTION_INFO_V1(equals);
+Datum
+equals(PG_FUNCTION_ARGS)
+{
+  Dna *dna1 = (Dna *) PG_GETARG_VARLENA_P(0);
+  Dna *dna2 = (Dna *) PG_GETARG_VARLENA_P(1);
+  bool result = dna_eq_internal(dna1, dna2);
+  PG_FREE_IF_COPY(dna1, 0);
+  PG_FREE_IF_COPY(dna2, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(length);
+Datum
+length(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    uint64_t length = dna->length;  // Directly get the length field
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_INT32(length);
+}
+
+PG_FUNCTION_INFO_V1(dna_ne);
+Datum
+dna_ne(PG_FUNCTION_ARGS)
+{
+    Dna *dna1 = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *dna2 = (Dna *) PG_GETARG_VARLENA_P(1);
+    bool result = !dna_eq_internal(dna1, dna2);  // ~ the result of dna_eq_internal, viola!
+    PG_FREE_IF_COPY(dna1, 0);
+    PG_FREE_IF_COPY(dna2, 1);
+    PG_RETURN_BOOL(result);
+}
+
+
+/********************************************************************************************
+* Kmer functions
+********************************************************************************************/
+
+/**
+ * Encoding function for K-mers
+ *
+ * Store the k-mer in a single 64-bit variable, each nucleotide takes 2 bits
+ * Encoding 'A' as 00, 'T' as 01, 'C' as 10, and 'G' as 11
+*/
+static uint64_t encode_kmer(const char *sequence, int length) {
+    uint64_t bit_sequence = 0;  // Single 64-bit variable to store the k-mer!
+    //elog(INFO, "Encoding K-mer: %s, length: %d", sequence, length);
+
+    if (length <= 0 || length > 32) { // Literally cannot store a k-mer longer than 32 nucleotides
+        ereport(ERROR, (errmsg("K-mer length must be between 1 and 32 nucleotides")));
+    }
+
+    for (int i = 0; i < length; i++) {
+        int offset = i * 2;  // Each nucleotide takes 2 bits
+
+        switch (sequence[i]) {
+            case 'A': /* 00 for A */ break;  // No operation needed for 'A'
+            case 'T': bit_sequence |= ((uint64_t)0x1 << offset); break; // 01 for T
+            case 'C': bit_sequence |= ((uint64_t)0x2 << offset); break; // 10 for C
+            case 'G': bit_sequence |= ((uint64_t)0x3 << offset); break; // 11 for G
+            case 'X': /* 00 for X */ break;  // Allow 'X' as a dummy value, will always occur at the end of a k-mer
+            default:
+                ereport(ERROR, (errmsg("Invalid character in K-mer: '%c'", sequence[i])));
+        }
+    }
+
+    return bit_sequence;  // Return the encoded k-mer
+}
+
+
+/*
+ * Decoding function for K-mers
+ *
+ * We decode the sequence by shifting the bits to the right and then reading the last 2 bits to get the nucleotide
+ */
+static char* decode_kmer(uint64_t bit_sequence, int length) {
+    // Allocate memory for the k-mer string (+1 for null terminator)
+    char *sequence = palloc(length + 1);
+    sequence[length] = '\0';
+
+    if (length <= 0 || length > 32) { // Ideally, nobody should pass invalid lengths, but just in case
+        ereport(ERROR, (errmsg("K-mer length must be between 1 and 32 nucleotides")));
+    }
+
+    for (int i = 0; i < length; i++) {
+        int offset = i * 2;  // Each nucleotide is 2 bits
+        uint64_t bits = (bit_sequence >> offset) & 0x3;  // Get the 2 bits we care about in this iteration
+
+        switch (bits) {
+            case 0x0: sequence[i] = 'A'; break;  // 00 -> A
+            case 0x1: sequence[i] = 'T'; break;  // 01 -> T
+            case 0x2: sequence[i] = 'C'; break;  // 10 -> C
+            case 0x3: sequence[i] = 'G'; break;  // 11 -> G
+            default:
+                ereport(ERROR, (errmsg("Unexpected bit pattern in K-mer: %lu", bits)));
+        }
+    }
+
+    return sequence;
+}
+
+/*
+ * Only difference here (from DNA) is that we also check the length of the k-mer
+ */
+static bool validate_kmer_sequence(const char *sequence) {
+    int length;
+
+    if (sequence == NULL || *sequence == '\0') {
+        ereport(ERROR, (errmsg("K-mer sequence cannot be empty")));
+        return false;
+    }
+    length = strlen(sequence);
+
+    if (length > 32) {
+        ereport(ERROR, (errmsg("K-mer length cannot exceed 32 nucleotides")));
+        return false;
+    }
+
+    for (const char *p = sequence; *p; p++) {
+        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G' && *p != 'X') { // We also allow 'X' for unknown nucleotides/dummy values
+            ereport(ERROR, (errmsg("Invalid character in K-mer sequence: '%c'", *p)));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Creates and returns a new Kmer struct by encoding the provided DNA/K-mer sequence string "ATCG" into binary format (2 bits per nucleotide)
+ *
+ * It checks the input, calculates required memory, and calls encode_kmer which stores the encoded sequence in bit_sequence
+ */
+static Kmer *kmer_make(const char *sequence)
+{
+   int length;
+
+   // Allocate memory for Kmer struct
+   Kmer *kmer = (Kmer *) palloc0(sizeof(Kmer));
+
+   // Validate input
+   if (sequence == NULL) {
+       ereport(ERROR, (errmsg("K-mer sequence cannot be NULL")));
+       pfree(kmer);
+       return NULL;
+   }
+   length = strlen(sequence);
+   kmer->length = length;
+   //elog(INFO, "K-mer length: %d, kmer->length: %d", length, kmer->length);
+
+   if (!validate_kmer_sequence(sequence)) {
+       ereport(ERROR, (errmsg("Invalid K-mer sequence: must contain only A, T, C, G and be at most 32 nucleotides long")));
+       pfree(kmer);
+       return NULL;
+   }
+
+   // Encode the K-mer sequence into the 64-bit bit_sequence
+   ////elog(INFO, "Encoding K-mer: %s, length: %d", sequence, length);
+   kmer->bit_sequence = encode_kmer(sequence, length);
+
+   return kmer;
+}
+
+/*
+ * String representation of a K-mer
+ */
+static char *kmer_to_str(const Kmer *kmer)
+{
+    if (kmer->length == 0) {
+        return pstrdup("");  // Return an empty string if the k-mer has no nucleotides
+    }
+    return decode_kmer(kmer->bit_sequence, kmer->length);  // Decode the k-mer and return the result
+}
+
+PG_FUNCTION_INFO_V1(kmer_in);
+Datum
+kmer_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);  // Get the input string
+    Kmer *kmer = kmer_make(str);       // Use kmer_make to create the encoded Kmer object
+
+    PG_RETURN_POINTER(kmer);          // Return the Kmer as a Datum
+}
+
+PG_FUNCTION_INFO_V1(kmer_out);
+Datum
+kmer_out(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
+    char *result = kmer_to_str(kmer);            // Convert the Kmer to a string
+    PG_FREE_IF_COPY(kmer, 0);                    // Free memory if needed
+    PG_RETURN_CSTRING(result);                   // Return the string
+}
+
+/*
+ * This function is supposed to take in an existing K-mer sequence and return a new K-mer sequence with the same values!
+ * An existing sequence means it's a binary encoded sequence in String format; just Postgres things!
+ */
+PG_FUNCTION_INFO_V1(kmer_recv);
+Datum
+kmer_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+
+    // Read the length of the K-mer
+    int length = pq_getmsgint(buf, sizeof(int));
+
+    // Allocate memory for the Kmer object
+    Kmer *kmer = (Kmer *) palloc0(sizeof(Kmer));
+    kmer->length = length;
+
+    if (length <= 0 || length > 32) {
+        ereport(ERROR, (errmsg("Invalid K-mer length: must be between 1 and 32")));
+    }
+
+    // Read the encoded bit_sequence from the message buffer
+    kmer->bit_sequence = pq_getmsgint64(buf);
+
+    PG_RETURN_POINTER(kmer);
+}
+
+/*
+ * Does the same but in reverse, takes a DNA/K-mer sequence and encodes it into a binary format
+ *
+ * We can't use kmer_to_str here because
+ * kmer_to_str converts the binary data back to a string format which is not what we want here!
+ */
+PG_FUNCTION_INFO_V1(kmer_send);
+Datum
+kmer_send(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+
+    // Serialize the length of the K-mer
+    pq_sendint(&buf, kmer->length, sizeof(int));
+
+    // Serialize the 64-bit bit_sequence
+    pq_sendint64(&buf, kmer->bit_sequence);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Convert a text object to a Kmer object
+ */
+PG_FUNCTION_INFO_V1(kmer_cast_from_text);
+Datum
+kmer_cast_from_text(PG_FUNCTION_ARGS)
+{
+    text *txt = PG_GETARG_TEXT_P(0);  // Get the input text
+    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));  // Convert to C string
+    Kmer *kmer = kmer_make(str);  // Encode the string as a Kmer
+    PG_RETURN_POINTER(kmer);  // Return the Kmer object
+}
+
+/*
+ * Convert a Kmer object to a text object
+ */
+PG_FUNCTION_INFO_V1(kmer_cast_to_text);
+Datum
+kmer_cast_to_text(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
+    text *out = (text *) DirectFunctionCall1(textin,
+                    PointerGetDatum(kmer_to_str(kmer)));  // Convert the Kmer to a string and then to text
+    PG_FREE_IF_COPY(kmer, 0);  // Free memory if the Kmer was copied
+    PG_RETURN_TEXT_P(out);  // Return the text object
+}
+
+/*
+ * Get the input C string and create a Kmer object
+ *
+ * These are somehow required by Postgres to create a new Kmer object
+ */
+PG_FUNCTION_INFO_V1(kmer_constructor);
+Datum
+kmer_constructor(PG_FUNCTION_ARGS)
+{
+    char *sequence = PG_GETARG_CSTRING(0);
+    PG_RETURN_POINTER(kmer_make(sequence));
+}
+
+PG_FUNCTION_INFO_V1(kmer_to_string);
+Datum
+kmer_to_string(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0); // Get the Kmer object
+    char *result = decode_kmer(kmer->bit_sequence, kmer->length);  // Decode the bit_sequence into a string
+    result[kmer->length] = '\0';  // Null-terminate the string
+    PG_FREE_IF_COPY(kmer, 0);  // Free memory if the Kmer was copied
+    PG_RETURN_CSTRING(result);  // Return the decoded string
+}
+
+/**
+ * Compare two Kmers for equality
+ *
+ * We compare the lengths and the bit sequences
+ */
+static bool kmer_eq_internal(Kmer *kmer1, Kmer *kmer2)
+{
+    // Check if lengths are different
+    if (kmer1->length != kmer2->length) {
+        return false;
+    }
+
+    // Now compare the bit sequences
+    if (kmer1->bit_sequence != kmer2->bit_sequence) {
+        return false;  // Sequences are different
+    }
+
+    return true;  // Both lengths and sequences are equal
+}
+
+/*
+starts_with function, takes in two char* and returns a boolean
+*/
+static bool starts_with_internal(const char *prefix, const char *kmer)
+{
+    int prefix_length = strlen(prefix);
+    int kmer_length = strlen(kmer);
+
+    if (prefix_length > kmer_length) {
+        ereport(ERROR, (errmsg("Prefix length cannot exceed kmer length")));
+    }
+
+    return strncmp(prefix, kmer, prefix_length) == 0;
+}
+
+
+PG_FUNCTION_INFO_V1(kmer_eq);
+Datum
+kmer_eq(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer1 = (Kmer *) PG_GETARG_POINTER(0);  // Get the first Kmer object
+    Kmer *kmer2 = (Kmer *) PG_GETARG_POINTER(1);  // Get the second Kmer object
+    bool result = kmer_eq_internal(kmer1, kmer2); // Compare the two Kmers
+    PG_FREE_IF_COPY(kmer1, 0);
+    PG_FREE_IF_COPY(kmer2, 1);
+    PG_RETURN_BOOL(result);  // Return the result
+}
+
+PG_FUNCTION_INFO_V1(kmer_length);
+Datum
+kmer_length(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer object
+    int length = kmer->length;  // Retrieve the length
+    PG_FREE_IF_COPY(kmer, 0);
+    PG_RETURN_INT32(length);  // Return the length as an integer
+}
+
+PG_FUNCTION_INFO_V1(kmer_ne);
+Datum
+kmer_ne(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer1 = (Kmer *) PG_GETARG_POINTER(0);  // Get the first Kmer object
+    Kmer *kmer2 = (Kmer *) PG_GETARG_POINTER(1);  // Get the second Kmer object
+
+    bool result = !kmer_eq_internal(kmer1, kmer2);  // Negate the result of kmer_eq_internal
+
+    PG_FREE_IF_COPY(kmer1, 0);
+    PG_FREE_IF_COPY(kmer2, 1);
+    PG_RETURN_BOOL(result);  // Return the result
+}
+
+PG_FUNCTION_INFO_V1(kmer_hash);
+Datum
+kmer_hash(PG_FUNCTION_ARGS)
+{
+    Kmer *input = (Kmer *) PG_GETARG_POINTER(0);  // Get the Kmer input
+    const unsigned char *data;
+    uint32 hash;
+
+    // Use hash_any to hash the bit_sequence field (8 bytes)
+    data = (unsigned char *) &input->bit_sequence;
+    hash = hash_any(data, sizeof(input->bit_sequence));  // 64-bit input, 32-bit output
+
+    PG_RETURN_UINT32(hash);  // Return the hash as uint32
+}
+
+/*
+ * This is a set returning function that generates all possible k-mers from a given DNA sequence
+ *
+ * We don't return all kmers at once, we return them one by one, this is why we use SRF_RETURN_NEXT
+ * Reference: https://www.postgresql.org/docs/current/xfunc-c.html#XFUNC-C-RETURN-SET
+ */
+PG_FUNCTION_INFO_V1(generate_kmers);
+Datum
+generate_kmers(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    // Declare state and vars
+    struct {
+        Dna *dna;
+        int k;
+    } *state; // We use this to store the DNA sequence and k value, seems counter-intuitive but there's no other way to store state in a SRF
+    Dna *dna; // Just used to receive the DNA sequence (it's a pointer so we don't copy the whole thing)
+    int k; // Input k value
+    int current_index; // Current kmer index we're generating, part of the state
+    char *kmer_sequence; // Even though we store kmers as binary, we have them as strings in the intermediate stage
+    Kmer *kmer; // The Kmer object we will return
+
+    // First call initialization
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        // Extract arguments
+        dna = (Dna *) PG_GETARG_VARLENA_P(0); // We know the first argument is a DNA sequence (and not just text)
+        k = PG_GETARG_INT32(1);
+
+        // Validate k
+        if (k <= 0 || k > 32)  // k should not exceed 32, that's usually the limit of the usefulness of k in dna sequences in practice
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and 32")));
+
+        // Save DNA and k in funcctx
+        state = palloc(sizeof(*state));
+        state->dna = dna;
+        state->k = k;
+
+        funcctx->user_fctx = state;
+        funcctx->max_calls = dna->length - k + 1;  // Total number of kmers to generate
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    // Per-call processing
+    funcctx = SRF_PERCALL_SETUP();
+
+    // Next, we get the state from the function context and run it as if we were in
+    state = funcctx->user_fctx;
+    // Current kmer index, we maintain "state" this way - the number of times we/they have called the function
+    current_index = funcctx->call_cntr;
+
+    if (current_index < funcctx->max_calls)
+    {
+        dna = state->dna;
+        k = state->k;
+
+        // Allocate memory for the kmer we will return
+        kmer_sequence = palloc0(k + 1);
+
+        // Decode kmer directly from the bit_sequence
+        for (int i = 0; i < k; i++)
+        {
+            int nucleotide_index = current_index + i;  // Nucleotide/character index in the DNA sequence
+            int bit_offset = (nucleotide_index * 2) % 64;  // Offset within the uint64_t
+            int chunk_index = nucleotide_index / 32;      // Where is it in the bit_sequence array
+            uint64_t bits = (dna->bit_sequence[chunk_index] >> bit_offset) & 0x3;  // AND with 0x3 to filter out just the last 2 bits
+
+            // Decode bits to string nucleotide for n00b users who can't read binary B)
+            switch (bits)
+            {
+                case 0x0: kmer_sequence[i] = 'A'; break;
+                case 0x1: kmer_sequence[i] = 'T'; break;
+                case 0x2: kmer_sequence[i] = 'C'; break;
+                case 0x3: kmer_sequence[i] = 'G'; break;
+                default:
+                    ereport(ERROR, (errmsg("Unexpected bit pattern in DNA sequence - this shouldn't ever happen!")));
+            }
+        }
+        kmer_sequence[k] = '\0';  // Null-terminate the kmer, since it's a string
+
+        Assert(strlen(kmer_sequence) == k);  // Just to be sure
+        // Encode the decoded k-mer as a Kmer object
+        kmer = kmer_make(kmer_sequence);
+        pfree(kmer_sequence);  // Free the temporary k-mer string
+
+        // Return just this kmer
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(kmer));
+    }
+    else
+    {
+        // Finish and cleanup
+        pfree(state);
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/*
+ * Basically just checks if the prefix is the same as the first n nucleotides of the kmer
+ */
+PG_FUNCTION_INFO_V1(starts_with);
+Datum
+starts_with(PG_FUNCTION_ARGS)
+{
+    int prefix_bits;
+    uint64_t mask;
+    bool result;
+
+    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);  // Get the prefix Kmer
+    Kmer *prefix = (Kmer *) PG_GETARG_POINTER(1);    // Get the target Kmer
+
+    // Prefix length must not exceed Kmer length
+    if (prefix->length > kmer->length) {
+        ereport(ERROR, (errmsg("Prefix length cannot exceed kmer length")));
+    }
+
+    // Calculate the number of bits to compare
+    prefix_bits = prefix->length * 2;
+
+    // Check if the first prefix_bits match in both Kmers
+    mask = ((uint64_t)1 << prefix_bits) - 1;  // Mask for prefix_bits
+    result = (prefix->bit_sequence == (kmer->bit_sequence & mask));
+
+    PG_RETURN_BOOL(result);
+}
+
+/********************************************************************************************
+* Qkmer functions
+********************************************************************************************/
+
+/*
+ * Enforces that the qkmer pattern is valid and contains only IUPAC nucleotide codes
+ * Also, the pattern must not be empty and must not exceed 32 characters
+ */
+static bool validate_qkmer_pattern(const char *pattern) {
+    if (pattern == NULL || *pattern == '\0') {
+        ereport(ERROR, (errmsg("qkmer pattern cannot be empty")));
+        return false;
+    }
+
+    // Check length
+    if (strlen(pattern) > 32) {
+        ereport(ERROR, (errmsg("Qkmer pattern length cannot exceed 32 characters")));
+        return false;
+    }
+
+    for (const char *p = pattern; *p; p++) {
+        switch (*p) {
+            case 'A': case 'T': case 'C': case 'G': case 'U': case 'W': case 'S': case 'M': case 'K':
+            case 'R': case 'Y': case 'B': case 'D': case 'H': case 'V': case 'N':
+                break;
+            default:
+                ereport(ERROR, (errmsg("Invalid character in qkmer pattern: %c", *p)));
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+* The IUPAC code of every mask of allowed nucleotides (bit 0 = A, 1 = T, 2 = C, 3 = G), so the mask of a code is
+* its position in the string
+*
+* List of IUPAC nucleotide codes we are using:
+* https://en.wikipedia.org/wiki/Nucleic_acid_notation
+* Symbol   Bases Represented
+* A        A
+* C        C
+* G        G
+* T        T
+* U        U (never in a kmer, so it matches nothing: mask 0)
+* W        A, T
+* S        C, G
+* M        A, C
+* K        G, T
+* R        A, G
+* Y        C, T
+* B        C, G, T
+* D        A, G, T
+* H        A, C, T
+* V        A, C, G
+* N        A, C, G, T
+*/
+static const char qkmer_iupac_codes[] = "UATWCMYHGRKDSVBN";
+
+#define QKMER_MASK_AT(qkmer, i) (((qkmer)->masks[(i) / 16] >> (4 * ((i) % 16))) & 0xF)
+
+/**
+ * Encoding function for Q-kmers
+ *
+ * Every code becomes its mask, unused positions are left at 0xF
+ */
+static Qkmer *qkmer_make(const char *sequence)
+{
+    int length = strlen(sequence);
+    Qkmer *qkmer;
+
+    // Validate sequence characters
+    if (!validate_qkmer_pattern(sequence)) {
+        ereport(ERROR, (errmsg("Invalid Qkmer sequence: must contain valid IUPAC nucleotide codes")));
+        return NULL;
+    }
+
+    qkmer = (Qkmer *) palloc0(sizeof(Qkmer));
+    qkmer->length = length;
+    qkmer->masks[0] = PG_UINT64_MAX;
+    qkmer->masks[1] = PG_UINT64_MAX;
+    for (int i = 0; i < length; i++) {
+        uint64_t mask = strchr(qkmer_iupac_codes, sequence[i]) - qkmer_iupac_codes;
+        qkmer->masks[i / 16] &= ~(UINT64CONST(0xF) << (4 * (i % 16)));
+        qkmer->masks[i / 16] |= mask << (4 * (i % 16));
+    }
+
+    return qkmer;
+}
+
+/**
+ * The pattern as a string of IUPAC codes
+ */
+static char *qkmer_to_str(const Qkmer *qkmer)
+{
+    char *result = (char *) palloc(qkmer->length + 1);
+
+    for (int i = 0; i < qkmer->length; i++) {
+        result[i] = qkmer_iupac_codes[QKMER_MASK_AT(qkmer, i)];
+    }
+    result[qkmer->length] = '\0';
+    return result;
+}
+
+PG_FUNCTION_INFO_V1(qkmer_in);
+Datum
+qkmer_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    Qkmer *qkmer = qkmer_make(str);
+    PG_RETURN_QKMER_P(qkmer);
+}
+
+PG_FUNCTION_INFO_V1(qkmer_out);
+Datum
+qkmer_out(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
+    PG_RETURN_CSTRING(qkmer_to_str(qkmer));
+}
+
+PG_FUNCTION_INFO_V1(qkmer_length);
+Datum
+qkmer_length(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
+    PG_RETURN_INT32(qkmer->length);
+}
+
+PG_FUNCTION_INFO_V1(qkmer_eq);
+Datum
+qkmer_eq(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer1 = PG_GETARG_QKMER_P(0);
+    Qkmer *qkmer2 = PG_GETARG_QKMER_P(1);
+    bool result = qkmer1->length == qkmer2->length && qkmer1->masks[0] == qkmer2->masks[0] &&
+                  qkmer1->masks[1] == qkmer2->masks[1];
+    PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(qkmer_recv);
+Datum
+qkmer_recv(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer;
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+
+    // Read the length of the sequence
+    int length = pq_getmsgint(buf, sizeof(int));
+
+    // Allocate a temporary buffer for the sequence
+    char *sequence = (char *) palloc(length + 1);
+    pq_copymsgbytes(buf, sequence, length);
+    sequence[length] = '\0'; // Null-terminate
+
+    // Use qkmer_make to create the Qkmer
+    qkmer = qkmer_make(sequence);
+    pfree(sequence); // Free the temp buffer!
+
+    PG_RETURN_QKMER_P(qkmer);
+}
+
+PG_FUNCTION_INFO_V1(qkmer_send);
+Datum
+qkmer_send(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
+    StringInfoData buf;
+
+    // Start constructing the binary representation, the IUPAC codes as before the masks
+    pq_begintypsend(&buf);
+
+    // Write the length of the sequence as a 4-byte integer
+    pq_sendint(&buf, qkmer->length, sizeof(int));
+
+    // Write the sequence as raw bytes (excluding the null terminator)
+    pq_sendbytes(&buf, qkmer_to_str(qkmer), qkmer->length);
+
+    // Return the serialized bytea
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+
+/*
+ * Convert a text object to a Qkmer object
+ */
+PG_FUNCTION_INFO_V1(qkmer_cast_from_text);
+Datum
+qkmer_cast_from_text(PG_FUNCTION_ARGS)
+{
+    text *txt = PG_GETARG_TEXT_P(0);  // Get the input text
+    char *str = DatumGetCString(DirectFunctionCall1(textout, PointerGetDatum(txt)));  // Convert to C string
+    Qkmer *qkmer = qkmer_make(str);  // Encode the string as a Qkmer
+    PG_RETURN_POINTER(qkmer);  // Return the Qkmer object
+}
+
+/*
+ * Convert a Qkmer object to a text object
+ */
+PG_FUNCTION_INFO_V1(qkmer_cast_to_text);
+Datum
+qkmer_cast_to_text(PG_FUNCTION_ARGS)
+{
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0);  // Get the Qkmer object
+    PG_RETURN_TEXT_P(cstring_to_text(qkmer_to_str(qkmer)));  // Convert the Qkmer to a string and then to text
+}
+
+/**
+ * One-hot masks of 16 2-bit codes: the code c of every nucleotide becomes the nibble 1 << c, laid out like the
+ * masks of a Qkmer
+ */
+static inline uint64_t kmer_one_hot(uint32 codes)
+{
+    const uint64_t ones = UINT64CONST(0x1111111111111111);
+    uint64_t x = codes;
+    uint64_t low, high;
+
+    // Spread the 2-bit codes out to one per nibble
+    x = (x | (x << 16)) & UINT64CONST(0x0000FFFF0000FFFF);
+    x = (x | (x << 8)) & UINT64CONST(0x00FF00FF00FF00FF);
+    x = (x | (x << 4)) & UINT64CONST(0x0F0F0F0F0F0F0F0F);
+    x = (x | (x << 2)) & UINT64CONST(0x3333333333333333);
+
+    low = x & ones;
+    high = (x >> 1) & ones;
+    return (~high & ~low & ones) | ((~high & low & ones) << 1) | ((high & ~low & ones) << 2) | ((high & low & ones) << 3);
+}
+
+/*
+ * Checks if a kmer matches a given qkmer pattern: the kmer's one-hot masks must not have a nucleotide the pattern
+ * doesn't allow. Positions past the kmer are A (code 0) and past the pattern 0xF, so they always pass
+ */
+PG_FUNCTION_INFO_V1(contains);
+Datum
+contains(PG_FUNCTION_ARGS)
+{
+    // Get args
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0); // Qkmer query pattern
+    Kmer *kmer = PG_GETARG_KMER_P(1);    // kmer to match, iteratively generated from generate_kmers()
+    uint64_t rejected;
+
+    // Fail if lengths do not match
+    if (qkmer->length != kmer->length) {
+        ereport(ERROR, (errmsg("Qkmer pattern and kmer lengths do not match")));
+    }
+
+    rejected = (kmer_one_hot((uint32) kmer->bit_sequence) & ~qkmer->masks[0]) |
+               (kmer_one_hot((uint32) (kmer->bit_sequence >> 32)) & ~qkmer->masks[1]);
+    PG_RETURN_BOOL(rejected == 0);
+}
+
+/********************************************************************************************
+* SpGIST Indexing Functions
+*
+* These functions are used to create a SpGIST index on the Kmer type
+* Modelled from: https://doxygen.postgresql.org/spgtextproc_8c_source.html
+********************************************************************************************/
+
+// Helper macro for forming Kmer datums
+#define FORM_KMER_DATUM(kmer_ptr) KmerPGetDatum(kmer_ptr)
+
+/*
+* Struct for sorting values in picksplit
+*/
+typedef struct spgNodePtr
+{
+    Datum       d;
+    int         i;
+    int16       c;
+} spgNodePtr;
+
+/*
+* Find the length of the common prefix of a and b
+*/
+static int
+commonPrefix(const char *a, const char *b, int lena, int lenb)
+{
+    int         i = 0;
+
+    while (i < lena && i < lenb && *a == *b)
+    {
+        a++;
+        b++;
+        i++;
+    }
+
+    return i;
+}
+
+/*
+* Binary search an array of int16 datums for a match to c
+*
+* On success, *i gets the match location; on failure, it gets where to insert
+*/
+static bool
+searchChar(Datum *nodeLabels, int nNodes, int16 c, int *i)
+{
+    int StopLow = 0,
+    StopHigh = nNodes;
+
+    while (StopLow < StopHigh)
+    {
+        int StopMiddle = (StopLow + StopHigh) >> 1;
+        int16 middle = DatumGetInt16(nodeLabels[StopMiddle]);
+
+        if (c < middle)
+            StopHigh = StopMiddle;
+        else if (c > middle)
+            StopLow = StopMiddle + 1;
+        else
+        {
+            *i = StopMiddle;
+            return true;
+        }
+    }
+
+    *i = StopHigh;
+    return false;
+}
+
+static int pg_cmp_s16(int16 a, int16 b)
+{
+    return (int32) a - (int32) b;
+}
+
+/*
+qsort comparator to sort spgNodePtr structs by "c"
+ */
+static int
+cmpNodePtr(const void *a, const void *b)
+{
+    const spgNodePtr *aa = (const spgNodePtr *) a;
+    const spgNodePtr *bb = (const spgNodePtr *) b;
+
+    return pg_cmp_s16(aa->c, bb->c);
+}
+
+/*
+ A function to test and get the Oid of the Postgres type kmer
+ Required for SP-GiST implementation (and is called from Sql)
+*/
+PG_FUNCTION_INFO_V1(get_oid);
+Datum
+get_oid(PG_FUNCTION_ARGS){
+    Oid int4_oid = typenameTypeId(NULL, makeTypeName("kmer"));
+    PG_RETURN_INT32(int4_oid);
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer_config);
+Datum
+spgist_kmer_config(PG_FUNCTION_ARGS)
+{
+    //spgConfigIn not needed!
+    spgConfigOut *cfgout = (spgConfigOut *) PG_GETARG_POINTER(1);
+
+    Oid KMEROID = typenameTypeId(NULL, makeTypeName("kmer"));
+
+    cfgout->prefixType = KMEROID;
+    cfgout->leafType = KMEROID;
+    cfgout->labelType = INT2OID;
+
+    cfgout->canReturnData = true; // A node may contain already the value that we want without it being a leaf
+    cfgout->longValuesOK = false;
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer_choose);
+Datum
+spgist_kmer_choose(PG_FUNCTION_ARGS)
+{
+    spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+    spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
+
+    Kmer *input_kmer = DatumGetKmerP(in->datum);
+    Kmer *prefix_kmer = NULL;
+    Kmer *new_prefix, *new_postfix, *rest_kmer;
+    const char *input_sequence = kmer_to_str(input_kmer);
+    const char *prefix_sequence = NULL;
+    char *truncated_prefix, *postfix_prefix;
+
+    int input_length = input_kmer->length;
+    int prefix_length = 0;
+    int common_length = 0;
+    int16 next_char = 0;
+    int idx = 0;
+
+    if (in->hasPrefix)
+    {
+        prefix_kmer = DatumGetKmerP(in->prefixDatum);
+        prefix_sequence = kmer_to_str(prefix_kmer);
+        prefix_length = prefix_kmer->length;
+
+        common_length = commonPrefix(input_sequence + in->level, prefix_sequence, input_length - in->level, prefix_length);
+
+        if (common_length == prefix_length)
+        {
+            if (input_length - in->level > common_length)
+                next_char = *(unsigned char *) input_sequence + in->level + common_length;
+            else
+                next_char = -1;
+        }
+        else
+        {
+            // Must split tuple because incoming value doesn't match prefix
+            out->resultType = spgSplitTuple;
+
+            if (common_length == 0)
+                out->result.splitTuple.prefixHasPrefix = false;
+            else
+            {
+                truncated_prefix = palloc0(common_length + 1);
+                memcpy(truncated_prefix, prefix_sequence, common_length);
+                truncated_prefix[common_length] = '\0';
+
+                new_prefix = kmer_make(truncated_prefix);
+
+                out->result.splitTuple.prefixHasPrefix = true;
+                out->result.splitTuple.prefixPrefixDatum = FORM_KMER_DATUM(new_prefix);
+
+                pfree(truncated_prefix);
+            }
+            out->result.splitTuple.prefixNNodes = 1;
+            out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
+            out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(*(unsigned char *)(prefix_sequence + common_length));
+
+            out->result.splitTuple.childNodeN = 0;
+            if (prefix_length - common_length == 1)
+            {
+                out->result.splitTuple.postfixHasPrefix = false;
+            }
+            else
+            {
+                postfix_prefix = palloc0(prefix_length - common_length);
+                memcpy(postfix_prefix, prefix_sequence + common_length + 1, prefix_length - common_length - 1);
+                postfix_prefix[prefix_length - common_length - 1] = '\0';
+
+                new_postfix = kmer_make(postfix_prefix);
+
+                out->result.splitTuple.postfixHasPrefix = true;
+                out->result.splitTuple.postfixPrefixDatum = FORM_KMER_DATUM(new_postfix);
+
+                pfree(postfix_prefix);
+            }
+            PG_RETURN_VOID();
+        }
+    }
+    else if (input_length > in->level)
+    {
+        next_char = *(unsigned char *)(input_sequence + in->level);
+    }
+    else
+    {
+        next_char = -1;
+    }
+
+    // Look up next_char in the node label array
+    if (searchChar(in->nodeLabels, in->nNodes, next_char, &idx))
+    {
+        // Match found: descend to the existing node
+        int level_add;
+        out->resultType = spgMatchNode;
+        out->result.matchNode.nodeN = idx;
+        level_add = common_length;
+        if (next_char >= 0)
+            level_add++;
+
+        out->result.matchNode.levelAdd = level_add;
+        if (input_length - in->level - level_add > 0)
+        {
+            char *rest_sequence = palloc0(input_length - in->level - level_add + 1); // +1 for null terminator
+            memcpy(rest_sequence, input_sequence + in->level + level_add, input_length - in->level - level_add);
+            rest_sequence[input_length - in->level - level_add] = '\0';
+
+            rest_kmer = kmer_make(rest_sequence);
+            out->result.matchNode.restDatum = FORM_KMER_DATUM(rest_kmer);
+
+            pfree(rest_sequence);
+        }
+        else
+        {
+            out->result.matchNode.restDatum = FORM_KMER_DATUM(kmer_make("X")); // Dummy value!
+        }
+    }
+    else if (in->allTheSame)
+    {
+        // Can't use AddNode, so split the tuple
+        out->resultType = spgSplitTuple;
+        out->result.splitTuple.prefixHasPrefix = in->hasPrefix;
+        out->result.splitTuple.prefixPrefixDatum = in->prefixDatum;
+        out->result.splitTuple.prefixNNodes = 1;
+        out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
+        out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(next_char);
+        out->result.splitTuple.childNodeN = 0;
+        out->result.splitTuple.postfixHasPrefix = false;
+    }
+    else
+    {
+        // Add a node for the not-previously-seen next_char value
+        out->resultType = spgAddNode;
+        out->result.addNode.nodeLabel = Int16GetDatum(next_char);
+        out->result.addNode.nodeN = idx;
+    }
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer_picksplit);
+Datum
+spgist_kmer_picksplit(PG_FUNCTION_ARGS)
+{
+    spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
+    spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
+
+    Kmer *first_kmer = DatumGetKmerP(in->datums[0]);
+    Kmer *new_prefix, *kmer;
+    char *first_sequence = kmer_to_str(first_kmer);
+    char *sequence, *truncated_prefix;
+
+    int common_length = first_kmer->length; // Start with the full length of the first Kmer
+    int i, len;
+
+    spgNodePtr *nodes;
+
+    // Find the longest common prefix
+    for (i = 1; i < in->nTuples; i++)
+    {
+        kmer = DatumGetKmerP(in->datums[i]);
+        sequence = kmer_to_str(kmer);
+        len = commonPrefix(first_sequence, sequence, common_length, kmer->length);
+
+        if (len < common_length)
+        {
+            common_length = len;
+        }
+    }
+
+    common_length = Min(common_length, 32);
+
+    if (common_length == 0)
+    {
+        out->hasPrefix = false;
+    }
+    else
+    {
+        truncated_prefix = palloc0(common_length + 1);
+        memcpy(truncated_prefix, first_sequence, common_length);
+        truncated_prefix[common_length] = '\0';
+
+        new_prefix = kmer_make(truncated_prefix);
+        out->hasPrefix = true;
+        out->prefixDatum = FORM_KMER_DATUM(new_prefix);
+
+        pfree(truncated_prefix);
+    }
+
+    // Extract the node label (first non-common character) for each tuple
+    nodes = (spgNodePtr *) palloc(sizeof(spgNodePtr) * in->nTuples);
+    for (i = 0; i < in->nTuples; i++)
+    {
+        const char *sequence;
+        kmer = DatumGetKmerP(in->datums[i]);
+        sequence = kmer_to_str(kmer);
+        if (common_length < kmer->length) {
+            nodes[i].c = *(unsigned char *)(sequence + common_length);
+        } else {
+            nodes[i].c = -1; // Dummy value because we don't have a suffix
+        }
+        nodes[i].i = i;
+        nodes[i].d = in->datums[i];
+    }
+
+    // Sort label values so we can group them into nodes
+    qsort(nodes, in->nTuples, sizeof(*nodes), cmpNodePtr);
+
+    // And emit results
+    out->nNodes = 0;
+    out->nodeLabels = (Datum *) palloc(sizeof(Datum) * in->nTuples);
+    out->mapTuplesToNodes = (int *) palloc(sizeof(int) * in->nTuples);
+    out->leafTupleDatums = (Datum *) palloc(sizeof(Datum) * in->nTuples);
+
+    for (i = 0; i < in->nTuples; i++)
+    {
+        Datum leafDatum;
+        const char *sequence;
+        kmer = DatumGetKmerP(nodes[i].d);
+        sequence = kmer_to_str(kmer);
+
+        if (i == 0 || nodes[i].c != nodes[i - 1].c)
+        {
+            out->nodeLabels[out->nNodes] = Int16GetDatum(nodes[i].c);
+            out->nNodes++;
+        }
+
+        if (common_length < kmer->length)
+        {
+            Kmer *suffix;
+            char *suffix_sequence = palloc0(kmer->length - common_length + 1);
+            memcpy(suffix_sequence, sequence + common_length, kmer->length - common_length);
+            suffix_sequence[kmer->length - common_length] = '\0';
+
+            suffix = kmer_make(suffix_sequence);
+            leafDatum = FORM_KMER_DATUM(suffix);
+            pfree(suffix_sequence);
+        }
+        else
+        {
+            leafDatum = FORM_KMER_DATUM(kmer_make(strdup("X"))); // Dummy value
+        }
+
+        out->leafTupleDatums[nodes[i].i] = leafDatum;
+        out->mapTuplesToNodes[nodes[i].i] = out->nNodes - 1;
+    }
+
+    pfree(nodes);
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer_inner_consistent);
+Datum
+spgist_kmer_inner_consistent(PG_FUNCTION_ARGS)
+{
+    spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+    spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+
+    Kmer *reconstructed_kmer; // Reconstructed Value
+    Kmer *prefixKmer = NULL;
+
+    char *reconstructed_sequence = NULL;
+    char *full_reconstructed_sequence = NULL;
+    char *prefixSequence = NULL;
+
+    int prefixLength = 0;
+    int maxReconstrLen;
+    int i;
+
+    reconstructed_kmer = (Kmer *) DatumGetKmerP(in->reconstructedValue);
+    Assert(reconstructed_kmer == NULL ? in->level == 0 : reconstructed_kmer->length == in->level);
+
+    maxReconstrLen = in->level + 1;
+    if (in->hasPrefix)
+    {
+        prefixKmer = DatumGetKmerP(in->prefixDatum);
+        prefixSequence = kmer_to_str(prefixKmer);
+        prefixLength = prefixKmer->length;
+        maxReconstrLen += prefixLength;
+    }
+
+    full_reconstructed_sequence = palloc0(maxReconstrLen);
+
+    if (in->level)
+    {
+        reconstructed_sequence = kmer_to_str(reconstructed_kmer);
+        memcpy(full_reconstructed_sequence, reconstructed_sequence, in->level);
+    }
+
+    if (prefixLength)
+    {
+        memcpy(full_reconstructed_sequence + in->level, prefixSequence, prefixLength);
+    }
+
+    // Last byte will be filled in below
+
+    // Scan the child nodes, for each one, complete the reconstructed sequence and check if it's consistent,
+    // if it is, add it to the output arrays
+
+    out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
+    out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
+    out->reconstructedValues = (Datum *) palloc(sizeof(Datum) * in->nNodes);
+    out->nNodes = 0;
+
+    for (i = 0; i < in->nNodes; i++)
+    {
+        int16 next_char = DatumGetInt16(in->nodeLabels[i]);
+        int thisLen;
+        bool res = true;
+        int j;
+
+        // If next_char is not a dummy value, append it to the reconstructed sequence
+        if (next_char <= 0)
+        { // Dummy value of either -1 or -2! From the choose/picksplit function
+            thisLen = maxReconstrLen - 1;
+            full_reconstructed_sequence[thisLen] = '\0';
+        }
+        else
+        {
+            full_reconstructed_sequence[maxReconstrLen - 1] = (char) next_char; // Append the next_char
+            thisLen = maxReconstrLen;
+            full_reconstructed_sequence[thisLen] = '\0';
+        }
+
+        for (j = 0; j < in->nkeys; j++)
+        {
+            StrategyNumber strategy = in->scankeys[j].sk_strategy;
+            Kmer *inKmer;
+            int inSize;
+            int r;
+
+            // We don't deal with collation aware strategies - we don't know why :)
+
+            inKmer = DatumGetKmerP(in->scankeys[j].sk_argument);
+            inSize = inKmer->length;
+
+            r = memcmp(full_reconstructed_sequence, kmer_to_str(inKmer), Min(thisLen, inSize)); // Compare the reconstructed sequence with the query sequence
+
+            switch (strategy)
+            {
+                case 1: // Equality operator from our index definition
+                    res = (r == 0);
+                    break;
+                case 2: // starts_with() or ^@ operator from our index definition
+                    if (in->level >= inSize)
+                    {
+                        res = 1;
+                    }
+                    else
+                    {
+                        res = starts_with_internal(full_reconstructed_sequence, kmer_to_str(inKmer));
+                    }
+                    break;
+                default:
+                    res = false;
+                    break;
+            }
+        }
+
+        if (res)
+        {
+            out->nodeNumbers[out->nNodes] = i;
+            out->levelAdds[out->nNodes] = thisLen - in->level;
+            full_reconstructed_sequence[thisLen] = '\0';
+            out->reconstructedValues[out->nNodes] = FORM_KMER_DATUM(kmer_make(full_reconstructed_sequence));
+            out->nNodes++;
+        }
+    }
+    pfree(full_reconstructed_sequence);
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer_leaf_consistent);
+Datum
+spgist_kmer_leaf_consistent(PG_FUNCTION_ARGS)
+{
+    spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+    spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+    int level = in->level;
+
+    Kmer *leaf_kmer = DatumGetKmerP(in->leafDatum);
+    Kmer *reconstructed_kmer = NULL;
+    Kmer *fullKmer;
+    const char *leaf_sequence = kmer_to_str(leaf_kmer);
+    char *full_reconstructed_sequence = NULL;
+    char *full_seq = NULL;
+    int full_len, j;
+    bool res;
+
+    // If leaf_sequence is NULL, then just return since it's a null node
+    if (leaf_sequence == NULL || leaf_sequence[0] == 'X')
+    {
+        PG_RETURN_BOOL(false);
+    }
+
+    out->recheck = false;
+
+    if (DatumGetPointer(in->reconstructedValue))
+    {
+        reconstructed_kmer = DatumGetKmerP(in->reconstructedValue);
+        full_reconstructed_sequence = kmer_to_str(reconstructed_kmer);
+    }
+    Assert(full_reconstructed_sequence == NULL ? level == 0 : reconstructed_kmer->length == level);
+
+    // Reconstruct the full string represented by this leaf tuple
+    full_len = level + leaf_kmer->length - 1;
+
+    if ((leaf_sequence == NULL || leaf_sequence[0] == 'X') && level > 0)
+    {
+        full_seq = full_reconstructed_sequence;
+        out->leafValue = PointerGetDatum(reconstructed_kmer);
+    }
+    else
+    {
+        full_seq = palloc(full_len + 1);
+        if (level > 0)
+        {
+            memcpy(full_seq, full_reconstructed_sequence, level);
+        }
+
+        if (leaf_kmer->length > 0)
+        {
+            int copy_start = 0;
+            int copy_len = leaf_kmer->length;
+
+            if (level > 0 && full_reconstructed_sequence[level - 1] == leaf_sequence[0])
+            {
+                copy_start = 1;
+                copy_len = leaf_kmer->length - 1;
+                full_len--;
+            }
+
+            if (copy_len > 0)
+            {
+                memcpy(full_seq + level, leaf_sequence + copy_start, copy_len);
+            }
+        }
+        full_seq[full_len] = '\0';
+
+        fullKmer = kmer_make(full_seq);
+
+        out->leafValue = FORM_KMER_DATUM(fullKmer);
+    }
+
+    // Perform the required comparisons
+    res = true;
+    for (j = 0; j < in->nkeys; j++)
+    {
+        StrategyNumber strategy = in->scankeys[j].sk_strategy;
+        Kmer *query_kmer = DatumGetKmerP(in->scankeys[j].sk_argument);
+        const char *query_sequence = kmer_to_str(query_kmer);
+        int query_len = query_kmer->length;
+        int r;
+
+        r = strncmp(full_seq, query_sequence, Min(full_len, query_len));
+
+        switch (strategy)
+        {
+            case 1:
+                res = (r == 0);
+                if (full_len != query_len)
+                { // We do not store kmers of this length, so partial matches are not possible
+                    res = false;
+                }
+                break;
+            case 2:
+                if (level >= query_len)
+                {
+                    res = 1;
+                }
+                else
+                {
+                    res = starts_with_internal(full_seq, query_sequence);
+                }
+                break;
+            default:
+                res = false;
+                break;
+        }
+
+        if (!res)
+            break;
+    }
+
+    PG_RETURN_BOOL(res);
+}
+/********************************************************************************************
+* DNA batch functions
+*
+* A dna_batch packs many (short) sequences into one value, see the DnaBatch struct for the layout
+********************************************************************************************/
+
+/**
+ * Allocates a zeroed DnaBatch for count sequences with total_length nucleotides between them
+ *
+ * Offsets and the bit stream are left for the caller to fill in
+ */
+static DnaBatch *dna_batch_alloc(uint32 count, uint64_t total_length)
+{
+    Size batch_size = DNA_BATCH_BITS_OFFSET(count) + DNA_NUM_WORDS(total_length) * sizeof(uint64_t);
+    DnaBatch *batch;
+
+    if (batch_size > MaxAllocSize) {
+        ereport(ERROR, (errmsg("DNA batch of %u sequences and %" PRIu64 " nucleotides is too large", count, total_length)));
+    }
+
+    batch = (DnaBatch *) palloc0(batch_size);
+    SET_VARSIZE(batch, batch_size);
+    batch->count = count;
+    return batch;
+}
+
+/**
+ * Parses the text form of a batch, which is just the sequences separated by commas: "ACGT,GGA,TTAC"
+ *
+ * Every sequence goes through dna_make, so the usual DNA validation applies to each one of them
+ */
+static DnaBatch *dna_batch_make(const char *str)
+{
+    char *copy = pstrdup(str);
+    char *token;
+    char *next;
+    uint32 count = 1;
+    uint64_t total_length = 0;
+    uint64_t offset = 0;
+    DnaBatch *batch;
+    Dna **sequences;
+    uint32 i;
+
+    for (const char *p = str; *p; p++) {
+        if (*p == ',') {
+            count++;
+        }
+    }
+
+    // Encode every sequence first so we know how big the batch has to be
+    sequences = (Dna **) palloc(count * sizeof(Dna *));
+    token = copy;
+    for (i = 0; i < count; i++) {
+        next = strchr(token, ',');
+        if (next != NULL) {
+            *next = '\0';
+        }
+        sequences[i] = dna_make(token); // Errors out on empty or invalid sequences
+        total_length += sequences[i]->length;
+        if (next != NULL) {
+            token = next + 1;
+        }
+    }
+
+    if (total_length > PG_UINT32_MAX) {
+        ereport(ERROR, (errmsg("DNA batch cannot hold more than %u nucleotides", PG_UINT32_MAX)));
+    }
+
+    batch = dna_batch_alloc(count, total_length);
+    for (i = 0; i < count; i++) {
+        batch->offsets[i] = (uint32) offset;
+        copy_bases(DNA_BATCH_BITS(batch), offset, sequences[i]->bit_sequence, 0, sequences[i]->length);
+        offset += sequences[i]->length;
+        pfree(sequences[i]);
+    }
+    batch->offsets[count] = (uint32) offset;
+
+    pfree(sequences);
+    pfree(copy);
+    return batch;
+}
+
+/**
+ * Converts a batch back to its comma separated text form
+ */
+static char *dna_batch_to_str(const DnaBatch *batch)
+{
+    const uint64_t *bits = DNA_BATCH_BITS(batch);
+    uint64_t total_length = batch->offsets[batch->count];
+    char *result = palloc(total_length + batch->count + 1); // Room for the separators and the null terminator
+    char *out = result;
+
+    for (uint32 i = 0; i < batch->count; i++) {
+        if (i > 0) {
+            *out++ = ',';
+        }
+        for (uint64_t pos = batch->offsets[i]; pos < batch->offsets[i + 1]; pos++) {
+            switch (DNA_BASE_AT(bits, pos)) {
+                case 0x0: *out++ = 'A'; break;
+                case 0x1: *out++ = 'T'; break;
+                case 0x2: *out++ = 'C'; break;
+                case 0x3: *out++ = 'G'; break;
+            }
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+PG_FUNCTION_INFO_V1(dna_batch_in);
+Datum
+dna_batch_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    PG_RETURN_DNA_BATCH_P(dna_batch_make(str));
+}
+
+PG_FUNCTION_INFO_V1(dna_batch_out);
+Datum
+dna_batch_out(PG_FUNCTION_ARGS)
+{
+    DnaBatch *batch = PG_GETARG_DNA_BATCH_P(0);
+    char *result = dna_batch_to_str(batch);
+    PG_FREE_IF_COPY(batch, 0);
+    PG_RETURN_CSTRING(result);
+}
+
+/*
+ * Binary format: number of sequences, the count + 1 offsets, then the bit stream the same way dna_send() writes it
+ */
+PG_FUNCTION_INFO_V1(dna_batch_recv);
+Datum
+dna_batch_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    uint32 count = pq_getmsgint(buf, sizeof(uint32));
+    uint32 *offsets;
+    DnaBatch *batch;
+
+    if (count == 0) {
+        ereport(ERROR, (errmsg("DNA batch cannot be empty")));
+    }
+    if ((Size) count + 1 > (Size) (buf->len - buf->cursor) / sizeof(uint32)) {
+        ereport(ERROR, (errmsg("Invalid DNA batch: %u sequences do not fit in the message", count)));
+    }
+
+    // Read the offsets first, we need the total length to know how much to allocate
+    offsets = (uint32 *) palloc((count + 1) * sizeof(uint32));
+    for (uint32 i = 0; i <= count; i++) {
+        offsets[i] = pq_getmsgint(buf, sizeof(uint32));
+        if ((i == 0 && offsets[i] != 0) || (i > 0 && offsets[i] <= offsets[i - 1])) {
+            ereport(ERROR, (errmsg("Invalid DNA batch: offsets must start at 0 and strictly increase")));
+        }
+    }
+
+    batch = dna_batch_alloc(count, offsets[count]);
+    memcpy(batch->offsets, offsets, (count + 1) * sizeof(uint32));
+    pfree(offsets);
+
+    pq_copy_bits(buf, DNA_BATCH_BITS(batch), DNA_NUM_WORDS(batch->offsets[count]), batch->offsets[count]);
+
+    PG_RETURN_DNA_BATCH_P(batch);
+}
+
+PG_FUNCTION_INFO_V1(dna_batch_send);
+Datum
+dna_batch_send(PG_FUNCTION_ARGS)
+{
+    DnaBatch *batch = PG_GETARG_DNA_BATCH_P(0);
+    const uint64_t *bits = DNA_BATCH_BITS(batch);
+    uint64_t num_words = DNA_NUM_WORDS(batch->offsets[batch->count]);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, batch->count);
+    for (uint32 i = 0; i <= batch->count; i++) {
+        pq_sendint32(&buf, batch->offsets[i]);
+    }
+    pq_send_bits(&buf, bits, num_words);
+    PG_FREE_IF_COPY(batch, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(dna_batch_cardinality);
+Datum
+dna_batch_cardinality(PG_FUNCTION_ARGS)
+{
+    DnaBatch *batch = PG_GETARG_DNA_BATCH_P(0);
+    uint32 count = batch->count;
+    PG_FREE_IF_COPY(batch, 0);
+    PG_RETURN_INT32(count);
+}
+
+/*
+ * Set returning function that gives back every sequence of the batch as a separate dna value
+ */
+PG_FUNCTION_INFO_V1(dna_batch_unnest);
+Datum
+dna_batch_unnest(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    DnaBatch *batch;
+    uint64_t i;
+    Dna *dna;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        // Detoast in the multi-call context so the batch survives across calls
+        batch = PG_GETARG_DNA_BATCH_P(0);
+        funcctx->user_fctx = batch;
+        funcctx->max_calls = batch->count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    batch = funcctx->user_fctx;
+    i = funcctx->call_cntr;
+
+    if (i < funcctx->max_calls)
+    {
+        dna = dna_alloc(batch->offsets[i + 1] - batch->offsets[i]);
+        copy_bases(dna->bit_sequence, 0, DNA_BATCH_BITS(batch), batch->offsets[i], dna->length);
+        SRF_RETURN_NEXT(funcctx, DnaPGetDatum(dna));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/*
+ * Aggregate state for dna_batch_agg: offsets and bit stream, both grown geometrically as sequences come in
+ */
+typedef struct DnaBatchBuildState
+{
+    uint32 count;           // Number of sequences added so far
+    uint32 max_count;       // Allocated entries in offsets (minus the one for the total length)
+    uint32 *offsets;        // count + 1 offsets, offsets[count] is the total length so far
+    uint64_t max_words;     // Allocated chunks in bits
+    uint64_t *bits;         // The packed bit stream
+} DnaBatchBuildState;
+
+PG_FUNCTION_INFO_V1(dna_batch_agg_transfn);
+Datum
+dna_batch_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    MemoryContext oldcontext;
+    DnaBatchBuildState *state;
+    Dna *dna;
+    uint64_t total_length;
+    uint64_t needed_words;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        ereport(ERROR, (errmsg("dna_batch_agg_transfn called in non-aggregate context")));
+    }
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaBatchBuildState *) PG_GETARG_POINTER(0);
+
+    if (state == NULL) {
+        // First row, set up the state in the aggregate context so it lives as long as the group does
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        state = (DnaBatchBuildState *) palloc0(sizeof(DnaBatchBuildState));
+        state->max_count = 64;
+        state->offsets = (uint32 *) palloc0((state->max_count + 1) * sizeof(uint32));
+        state->max_words = 64;
+        state->bits = (uint64_t *) palloc0(state->max_words * sizeof(uint64_t));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    // NULL sequences are simply left out of the batch
+    if (PG_ARGISNULL(1)) {
+        PG_RETURN_POINTER(state);
+    }
+
+    dna = (Dna *) PG_GETARG_VARLENA_P(1);
+    total_length = (uint64_t) state->offsets[state->count] + dna->length;
+
+    if (total_length > PG_UINT32_MAX) {
+        ereport(ERROR, (errmsg("DNA batch cannot hold more than %u nucleotides", PG_UINT32_MAX)));
+    }
+
+    // repalloc keeps the chunks in the context they were allocated in, i.e. the aggregate context
+    if (state->count == state->max_count) {
+        state->max_count *= 2;
+        state->offsets = (uint32 *) repalloc(state->offsets, (state->max_count + 1) * sizeof(uint32));
+    }
+    needed_words = DNA_NUM_WORDS(total_length);
+    if (needed_words > state->max_words) {
+        uint64_t new_words = state->max_words;
+        while (new_words < needed_words) {
+            new_words *= 2;
+        }
+        state->bits = (uint64_t *) repalloc(state->bits, new_words * sizeof(uint64_t));
+        memset(state->bits + state->max_words, 0, (new_words - state->max_words) * sizeof(uint64_t));
+        state->max_words = new_words;
+    }
+
+    copy_bases(state->bits, state->offsets[state->count], dna->bit_sequence, 0, dna->length);
+    state->count++;
+    state->offsets[state->count] = (uint32) total_length;
+
+    PG_FREE_IF_COPY(dna, 1);
+    PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(dna_batch_agg_finalfn);
+Datum
+dna_batch_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    DnaBatchBuildState *state;
+    DnaBatch *batch;
+    uint64_t total_length;
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaBatchBuildState *) PG_GETARG_POINTER(0);
+    if (state == NULL || state->count == 0) {
+        PG_RETURN_NULL(); // Like array_agg, no rows (or only NULLs) gives NULL
+    }
+
+    // Copy everything out, the state may still be used afterwards (e.g. as a window aggregate)
+    total_length = state->offsets[state->count];
+    batch = dna_batch_alloc(state->count, total_length);
+    memcpy(batch->offsets, state->offsets, (state->count + 1) * sizeof(uint32));
+    memcpy(DNA_BATCH_BITS(batch), state->bits, DNA_NUM_WORDS(total_length) * sizeof(uint64_t));
+
+    PG_RETURN_DNA_BATCH_P(batch);
+}
+
+/*
+ * Generates the k-mers of every sequence in the batch, k-mers never span two sequences
+ *
+ * Unlike generate_kmers(dna, int) we walk the bit stream only once: the first k-mer of a sequence is read
+ * in one go with read_bases, every next one is the previous one shifted by one nucleotide (2 bits)
+ * with the new nucleotide put in at the top
+ */
+PG_FUNCTION_INFO_V1(generate_kmers_batch);
+Datum
+generate_kmers_batch(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    struct {
+        DnaBatch *batch;
+        const uint64_t *bits;
+        int k;
+        uint32 read;        // Sequence we're currently in
+        uint64_t pos;       // Start (in the bit stream) of the last k-mer we returned
+        uint64_t code;      // The last k-mer we returned
+        bool started;       // Whether we have returned a k-mer of the current sequence yet
+    } *state;
+    DnaBatch *batch;
+    int k;
+    Kmer *kmer;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        batch = PG_GETARG_DNA_BATCH_P(0);
+        k = PG_GETARG_INT32(1);
+
+        if (k <= 0 || k > 32)
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and 32")));
+
+        state = palloc0(sizeof(*state));
+        state->batch = batch;
+        state->bits = DNA_BATCH_BITS(batch);
+        state->k = k;
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = funcctx->user_fctx;
+    batch = state->batch;
+    k = state->k;
+
+    while (state->read < batch->count)
+    {
+        uint64_t start = batch->offsets[state->read];
+        uint64_t end = batch->offsets[state->read + 1];
+
+        if (!state->started && end - start >= (uint64_t) k) {
+            // First k-mer of this sequence
+            state->pos = start;
+            state->code = read_bases(state->bits, start, k);
+            state->started = true;
+        } else if (state->started && state->pos + k < end) {
+            // Roll: drop the first nucleotide, add the one right after the current k-mer
+            state->pos++;
+            state->code = (state->code >> 2) | (DNA_BASE_AT(state->bits, state->pos + k - 1) << (2 * (k - 1)));
+        } else {
+            // Sequence exhausted (or shorter than k), move on to the next one
+            state->read++;
+            state->started = false;
+            continue;
+        }
+
+        kmer = (Kmer *) palloc0(sizeof(Kmer));
+        kmer->length = k;
+        kmer->bit_sequence = state->code;
+        SRF_RETURN_NEXT(funcctx, KmerPGetDatum(kmer));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/********************************************************************************************
+* DNA reference functions
+*
+* A dna_ref points at a region of a sequence in a UCSC .2bit file on the database server.
+* Format reference: https://genome.ucsc.edu/FAQ/FAQformat.html#format7
+*
+* Files are mmap-ed the first time they are used and stay mapped (and indexed) for the rest of the backend's
+* life, so every dna_ref after that is resolved with one stat() and without any I/O or copying of the file.
+* A file whose inode, size or modification time changed is mapped again.
+********************************************************************************************/
+
+#define TWOBIT_SIGNATURE 0x1A412743
+
+/*
+ * One sequence of a .2bit file, everything after record_offset is only filled in the first time the sequence is used
+ */
+typedef struct TwoBitSequence
+{
+    char *name;
+    uint64_t record_offset;     // Where the sequence record (dnaSize, N blocks, mask blocks, ...) starts
+    const uint8 *packed;        // Its packed nucleotides in the mapped file, NULL until resolved
+    uint64_t length;            // Length of the sequence in nucleotides
+    uint32 num_n_blocks;        // Runs of N, which .2bit packs as T, sorted by start
+    uint32 *n_block_starts;
+    uint32 *n_block_sizes;
+} TwoBitSequence;
+
+/*
+ * A mapped .2bit file, with its sequence index sorted by name
+ */
+typedef struct TwoBitFile
+{
+    char *path;
+    const uint8 *data;          // The whole file, mapped read-only
+    Size size;
+    dev_t device;               // What the file was when we mapped it, to notice it being replaced or rewritten
+    ino_t inode;
+    time_t mtime;
+    int pins;                   // Set returning functions still reading from the mapping
+    bool stale;                 // No longer in twobit_files, unmapped once the last pin is gone
+    MemoryContext context;      // Everything below (and the file itself) is allocated in here
+    bool swapped;               // Written on a machine with the other byte order
+    bool offsets_64bit;         // Version 1 files have 64-bit offsets in the index
+    uint32 num_sequences;
+    TwoBitSequence *sequences;
+    struct TwoBitFile *next;
+} TwoBitFile;
+
+static TwoBitFile *twobit_files = NULL; // Per-backend cache of mapped files
+
+/*
+ * .2bit packs 4 nucleotides per byte, first one in the top 2 bits, as T=00, C=01, A=10, G=11
+ * This maps a .2bit code to ours (A=00, T=01, C=10, G=11)
+ */
+static const uint8 twobit_to_dna[4] = {0x1, 0x2, 0x0, 0x3};
+
+// A whole .2bit byte (4 nucleotides) translated to our packing, filled in on first use
+static uint8 twobit_byte_to_dna[256];
+static bool twobit_byte_to_dna_ready = false;
+
+static void twobit_init_byte_table(void)
+{
+    if (twobit_byte_to_dna_ready) {
+        return;
+    }
+    for (int b = 0; b < 256; b++) {
+        uint8 out = 0;
+        for (int i = 0; i < 4; i++) {
+            out |= twobit_to_dna[(b >> (6 - 2 * i)) & 0x3] << (2 * i);
+        }
+        twobit_byte_to_dna[b] = out;
+    }
+    twobit_byte_to_dna_ready = true;
+}
+
+/*
+ * Server files are only readable by superusers and members of pg_read_server_files, same as COPY FROM a file
+ */
+static void check_server_file_access(const char *path)
+{
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("Permission denied to read file \"%s\"", path),
+                 errhint("Only roles with privileges of the \"pg_read_server_files\" role may read server files.")));
+    }
+}
+
+static uint32 twobit_read_uint32(const TwoBitFile *file, uint64_t offset)
+{
+    uint32 value;
+
+    if (offset + sizeof(uint32) > file->size) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": unexpected end of file", file->path)));
+    }
+    memcpy(&value, file->data + offset, sizeof(uint32));
+    return file->swapped ? pg_bswap32(value) : value;
+}
+
+static uint64_t twobit_read_uint64(const TwoBitFile *file, uint64_t offset)
+{
+    uint64_t value;
+
+    if (offset + sizeof(uint64_t) > file->size) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": unexpected end of file", file->path)));
+    }
+    memcpy(&value, file->data + offset, sizeof(uint64_t));
+    return file->swapped ? pg_bswap64(value) : value;
+}
+
+static int twobit_sequence_cmp(const void *a, const void *b)
+{
+    return strcmp(((const TwoBitSequence *) a)->name, ((const TwoBitSequence *) b)->name);
+}
+
+/*
+ * Reads the header and the sequence index of a freshly mapped file
+ */
+static void twobit_read_index(TwoBitFile *file)
+{
+    uint32 signature;
+    uint32 version;
+    uint64_t offset = 16; // Index starts right after the 16-byte header
+
+    if (file->size < 16) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": file too short", file->path)));
+    }
+
+    // The signature tells us the byte order the file was written in
+    memcpy(&signature, file->data, sizeof(uint32));
+    if (signature == TWOBIT_SIGNATURE) {
+        file->swapped = false;
+    } else if (pg_bswap32(signature) == TWOBIT_SIGNATURE) {
+        file->swapped = true;
+    } else {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": bad signature", file->path)));
+    }
+
+    version = twobit_read_uint32(file, 4);
+    if (version > 1) {
+        ereport(ERROR, (errmsg("Unsupported .2bit version %u in file \"%s\"", version, file->path)));
+    }
+    file->offsets_64bit = (version == 1);
+    file->num_sequences = twobit_read_uint32(file, 8);
+
+    // Don't trust the count until we know every entry is really there (each one takes at least 5 bytes)
+    if ((uint64_t) file->num_sequences * 5 > file->size) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": bad sequence count", file->path)));
+    }
+    file->sequences = (TwoBitSequence *) palloc0(Max(file->num_sequences, 1) * sizeof(TwoBitSequence));
+
+    for (uint32 i = 0; i < file->num_sequences; i++) {
+        uint8 name_size;
+
+        if (offset + 1 > file->size) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": truncated index", file->path)));
+        }
+        name_size = file->data[offset++];
+        if (offset + name_size > file->size) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": truncated index", file->path)));
+        }
+        file->sequences[i].name = pnstrdup((const char *) file->data + offset, name_size);
+        offset += name_size;
+
+        if (file->offsets_64bit) {
+            file->sequences[i].record_offset = twobit_read_uint64(file, offset);
+            offset += sizeof(uint64_t);
+        } else {
+            file->sequences[i].record_offset = twobit_read_uint32(file, offset);
+            offset += sizeof(uint32);
+        }
+    }
+
+    // Sorted, so we can binary search sequence names later
+    qsort(file->sequences, file->num_sequences, sizeof(TwoBitSequence), twobit_sequence_cmp);
+}
+
+static void twobit_close(TwoBitFile *file)
+{
+    munmap((void *) file->data, file->size);
+    MemoryContextDelete(file->context);
+}
+
+static void twobit_unpin(void *arg)
+{
+    TwoBitFile *file = (TwoBitFile *) arg;
+
+    file->pins--;
+    if (file->pins == 0 && file->stale) {
+        twobit_close(file);
+    }
+}
+
+/*
+ * Keeps the mapping of file around until context goes away, even if twobit_open() maps the file again meanwhile
+ */
+static void twobit_pin(TwoBitFile *file, MemoryContext context)
+{
+    MemoryContextCallback *callback = (MemoryContextCallback *) MemoryContextAlloc(context, sizeof(MemoryContextCallback));
+
+    callback->func = twobit_unpin;
+    callback->arg = file;
+    MemoryContextRegisterResetCallback(context, callback);
+    file->pins++;
+}
+
+/*
+ * Returns the mapped .2bit file at path, mapping and indexing it the first time around and again whenever
+ * the file on disk is not the one we mapped anymore
+ *
+ * A file truncated in place while it is mapped makes reads from the mapping fail with SIGBUS, so files must be
+ * replaced (written elsewhere and renamed over) rather than rewritten.
+ */
+static TwoBitFile *twobit_open(const char *path)
+{
+    TwoBitFile *file;
+    TwoBitFile **link;
+    MemoryContext file_context;
+    MemoryContext oldcontext;
+    struct stat st;
+    void *data;
+    int fd;
+
+    check_server_file_access(path);
+
+    for (link = &twobit_files; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            break;
+        }
+    }
+    if (*link != NULL) {
+        file = *link;
+        if (stat(path, &st) < 0) {
+            ereport(ERROR, (errcode_for_file_access(), errmsg("Could not stat .2bit file \"%s\": %m", path)));
+        }
+        if (st.st_dev == file->device && st.st_ino == file->inode && (Size) st.st_size == file->size
+            && st.st_mtime == file->mtime) {
+            return file;
+        }
+
+        // Replaced or rewritten: forget it, and unmap it unless a set returning function is still reading from it
+        *link = file->next;
+        file->stale = true;
+        if (file->pins == 0) {
+            twobit_close(file);
+        }
+    }
+
+    fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+    if (fd < 0) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("Could not open .2bit file \"%s\": %m", path)));
+    }
+    if (fstat(fd, &st) < 0) {
+        CloseTransientFile(fd);
+        ereport(ERROR, (errcode_for_file_access(), errmsg("Could not stat .2bit file \"%s\": %m", path)));
+    }
+    if (st.st_size == 0) {
+        CloseTransientFile(fd);
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": file is empty", path)));
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    CloseTransientFile(fd); // The mapping stays valid after the descriptor is closed
+    if (data == MAP_FAILED) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("Could not map .2bit file \"%s\": %m", path)));
+    }
+
+    // Everything about the file lives in its own long-lived context, so a bad file is easy to throw away
+    file_context = AllocSetContextCreate(TopMemoryContext, "dna .2bit file", ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(file_context);
+
+    file = (TwoBitFile *) palloc0(sizeof(TwoBitFile));
+    file->path = pstrdup(path);
+    file->data = (const uint8 *) data;
+    file->size = st.st_size;
+    file->device = st.st_dev;
+    file->inode = st.st_ino;
+    file->mtime = st.st_mtime;
+    file->context = file_context;
+
+    PG_TRY();
+    {
+        twobit_read_index(file);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        munmap(data, st.st_size);
+        MemoryContextDelete(file_context);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(oldcontext);
+
+    file->next = twobit_files;
+    twobit_files = file;
+    return file;
+}
+
+/*
+ * Finds a sequence by name, and works out where its nucleotides and N blocks are if we haven't done that yet
+ */
+static TwoBitSequence *twobit_find_sequence(TwoBitFile *file, const char *name)
+{
+    TwoBitSequence key;
+    TwoBitSequence *seq;
+    uint64_t offset;
+    uint64_t prev_end = 0;
+    uint32 n_block_count;
+    uint32 mask_block_count;
+
+    key.name = (char *) name;
+    seq = (TwoBitSequence *) bsearch(&key, file->sequences, file->num_sequences, sizeof(TwoBitSequence), twobit_sequence_cmp);
+    if (seq == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT), errmsg("Sequence \"%s\" not found in .2bit file \"%s\"", name, file->path)));
+    }
+
+    if (seq->packed == NULL) {
+        // Record: dnaSize, nBlockCount, nBlockStarts[], nBlockSizes[], maskBlockCount, maskBlockStarts[], maskBlockSizes[], reserved, packedDna
+        offset = seq->record_offset;
+        seq->length = twobit_read_uint32(file, offset);
+        offset += sizeof(uint32);
+        n_block_count = twobit_read_uint32(file, offset);
+        offset += sizeof(uint32);
+        if ((uint64_t) n_block_count * 2 * sizeof(uint32) > file->size - Min(offset, file->size)) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": sequence \"%s\" is truncated", file->path, name)));
+        }
+
+        // Kept (without the empty ones) so we never hand out the T that .2bit stores in place of each N
+        seq->num_n_blocks = 0;
+        seq->n_block_starts = (uint32 *) MemoryContextAlloc(file->context, Max(n_block_count, 1) * sizeof(uint32));
+        seq->n_block_sizes = (uint32 *) MemoryContextAlloc(file->context, Max(n_block_count, 1) * sizeof(uint32));
+        for (uint32 i = 0; i < n_block_count; i++) {
+            uint32 start = twobit_read_uint32(file, offset + (uint64_t) i * sizeof(uint32));
+            uint32 size = twobit_read_uint32(file, offset + ((uint64_t) n_block_count + i) * sizeof(uint32));
+
+            if (size == 0) {
+                continue;
+            }
+            if (start < prev_end || (uint64_t) start + size > seq->length) {
+                ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": bad N blocks in sequence \"%s\"", file->path, name)));
+            }
+            seq->n_block_starts[seq->num_n_blocks] = start;
+            seq->n_block_sizes[seq->num_n_blocks] = size;
+            seq->num_n_blocks++;
+            prev_end = (uint64_t) start + size;
+        }
+        offset += (uint64_t) n_block_count * 2 * sizeof(uint32);
+
+        mask_block_count = twobit_read_uint32(file, offset);
+        offset += sizeof(uint32) + (uint64_t) mask_block_count * 2 * sizeof(uint32);
+        offset += sizeof(uint32); // Reserved
+
+        if (offset + (seq->length + 3) / 4 > file->size) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid .2bit file \"%s\": sequence \"%s\" is truncated", file->path, name)));
+        }
+        seq->packed = file->data + offset;
+    }
+
+    return seq;
+}
+
+/*
+ * Index of the first N block of seq that ends after pos, num_n_blocks if there is none
+ */
+static uint32 twobit_next_n_block(const TwoBitSequence *seq, uint64_t pos)
+{
+    uint32 low = 0;
+    uint32 high = seq->num_n_blocks;
+
+    while (low < high) {
+        uint32 mid = low + (high - low) / 2;
+        if ((uint64_t) seq->n_block_starts[mid] + seq->n_block_sizes[mid] <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Returns the sequence a dna_ref points into, after checking the region is inside it
+ *
+ * Its packed nucleotides are read straight from the mapped file, (length + 3) / 4 bytes of them. Only valid
+ * until the next twobit_open() unless the file (stored in file_out when it isn't NULL) is pinned
+ */
+static const TwoBitSequence *dna_ref_resolve(const DnaRef *ref, TwoBitFile **file_out)
+{
+    TwoBitFile *file = twobit_open(DNA_REF_FILE(ref));
+    TwoBitSequence *seq = twobit_find_sequence(file, DNA_REF_NAME(ref));
+
+    if (ref->start + ref->length > seq->length) {
+        ereport(ERROR,
+                (errmsg("Region %" PRIu64 "-%" PRIu64 " is outside of sequence \"%s\" (length %" PRIu64 ")",
+                        ref->start, ref->start + ref->length, DNA_REF_NAME(ref), seq->length)));
+    }
+
+    twobit_init_byte_table();
+    if (file_out != NULL) {
+        *file_out = file;
+    }
+    return seq;
+}
+
+/*
+ * 32 nucleotides of a .2bit packed sequence starting at pos, as one of our 64-bit chunks
+ *
+ * Whole bytes are translated with the lookup table, then shifted into place if pos isn't on a byte boundary.
+ * Anything past the end of the sequence reads as zeros.
+ */
+static uint64_t twobit_read_word(const uint8 *packed, uint64_t num_bytes, uint64_t pos)
+{
+    uint64_t byte = pos / 4;
+    int shift = (pos % 4) * 2;
+    uint64_t word = 0;
+
+    for (int i = 0; i < 8 && byte + i < num_bytes; i++) {
+        word |= (uint64_t) twobit_byte_to_dna[packed[byte + i]] << (8 * i);
+    }
+    if (shift > 0) {
+        word >>= shift;
+        if (byte + 8 < num_bytes) {
+            word |= (uint64_t) twobit_byte_to_dna[packed[byte + 8]] << (64 - shift);
+        }
+    }
+    return word;
+}
+
+// Our 2-bit code of the nucleotide at pos of a .2bit packed sequence
+#define TWOBIT_BASE_AT(packed, pos) (twobit_to_dna[((packed)[(pos) / 4] >> (6 - ((pos) % 4) * 2)) & 0x3])
+
+static DnaRef *dna_ref_make(const char *file, const char *name, int64 start, int64 length)
+{
+    Size file_size = strlen(file) + 1;
+    Size name_size = strlen(name) + 1;
+    Size ref_size = offsetof(DnaRef, data) + file_size + name_size;
+    DnaRef *ref;
+
+    if (file_size == 1) {
+        ereport(ERROR, (errmsg("dna_ref file name cannot be empty")));
+    }
+    if (name_size == 1 || name_size > 256) { // .2bit sequence names are at most 255 characters long
+        ereport(ERROR, (errmsg("dna_ref sequence name must be between 1 and 255 characters long")));
+    }
+    if (start < 0 || length <= 0 || start > PG_INT64_MAX - length) {
+        ereport(ERROR, (errmsg("Invalid dna_ref region: start must be >= 0 and length > 0")));
+    }
+
+    ref = (DnaRef *) palloc0(ref_size);
+    SET_VARSIZE(ref, ref_size);
+    ref->start = start;
+    ref->length = length;
+    memcpy(ref->data, file, file_size);
+    memcpy(ref->data + file_size, name, name_size);
+    return ref;
+}
+
+/*
+ * Text form is "<file>:<sequence name>:<start>-<end>", 0-based and end-exclusive like BED
+ * We split from the right, so the file path may contain ':' but the sequence name may not
+ */
+PG_FUNCTION_INFO_V1(dna_ref_in);
+Datum
+dna_ref_in(PG_FUNCTION_ARGS)
+{
+    char *str = pstrdup(PG_GETARG_CSTRING(0));
+    char *range = strrchr(str, ':');
+    char *name;
+    char *end;
+    uint64_t start_pos;
+    uint64_t end_pos;
+
+    if (range == NULL) {
+        ereport(ERROR, (errmsg("Invalid dna_ref \"%s\": expected <file>:<sequence>:<start>-<end>", PG_GETARG_CSTRING(0))));
+    }
+    *range++ = '\0';
+    name = strrchr(str, ':');
+    if (name == NULL) {
+        ereport(ERROR, (errmsg("Invalid dna_ref \"%s\": expected <file>:<sequence>:<start>-<end>", PG_GETARG_CSTRING(0))));
+    }
+    *name++ = '\0';
+
+    errno = 0;
+    start_pos = strtoull(range, &end, 10);
+    if (errno != 0 || end == range || *end != '-' || !isdigit((unsigned char) end[1])) {
+        ereport(ERROR, (errmsg("Invalid dna_ref range \"%s\": expected <start>-<end>", range)));
+    }
+    range = end + 1;
+    end_pos = strtoull(range, &end, 10);
+    if (errno != 0 || *end != '\0' || end_pos <= start_pos || end_pos > PG_INT64_MAX) {
+        ereport(ERROR, (errmsg("Invalid dna_ref range: end must be a number greater than start")));
+    }
+
+    PG_RETURN_DNA_REF_P(dna_ref_make(str, name, start_pos, end_pos - start_pos));
+}
+
+PG_FUNCTION_INFO_V1(dna_ref_out);
+Datum
+dna_ref_out(PG_FUNCTION_ARGS)
+{
+    DnaRef *ref = PG_GETARG_DNA_REF_P(0);
+    char *result = psprintf("%s:%s:%" PRIu64 "-%" PRIu64, DNA_REF_FILE(ref), DNA_REF_NAME(ref), ref->start, ref->start + ref->length);
+    PG_FREE_IF_COPY(ref, 0);
+    PG_RETURN_CSTRING(result);
+}
+
+/*
+ * Binary format: file, sequence name (both as strings), start and length
+ */
+PG_FUNCTION_INFO_V1(dna_ref_recv);
+Datum
+dna_ref_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    const char *file = pq_getmsgstring(buf);
+    const char *name = pq_getmsgstring(buf);
+    int64 start = pq_getmsgint64(buf);
+    int64 length = pq_getmsgint64(buf);
+
+    PG_RETURN_DNA_REF_P(dna_ref_make(file, name, start, length));
+}
+
+PG_FUNCTION_INFO_V1(dna_ref_send);
+Datum
+dna_ref_send(PG_FUNCTION_ARGS)
+{
+    DnaRef *ref = PG_GETARG_DNA_REF_P(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendstring(&buf, DNA_REF_FILE(ref));
+    pq_sendstring(&buf, DNA_REF_NAME(ref));
+    pq_sendint64(&buf, ref->start);
+    pq_sendint64(&buf, ref->length);
+    PG_FREE_IF_COPY(ref, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(dna_ref_constructor);
+Datum
+dna_ref_constructor(PG_FUNCTION_ARGS)
+{
+    char *file = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    char *name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int64 start = PG_GETARG_INT64(2);
+    int64 length = PG_GETARG_INT64(3);
+
+    PG_RETURN_DNA_REF_P(dna_ref_make(file, name, start, length));
+}
+
+PG_FUNCTION_INFO_V1(dna_ref_length);
+Datum
+dna_ref_length(PG_FUNCTION_ARGS)
+{
+    DnaRef *ref = PG_GETARG_DNA_REF_P(0);
+    int64 length = ref->length;
+    PG_FREE_IF_COPY(ref, 0);
+    PG_RETURN_INT64(length);
+}
+
+/*
+ * Sub-region of a reference, start is 0-based and relative to the region. Nothing is read, we only move the window.
+ */
+PG_FUNCTION_INFO_V1(dna_ref_substring);
+Datum
+dna_ref_substring(PG_FUNCTION_ARGS)
+{
+    DnaRef *ref = PG_GETARG_DNA_REF_P(0);
+    int64 start = PG_GETARG_INT64(1);
+    int64 length = PG_GETARG_INT64(2);
+
+    if (start < 0 || length <= 0 || (uint64_t) start >= ref->length || (uint64_t) length > ref->length - start) {
+        ereport(ERROR, (errmsg("Substring %" PRId64 "+%" PRId64 " is outside of the dna_ref (length %" PRIu64 ")", start, length, ref->length)));
+    }
+
+    PG_RETURN_DNA_REF_P(dna_ref_make(DNA_REF_FILE(ref), DNA_REF_NAME(ref), ref->start + start, length));
+}
+
+/*
+ * Materializes the region as a regular dna value, a 64-bit chunk at a time
+ *
+ * dna has no N, so a region overlapping a run of them is an error rather than silently reading them as T
+ */
+PG_FUNCTION_INFO_V1(dna_ref_to_dna);
+Datum
+dna_ref_to_dna(PG_FUNCTION_ARGS)
+{
+    DnaRef *ref = PG_GETARG_DNA_REF_P(0);
+    const TwoBitSequence *seq = dna_ref_resolve(ref, NULL);
+    uint32 n = twobit_next_n_block(seq, ref->start);
+    uint64_t num_bytes = (seq->length + 3) / 4;
+    uint64_t num_words = DNA_NUM_WORDS(ref->length);
+    Dna *dna;
+
+    if (n < seq->num_n_blocks && seq->n_block_starts[n] < ref->start + ref->length) {
+        ereport(ERROR,
+                (errmsg("Region %" PRIu64 "-%" PRIu64 " of sequence \"%s\" overlaps a run of N at %u-%" PRIu64 ", which dna cannot store",
+                        ref->start, ref->start + ref->length, DNA_REF_NAME(ref),
+                        seq->n_block_starts[n], (uint64_t) seq->n_block_starts[n] + seq->n_block_sizes[n]),
+                 errhint("generate_kmers_ref() skips the k-mers spanning N.")));
+    }
+
+    dna = dna_alloc(ref->length);
+    for (uint64_t i = 0; i < num_words; i++) {
+        dna->bit_sequence[i] = twobit_read_word(seq->packed, num_bytes, ref->start + i * 32);
+    }
+    // The last chunk may have picked up nucleotides after the region, those have to be zero
+    if (ref->length % 32 != 0) {
+        dna->bit_sequence[num_words - 1] &= ((uint64_t) 1 << (2 * (ref->length % 32))) - 1;
+    }
+
+    PG_FREE_IF_COPY(ref, 0);
+    PG_RETURN_DNA_P(dna);
+}
+
+/*
+ * Generates the k-mers of the region directly from the mapped file, rolling one nucleotide at a time
+ *
+ * K-mers spanning a run of N are skipped, we jump past the run and start rolling again after it
+ */
+PG_FUNCTION_INFO_V1(generate_kmers_ref);
+Datum
+generate_kmers_ref(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    struct {
+        const TwoBitSequence *seq;  // Lives in the mapped file's context, pinned until the last call
+        uint64_t num_bytes;
+        uint64_t pos;           // Start of the next k-mer
+        uint64_t last;          // Start of the last k-mer of the region, plus one
+        uint32 next_n;          // First N block ending after pos
+        bool rolling;           // Whether code holds the k-mer at pos - 1
+        int k;
+        uint64_t code;          // The last k-mer we returned
+    } *state;
+    const TwoBitSequence *seq;
+    TwoBitFile *file;
+    DnaRef *ref;
+    int k;
+    Kmer *kmer;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        ref = PG_GETARG_DNA_REF_P(0);
+        k = PG_GETARG_INT32(1);
+
+        if (k <= 0 || k > 32)
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and 32")));
+
+        state = palloc0(sizeof(*state));
+        state->seq = dna_ref_resolve(ref, &file);
+        twobit_pin(file, funcctx->multi_call_memory_ctx);
+        state->num_bytes = (state->seq->length + 3) / 4;
+        state->pos = ref->start;
+        state->last = ref->length >= (uint64_t) k ? ref->start + ref->length - k + 1 : ref->start;
+        state->next_n = twobit_next_n_block(state->seq, ref->start);
+        state->k = k;
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = funcctx->user_fctx;
+    seq = state->seq;
+    k = state->k;
+
+    // The next k-mer overlaps a run of N (it ends after pos), start again right after it
+    while (state->next_n < seq->num_n_blocks && seq->n_block_starts[state->next_n] < state->pos + k) {
+        state->pos = (uint64_t) seq->n_block_starts[state->next_n] + seq->n_block_sizes[state->next_n];
+        state->rolling = false;
+        state->next_n++;
+    }
+
+    if (state->pos < state->last)
+    {
+        if (!state->rolling) {
+            state->code = twobit_read_word(seq->packed, state->num_bytes, state->pos);
+            if (k < 32) {
+                state->code &= ((uint64_t) 1 << (2 * k)) - 1;
+            }
+            state->rolling = true;
+        } else {
+            state->code = (state->code >> 2) | ((uint64_t) TWOBIT_BASE_AT(seq->packed, state->pos + k - 1) << (2 * (k - 1)));
+        }
+        state->pos++;
+
+        kmer = (Kmer *) palloc0(sizeof(Kmer));
+        kmer->length = k;
+        kmer->bit_sequence = state->code;
+        SRF_RETURN_NEXT(funcctx, KmerPGetDatum(kmer));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* FASTA/FASTQ readers
+*
+* read_fasta(path) and read_fastq(path) stream records from a file on the server and encode the nucleotides
+* straight into the packed dna format as they come out of the read buffer, no intermediate strings.
+* With skip_invalid, records with anything but A, C, G, T (mostly N) are dropped instead of failing the load.
+********************************************************************************************/
+
+#define SEQ_FILE_BUFFER_SIZE (1024 * 1024) // We read the file in 1MB chunks
+
+/*
+ * Buffered reader plus everything we need to build the next record
+ */
+typedef struct SeqFileReader
+{
+    FILE *file;
+    char *path;
+    char *buffer;           // SEQ_FILE_BUFFER_SIZE bytes
+    size_t buffer_len;      // Bytes currently in the buffer
+    size_t buffer_pos;      // Next byte to look at
+    bool eof;
+    uint64_t line;          // Current line number, for error messages
+
+    StringInfoData name;    // Header line of the current record (without '>' or '@')
+    StringInfoData quality; // Quality line of the current FASTQ record
+    uint64_t *words;        // Packed nucleotides of the current record
+    uint64_t max_words;     // Allocated chunks in words
+    uint64_t length;        // Nucleotides in words
+    bool skip_invalid;      // Drop records with other characters instead of raising an error
+    bool invalid;           // The current record has one of them
+    uint64_t skipped;       // Records dropped so far
+} SeqFileReader;
+
+/*
+ * Makes sure there is something in the buffer, returns false at the end of the file
+ */
+static bool seq_reader_fill(SeqFileReader *reader)
+{
+    if (reader->buffer_pos < reader->buffer_len) {
+        return true;
+    }
+    if (reader->eof) {
+        return false;
+    }
+
+    reader->buffer_len = fread(reader->buffer, 1, SEQ_FILE_BUFFER_SIZE, reader->file);
+    reader->buffer_pos = 0;
+    if (reader->buffer_len == 0) {
+        if (ferror(reader->file)) {
+            ereport(ERROR, (errcode_for_file_access(), errmsg("Could not read file \"%s\": %m", reader->path)));
+        }
+        reader->eof = true;
+        return false;
+    }
+    return true;
+}
+
+// Next character without consuming it, or EOF
+static int seq_reader_peek(SeqFileReader *reader)
+{
+    if (!seq_reader_fill(reader)) {
+        return EOF;
+    }
+    return (unsigned char) reader->buffer[reader->buffer_pos];
+}
+
+/*
+ * Consumes the rest of the current line, appending it to out if that's not NULL (without the line break)
+ */
+static void seq_reader_read_line(SeqFileReader *reader, StringInfo out)
+{
+    while (seq_reader_fill(reader)) {
+        char *start = reader->buffer + reader->buffer_pos;
+        size_t available = reader->buffer_len - reader->buffer_pos;
+        char *newline = memchr(start, '\n', available);
+        size_t span = newline != NULL ? (size_t) (newline - start) : available;
+
+        if (out != NULL) {
+            appendBinaryStringInfo(out, start, span);
+        }
+        reader->buffer_pos += span;
+        if (newline != NULL) {
+            reader->buffer_pos++; // Eat the line break too
+            break;
+        }
+    }
+    reader->line++;
+
+    // Windows line endings
+    if (out != NULL && out->len > 0 && out->data[out->len - 1] == '\r') {
+        out->data[--out->len] = '\0';
+    }
+}
+
+/*
+ * Consumes the rest of the current line, encoding every nucleotide on it into the current record
+ */
+static void seq_reader_encode_line(SeqFileReader *reader)
+{
+    while (seq_reader_fill(reader)) {
+        const char *start = reader->buffer + reader->buffer_pos;
+        size_t available = reader->buffer_len - reader->buffer_pos;
+        const char *newline = memchr(start, '\n', available);
+        size_t span = newline != NULL ? (size_t) (newline - start) : available;
+        uint64_t needed_words = DNA_NUM_WORDS(reader->length + span);
+
+        // Grow geometrically, new chunks have to be zero since we OR the nucleotides in
+        if (needed_words > reader->max_words) {
+            uint64_t new_words = reader->max_words;
+            while (new_words < needed_words) {
+                new_words *= 2;
+            }
+            if (new_words * sizeof(uint64_t) > MaxAllocSize) {
+                ereport(ERROR, (errmsg("Sequence \"%s\" in file \"%s\" is too long", reader->name.data, reader->path)));
+            }
+            reader->words = (uint64_t *) repalloc(reader->words, new_words * sizeof(uint64_t));
+            memset(reader->words + reader->max_words, 0, (new_words - reader->max_words) * sizeof(uint64_t));
+            reader->max_words = new_words;
+        }
+
+        for (size_t i = 0; i < span; i++) {
+            uint8 code = base_codes[(unsigned char) start[i]];
+
+            if (likely(code <= 0x3)) {
+                reader->words[reader->length / 32] |= (uint64_t) code << ((reader->length % 32) * 2);
+                reader->length++;
+            } else if (start[i] == '\r' || start[i] == ' ' || start[i] == '\t') {
+                continue;
+            } else if (reader->skip_invalid) {
+                // Still counted, so FASTQ quality lines keep matching the sequence length
+                reader->invalid = true;
+                reader->length++;
+            } else {
+                ereport(ERROR,
+                        (errmsg("Invalid character in DNA sequence: %c", start[i]),
+                         errdetail("Sequence \"%s\", line %" PRIu64 " of file \"%s\".", reader->name.data, reader->line + 1, reader->path)));
+            }
+        }
+
+        reader->buffer_pos += span;
+        if (newline != NULL) {
+            reader->buffer_pos++;
+            break;
+        }
+    }
+    reader->line++;
+}
+
+/*
+ * Starts a new record: forget the previous one's nucleotides, name and quality
+ */
+static void seq_reader_reset_record(SeqFileReader *reader)
+{
+    memset(reader->words, 0, DNA_NUM_WORDS(reader->length) * sizeof(uint64_t));
+    reader->length = 0;
+    reader->invalid = false;
+    resetStringInfo(&reader->name);
+    resetStringInfo(&reader->quality);
+}
+
+/*
+ * Reads the next FASTA record, returns false at the end of the file
+ *
+ * >name and description
+ * ACGT...   (any number of lines, up to the next '>')
+ */
+static bool seq_reader_next_fasta(SeqFileReader *reader)
+{
+    int c;
+
+    // Skip empty lines before the record
+    while ((c = seq_reader_peek(reader)) == '\n' || c == '\r') {
+        seq_reader_read_line(reader, NULL);
+    }
+    if (c == EOF) {
+        return false;
+    }
+    if (c != '>') {
+        ereport(ERROR, (errmsg("Invalid FASTA file \"%s\": expected '>' at line %" PRIu64, reader->path, reader->line + 1)));
+    }
+
+    seq_reader_reset_record(reader);
+    reader->buffer_pos++; // Skip '>'
+    seq_reader_read_line(reader, &reader->name);
+
+    while ((c = seq_reader_peek(reader)) != EOF && c != '>') {
+        seq_reader_encode_line(reader);
+    }
+    return true;
+}
+
+/*
+ * Reads the next FASTQ record, returns false at the end of the file
+ *
+ * @name and description
+ * ACGT...   (sequence, may be wrapped over several lines)
+ * +         (optionally repeating the name)
+ * IIII...   (quality, as many characters as there are nucleotides)
+ */
+static bool seq_reader_next_fastq(SeqFileReader *reader)
+{
+    int c;
+
+    while ((c = seq_reader_peek(reader)) == '\n' || c == '\r') {
+        seq_reader_read_line(reader, NULL);
+    }
+    if (c == EOF) {
+        return false;
+    }
+    if (c != '@') {
+        ereport(ERROR, (errmsg("Invalid FASTQ file \"%s\": expected '@' at line %" PRIu64, reader->path, reader->line + 1)));
+    }
+
+    seq_reader_reset_record(reader);
+    reader->buffer_pos++; // Skip '@'
+    seq_reader_read_line(reader, &reader->name);
+
+    while ((c = seq_reader_peek(reader)) != EOF && c != '+') {
+        seq_reader_encode_line(reader);
+    }
+    if (c == EOF) {
+        ereport(ERROR, (errmsg("Invalid FASTQ file \"%s\": record \"%s\" has no quality line", reader->path, reader->name.data)));
+    }
+    seq_reader_read_line(reader, NULL); // The '+' line
+
+    // Quality lines can't be told apart from a next '@' record by their first character, so go by length
+    while ((uint64_t) reader->quality.len < reader->length && seq_reader_peek(reader) != EOF) {
+        seq_reader_read_line(reader, &reader->quality);
+    }
+    if ((uint64_t) reader->quality.len != reader->length) {
+        ereport(ERROR,
+                (errmsg("Invalid FASTQ file \"%s\": record \"%s\" has %d quality values for %" PRIu64 " nucleotides",
+                        reader->path, reader->name.data, reader->quality.len, reader->length)));
+    }
+    return true;
+}
+
+/*
+ * Closes the file if the query stops reading before the end (e.g. LIMIT)
+ */
+static void seq_reader_shutdown(Datum arg)
+{
+    SeqFileReader *reader = (SeqFileReader *) DatumGetPointer(arg);
+
+    if (reader->file != NULL) {
+        FreeFile(reader->file);
+        reader->file = NULL;
+    }
+}
+
+/*
+ * Shared body of read_fasta() and read_fastq(), one record per call
+ */
+static Datum read_sequence_file(FunctionCallInfo fcinfo, bool fastq)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    SeqFileReader *reader;
+    TupleDesc tupdesc;
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+    bool found;
+    Dna *dna;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        reader = (SeqFileReader *) palloc0(sizeof(SeqFileReader));
+        reader->path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+        reader->skip_invalid = PG_GETARG_BOOL(1);
+        check_server_file_access(reader->path);
+
+        // AllocateFile makes sure the file gets closed if the transaction aborts
+        reader->file = AllocateFile(reader->path, PG_BINARY_R);
+        if (reader->file == NULL) {
+            ereport(ERROR, (errcode_for_file_access(), errmsg("Could not open file \"%s\": %m", reader->path)));
+        }
+        reader->buffer = (char *) palloc(SEQ_FILE_BUFFER_SIZE);
+        reader->max_words = 1024;
+        reader->words = (uint64_t *) palloc0(reader->max_words * sizeof(uint64_t));
+        initStringInfo(&reader->name);
+        initStringInfo(&reader->quality);
+        init_base_codes();
+
+        if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo)) {
+            RegisterExprContextCallback(rsinfo->econtext, seq_reader_shutdown, PointerGetDatum(reader));
+        }
+        funcctx->user_fctx = reader;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    reader = funcctx->user_fctx;
+
+    // The record buffers live in the multi-call context, only the returned values are allocated per call
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    found = fastq ? seq_reader_next_fastq(reader) : seq_reader_next_fasta(reader);
+    while (found && reader->invalid) {
+        reader->skipped++;
+        found = fastq ? seq_reader_next_fastq(reader) : seq_reader_next_fasta(reader);
+    }
+    MemoryContextSwitchTo(oldcontext);
+
+    if (found)
+    {
+        values[0] = PointerGetDatum(cstring_to_text_with_len(reader->name.data, reader->name.len));
+        if (reader->length > 0) {
+            dna = dna_alloc(reader->length);
+            memcpy(dna->bit_sequence, reader->words, DNA_NUM_WORDS(reader->length) * sizeof(uint64_t));
+            values[1] = DnaPGetDatum(dna);
+        } else {
+            nulls[1] = true; // A record without nucleotides, dna can't be empty
+        }
+        if (fastq) {
+            values[2] = PointerGetDatum(cstring_to_text_with_len(reader->quality.data, reader->quality.len));
+        }
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        // Close the file ourselves, the callback would run after the multi-call context (and reader) is gone
+        if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo)) {
+            UnregisterExprContextCallback(rsinfo->econtext, seq_reader_shutdown, PointerGetDatum(reader));
+        }
+        seq_reader_shutdown(PointerGetDatum(reader));
+        if (reader->skipped > 0) {
+            ereport(NOTICE,
+                    (errmsg_plural("Skipped %" PRIu64 " record of file \"%s\" with characters other than A, C, G and T",
+                                   "Skipped %" PRIu64 " records of file \"%s\" with characters other than A, C, G and T",
+                                   reader->skipped, reader->skipped, reader->path)));
+        }
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(read_fasta);
+Datum
+read_fasta(PG_FUNCTION_ARGS)
+{
+    return read_sequence_file(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(read_fastq);
+Datum
+read_fastq(PG_FUNCTION_ARGS)
+{
+    return read_sequence_file(fcinfo, true);
+}
+
+/********************************************************************************************
+* Reverse complement functions
+********************************************************************************************/
+
+// A=00 <-> T=01 and C=10 <-> G=11 only differ in the low bit, so XOR with this complements 32 nucleotides at once
+#define DNA_COMPLEMENT_MASK UINT64CONST(0x5555555555555555)
+
+/**
+ * Reverses the order of the 32 nucleotides (2-bit groups) in a 64-bit chunk
+ *
+ * Swap neighbouring nucleotides, then neighbouring pairs of them (the nibbles), and a byte swap does the rest
+ */
+static inline uint64_t reverse_bases(uint64_t word)
+{
+    word = ((word >> 2) & UINT64CONST(0x3333333333333333)) | ((word & UINT64CONST(0x3333333333333333)) << 2);
+    word = ((word >> 4) & UINT64CONST(0x0F0F0F0F0F0F0F0F)) | ((word & UINT64CONST(0x0F0F0F0F0F0F0F0F)) << 4);
+    return pg_bswap64(word);
+}
+
+/**
+ * Reverse complements a packed sequence in place, a chunk at a time
+ *
+ * Reversing the chunks puts the padding of the last chunk at the start,
+ * so afterwards everything gets shifted down by the padding to line up at position 0 again
+ */
+static void revcomp_bits(uint64_t *bits, uint64_t length)
+{
+    uint64_t num_words = DNA_NUM_WORDS(length);
+    int shift = (int) (num_words * 64 - length * 2);  // Padding bits, always less than 64
+
+    for (uint64_t i = 0; i < num_words / 2; i++) {
+        uint64_t low = bits[i];
+
+        bits[i] = reverse_bases(bits[num_words - 1 - i] ^ DNA_COMPLEMENT_MASK);
+        bits[num_words - 1 - i] = reverse_bases(low ^ DNA_COMPLEMENT_MASK);
+    }
+    if (num_words % 2 == 1) {
+        bits[num_words / 2] = reverse_bases(bits[num_words / 2] ^ DNA_COMPLEMENT_MASK);
+    }
+
+    // The complemented padding ends up in the low bits of the first chunk and falls off here
+    if (shift != 0) {
+        for (uint64_t i = 0; i + 1 < num_words; i++) {
+            bits[i] = (bits[i] >> shift) | (bits[i + 1] << (64 - shift));
+        }
+        bits[num_words - 1] >>= shift;
+    }
+}
+
+static Dna *dna_revcomp_internal(const Dna *dna)
+{
+    Dna *result = dna_alloc(dna->length);
+
+    memcpy(result->bit_sequence, dna->bit_sequence, DNA_NUM_WORDS(dna->length) * sizeof(uint64_t));
+    revcomp_bits(result->bit_sequence, result->length);
+    return result;
+}
+
+PG_FUNCTION_INFO_V1(dna_revcomp);
+Datum
+dna_revcomp(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *result = dna_revcomp_internal(dna);
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_DNA_P(result);
+}
+
+/**
+ * Reverse complement of a K-mer, same trick on its single chunk
+ */
+static uint64_t kmer_revcomp_bits(uint64_t bit_sequence, int length)
+{
+    if (length == 0) {
+        return 0;
+    }
+    return reverse_bases(bit_sequence ^ DNA_COMPLEMENT_MASK) >> (64 - 2 * length);
+}
+
+PG_FUNCTION_INFO_V1(kmer_revcomp);
+Datum
+kmer_revcomp(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = PG_GETARG_KMER_P(0);
+    Kmer *result = (Kmer *) palloc0(sizeof(Kmer));
+
+    result->length = kmer->length;
+    result->bit_sequence = kmer_revcomp_bits(kmer->bit_sequence, kmer->length);
+    PG_RETURN_KMER_P(result);
+}
+
+/********************************************************************************************
+* Base composition functions
+********************************************************************************************/
+
+// Where the chunks start in the data of a Dna varlena, i.e. the offset TOAST slices are relative to
+#define DNA_BITS_DATA_OFFSET (offsetof(Dna, bit_sequence) - VARHDRSZ)
+
+// How many chunks we fetch per TOAST slice, 64kB or 256k nucleotides
+#define DNA_SLICE_WORDS 8192
+
+// Low bit of every nucleotide in a chunk, T=01 and G=11 have it set
+#define DNA_LOW_BITS UINT64CONST(0x5555555555555555)
+
+/**
+ * Reads the chunks of a DNA value without detoasting all of it
+ *
+ * Values stored out of line and uncompressed (STORAGE EXTERNAL) are fetched a slice at a time, so walking over
+ * a whole chromosome only ever keeps DNA_SLICE_WORDS chunks in memory. Anything else is just detoasted as usual,
+ * a slice of a compressed value means decompressing everything before it, again for every slice
+ */
+typedef struct DnaSliceReader
+{
+    struct varlena *datum;   // The (still toasted) value slices get fetched from
+    const uint64_t *bits;    // All the chunks, when the value is not stored out of line
+    uint64_t length;         // Length of the sequence in nucleotides
+    uint64_t num_words;      // Number of chunks
+    uint64_t *cache;         // Chunks [cache_first, cache_first + cache_words) of an out of line value
+    uint64_t cache_first;
+    uint64_t cache_words;
+} DnaSliceReader;
+
+// Whether slices of the value can be fetched without decompressing or copying the rest of it
+static bool dna_is_sliceable(struct varlena *datum)
+{
+    struct varatt_external toast_pointer;
+
+    if (!VARATT_IS_EXTERNAL_ONDISK(datum)) {
+        return false;
+    }
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, datum);
+    return !VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer);
+}
+
+static void dna_slice_reader_init(DnaSliceReader *reader, Datum value)
+{
+    struct varlena *datum = (struct varlena *) DatumGetPointer(value);
+
+    memset(reader, 0, sizeof(DnaSliceReader));
+    if (dna_is_sliceable(datum)) {
+        // Only fetch the header for now
+        Dna *header = (Dna *) PG_DETOAST_DATUM_SLICE(value, 0, DNA_BITS_DATA_OFFSET);
+
+        if (VARSIZE_ANY_EXHDR(header) < DNA_BITS_DATA_OFFSET) {
+            ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid DNA value: truncated header")));
+        }
+        reader->datum = datum;
+        reader->length = header->length;
+        pfree(header);
+    }
+    else {
+        Dna *dna = (Dna *) PG_DETOAST_DATUM(value);
+
+        reader->bits = dna->bit_sequence;
+        reader->length = dna->length;
+    }
+    reader->num_words = DNA_NUM_WORDS(reader->length);
+}
+
+/**
+ * Returns a pointer to chunks [first, first + n), n must be at most DNA_SLICE_WORDS
+ *
+ * The pointer is only valid until the next call, which may have to fetch another slice
+ */
+static const uint64_t *dna_slice_words(DnaSliceReader *reader, uint64_t first, uint64_t n)
+{
+    struct varlena *slice;
+    uint64_t fetch;
+
+    Assert(first + n <= reader->num_words && n <= DNA_SLICE_WORDS);
+    if (reader->bits != NULL) {
+        return reader->bits + first;
+    }
+    if (first >= reader->cache_first && first + n <= reader->cache_first + reader->cache_words) {
+        return reader->cache + (first - reader->cache_first);
+    }
+
+    // Fetch a whole slice from first on, callers mostly move forward
+    fetch = Min((uint64_t) DNA_SLICE_WORDS, reader->num_words - first);
+    if (reader->cache == NULL) {
+        reader->cache = (uint64_t *) palloc(DNA_SLICE_WORDS * sizeof(uint64_t));
+    }
+    slice = PG_DETOAST_DATUM_SLICE(PointerGetDatum(reader->datum),
+                                   DNA_BITS_DATA_OFFSET + first * sizeof(uint64_t),
+                                   fetch * sizeof(uint64_t));
+    if (VARSIZE_ANY_EXHDR(slice) < fetch * sizeof(uint64_t)) {
+        ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("Invalid DNA value: truncated bit sequence")));
+    }
+    // The slice data is only 4-byte aligned, copy it over instead of reading the chunks in place
+    memcpy(reader->cache, VARDATA_ANY(slice), fetch * sizeof(uint64_t));
+    pfree(slice);
+
+    reader->cache_first = first;
+    reader->cache_words = fetch;
+    return reader->cache;
+}
+
+/**
+ * Counts the A, C, G and T (in that order) in positions [start, end) of the sequence
+ *
+ * C=10 and G=11 are the only codes with the high bit set and T=01/G=11 the only ones with the low bit set,
+ * so it's 3 popcounts per 32 nucleotides: high bits (C + G), low bits (T + G) and both (G)
+ */
+static void count_bases_range(DnaSliceReader *reader, uint64_t start, uint64_t end, uint64_t counts[4])
+{
+    uint64_t high = 0, low = 0, both = 0;
+    uint64_t word = start / 32;
+
+    while (word * 32 < end) {
+        uint64_t n = Min((uint64_t) DNA_SLICE_WORDS, (end - 1) / 32 + 1 - word);
+        const uint64_t *words = dna_slice_words(reader, word, n);
+
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t first = (word + i) * 32;
+            uint64_t mask = DNA_LOW_BITS;
+            uint64_t h, l;
+
+            // Only keep the nucleotides of the first and last chunk that are in the range
+            if (first < start) {
+                mask &= ~(uint64_t) 0 << (2 * (start - first));
+            }
+            if (first + 32 > end) {
+                mask &= ((uint64_t) 1 << (2 * (end - first))) - 1;
+            }
+
+            h = (words[i] >> 1) & mask;
+            l = words[i] & mask;
+            high += pg_popcount64(h);
+            low += pg_popcount64(l);
+            both += pg_popcount64(h & l);
+        }
+        word += n;
+    }
+
+    counts[2] = both;                 // G
+    counts[1] = high - both;          // C
+    counts[3] = low - both;           // T
+    counts[0] = (end - start) - high - counts[3];  // A, everything else
+}
+
+PG_FUNCTION_INFO_V1(dna_gc_content);
+Datum
+dna_gc_content(PG_FUNCTION_ARGS)
+{
+    DnaSliceReader reader;
+    uint64_t counts[4];
+
+    dna_slice_reader_init(&reader, PG_GETARG_DATUM(0));
+    count_bases_range(&reader, 0, reader.length, counts);
+    PG_RETURN_FLOAT8((double) (counts[1] + counts[2]) / reader.length);
+}
+
+PG_FUNCTION_INFO_V1(dna_base_counts);
+Datum
+dna_base_counts(PG_FUNCTION_ARGS)
+{
+    DnaSliceReader reader;
+    uint64_t counts[4];
+    TupleDesc tupdesc;
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    dna_slice_reader_init(&reader, PG_GETARG_DATUM(0));
+    count_bases_range(&reader, 0, reader.length, counts);
+    for (int i = 0; i < 4; i++) {
+        values[i] = Int64GetDatum((int64) counts[i]);
+    }
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(kmer_gc_content);
+Datum
+kmer_gc_content(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = PG_GETARG_KMER_P(0);
+
+    if (kmer->length == 0) {
+        PG_RETURN_NULL();
+    }
+    // Padding is all A, so it never has the high bit set
+    PG_RETURN_FLOAT8((double) pg_popcount64((kmer->bit_sequence >> 1) & DNA_LOW_BITS) / kmer->length);
+}
+
+typedef struct GcWindowState
+{
+    DnaSliceReader reader;
+    uint64_t window;         // Window size in nucleotides
+    uint64_t step;           // Distance between the starts of two windows
+    uint64_t start;          // Start of the next window
+} GcWindowState;
+
+/**
+ * GC content of every window of the sequence, one row (start, gc_content) per window
+ *
+ * Only windows that fit entirely in the sequence are returned, starts are 0-based
+ */
+PG_FUNCTION_INFO_V1(dna_gc_content_windows);
+Datum
+dna_gc_content_windows(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    GcWindowState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        int32 window = PG_GETARG_INT32(1);
+        int32 step = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : window;
+
+        if (window <= 0 || step <= 0) {
+            ereport(ERROR, (errmsg("Window size and step must be positive")));
+        }
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        // Slices and the detoasted value have to live across calls
+        state = (GcWindowState *) palloc0(sizeof(GcWindowState));
+        dna_slice_reader_init(&state->reader, PG_GETARG_DATUM(0));
+        state->window = window;
+        state->step = step;
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (GcWindowState *) funcctx->user_fctx;
+
+    if (state->start + state->window <= state->reader.length)
+    {
+        uint64_t counts[4];
+        Datum values[2];
+        bool nulls[2] = {false, false};
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        count_bases_range(&state->reader, state->start, state->start + state->window, counts);
+        MemoryContextSwitchTo(oldcontext);
+
+        values[0] = Int64GetDatum((int64) state->start);
+        values[1] = Float8GetDatum((double) (counts[1] + counts[2]) / state->window);
+        state->start += state->step;
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* Approximate matching functions
+*
+* Myers' bit-vector algorithm (https://doi.org/10.1145/316542.316550), with Hyyrö's blocks for patterns longer than 64:
+* each 64-bit block keeps the vertical differences (+1 in Pv, -1 in Mv) of 64 rows of the DP matrix,
+* so one column of the matrix costs a handful of word operations per block
+********************************************************************************************/
+
+typedef struct MyersPattern
+{
+    uint64_t length;          // Pattern length in nucleotides, the rows of the DP matrix
+    int num_blocks;           // Number of 64-row blocks
+    int last_bit;             // Bit of the last block that holds the last row
+    uint64_t *peq;            // Match masks, peq[code * num_blocks + block] has bit i set where the pattern has that nucleotide
+    uint64_t *pv;             // Vertical +1 differences of every block
+    uint64_t *mv;             // Vertical -1 differences of every block
+    int64 *scores;            // Value of the DP matrix at the last row of every block
+} MyersPattern;
+
+/**
+ * Builds the per nucleotide match masks straight from the packed pattern and resets the DP state
+ */
+static MyersPattern *myers_pattern_make(const Dna *pattern)
+{
+    MyersPattern *myers = (MyersPattern *) palloc0(sizeof(MyersPattern));
+    int num_blocks = (int) ((pattern->length + 63) / 64);
+
+    myers->length = pattern->length;
+    myers->num_blocks = num_blocks;
+    myers->last_bit = (int) ((pattern->length - 1) % 64);
+    myers->peq = (uint64_t *) palloc0(4 * num_blocks * sizeof(uint64_t));
+    myers->pv = (uint64_t *) palloc(num_blocks * sizeof(uint64_t));
+    myers->mv = (uint64_t *) palloc(num_blocks * sizeof(uint64_t));
+    myers->scores = (int64 *) palloc(num_blocks * sizeof(int64));
+
+    for (uint64_t i = 0; i < pattern->length; i++) {
+        myers->peq[DNA_BASE_AT(pattern->bit_sequence, i) * num_blocks + i / 64] |= (uint64_t) 1 << (i % 64);
+    }
+
+    // First column of the matrix is 0, 1, 2, ..., every vertical difference is +1
+    for (int b = 0; b < num_blocks; b++) {
+        myers->pv[b] = ~(uint64_t) 0;
+        myers->mv[b] = 0;
+        myers->scores[b] = (b == num_blocks - 1) ? (int64) pattern->length : (int64) (b + 1) * 64;
+    }
+    return myers;
+}
+
+/**
+ * Advances one block by one column, hin is the horizontal difference coming in at the top of the block (-1, 0 or +1)
+ *
+ * Returns the horizontal difference at bit high_bit, which is what goes into the next block (or the last row)
+ */
+static inline int myers_block(uint64_t *pv_io, uint64_t *mv_io, uint64_t eq, int hin, int high_bit)
+{
+    uint64_t pv = *pv_io;
+    uint64_t mv = *mv_io;
+    uint64_t hin_neg = hin < 0 ? 1 : 0;
+    uint64_t xv = eq | mv;
+    uint64_t xh, ph, mh;
+    int hout;
+
+    eq |= hin_neg;
+    xh = (((eq & pv) + pv) ^ pv) | eq;
+    ph = mv | ~(xh | pv);
+    mh = pv & xh;
+
+    hout = (int) ((ph >> high_bit) & 1) - (int) ((mh >> high_bit) & 1);
+
+    ph = (ph << 1) | (hin > 0 ? 1 : 0);
+    mh = (mh << 1) | hin_neg;
+
+    *pv_io = mh | ~(xv | ph);
+    *mv_io = ph & xv;
+    return hout;
+}
+
+/**
+ * Advances blocks 0 to last_block by one column for text nucleotide code
+ *
+ * hin is the difference along the top row, 0 when searching (a match can start anywhere) and +1 for a global distance
+ */
+static inline void myers_column(MyersPattern *myers, int code, int hin, int last_block)
+{
+    const uint64_t *eq = myers->peq + code * myers->num_blocks;
+
+    for (int b = 0; b <= last_block; b++) {
+        int high_bit = (b == myers->num_blocks - 1) ? myers->last_bit : 63;
+
+        hin = myers_block(&myers->pv[b], &myers->mv[b], eq[b], hin, high_bit);
+        myers->scores[b] += hin;
+    }
+}
+
+typedef struct ApproxSearchState
+{
+    DnaSliceReader haystack;  // Streams over the packed haystack, no decoding
+    MyersPattern *myers;
+    int64 max_edits;
+    uint64_t position;        // Number of haystack nucleotides consumed so far
+    uint64_t word;            // Haystack chunk the next nucleotide is in
+} ApproxSearchState;
+
+/**
+ * Finds all the places where pattern occurs in haystack with at most max_edits substitutions, insertions or deletions
+ *
+ * Returns (end_pos, edits) for every haystack position where a match ends, end_pos is end-exclusive (0-based, like BED)
+ * and edits is the smallest number of edits of a match ending there
+ */
+PG_FUNCTION_INFO_V1(dna_find_approx);
+Datum
+dna_find_approx(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    ApproxSearchState *state;
+    MyersPattern *myers;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        Dna *pattern;
+        int32 max_edits = PG_GETARG_INT32(2);
+
+        if (max_edits < 0) {
+            ereport(ERROR, (errmsg("Maximum number of edits cannot be negative")));
+        }
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = (ApproxSearchState *) palloc0(sizeof(ApproxSearchState));
+        dna_slice_reader_init(&state->haystack, PG_GETARG_DATUM(0));
+        pattern = (Dna *) PG_GETARG_VARLENA_P(1);
+        state->myers = myers_pattern_make(pattern);
+        state->max_edits = max_edits;
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (ApproxSearchState *) funcctx->user_fctx;
+    myers = state->myers;
+
+    while (state->position < state->haystack.length)
+    {
+        if (state->position % 32 == 0) {
+            // Slices of the haystack live in the multi-call context with the reader
+            MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+            state->word = *dna_slice_words(&state->haystack, state->position / 32, 1);
+            MemoryContextSwitchTo(oldcontext);
+        }
+
+        myers_column(myers, (int) ((state->word >> ((state->position % 32) * 2)) & 0x3), 0, myers->num_blocks - 1);
+        state->position++;
+
+        if (myers->scores[myers->num_blocks - 1] <= state->max_edits) {
+            Datum values[2];
+            bool nulls[2] = {false, false};
+
+            values[0] = Int64GetDatum((int64) state->position);
+            values[1] = Int32GetDatum((int32) myers->scores[myers->num_blocks - 1]);
+            SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+        }
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/**
+ * Edit (Levenshtein) distance between two sequences, the shorter one goes into the bit vectors
+ *
+ * With max_dist >= 0 this is banded like Ukkonen's algorithm: a cell more than max_dist rows off the diagonal
+ * can't be on an alignment with at most max_dist edits, so blocks below the band are only started once the band
+ * reaches them, and we give up as soon as every cell of a column is over max_dist.
+ * Anything over max_dist comes back as max_dist + 1
+ */
+static int64 dna_edit_distance_internal(const Dna *a, const Dna *b, int64 max_dist)
+{
+    const Dna *pattern = a->length <= b->length ? a : b;
+    const Dna *text = a->length <= b->length ? b : a;
+    MyersPattern *myers;
+    int last_block;
+    int64 result;
+
+    // Every extra nucleotide of the longer sequence costs at least one edit
+    if (max_dist >= 0 && (int64) (text->length - pattern->length) > max_dist) {
+        return max_dist + 1;
+    }
+
+    myers = myers_pattern_make(pattern);
+    last_block = max_dist >= 0 ? 0 : myers->num_blocks - 1;
+
+    for (uint64_t j = 0; j < text->length; j++) {
+        if (max_dist >= 0) {
+            // Rows up to j + 1 + max_dist are in the band of this column
+            int band_block = (int) Min((uint64_t) myers->num_blocks - 1, (j + (uint64_t) max_dist) / 64);
+            bool alive = false;
+
+            // A new block starts from the column before, as if it was all insertions below the block above.
+            // These values are too big, but only for cells outside the band which we don't care about
+            while (last_block < band_block) {
+                last_block++;
+                myers->scores[last_block] = myers->scores[last_block - 1] +
+                    (last_block == myers->num_blocks - 1 ? myers->last_bit + 1 : 64);
+            }
+
+            myers_column(myers, DNA_BASE_AT(text->bit_sequence, j), 1, last_block);
+
+            // Neighbouring rows differ by at most one, so nothing in a block is below its last row minus the block height
+            for (int blk = 0; blk <= last_block && !alive; blk++) {
+                int rows = (blk == myers->num_blocks - 1) ? myers->last_bit + 1 : 64;
+                alive = myers->scores[blk] - (rows - 1) <= max_dist;
+            }
+            if (!alive) {
+                return max_dist + 1;
+            }
+        }
+        else {
+            myers_column(myers, DNA_BASE_AT(text->bit_sequence, j), 1, last_block);
+        }
+    }
+
+    result = myers->scores[myers->num_blocks - 1];
+    if (max_dist >= 0 && result > max_dist) {
+        return max_dist + 1;
+    }
+    return result;
+}
+
+/**
+ * dna_edit_distance(a, b, max_dist default null) and the <~> operator
+ */
+PG_FUNCTION_INFO_V1(dna_edit_distance);
+Datum
+dna_edit_distance(PG_FUNCTION_ARGS)
+{
+    Dna *a;
+    Dna *b;
+    int64 max_dist = -1;
+    int64 result;
+
+    // Not strict because of the NULL default of max_dist
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+        PG_RETURN_NULL();
+    }
+    if (PG_NARGS() > 2 && !PG_ARGISNULL(2)) {
+        max_dist = PG_GETARG_INT32(2);
+        if (max_dist < 0) {
+            ereport(ERROR, (errmsg("Maximum distance cannot be negative")));
+        }
+    }
+
+    a = (Dna *) PG_GETARG_VARLENA_P(0);
+    b = (Dna *) PG_GETARG_VARLENA_P(1);
+    result = dna_edit_distance_internal(a, b, max_dist);
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_INT64(result);
+}
+
+/********************************************************************************************
+* Alignment functions
+*
+* Smith-Waterman (local), Needleman-Wunsch (global) and semi-global (whole query, part of the target) alignment
+* with affine gaps: a gap of length L costs gap_open + (L - 1) * gap_extend.
+*
+* Local alignments are scored with Farrar's striped SIMD algorithm (https://doi.org/10.1093/bioinformatics/btl582)
+* on 8 16-bit lanes, the same way SSW does it: one pass for the score and where the alignment ends, one pass over the
+* reversed sequences for where it starts, and a scalar Gotoh traceback on just that region for the CIGAR.
+* Scores too big for 16 bits fall back to the scalar code, as does everything on machines without SSE2
+********************************************************************************************/
+
+typedef enum AlignMode
+{
+    ALIGN_LOCAL,
+    ALIGN_GLOBAL,
+    ALIGN_SEMIGLOBAL
+} AlignMode;
+
+typedef struct AlignScoring
+{
+    int match;           // Added for a match
+    int mismatch;        // Subtracted for a mismatch
+    int gap_open;        // Subtracted for the first nucleotide of a gap
+    int gap_extend;      // Subtracted for every other nucleotide of a gap
+} AlignScoring;
+
+typedef struct AlignResult
+{
+    bool found;          // False for a local alignment without any positive score
+    int64 score;
+    int query_start;     // 0-based, end-exclusive coordinates of the aligned parts
+    int query_end;
+    int target_start;
+    int target_end;
+    StringInfoData cigar;
+} AlignResult;
+
+#define ALIGN_NEG_INF (PG_INT64_MIN / 4)  // Low enough to never win, high enough to never overflow when subtracted from
+
+// Traceback matrix, where each cell's score came from (low 2 bits) and whether the gaps got extended
+#define ALIGN_FROM_DIAG 0
+#define ALIGN_FROM_E 1        // Gap in the query, consumes the target (D)
+#define ALIGN_FROM_F 2        // Gap in the target, consumes the query (I)
+#define ALIGN_FROM_ZERO 3     // Start of a local alignment
+#define ALIGN_E_EXTEND 4
+#define ALIGN_F_EXTEND 8
+
+/**
+ * Unpacks the 2-bit codes of a sequence into one byte each, which is what the alignment profiles are indexed by
+ */
+static uint8 *dna_unpack_codes(const Dna *dna)
+{
+    uint8 *codes;
+    uint64_t num_words = DNA_NUM_WORDS(dna->length);
+
+    if (dna->length > (uint64_t) PG_INT32_MAX) {
+        ereport(ERROR, (errmsg("DNA sequence of %" PRIu64 " nucleotides is too long to align", dna->length)));
+    }
+
+    codes = (uint8 *) palloc(dna->length);
+    for (uint64_t w = 0; w < num_words; w++) {
+        uint64_t word = dna->bit_sequence[w];
+        uint64_t n = Min((uint64_t) 32, dna->length - w * 32);
+
+        for (uint64_t i = 0; i < n; i++) {
+            codes[w * 32 + i] = word & 0x3;
+            word >>= 2;
+        }
+    }
+    return codes;
+}
+
+/**
+ * Plain Smith-Waterman score with affine gaps in linear space
+ *
+ * Returns the best score and where (inclusive) the first alignment with that score ends, column by column
+ */
+static void sw_score_scalar(const uint8 *query, int qlen, const uint8 *target, int tlen, const AlignScoring *sc,
+                            int64 *score, int *query_end, int *target_end)
+{
+    int64 *h = (int64 *) palloc0((qlen + 1) * sizeof(int64));
+    int64 *e = (int64 *) palloc((qlen + 1) * sizeof(int64));
+    int64 best = 0;
+
+    for (int i = 0; i <= qlen; i++) {
+        e[i] = ALIGN_NEG_INF;
+    }
+    *query_end = *target_end = -1;
+
+    for (int j = 0; j < tlen; j++) {
+        int64 diag = 0;
+        int64 f = ALIGN_NEG_INF;
+
+        for (int i = 1; i <= qlen; i++) {
+            int64 cell = diag + (query[i - 1] == target[j] ? sc->match : -sc->mismatch);
+
+            e[i] = Max(h[i] - sc->gap_open, e[i] - sc->gap_extend);
+            f = Max(h[i - 1] - sc->gap_open, f - sc->gap_extend);
+            cell = Max(cell, Max(e[i], f));
+            cell = Max(cell, 0);
+
+            diag = h[i];
+            h[i] = cell;
+            if (cell > best) {
+                best = cell;
+                *query_end = i - 1;
+                *target_end = j;
+            }
+        }
+    }
+
+    pfree(h);
+    pfree(e);
+    *score = best;
+}
+
+#ifdef __SSE2__
+/**
+ * Farrar's striped Smith-Waterman on 8 16-bit lanes
+ *
+ * The query is split into 8 segments, lane l of vector i is query position l * seg_len + i, so the vertical
+ * dependency only crosses vectors at the segment ends, which the "lazy F" loop fixes up afterwards.
+ * Returns false if the score got too close to the 16-bit limit, the caller has to redo it with the scalar code
+ */
+static bool sw_score_sse2(const uint8 *query, int qlen, const uint8 *target, int tlen, const AlignScoring *sc,
+                          int64 *score, int *query_end, int *target_end)
+{
+    int seg_len = (qlen + 7) / 8;
+    __m128i *profile = (__m128i *) palloc_aligned(4 * seg_len * sizeof(__m128i), 16, 0);
+    __m128i *h_store = (__m128i *) palloc_aligned(seg_len * sizeof(__m128i), 16, MCXT_ALLOC_ZERO);
+    __m128i *h_load = (__m128i *) palloc_aligned(seg_len * sizeof(__m128i), 16, MCXT_ALLOC_ZERO);
+    __m128i *e_vec = (__m128i *) palloc_aligned(seg_len * sizeof(__m128i), 16, MCXT_ALLOC_ZERO);
+    __m128i gap_open = _mm_set1_epi16((int16) sc->gap_open);
+    __m128i gap_extend = _mm_set1_epi16((int16) sc->gap_extend);
+    int16 lanes[8];
+    int best = 0;
+    bool fits = true;
+
+    // Query profile, the score of every query position against each nucleotide, in the striped order.
+    // Padding at the end of the last segment gets a score low enough to never be part of an alignment
+    for (int code = 0; code < 4; code++) {
+        for (int i = 0; i < seg_len; i++) {
+            for (int l = 0; l < 8; l++) {
+                int pos = l * seg_len + i;
+                lanes[l] = pos >= qlen ? PG_INT16_MIN / 2 : (query[pos] == code ? sc->match : -sc->mismatch);
+            }
+            profile[code * seg_len + i] = _mm_loadu_si128((const __m128i *) lanes);
+        }
+    }
+    *query_end = *target_end = -1;
+
+    for (int j = 0; j < tlen && fits; j++) {
+        const __m128i *p = profile + target[j] * seg_len;
+        __m128i vf = _mm_setzero_si128();
+        __m128i vmax = _mm_setzero_si128();
+        __m128i vh = _mm_slli_si128(h_store[seg_len - 1], 2);  // H of the previous column, one row up
+        __m128i *swap = h_load;
+        int column_max = 0;
+
+        h_load = h_store;
+        h_store = swap;
+
+        // Scores are never negative here: E and F start at 0 and the unsigned subtractions saturate at 0,
+        // so the max with them is the max with 0 a local alignment needs
+        for (int i = 0; i < seg_len; i++) {
+            __m128i ve = e_vec[i];
+
+            vh = _mm_adds_epi16(vh, p[i]);
+            vh = _mm_max_epi16(vh, ve);
+            vh = _mm_max_epi16(vh, vf);
+            vmax = _mm_max_epi16(vmax, vh);
+            h_store[i] = vh;
+
+            vh = _mm_subs_epu16(vh, gap_open);
+            e_vec[i] = _mm_max_epi16(_mm_subs_epu16(ve, gap_extend), vh);
+            vf = _mm_max_epi16(_mm_subs_epu16(vf, gap_extend), vh);
+            vh = h_load[i];
+        }
+
+        // Lazy F: carry the vertical gaps over the segment boundaries until they can't improve anything
+        for (int k = 0; k < 8; k++) {
+            bool done = false;
+
+            vf = _mm_slli_si128(vf, 2);
+            for (int i = 0; i < seg_len; i++) {
+                __m128i h_old = h_store[i];
+
+                vh = _mm_max_epi16(h_old, vf);
+                h_store[i] = vh;
+                vmax = _mm_max_epi16(vmax, vh);
+                vh = _mm_subs_epu16(vh, gap_open);
+                e_vec[i] = _mm_max_epi16(e_vec[i], vh);
+                vf = _mm_max_epi16(_mm_subs_epu16(vf, gap_extend), vh);
+                // Done once the carried gap is no better than opening one from the H the main loop already used
+                if (!_mm_movemask_epi8(_mm_cmpgt_epi16(vf, _mm_subs_epu16(h_old, gap_open)))) {
+                    done = true;
+                    break;
+                }
+            }
+            if (done) {
+                break;
+            }
+        }
+
+        _mm_storeu_si128((__m128i *) lanes, vmax);
+        for (int l = 0; l < 8; l++) {
+            column_max = Max(column_max, lanes[l]);
+        }
+
+        if (column_max > best) {
+            // Find the first query position with the new best score
+            int found = qlen;
+
+            best = column_max;
+            *target_end = j;
+            for (int i = 0; i < seg_len; i++) {
+                _mm_storeu_si128((__m128i *) lanes, h_store[i]);
+                for (int l = 0; l < 8; l++) {
+                    int pos = l * seg_len + i;
+                    if (lanes[l] == best && pos < found) {
+                        found = pos;
+                    }
+                }
+            }
+            *query_end = found;
+            fits = best < PG_INT16_MAX - sc->match;
+        }
+    }
+
+    pfree(profile);
+    pfree(h_store);
+    pfree(h_load);
+    pfree(e_vec);
+    *score = best;
+    return fits;
+}
+#endif
+
+static void sw_score(const uint8 *query, int qlen, const uint8 *target, int tlen, const AlignScoring *sc,
+                     int64 *score, int *query_end, int *target_end)
+{
+#ifdef __SSE2__
+    if (sw_score_sse2(query, qlen, target, tlen, sc, score, query_end, target_end)) {
+        return;
+    }
+#endif
+    sw_score_scalar(query, qlen, target, tlen, sc, score, query_end, target_end);
+}
+
+/**
+ * Appends a CIGAR operation, merging it with the previous one if it's the same
+ */
+static void cigar_append(StringInfo cigar, char *last_op, int *run, char op)
+{
+    if (op != *last_op && *run > 0) {
+        appendStringInfo(cigar, "%d%c", *run, *last_op);
+        *run = 0;
+    }
+    *last_op = op;
+    (*run)++;
+}
+
+/**
+ * Gotoh's algorithm with a full traceback matrix, one byte per cell
+ *
+ * For local mode the coordinates are relative to the given query and target, no soft clipping in the CIGAR
+ */
+static void align_traceback(const uint8 *query, int qlen, const uint8 *target, int tlen, const AlignScoring *sc,
+                            AlignMode mode, AlignResult *result)
+{
+    Size width = (Size) tlen + 1;
+    uint8 *dir;
+    int64 *h;
+    int64 *e;
+    int64 best;
+    int best_i, best_j;
+    char *ops;
+    int num_ops = 0;
+    int i, j, state;
+    char last_op = 0;
+    int run = 0;
+
+    if ((Size) qlen + 1 > MaxAllocSize / width) {
+        ereport(ERROR, (errmsg("Alignment of %d by %d nucleotides is too big for a traceback", qlen, tlen)));
+    }
+    dir = (uint8 *) palloc(((Size) qlen + 1) * width);
+    h = (int64 *) palloc((qlen + 1) * sizeof(int64));
+    e = (int64 *) palloc((qlen + 1) * sizeof(int64));
+
+    // First column: nothing of the target used, so the query is a gap (except for local alignments)
+    h[0] = 0;
+    e[0] = ALIGN_NEG_INF;
+    dir[0] = ALIGN_FROM_ZERO;
+    for (i = 1; i <= qlen; i++) {
+        h[i] = mode == ALIGN_LOCAL ? 0 : -(sc->gap_open + (int64) (i - 1) * sc->gap_extend);
+        e[i] = ALIGN_NEG_INF;
+        dir[i * width] = mode == ALIGN_LOCAL ? ALIGN_FROM_ZERO : ALIGN_FROM_F | (i > 1 ? ALIGN_F_EXTEND : 0);
+    }
+    best = mode == ALIGN_LOCAL ? 0 : h[qlen];
+    best_i = mode == ALIGN_LOCAL ? 0 : qlen;
+    best_j = 0;
+
+    for (j = 1; j <= tlen; j++) {
+        int64 diag = h[0];
+        int64 f = ALIGN_NEG_INF;
+
+        // First row: only global alignments pay for skipping the start of the target
+        h[0] = mode == ALIGN_GLOBAL ? -(sc->gap_open + (int64) (j - 1) * sc->gap_extend) : 0;
+        dir[j] = mode == ALIGN_GLOBAL ? ALIGN_FROM_E | (j > 1 ? ALIGN_E_EXTEND : 0) : ALIGN_FROM_ZERO;
+
+        for (i = 1; i <= qlen; i++) {
+            int64 cell = diag + (query[i - 1] == target[j - 1] ? sc->match : -sc->mismatch);
+            int64 e_open = h[i] - sc->gap_open;
+            int64 e_ext = e[i] - sc->gap_extend;
+            int64 f_open = h[i - 1] - sc->gap_open;
+            int64 f_ext = f - sc->gap_extend;
+            uint8 d = ALIGN_FROM_DIAG;
+
+            if (e_ext > e_open) {
+                e[i] = e_ext;
+                d |= ALIGN_E_EXTEND;
+            }
+            else {
+                e[i] = e_open;
+            }
+            if (f_ext > f_open) {
+                f = f_ext;
+                d |= ALIGN_F_EXTEND;
+            }
+            else {
+                f = f_open;
+            }
+
+            if (e[i] > cell) {
+                cell = e[i];
+                d = (d & ~0x3) | ALIGN_FROM_E;
+            }
+            if (f > cell) {
+                cell = f;
+                d = (d & ~0x3) | ALIGN_FROM_F;
+            }
+            if (mode == ALIGN_LOCAL && cell <= 0) {
+                cell = 0;
+                d = (d & ~0x3) | ALIGN_FROM_ZERO;
+            }
+
+            diag = h[i];
+            h[i] = cell;
+            dir[i * width + j] = d;
+
+            if (mode == ALIGN_LOCAL && cell > best) {
+                best = cell;
+                best_i = i;
+                best_j = j;
+            }
+        }
+
+        // Semi-global alignments can end anywhere in the target, global ones only at the very end
+        if ((mode == ALIGN_SEMIGLOBAL && h[qlen] > best) || (mode == ALIGN_GLOBAL && j == tlen)) {
+            best = h[qlen];
+            best_i = qlen;
+            best_j = j;
+        }
+    }
+
+    result->found = mode != ALIGN_LOCAL || best > 0;
+    result->score = best;
+    result->query_end = best_i;
+    result->target_end = best_j;
+
+    // Walk back from the end, collecting the operations in reverse
+    ops = (char *) palloc(qlen + tlen + 1);
+    i = best_i;
+    j = best_j;
+    state = ALIGN_FROM_DIAG;
+    while (result->found && (i > 0 || j > 0)) {
+        uint8 d = dir[i * width + j];
+
+        if (state == ALIGN_FROM_DIAG) {
+            if ((d & 0x3) == ALIGN_FROM_ZERO) {
+                break;
+            }
+            if (i == 0) {
+                ops[num_ops++] = 'D';
+                j--;
+            }
+            else if (j == 0) {
+                ops[num_ops++] = 'I';
+                i--;
+            }
+            else if ((d & 0x3) == ALIGN_FROM_DIAG) {
+                ops[num_ops++] = 'M';
+                i--;
+                j--;
+            }
+            else {
+                state = d & 0x3;
+            }
+        }
+        else if (state == ALIGN_FROM_E) {
+            ops[num_ops++] = 'D';
+            state = (d & ALIGN_E_EXTEND) ? ALIGN_FROM_E : ALIGN_FROM_DIAG;
+            j--;
+        }
+        else {
+            ops[num_ops++] = 'I';
+            state = (d & ALIGN_F_EXTEND) ? ALIGN_FROM_F : ALIGN_FROM_DIAG;
+            i--;
+        }
+    }
+    result->query_start = i;
+    result->target_start = j;
+
+    initStringInfo(&result->cigar);
+    while (num_ops > 0) {
+        cigar_append(&result->cigar, &last_op, &run, ops[--num_ops]);
+    }
+    if (run > 0) {
+        appendStringInfo(&result->cigar, "%d%c", run, last_op);
+    }
+
+    pfree(ops);
+    pfree(dir);
+    pfree(h);
+    pfree(e);
+}
+
+/**
+ * Local alignment: SIMD passes for the end and the start, then the traceback on the region in between
+ */
+static void align_local(const uint8 *query, int qlen, const uint8 *target, int tlen, const AlignScoring *sc,
+                        AlignResult *result)
+{
+    int64 score;
+    int query_end, target_end, rev_query_end, rev_target_end;
+    int query_start, target_start;
+    uint8 *rev_query;
+    uint8 *rev_target;
+    StringInfoData cigar;
+
+    sw_score(query, qlen, target, tlen, sc, &score, &query_end, &target_end);
+    if (score <= 0) {
+        result->found = false;
+        result->score = 0;
+        return;
+    }
+
+    // The best alignment of the reversed prefixes ends where the best alignment starts
+    rev_query = (uint8 *) palloc(query_end + 1);
+    rev_target = (uint8 *) palloc(target_end + 1);
+    for (int i = 0; i <= query_end; i++) {
+        rev_query[i] = query[query_end - i];
+    }
+    for (int j = 0; j <= target_end; j++) {
+        rev_target[j] = target[target_end - j];
+    }
+    sw_score(rev_query, query_end + 1, rev_target, target_end + 1, sc, &score, &rev_query_end, &rev_target_end);
+    query_start = query_end - rev_query_end;
+    target_start = target_end - rev_target_end;
+    pfree(rev_query);
+    pfree(rev_target);
+
+    align_traceback(query + query_start, query_end - query_start + 1,
+                    target + target_start, target_end - target_start + 1, sc, ALIGN_LOCAL, result);
+    result->query_start += query_start;
+    result->query_end += query_start;
+    result->target_start += target_start;
+    result->target_end += target_start;
+
+    // Soft clip the rest of the query, like SAM does for local alignments
+    initStringInfo(&cigar);
+    if (result->query_start > 0) {
+        appendStringInfo(&cigar, "%dS", result->query_start);
+    }
+    appendBinaryStringInfo(&cigar, result->cigar.data, result->cigar.len);
+    if (result->query_end < qlen) {
+        appendStringInfo(&cigar, "%dS", qlen - result->query_end);
+    }
+    pfree(result->cigar.data);
+    result->cigar = cigar;
+}
+
+/**
+ * dna_align(query, target, mode, match, mismatch, gap_open, gap_extend)
+ *
+ * Returns (score, query_start, query_end, target_start, target_end, cigar), coordinates are 0-based and end-exclusive.
+ * A local alignment without any positive score has NULL coordinates and CIGAR
+ */
+PG_FUNCTION_INFO_V1(dna_align);
+Datum
+dna_align(PG_FUNCTION_ARGS)
+{
+    Dna *query = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *target = (Dna *) PG_GETARG_VARLENA_P(1);
+    char *mode_str = text_to_cstring(PG_GETARG_TEXT_PP(2));
+    AlignScoring sc;
+    AlignMode mode;
+    AlignResult result;
+    uint8 *query_codes;
+    uint8 *target_codes;
+    TupleDesc tupdesc;
+    Datum values[6];
+    bool nulls[6] = {false, false, false, false, false, false};
+
+    if (strcmp(mode_str, "local") == 0) {
+        mode = ALIGN_LOCAL;
+    }
+    else if (strcmp(mode_str, "global") == 0) {
+        mode = ALIGN_GLOBAL;
+    }
+    else if (strcmp(mode_str, "semiglobal") == 0) {
+        mode = ALIGN_SEMIGLOBAL;
+    }
+    else {
+        ereport(ERROR, (errmsg("Invalid alignment mode \"%s\": must be local, global or semiglobal", mode_str)));
+    }
+
+    sc.match = PG_GETARG_INT32(3);
+    sc.mismatch = PG_GETARG_INT32(4);
+    sc.gap_open = PG_GETARG_INT32(5);
+    sc.gap_extend = PG_GETARG_INT32(6);
+    // Has to fit in the 16-bit lanes, the penalties are given as positive numbers
+    if (sc.match < 0 || sc.match > 1000 || sc.mismatch < 0 || sc.mismatch > 1000 ||
+        sc.gap_open < 0 || sc.gap_open > 1000 || sc.gap_extend < 0 || sc.gap_extend > 1000) {
+        ereport(ERROR, (errmsg("Alignment scores and penalties must be between 0 and 1000")));
+    }
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    query_codes = dna_unpack_codes(query);
+    target_codes = dna_unpack_codes(target);
+
+    if (mode == ALIGN_LOCAL) {
+        align_local(query_codes, (int) query->length, target_codes, (int) target->length, &sc, &result);
+    }
+    else {
+        align_traceback(query_codes, (int) query->length, target_codes, (int) target->length, &sc, mode, &result);
+    }
+
+    values[0] = Int64GetDatum(result.score);
+    if (result.found) {
+        values[1] = Int64GetDatum(result.query_start);
+        values[2] = Int64GetDatum(result.query_end);
+        values[3] = Int64GetDatum(result.target_start);
+        values[4] = Int64GetDatum(result.target_end);
+        values[5] = PointerGetDatum(cstring_to_text_with_len(result.cigar.data, result.cigar.len));
+    }
+    else {
+        for (int i = 1; i < 6; i++) {
+            nulls[i] = true;
+        }
+    }
+
+    PG_FREE_IF_COPY(query, 0);
+    PG_FREE_IF_COPY(target, 1);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/********************************************************************************************
+* Hamming distance functions
+********************************************************************************************/
+
+/**
+ * Number of nucleotides that differ between two chunks
+ *
+ * XOR leaves a non-zero 2-bit pair wherever they differ, folding each pair onto its low bit gives one bit per mismatch
+ */
+static inline int hamming_word(uint64_t a, uint64_t b)
+{
+    uint64_t diff = a ^ b;
+    return pg_popcount64((diff | (diff >> 1)) & DNA_LOW_BITS);
+}
+
+static void dna_hamming_check_lengths(const Dna *a, const Dna *b)
+{
+    if (a->length != b->length) {
+        ereport(ERROR, (errmsg("Hamming distance needs sequences of the same length, got %" PRIu64 " and %" PRIu64,
+                               a->length, b->length)));
+    }
+}
+
+/**
+ * Hamming distance of two sequences of the same length, stops counting once it's over max_dist (if max_dist >= 0)
+ *
+ * Padding bits are zero in both, so they never count
+ */
+static int64 dna_hamming_internal(const Dna *a, const Dna *b, int64 max_dist)
+{
+    uint64_t num_words = DNA_NUM_WORDS(a->length);
+    int64 distance = 0;
+
+    dna_hamming_check_lengths(a, b);
+    for (uint64_t i = 0; i < num_words; i++) {
+        distance += hamming_word(a->bit_sequence[i], b->bit_sequence[i]);
+        if (max_dist >= 0 && distance > max_dist) {
+            break;
+        }
+    }
+    return distance;
+}
+
+static int kmer_hamming_internal(const Kmer *a, const Kmer *b)
+{
+    if (a->length != b->length) {
+        ereport(ERROR, (errmsg("Hamming distance needs k-mers of the same length, got %d and %d", a->length, b->length)));
+    }
+    return hamming_word(a->bit_sequence, b->bit_sequence);
+}
+
+PG_FUNCTION_INFO_V1(dna_hamming);
+Datum
+dna_hamming(PG_FUNCTION_ARGS)
+{
+    Dna *a = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *b = (Dna *) PG_GETARG_VARLENA_P(1);
+    int64 result = dna_hamming_internal(a, b, -1);
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_INT64(result);
+}
+
+PG_FUNCTION_INFO_V1(dna_hamming_le);
+Datum
+dna_hamming_le(PG_FUNCTION_ARGS)
+{
+    Dna *a = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *b = (Dna *) PG_GETARG_VARLENA_P(1);
+    int32 max_dist = PG_GETARG_INT32(2);
+    bool result;
+
+    // Sequences of different lengths are an error like for hamming(), whatever max_dist is
+    dna_hamming_check_lengths(a, b);
+    result = max_dist >= 0 && dna_hamming_internal(a, b, max_dist) <= max_dist;
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(kmer_hamming);
+Datum
+kmer_hamming(PG_FUNCTION_ARGS)
+{
+    Kmer *a = PG_GETARG_KMER_P(0);
+    Kmer *b = PG_GETARG_KMER_P(1);
+    PG_RETURN_INT32(kmer_hamming_internal(a, b));
+}
+
+PG_FUNCTION_INFO_V1(kmer_hamming_le);
+Datum
+kmer_hamming_le(PG_FUNCTION_ARGS)
+{
+    Kmer *a = PG_GETARG_KMER_P(0);
+    Kmer *b = PG_GETARG_KMER_P(1);
+    int32 max_dist = PG_GETARG_INT32(2);
+    PG_RETURN_BOOL(kmer_hamming_internal(a, b) <= max_dist);
+}
+
+/********************************************************************************************
+* Concatenation functions
+********************************************************************************************/
+
+/**
+ * a || b without decoding: a's chunks are copied as they are, b's get shift-merged in right after a
+ */
+PG_FUNCTION_INFO_V1(dna_concat);
+Datum
+dna_concat(PG_FUNCTION_ARGS)
+{
+    Dna *a = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *b = (Dna *) PG_GETARG_VARLENA_P(1);
+    Dna *result = dna_alloc(a->length + b->length);
+
+    // a's padding is zero, which is what copy_bases needs for b
+    memcpy(result->bit_sequence, a->bit_sequence, DNA_NUM_WORDS(a->length) * sizeof(uint64_t));
+    copy_bases(result->bit_sequence, a->length, b->bit_sequence, 0, b->length);
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_DNA_P(result);
+}
+
+/*
+ * Aggregate state for dna_agg: the packed sequence so far, grown geometrically like dna_batch_agg's
+ */
+typedef struct DnaAggState
+{
+    uint64_t length;        // Nucleotides added so far
+    uint64_t max_words;     // Allocated chunks in bits
+    uint64_t *bits;         // The packed sequence, zero past length
+} DnaAggState;
+
+PG_FUNCTION_INFO_V1(dna_agg_transfn);
+Datum
+dna_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    MemoryContext oldcontext;
+    DnaAggState *state;
+    Dna *dna;
+    uint64_t needed_words;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        ereport(ERROR, (errmsg("dna_agg_transfn called in non-aggregate context")));
+    }
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaAggState *) PG_GETARG_POINTER(0);
+
+    if (state == NULL) {
+        // First row, set up the state in the aggregate context so it lives as long as the group does
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        state = (DnaAggState *) palloc0(sizeof(DnaAggState));
+        state->max_words = 64;
+        state->bits = (uint64_t *) palloc0(state->max_words * sizeof(uint64_t));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    // NULLs are skipped, like string_agg does
+    if (PG_ARGISNULL(1)) {
+        PG_RETURN_POINTER(state);
+    }
+
+    dna = (Dna *) PG_GETARG_VARLENA_P(1);
+
+    // Doubling keeps appending linear overall, a 100 Mb sequence takes 16 repallocs.
+    // repalloc keeps the chunks in the aggregate context; the result has to fit in a single value anyway
+    needed_words = DNA_NUM_WORDS(state->length + dna->length);
+    if (offsetof(Dna, bit_sequence) + needed_words * sizeof(uint64_t) > MaxAllocSize) {
+        ereport(ERROR, (errmsg("DNA sequence of %" PRIu64 " nucleotides is too long", state->length + dna->length)));
+    }
+    if (needed_words > state->max_words) {
+        uint64_t new_words = state->max_words;
+        while (new_words < needed_words) {
+            new_words *= 2;
+        }
+        new_words = Min(new_words, (MaxAllocSize - offsetof(Dna, bit_sequence)) / sizeof(uint64_t));
+        state->bits = (uint64_t *) repalloc(state->bits, new_words * sizeof(uint64_t));
+        memset(state->bits + state->max_words, 0, (new_words - state->max_words) * sizeof(uint64_t));
+        state->max_words = new_words;
+    }
+
+    copy_bases(state->bits, state->length, dna->bit_sequence, 0, dna->length);
+    state->length += dna->length;
+
+    PG_FREE_IF_COPY(dna, 1);
+    PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(dna_agg_finalfn);
+Datum
+dna_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    DnaAggState *state;
+    Dna *result;
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaAggState *) PG_GETARG_POINTER(0);
+    if (state == NULL || state->length == 0) {
+        PG_RETURN_NULL(); // No rows (or only NULLs)
+    }
+
+    // Copy it out, the state may still be used afterwards (e.g. as a window aggregate)
+    result = dna_alloc(state->length);
+    memcpy(result->bit_sequence, state->bits, DNA_NUM_WORDS(state->length) * sizeof(uint64_t));
+    PG_RETURN_DNA_P(result);
+}
+
+/********************************************************************************************
+* Translation functions
+********************************************************************************************/
+
+/*
+ * NCBI genetic codes (https://www.ncbi.nlm.nih.gov/Taxonomy/Utils/wprintgc.cgi), indexed by their id.
+ * Amino acids of the 64 codons in the usual TCAG order: the first base picks a block of 16, the second one of 4
+ */
+static const char *const genetic_codes[] = {
+    [1] = "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",   // Standard
+    [2] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSS**VVVVAAAADDEEGGGG",   // Vertebrate mitochondrial
+    [3] = "FFLLSSSSYY**CCWWTTTTPPPPHHQQRRRRIIMMTTTTNNKKSSRRVVVVAAAADDEEGGGG",   // Yeast mitochondrial
+    [4] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",   // Mold, protozoan and coelenterate mitochondrial, Mycoplasma
+    [5] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSSSSVVVVAAAADDEEGGGG",   // Invertebrate mitochondrial
+    [6] = "FFLLSSSSYYQQCC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",   // Ciliate, dasycladacean and Hexamita nuclear
+    [9] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNNKSSSSVVVVAAAADDEEGGGG",   // Echinoderm and flatworm mitochondrial
+    [10] = "FFLLSSSSYY**CCCWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Euplotid nuclear
+    [11] = "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Bacterial, archaeal and plant plastid
+    [12] = "FFLLSSSSYY**CC*WLLLSPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Alternative yeast nuclear
+    [13] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSSGGVVVVAAAADDEEGGGG",  // Ascidian mitochondrial
+    [14] = "FFLLSSSSYYY*CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNNKSSSSVVVVAAAADDEEGGGG",  // Alternative flatworm mitochondrial
+    [16] = "FFLLSSSSYY*LCC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Chlorophycean mitochondrial
+    [21] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNNKSSSSVVVVAAAADDEEGGGG",  // Trematode mitochondrial
+    [22] = "FFLLSS*SYY*LCC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Scenedesmus obliquus mitochondrial
+    [23] = "FF*LSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Thraustochytrium mitochondrial
+    [24] = "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSSKVVVVAAAADDEEGGGG",  // Rhabdopleuridae mitochondrial
+    [25] = "FFLLSSSSYY**CCGWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Candidate division SR1 and Gracilibacteria
+    [26] = "FFLLSSSSYY**CC*WLLLAPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Pachysolen tannophilus nuclear
+    [29] = "FFLLSSSSYYYYCC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Mesodinium nuclear
+    [30] = "FFLLSSSSYYEECC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG",  // Peritrich nuclear
+    [33] = "FFLLSSSSYYY*CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSSKVVVVAAAADDEEGGGG",  // Cephalodiscidae mitochondrial
+};
+
+#define NUM_GENETIC_CODES ((int) lengthof(genetic_codes))
+
+/**
+ * Remaps a genetic code to our encoding: the 6 bits of a codon read straight from the bit sequence
+ * (first base in the lowest 2 bits, A=00 T=01 C=10 G=11) index the table directly
+ */
+static void build_codon_table(int table, char codon_table[64])
+{
+    static const int tcag_index[4] = {2, 0, 1, 3};  // Position of A, T, C and G in TCAG
+
+    if (table < 1 || table >= NUM_GENETIC_CODES || genetic_codes[table] == NULL) {
+        ereport(ERROR, (errmsg("Unknown genetic code %d", table)));
+    }
+
+    for (int codon = 0; codon < 64; codon++) {
+        int first = tcag_index[codon & 0x3];
+        int second = tcag_index[(codon >> 2) & 0x3];
+        int third = tcag_index[(codon >> 4) & 0x3];
+        codon_table[codon] = genetic_codes[table][first * 16 + second * 4 + third];
+    }
+}
+
+/**
+ * Translates the codons from position start on, 10 codons (60 bits) per read from the bit sequence
+ */
+static text *translate_internal(const Dna *dna, uint64_t start, const char codon_table[64])
+{
+    uint64_t num_codons = dna->length > start ? (dna->length - start) / 3 : 0;
+    text *result;
+    char *out;
+    uint64_t i = 0;
+
+    if (num_codons + VARHDRSZ > MaxAllocSize) {
+        ereport(ERROR, (errmsg("Translation of %" PRIu64 " codons is too long", num_codons)));
+    }
+    result = (text *) palloc(VARHDRSZ + num_codons);
+    SET_VARSIZE(result, VARHDRSZ + num_codons);
+    out = VARDATA(result);
+
+    for (; i + 10 <= num_codons; i += 10) {
+        uint64_t bits = read_bases(dna->bit_sequence, start + i * 3, 30);
+        for (int c = 0; c < 10; c++) {
+            out[i + c] = codon_table[bits & 0x3F];
+            bits >>= 6;
+        }
+    }
+    for (; i < num_codons; i++) {
+        out[i] = codon_table[read_bases(dna->bit_sequence, start + i * 3, 3)];
+    }
+    return result;
+}
+
+/**
+ * translate(dna, frame, table): frames 1, 2 and 3 start at the first, second and third nucleotide,
+ * -1, -2 and -3 do the same on the reverse complement
+ */
+PG_FUNCTION_INFO_V1(dna_translate);
+Datum
+dna_translate(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    int32 frame = PG_GETARG_INT32(1);
+    int32 table = PG_GETARG_INT32(2);
+    char codon_table[64];
+    text *result;
+
+    if (frame == 0 || frame < -3 || frame > 3) {
+        ereport(ERROR, (errmsg("Invalid reading frame %d: must be 1, 2, 3, -1, -2 or -3", frame)));
+    }
+    build_codon_table(table, codon_table);
+
+    if (frame > 0) {
+        result = translate_internal(dna, frame - 1, codon_table);
+    }
+    else {
+        Dna *revcomp = dna_revcomp_internal(dna);
+        result = translate_internal(revcomp, -frame - 1, codon_table);
+        pfree(revcomp);
+    }
+
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_TEXT_P(result);
+}
+
+typedef struct SixFrameState
+{
+    Dna *forward;
+    Dna *reverse;            // Reverse complement of forward
+    char codon_table[64];
+} SixFrameState;
+
+/**
+ * Translations in all six frames, one row (frame, protein) per frame: 1, 2, 3, -1, -2, -3
+ */
+PG_FUNCTION_INFO_V1(dna_six_frame_translate);
+Datum
+dna_six_frame_translate(PG_FUNCTION_ARGS)
+{
+    static const int frames[6] = {1, 2, 3, -1, -2, -3};
+    FuncCallContext *funcctx;
+    SixFrameState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = (SixFrameState *) palloc(sizeof(SixFrameState));
+        build_codon_table(PG_GETARG_INT32(1), state->codon_table);
+        state->forward = (Dna *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(0));
+        state->reverse = dna_revcomp_internal(state->forward);
+        funcctx->user_fctx = state;
+        funcctx->max_calls = 6;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (SixFrameState *) funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int frame = frames[funcctx->call_cntr];
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        values[0] = Int32GetDatum(frame);
+        values[1] = PointerGetDatum(translate_internal(frame > 0 ? state->forward : state->reverse,
+                                                       (uint64_t) (frame > 0 ? frame : -frame) - 1, state->codon_table));
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* ORF functions
+********************************************************************************************/
+
+#define CODON_ATG (0 | (1 << 2) | (3 << 4))  // A, T, G in the 6 bit codon encoding
+
+/**
+ * Scan state of find_orfs: a rolling 6 bit codon walks the sequence one base at a time,
+ * the frame of a codon is its start position modulo 3
+ */
+typedef struct OrfScanState
+{
+    Dna *dna;                // Own copy, reverse complemented in place once the forward strand is done
+    uint64_t min_len;
+    bool both_strands;
+    int strand;              // 1 on the forward strand, -1 on the reverse one
+    uint64_t position;       // Start of the next codon to look at
+    uint32_t codon;          // Previous codon, shifted down a base and topped up with the next one at each step
+    int64 orf_start[3];      // First ATG since the last stop in each frame, -1 when there is none
+    char codon_table[64];
+} OrfScanState;
+
+static void orf_scan_reset(OrfScanState *state)
+{
+    state->position = 0;
+    state->codon = state->dna->length >= 2 ? (uint32_t) read_bases(state->dna->bit_sequence, 0, 2) << 2 : 0;
+    state->orf_start[0] = state->orf_start[1] = state->orf_start[2] = -1;
+}
+
+/**
+ * Advances to the next ORF of at least min_len nucleotides, ATG up to and including the stop codon.
+ * Returns false when both strands are exhausted, otherwise fills start and end in strand coordinates
+ */
+static bool orf_scan_next(OrfScanState *state, uint64_t *start, uint64_t *end)
+{
+    const uint64_t *bits = state->dna->bit_sequence;
+    uint64_t length = state->dna->length;
+
+    for (;;) {
+        while (state->position + 3 <= length) {
+            uint64_t pos = state->position++;
+            int frame = (int) (pos % 3);
+            uint32_t codon = (state->codon >> 2) | ((uint32_t) DNA_BASE_AT(bits, pos + 2) << 4);
+
+            state->codon = codon;
+            if (state->codon_table[codon] == '*') {
+                int64 orf_start = state->orf_start[frame];
+
+                state->orf_start[frame] = -1;
+                if (orf_start >= 0 && pos + 3 - (uint64_t) orf_start >= state->min_len) {
+                    *start = (uint64_t) orf_start;
+                    *end = pos + 3;
+                    return true;
+                }
+            }
+            else if (codon == CODON_ATG && state->orf_start[frame] < 0) {
+                state->orf_start[frame] = (int64) pos;
+            }
+        }
+
+        if (state->strand < 0 || !state->both_strands) {
+            return false;
+        }
+        revcomp_bits(state->dna->bit_sequence, length);
+        state->strand = -1;
+        orf_scan_reset(state);
+    }
+}
+
+/**
+ * find_orfs(dna, min_len, both_strands): open reading frames from ATG to a stop codon of the standard code.
+ * Every stop closes the longest ORF in its frame, nested ATGs are not reported separately.
+ * start and end are 0 based and end exclusive on the forward strand for either strand,
+ * frame is 1, 2, 3 for the forward strand and -1, -2, -3 for the reverse one, as in translate()
+ */
+PG_FUNCTION_INFO_V1(dna_find_orfs);
+Datum
+dna_find_orfs(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    OrfScanState *state;
+    uint64_t start;
+    uint64_t end;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        int32 min_len = PG_GETARG_INT32(1);
+
+        if (min_len < 0) {
+            ereport(ERROR, (errmsg("Minimum ORF length must not be negative")));
+        }
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = (OrfScanState *) palloc(sizeof(OrfScanState));
+        state->dna = (Dna *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(0));
+        state->min_len = (uint64_t) min_len;
+        state->both_strands = PG_GETARG_BOOL(2);
+        state->strand = 1;
+        build_codon_table(1, state->codon_table);
+        orf_scan_reset(state);
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (OrfScanState *) funcctx->user_fctx;
+
+    if (orf_scan_next(state, &start, &end))
+    {
+        uint64_t length = state->dna->length;
+        Datum values[4];
+        bool nulls[4] = {false, false, false, false};
+
+        if (state->strand > 0) {
+            values[0] = Int64GetDatum((int64) start);
+            values[1] = Int64GetDatum((int64) end);
+            values[2] = Int32GetDatum((int32) (start % 3) + 1);
+        }
+        else {
+            values[0] = Int64GetDatum((int64) (length - end));
+            values[1] = Int64GetDatum((int64) (length - start));
+            values[2] = Int32GetDatum(-((int32) (start % 3) + 1));
+        }
+        values[3] = PointerGetDatum(cstring_to_text(state->strand > 0 ? "+" : "-"));
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* Low complexity functions
+*
+* Symmetric DUST (Morgulis et al. 2006, https://doi.org/10.1089/cmb.2006.13.1028), the algorithm of NCBI
+* dustmasker and minimap2's sdust. A stretch of l triplets where triplet t occurs c_t times has
+* score 10 * sum(c_t * (c_t - 1) / 2) / (l - 1), windows are a fixed number of bases and whatever scores
+* above the threshold inside a window (a "perfect interval") gets masked.
+* Triplets are the 6 bit codes of three packed bases, every count is updated incrementally as the window slides.
+********************************************************************************************/
+
+#define DUST_NUM_TRIPLETS 64
+#define DUST_MAX_WINDOW 1000
+
+#define DUST_TRIPLET_AT(bits, pos) ((int) read_bases((bits), (pos), 3))
+
+/**
+ * A perfect interval of the current window, [start, end) in bases
+ */
+typedef struct DustInterval
+{
+    uint64_t start;
+    uint64_t end;
+    int64 r;                 // sum(c_t * (c_t - 1) / 2) over its triplets
+    int64 l;                 // Number of triplets minus one
+} DustInterval;
+
+typedef struct DustScan
+{
+    const uint64_t *bits;
+    int threshold;
+    int max_triplets;        // Triplets in a full window
+    uint64_t start;          // Window start, the window holds the triplets starting at start .. start + size - 1
+    int size;
+    int suffix;              // Length of the window suffix where no triplet is over-represented (L in the paper)
+    int64 rw;                // r of the whole window
+    int64 rv;                // r of the suffix
+    int cw[DUST_NUM_TRIPLETS];
+    int cv[DUST_NUM_TRIPLETS];
+    DustInterval *perfect;   // Perfect intervals not yet saved, ordered by decreasing start
+    int num_perfect;
+    int max_perfect;
+    uint64_t *regions;       // Masked regions as start, end pairs
+    int num_regions;
+    int max_regions;
+} DustScan;
+
+static void dust_check_args(int32 window, int32 threshold)
+{
+    if (window < 3 || window > DUST_MAX_WINDOW) {
+        ereport(ERROR, (errmsg("Invalid DUST window %d: must be between 3 and %d", window, DUST_MAX_WINDOW)));
+    }
+    if (threshold < 1) {
+        ereport(ERROR, (errmsg("Invalid DUST threshold %d: must be positive", threshold)));
+    }
+}
+
+/**
+ * Moves the oldest unsaved perfect interval to the masked regions once the window has moved past its start
+ */
+static void dust_save_regions(DustScan *scan, uint64_t window_start)
+{
+    DustInterval *p;
+    int i;
+
+    if (scan->num_perfect == 0 || scan->perfect[scan->num_perfect - 1].start >= window_start) {
+        return;
+    }
+    p = &scan->perfect[scan->num_perfect - 1];
+
+    if (scan->num_regions > 0 && p->start <= scan->regions[2 * scan->num_regions - 1]) {
+        uint64_t *end = &scan->regions[2 * scan->num_regions - 1];
+        *end = Max(*end, p->end);
+    }
+    else {
+        if (scan->num_regions == scan->max_regions) {
+            scan->max_regions *= 2;
+            scan->regions = (uint64_t *) repalloc(scan->regions, 2 * scan->max_regions * sizeof(uint64_t));
+        }
+        scan->regions[2 * scan->num_regions] = p->start;
+        scan->regions[2 * scan->num_regions + 1] = p->end;
+        scan->num_regions++;
+    }
+
+    for (i = scan->num_perfect - 1; i >= 0 && scan->perfect[i].start < window_start; i--);
+    scan->num_perfect = i + 1;
+}
+
+/**
+ * Slides the window one triplet to the right. The suffix is cut back whenever the new triplet
+ * becomes over-represented in it, that keeps the candidates find_perfect has to look at short
+ */
+static void dust_shift_window(DustScan *scan, int t)
+{
+    int s;
+
+    if (scan->size >= scan->max_triplets) {
+        s = DUST_TRIPLET_AT(scan->bits, scan->start);
+        scan->start++;
+        scan->size--;
+        scan->rw -= --scan->cw[s];
+        if (scan->suffix > scan->size) {
+            scan->suffix--;
+            scan->rv -= --scan->cv[s];
+        }
+    }
+
+    scan->size++;
+    scan->suffix++;
+    scan->rw += scan->cw[t]++;
+    scan->rv += scan->cv[t]++;
+    if (scan->cv[t] * 10 > 2 * scan->threshold) {
+        do {
+            s = DUST_TRIPLET_AT(scan->bits, scan->start + scan->size - scan->suffix);
+            scan->rv -= --scan->cv[s];
+            scan->suffix--;
+        } while (s != t);
+    }
+}
+
+/**
+ * Extends the suffix leftwards one triplet at a time and records every extension that is suspicious
+ * and scores at least as well as the best perfect interval starting to its right
+ */
+static void dust_find_perfect(DustScan *scan)
+{
+    int c[DUST_NUM_TRIPLETS];
+    int64 r = scan->rv;
+    int64 max_r = 0;
+    int64 max_l = 0;
+    int j = 0;               // Intervals before j start at or after start + i and are included in max_r / max_l
+
+    memcpy(c, scan->cv, sizeof(c));
+    for (int i = scan->size - scan->suffix - 1; i >= 0; i--) {
+        int t = DUST_TRIPLET_AT(scan->bits, scan->start + i);
+        int64 new_l = scan->size - i - 1;
+
+        r += c[t]++;
+        if (r * 10 <= (int64) scan->threshold * new_l) {
+            continue;
+        }
+
+        // The list is ordered by decreasing start and i only goes down, so the scan picks up where it left off
+        for (; j < scan->num_perfect && scan->perfect[j].start >= scan->start + i; j++) {
+            DustInterval *p = &scan->perfect[j];
+            if (max_r == 0 || p->r * max_l > max_r * p->l) {
+                max_r = p->r;
+                max_l = p->l;
+            }
+        }
+        if (max_r == 0 || r * max_l >= max_r * new_l) {
+            max_r = r;
+            max_l = new_l;
+            if (scan->num_perfect == scan->max_perfect) {
+                scan->max_perfect *= 2;
+                scan->perfect = (DustInterval *) repalloc(scan->perfect, scan->max_perfect * sizeof(DustInterval));
+            }
+            memmove(&scan->perfect[j + 1], &scan->perfect[j], (scan->num_perfect - j) * sizeof(DustInterval));
+            scan->num_perfect++;
+            scan->perfect[j].start = scan->start + i;
+            scan->perfect[j].end = scan->start + scan->size + 2;
+            scan->perfect[j].r = r;
+            scan->perfect[j].l = new_l;
+            j++;
+        }
+    }
+}
+
+/**
+ * Low complexity regions of the whole sequence, sorted and disjoint start, end pairs (end exclusive).
+ * Returns the number of regions
+ */
+static int dust_regions(const Dna *dna, int window, int threshold, uint64_t **regions)
+{
+    DustScan scan;
+    uint64_t window_start;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.bits = dna->bit_sequence;
+    scan.threshold = threshold;
+    scan.max_triplets = window - 2;
+    scan.max_perfect = 16;
+    scan.perfect = (DustInterval *) palloc(scan.max_perfect * sizeof(DustInterval));
+    scan.max_regions = 16;
+    scan.regions = (uint64_t *) palloc(2 * scan.max_regions * sizeof(uint64_t));
+
+    for (uint64_t pos = 0; pos + 3 <= dna->length; pos++) {
+        // The window always ends with the triplet at pos, once full it starts window - 1 bases back
+        window_start = pos + 3 > (uint64_t) window ? pos + 3 - window : 0;
+        dust_save_regions(&scan, window_start);
+        dust_shift_window(&scan, DUST_TRIPLET_AT(scan.bits, pos));
+        if (scan.rw * 10 > (int64) scan.suffix * threshold) {
+            dust_find_perfect(&scan);
+        }
+    }
+
+    window_start = (dna->length + 1 > (uint64_t) window ? dna->length + 1 - window : 0) + 1;
+    while (scan.num_perfect > 0) {
+        dust_save_regions(&scan, window_start++);
+    }
+
+    pfree(scan.perfect);
+    *regions = scan.regions;
+    return scan.num_regions;
+}
+
+/**
+ * dust_score(dna, window): the highest DUST score of any window of the sequence (the whole sequence if it's shorter)
+ */
+PG_FUNCTION_INFO_V1(dna_dust_score);
+Datum
+dna_dust_score(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    int32 window = PG_GETARG_INT32(1);
+    int counts[DUST_NUM_TRIPLETS] = {0};
+    int num_triplets = window - 2;
+    int64 r = 0;
+    int64 max_r = 0;
+    int64 l;
+
+    dust_check_args(window, 1);
+    if (dna->length < 4) {
+        PG_FREE_IF_COPY(dna, 0);
+        PG_RETURN_FLOAT8(0.0);
+    }
+
+    for (uint64_t pos = 0; pos + 3 <= dna->length; pos++) {
+        if (pos >= (uint64_t) num_triplets) {
+            r -= --counts[DUST_TRIPLET_AT(dna->bit_sequence, pos - num_triplets)];
+        }
+        r += counts[DUST_TRIPLET_AT(dna->bit_sequence, pos)]++;
+        max_r = Max(max_r, r);
+    }
+    l = Min((int64) num_triplets, (int64) dna->length - 2);
+
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_FLOAT8(10.0 * (double) max_r / (double) (l - 1));
+}
+
+typedef struct DustRegionState
+{
+    uint64_t *regions;
+    int num_regions;
+} DustRegionState;
+
+/**
+ * low_complexity_regions(dna, window, threshold): one (start, end) row per masked region, 0 based and end exclusive
+ */
+PG_FUNCTION_INFO_V1(dna_low_complexity_regions);
+Datum
+dna_low_complexity_regions(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    DustRegionState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        Dna *dna;
+
+        dust_check_args(PG_GETARG_INT32(1), PG_GETARG_INT32(2));
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        state = (DustRegionState *) palloc(sizeof(DustRegionState));
+        state->num_regions = dust_regions(dna, PG_GETARG_INT32(1), PG_GETARG_INT32(2), &state->regions);
+        funcctx->user_fctx = state;
+        funcctx->max_calls = state->num_regions;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (DustRegionState *) funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        values[0] = Int64GetDatum((int64) state->regions[2 * funcctx->call_cntr]);
+        values[1] = Int64GetDatum((int64) state->regions[2 * funcctx->call_cntr + 1]);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/**
+ * generate_kmers(dna, k, dust_window, dust_threshold): like generate_kmers(dna, k), but without the k-mers that
+ * overlap a low complexity region. K-mers are rolled 2 bits at a time and only re-read after a masked region
+ */
+PG_FUNCTION_INFO_V1(generate_kmers_unmasked);
+Datum
+generate_kmers_unmasked(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    struct {
+        Dna *dna;
+        int k;
+        uint64_t *regions;
+        int num_regions;
+        int region;          // First region that doesn't end before pos
+        uint64_t pos;        // Start of the next k-mer
+        uint64_t code;       // K-mer starting at pos - 1, if rolling
+        bool rolling;
+    } *state;
+    Kmer *kmer;
+    int k;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+
+        k = PG_GETARG_INT32(1);
+        if (k <= 0 || k > 32)
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and 32")));
+        dust_check_args(PG_GETARG_INT32(2), PG_GETARG_INT32(3));
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = palloc0(sizeof(*state));
+        state->dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        state->k = k;
+        state->num_regions = dust_regions(state->dna, PG_GETARG_INT32(2), PG_GETARG_INT32(3), &state->regions);
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = funcctx->user_fctx;
+    k = state->k;
+
+    while (state->pos + k <= state->dna->length)
+    {
+        uint64_t pos = state->pos;
+
+        while (state->region < state->num_regions && state->regions[2 * state->region + 1] <= pos) {
+            state->region++;
+        }
+        if (state->region < state->num_regions && pos + k > state->regions[2 * state->region]) {
+            // Overlaps the region, continue right after it
+            state->pos = state->regions[2 * state->region + 1];
+            state->rolling = false;
+            continue;
+        }
+
+        if (state->rolling) {
+            state->code = (state->code >> 2) | (DNA_BASE_AT(state->dna->bit_sequence, pos + k - 1) << (2 * (k - 1)));
+        }
+        else {
+            state->code = read_bases(state->dna->bit_sequence, pos, k);
+            state->rolling = true;
+        }
+        state->pos++;
+
+        kmer = (Kmer *) palloc0(sizeof(Kmer));
+        kmer->length = k;
+        kmer->bit_sequence = state->code;
+        SRF_RETURN_NEXT(funcctx, KmerPGetDatum(kmer));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/********************************************************************************************
+* FM-index functions
+********************************************************************************************/
+
+#define FM_MAX_SAMPLE_RATE 1024
+
+/*
+ * Suffix array construction by induced sorting (SA-IS, Nong, Zhang & Chan 2009), linear in the length of the text.
+ * text[n - 1] must be 0 and the only 0, the other characters are 1 .. k.
+ * The top level text is bytes (width 1), the recursion runs on int32 names kept in the upper part of sa
+ */
+#define SAIS_CHR(i) (width == 1 ? (int32) ((const uint8 *) text)[i] : ((const int32 *) text)[i])
+#define SAIS_IS_S(i) ((types[(i) / 8] >> ((i) % 8)) & 1)
+#define SAIS_IS_LMS(i) ((i) > 0 && SAIS_IS_S(i) && !SAIS_IS_S((i) - 1))
+
+static void sais_buckets(const void *text, int width, int32 n, int32 k, int32 *buckets, bool end)
+{
+    int32 sum = 0;
+
+    memset(buckets, 0, ((Size) k + 1) * sizeof(int32));
+    for (int32 i = 0; i < n; i++) {
+        buckets[SAIS_CHR(i)]++;
+    }
+    for (int32 c = 0; c <= k; c++) {
+        sum += buckets[c];
+        buckets[c] = end ? sum : sum - buckets[c];
+    }
+}
+
+/**
+ * Sorts all suffixes from the sorted LMS suffixes: L-type ones left to right into the bucket heads,
+ * then S-type ones right to left into the bucket tails
+ */
+static void sais_induce(const void *text, int width, const uint8 *types, int32 *sa, int32 n, int32 k, int32 *buckets)
+{
+    sais_buckets(text, width, n, k, buckets, false);
+    for (int32 i = 0; i < n; i++) {
+        int32 j = sa[i] - 1;
+        if (sa[i] > 0 && !SAIS_IS_S(j)) {
+            sa[buckets[SAIS_CHR(j)]++] = j;
+        }
+    }
+
+    sais_buckets(text, width, n, k, buckets, true);
+    for (int32 i = n - 1; i >= 0; i--) {
+        int32 j = sa[i] - 1;
+        if (sa[i] > 0 && SAIS_IS_S(j)) {
+            sa[--buckets[SAIS_CHR(j)]] = j;
+        }
+    }
+}
+
+static void sais(const void *text, int width, int32 *sa, int32 n, int32 k)
+{
+    uint8 *types = (uint8 *) palloc0((Size) n / 8 + 1);  // 1 for S-type (smaller than the suffix after it)
+    int32 *buckets = (int32 *) palloc(((Size) k + 1) * sizeof(int32));
+    int32 *sa1;
+    int32 *text1;
+    int32 n1 = 0;
+    int32 name = 0;
+    int32 prev = -1;
+    int32 i;
+    int32 j;
+
+    types[(n - 1) / 8] |= 1 << ((n - 1) % 8);
+    for (i = n - 2; i >= 0; i--) {
+        if (SAIS_CHR(i) < SAIS_CHR(i + 1) || (SAIS_CHR(i) == SAIS_CHR(i + 1) && SAIS_IS_S(i + 1))) {
+            types[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    // Stage 1: sort the LMS substrings by inducing from LMS positions dropped into their bucket tails
+    sais_buckets(text, width, n, k, buckets, true);
+    for (i = 0; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = 1; i < n; i++) {
+        if (SAIS_IS_LMS(i)) {
+            sa[--buckets[SAIS_CHR(i)]] = i;
+        }
+    }
+    sais_induce(text, width, types, sa, n, k, buckets);
+
+    // Name the sorted LMS substrings, equal substrings get the same name. No two LMS positions are adjacent,
+    // so pos / 2 is a unique slot for each of them in the upper half
+    for (i = 0; i < n; i++) {
+        if (SAIS_IS_LMS(sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (i = n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = 0; i < n1; i++) {
+        int32 pos = sa[i];
+        bool diff = false;
+
+        for (int32 d = 0; d < n; d++) {
+            if (prev == -1 || SAIS_CHR(pos + d) != SAIS_CHR(prev + d) || SAIS_IS_S(pos + d) != SAIS_IS_S(prev + d)) {
+                diff = true;
+                break;
+            }
+            if (d > 0 && (SAIS_IS_LMS(pos + d) || SAIS_IS_LMS(prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) {
+            sa[j--] = sa[i];
+        }
+    }
+
+    // Stage 2: sort the LMS suffixes, recursing on the reduced text if names aren't unique yet
+    sa1 = sa;
+    text1 = sa + n - n1;
+    if (name < n1) {
+        sais(text1, (int) sizeof(int32), sa1, n1, name - 1);
+    }
+    else {
+        for (i = 0; i < n1; i++) {
+            sa1[text1[i]] = i;
+        }
+    }
+
+    // Stage 3: induce the whole suffix array from the sorted LMS suffixes
+    sais_buckets(text, width, n, k, buckets, true);
+    for (i = 1, j = 0; i < n; i++) {
+        if (SAIS_IS_LMS(i)) {
+            text1[j++] = i;
+        }
+    }
+    for (i = 0; i < n1; i++) {
+        sa1[i] = text1[sa1[i]];
+    }
+    for (i = n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = n1 - 1; i >= 0; i--) {
+        j = sa[i];
+        sa[i] = -1;
+        sa[--buckets[SAIS_CHR(j)]] = j;
+    }
+    sais_induce(text, width, types, sa, n, k, buckets);
+
+    pfree(types);
+    pfree(buckets);
+}
+
+static FmIndex *fm_index_build(const Dna *dna, uint32 sample_rate)
+{
+    uint64_t length = dna->length;
+    uint64_t num_rows = length + 1;
+    uint64_t num_samples = length / sample_rate + 1;
+    Size size;
+    uint8 *text;
+    int32 *sa;
+    FmIndex *fm;
+    FmBlock *blocks;
+    uint64_t *marks;
+    uint32 *mark_ranks;
+    uint32 *samples;
+    uint32 counts[4] = {0, 0, 0, 0};
+    uint32 marked = 0;
+
+    if (length >= PG_INT32_MAX) {
+        ereport(ERROR, (errmsg("Sequence of %" PRIu64 " nucleotides is too long for an FM-index", length)));
+    }
+    size = FM_INDEX_SIZE(length, num_samples);
+    if (size > MaxAllocSize) {
+        ereport(ERROR, (errmsg("FM-index of %" PRIu64 " nucleotides with sample rate %u would take %zu bytes, the maximum is %zu",
+                               length, sample_rate, size, (Size) MaxAllocSize)));
+    }
+
+    // $ is 0, A, T, C and G are 1 to 4 so that the suffix order matches the 2 bit codes
+    text = (uint8 *) MemoryContextAllocHuge(CurrentMemoryContext, num_rows);
+    for (uint64_t i = 0; i < length; i++) {
+        text[i] = (uint8) DNA_BASE_AT(dna->bit_sequence, i) + 1;
+    }
+    text[length] = 0;
+    sa = (int32 *) MemoryContextAllocHuge(CurrentMemoryContext, num_rows * sizeof(int32));
+    sais(text, 1, sa, (int32) num_rows, 4);
+
+    fm = (FmIndex *) palloc0(size);
+    SET_VARSIZE(fm, size);
+    fm->sample_rate = sample_rate;
+    fm->length = length;
+    fm->num_samples = num_samples;
+    blocks = (FmBlock *) fm->data;
+    marks = (uint64_t *) (blocks + FM_NUM_BLOCKS(num_rows));
+    mark_ranks = (uint32 *) (marks + FM_NUM_MARK_WORDS(num_rows));
+    samples = mark_ranks + FM_NUM_MARK_WORDS(num_rows);
+
+    for (uint64_t row = 0; row < num_rows; row++) {
+        int32 pos = sa[row];
+        int c = 0;
+
+        if (row % FM_BLOCK_BASES == 0) {
+            memcpy(blocks[row / FM_BLOCK_BASES].counts, counts, sizeof(counts));
+            CHECK_FOR_INTERRUPTS();
+        }
+        if (row % 64 == 0) {
+            mark_ranks[row / 64] = marked;
+        }
+
+        if (pos == 0) {
+            fm->primary = row;  // $ stays an A in the block and isn't counted, fm_rank() corrects for it
+        }
+        else {
+            c = text[pos - 1] - 1;
+            counts[c]++;
+        }
+        blocks[row / FM_BLOCK_BASES].bits[(row % FM_BLOCK_BASES) / 32] |= (uint64_t) c << (2 * (row % 32));
+
+        if ((uint32) pos % sample_rate == 0) {
+            marks[row / 64] |= UINT64CONST(1) << (row % 64);
+            samples[marked++] = (uint32) pos;
+        }
+    }
+    // rank() of the row past the end reads the block (and mark word) after the last row
+    if (num_rows % FM_BLOCK_BASES == 0) {
+        memcpy(blocks[num_rows / FM_BLOCK_BASES].counts, counts, sizeof(counts));
+    }
+    if (num_rows % 64 == 0) {
+        mark_ranks[num_rows / 64] = marked;
+    }
+
+    fm->counts[0] = 1;
+    for (int c = 1; c < 4; c++) {
+        fm->counts[c] = fm->counts[c - 1] + counts[c - 1];
+    }
+
+    pfree(text);
+    pfree(sa);
+    return fm;
+}
+
+#define FM_BLOCK_BWT_AT(block, row) ((int) (((block)->bits[((row) % FM_BLOCK_BASES) / 32] >> (2 * ((row) % 32))) & 0x3))
+#define FM_BWT_AT(fm, row) FM_BLOCK_BWT_AT(&FM_BLOCKS(fm)[(row) / FM_BLOCK_BASES], row)
+
+/**
+ * Occurrences of nucleotide c in BWT rows 0 .. row - 1, from the block holding the row: the block's count plus
+ * popcounts of the 2 bit fields equal to c, at most 6 words all in the same cache line
+ */
+static inline uint64_t fm_block_rank(const FmBlock *block, uint64_t primary, int c, uint64_t row)
+{
+    uint64_t pattern = DNA_LOW_BITS * (uint64_t) c;  // c repeated 32 times
+    int offset = (int) (row % FM_BLOCK_BASES);
+    uint64_t rank = block->counts[c];
+    int w;
+
+    for (w = 0; w < offset / 32; w++) {
+        uint64_t same = ~(block->bits[w] ^ pattern);
+        rank += pg_popcount64(same & (same >> 1) & DNA_LOW_BITS);
+    }
+    if (offset % 32 != 0) {
+        uint64_t same = ~(block->bits[w] ^ pattern);
+        rank += pg_popcount64(same & (same >> 1) & DNA_LOW_BITS & ((UINT64CONST(1) << (2 * (offset % 32))) - 1));
+    }
+    if (c == 0 && primary < row && primary >= row - offset) {
+        rank--;  // One of the As popcounted was the $, the block counts never include it
+    }
+    return rank;
+}
+
+static inline uint64_t fm_rank(const FmIndex *fm, int c, uint64_t row)
+{
+    return fm_block_rank(&FM_BLOCKS(fm)[row / FM_BLOCK_BASES], fm->primary, c, row);
+}
+
+/**
+ * Backward search: the rows [lo, hi) whose suffixes start with the pattern, one pair of ranks per nucleotide
+ */
+static uint64_t fm_search(const FmIndex *fm, const Dna *pattern, uint64_t *lo, uint64_t *hi)
+{
+    *lo = 0;
+    *hi = FM_NUM_ROWS(fm);
+    for (uint64_t i = pattern->length; i > 0 && *lo < *hi; i--) {
+        int c = (int) DNA_BASE_AT(pattern->bit_sequence, i - 1);
+        *lo = fm->counts[c] + fm_rank(fm, c, *lo);
+        *hi = fm->counts[c] + fm_rank(fm, c, *hi);
+    }
+    return *lo < *hi ? *hi - *lo : 0;
+}
+
+/**
+ * Position in the sequence of the suffix in a row: walk LF until a sampled row, fewer than sample_rate steps
+ */
+static uint64_t fm_locate_row(const FmIndex *fm, uint64_t row)
+{
+    const uint64_t *marks = FM_MARKS(fm);
+    uint64_t steps = 0;
+
+    while (((marks[row / 64] >> (row % 64)) & 1) == 0) {
+        int c = FM_BWT_AT(fm, row);
+        row = fm->counts[c] + fm_rank(fm, c, row);
+        steps++;
+    }
+    return FM_SAMPLES(fm)[FM_MARK_RANKS(fm)[row / 64] + pg_popcount64(marks[row / 64] & ((UINT64CONST(1) << (row % 64)) - 1))] + steps;
+}
+
+typedef struct FmIndexCache
+{
+    Oid toastrelid;
+    Oid valueid;
+    FmIndex *fm;
+} FmIndexCache;
+
+/**
+ * The index argument, detoasted. fm_count() and fm_locate() are typically called once per pattern with the same
+ * index, so an index stored out of line is detoasted once per query and kept in fn_extra, keyed by its TOAST pointer
+ */
+static FmIndex *fm_index_arg(FunctionCallInfo fcinfo, int argno)
+{
+    struct varlena *raw = (struct varlena *) DatumGetPointer(PG_GETARG_DATUM(argno));
+    FmIndexCache *cache = (FmIndexCache *) fcinfo->flinfo->fn_extra;
+    struct varatt_external toast_pointer;
+    MemoryContext oldcontext;
+
+    if (!VARATT_IS_EXTERNAL_ONDISK(raw)) {
+        return (FmIndex *) PG_DETOAST_DATUM(PG_GETARG_DATUM(argno));
+    }
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, raw);
+
+    if (cache == NULL) {
+        cache = (FmIndexCache *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(FmIndexCache));
+        fcinfo->flinfo->fn_extra = cache;
+    }
+    else if (cache->fm != NULL && cache->toastrelid == toast_pointer.va_toastrelid && cache->valueid == toast_pointer.va_valueid) {
+        return cache->fm;
+    }
+
+    if (cache->fm != NULL) {
+        pfree(cache->fm);
+    }
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    cache->fm = (FmIndex *) PG_DETOAST_DATUM(PG_GETARG_DATUM(argno));
+    MemoryContextSwitchTo(oldcontext);
+    cache->toastrelid = toast_pointer.va_toastrelid;
+    cache->valueid = toast_pointer.va_valueid;
+    return cache->fm;
+}
+
+/*
+ * There is no text form to type in, an fm_index is always built from a sequence with dna_fmindex(dna)
+ */
+PG_FUNCTION_INFO_V1(fm_index_in);
+Datum
+fm_index_in(PG_FUNCTION_ARGS)
+{
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("Cannot accept a value of type fm_index, build it with dna_fmindex(dna)")));
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(fm_index_out);
+Datum
+fm_index_out(PG_FUNCTION_ARGS)
+{
+    // Only the header is needed
+    FmIndex *fm = (FmIndex *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0, offsetof(FmIndex, data));
+    PG_RETURN_CSTRING(psprintf("fm_index(length=%" PRIu64 ", sample_rate=%u)", fm->length, fm->sample_rate));
+}
+
+PG_FUNCTION_INFO_V1(dna_fmindex);
+Datum
+dna_fmindex(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    int32 sample_rate = PG_GETARG_INT32(1);
+    FmIndex *fm;
+
+    if (sample_rate < 1 || sample_rate > FM_MAX_SAMPLE_RATE) {
+        ereport(ERROR, (errmsg("Invalid sample rate %d: must be between 1 and %d", sample_rate, FM_MAX_SAMPLE_RATE)));
+    }
+    fm = fm_index_build(dna, (uint32) sample_rate);
+
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_POINTER(fm);
+}
+
+/**
+ * fm_count(fm_index, dna): number of (possibly overlapping) occurrences of the pattern, O(pattern length)
+ */
+PG_FUNCTION_INFO_V1(fm_count);
+Datum
+fm_count(PG_FUNCTION_ARGS)
+{
+    FmIndex *fm = fm_index_arg(fcinfo, 0);
+    Dna *pattern = (Dna *) PG_GETARG_VARLENA_P(1);
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t count = fm_search(fm, pattern, &lo, &hi);
+
+    PG_FREE_IF_COPY(pattern, 1);
+    PG_RETURN_INT64((int64) count);
+}
+
+static int fm_position_cmp(const void *a, const void *b)
+{
+    int64 x = DatumGetInt64(*(const Datum *) a);
+    int64 y = DatumGetInt64(*(const Datum *) b);
+    return (x > y) - (x < y);
+}
+
+/**
+ * fm_locate(fm_index, dna): 0-based start positions of every occurrence of the pattern, in ascending order.
+ * O(pattern length + occurrences * sample rate)
+ */
+PG_FUNCTION_INFO_V1(fm_locate);
+Datum
+fm_locate(PG_FUNCTION_ARGS)
+{
+    FmIndex *fm = fm_index_arg(fcinfo, 0);
+    Dna *pattern = (Dna *) PG_GETARG_VARLENA_P(1);
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t count = fm_search(fm, pattern, &lo, &hi);
+    Datum *positions;
+    ArrayType *result;
+
+    if (count == 0) {
+        PG_FREE_IF_COPY(pattern, 1);
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT8OID));
+    }
+    if (count > MaxAllocSize / sizeof(Datum)) {
+        ereport(ERROR, (errmsg("Too many occurrences to return: %" PRIu64, count)));
+    }
+
+    positions = (Datum *) palloc(count * sizeof(Datum));
+    for (uint64_t row = lo; row < hi; row++) {
+        positions[row - lo] = Int64GetDatum((int64) fm_locate_row(fm, row));
+    }
+    qsort(positions, count, sizeof(Datum), fm_position_cmp);
+    result = construct_array_builtin(positions, (int) count, INT8OID);
+
+    PG_FREE_IF_COPY(pattern, 1);
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/********************************************************************************************
+* Substring search functions
+*
+* dna @> dna is an exact substring test on the packed bits. The dna_fm index access method answers it for a whole
+* column with FM-indexes of the concatenated sequences: rows are appended to a partition until it holds
+* maintenance_work_mem / 8 nucleotides, then the partition's FM-index (fm_index_build()) is written across index
+* pages, followed by the start of every row in the concatenation and its TID. A query runs the backward search in
+* each partition and locates every occurrence, keeping the rows it lies within, so the index answers exactly and
+* occurrences spanning two rows are dropped.
+*
+* The FM-indexes are built once by CREATE INDEX. Rows inserted later (and rows too long for a partition) go to
+* a pending list of TIDs that every query returns to be rechecked, until REINDEX folds them in.
+********************************************************************************************/
+
+/**
+ * Whether len nucleotides of a starting at a_pos equal those of b starting at b_pos, 32 at a time
+ */
+static bool dna_range_equals(const uint64_t *a, uint64_t a_pos, const uint64_t *b, uint64_t b_pos, uint64_t len)
+{
+    for (; len >= 32; len -= 32, a_pos += 32, b_pos += 32) {
+        if (read_bases(a, a_pos, 32) != read_bases(b, b_pos, 32)) {
+            return false;
+        }
+    }
+    return len == 0 || read_bases(a, a_pos, (int) len) == read_bases(b, b_pos, (int) len);
+}
+
+/**
+ * Exact substring test: the first (up to) 32 nucleotides of the needle are compared as one integer against a
+ * window rolled 2 bits at a time over the haystack, the rest only when those match
+ */
+static bool dna_contains_internal(const Dna *haystack, const Dna *needle)
+{
+    uint64_t n = haystack->length;
+    uint64_t m = needle->length;
+    int head = (int) Min(m, (uint64_t) 32);
+    int shift = 2 * (head - 1);
+    uint64_t head_code;
+    uint64_t code;
+
+    if (m > n) {
+        return false;
+    }
+    head_code = read_bases(needle->bit_sequence, 0, head);
+    code = read_bases(haystack->bit_sequence, 0, head);
+
+    for (uint64_t pos = 0;; pos++) {
+        if (code == head_code &&
+            (m <= 32 || dna_range_equals(haystack->bit_sequence, pos + 32, needle->bit_sequence, 32, m - 32))) {
+            return true;
+        }
+        if (pos + m >= n) {
+            return false;
+        }
+        code = (code >> 2) | (DNA_BASE_AT(haystack->bit_sequence, pos + head) << shift);
+    }
+}
+
+PG_FUNCTION_INFO_V1(dna_contains);
+Datum
+dna_contains(PG_FUNCTION_ARGS)
+{
+    Dna *haystack = (Dna *) PG_GETARG_VARLENA_P(0);
+    Dna *needle = (Dna *) PG_GETARG_VARLENA_P(1);
+    bool result = dna_contains_internal(haystack, needle);
+
+    PG_FREE_IF_COPY(haystack, 0);
+    PG_FREE_IF_COPY(needle, 1);
+    PG_RETURN_BOOL(result);
+}
+
+#define DNA_FM_MAGIC 0x444E4146             // "DNAF"
+#define DNA_FM_METAPAGE 0
+#define DNA_FM_SAMPLE_RATE 32
+#define DNA_FM_MAX_PARTITION (UINT64CONST(1) << 30)  // Keeps the FM-index of a partition under MaxAllocSize
+#define DNA_FM_STRATEGY_CONTAINS 1
+
+typedef struct DnaFmPageOpaque
+{
+    BlockNumber next;       // Next page of the pending list
+    uint32 count;           // TIDs on a pending list page
+} DnaFmPageOpaque;
+
+#define DNA_FM_PAGE_CAPACITY (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(DnaFmPageOpaque)))
+#define DnaFmPageGetOpaque(page) ((DnaFmPageOpaque *) PageGetSpecialPointer(page))
+
+/*
+ * Block 0. Everything else is runs of consecutive pages written by dna_fm_write_items()
+ */
+typedef struct DnaFmMeta
+{
+    uint32 magic;
+    uint32 num_partitions;
+    BlockNumber directory;      // First page of the DnaFmPartition array
+    BlockNumber pending_head;   // InvalidBlockNumber when no TID is pending
+    BlockNumber pending_tail;
+    uint64_t num_pending;
+    uint64_t length;            // Nucleotides in all partitions
+} DnaFmMeta;
+
+typedef struct DnaFmPartition
+{
+    BlockNumber fm_start;       // First page of the FmIndex bytes
+    BlockNumber rows_start;     // First page of the DnaFmRow array
+    uint32 num_rows;
+} DnaFmPartition;
+
+typedef struct DnaFmRow
+{
+    uint32 start;               // Offset of the row in the partition's concatenated sequence
+    ItemPointerData tid;        // Invalid once VACUUM has removed the row
+} DnaFmRow;
+
+static void dna_fm_init_page(Page page)
+{
+    PageInit(page, BLCKSZ, sizeof(DnaFmPageOpaque));
+    DnaFmPageGetOpaque(page)->next = InvalidBlockNumber;
+    DnaFmPageGetOpaque(page)->count = 0;
+}
+
+/**
+ * pd_lower marks the end of the contents, so that full page images leave out the rest of the page
+ */
+static void dna_fm_set_contents_size(Page page, Size size)
+{
+    ((PageHeader) page)->pd_lower = (LocationIndex) (PageGetContents(page) + size - (char *) page);
+}
+
+/**
+ * Writes num_items items of item_size bytes to new pages at the end of the index, as many whole items per page
+ * as fit, and returns the first page (InvalidBlockNumber for no items). Byte arrays (item_size 1) fill the
+ * pages completely. Only used while building, the pages get WAL-logged at the end of dna_fm_build()
+ */
+static BlockNumber dna_fm_write_items(Relation index, const void *items, uint64_t num_items, Size item_size)
+{
+    uint64_t per_page = DNA_FM_PAGE_CAPACITY / item_size;
+    BlockNumber first = InvalidBlockNumber;
+
+    for (uint64_t i = 0; i < num_items; i += per_page) {
+        Buffer buffer = ExtendBufferedRel(BMR_REL(index), MAIN_FORKNUM, NULL, EB_LOCK_FIRST);
+        Page page = BufferGetPage(buffer);
+        Size size = Min(per_page, num_items - i) * item_size;
+
+        if (first == InvalidBlockNumber) {
+            first = BufferGetBlockNumber(buffer);
+        }
+        dna_fm_init_page(page);
+        memcpy(PageGetContents(page), (const char *) items + i * item_size, size);
+        dna_fm_set_contents_size(page, size);
+        MarkBufferDirty(buffer);
+        UnlockReleaseBuffer(buffer);
+        CHECK_FOR_INTERRUPTS();
+    }
+    return first;
+}
+
+/*
+ * Reads items back from the page runs, keeping the last page pinned for the next read
+ */
+typedef struct DnaFmReader
+{
+    Relation index;
+    Buffer buffer;
+} DnaFmReader;
+
+static void dna_fm_read_items(DnaFmReader *reader, BlockNumber start, uint64_t i, Size item_size, uint64_t count,
+                              void *items)
+{
+    uint64_t per_page = DNA_FM_PAGE_CAPACITY / item_size;
+    char *out = (char *) items;
+
+    while (count > 0) {
+        BlockNumber block = start + (BlockNumber) (i / per_page);
+        uint64_t n = Min(count, per_page - i % per_page);
+
+        if (!BufferIsValid(reader->buffer) || BufferGetBlockNumber(reader->buffer) != block) {
+            if (BufferIsValid(reader->buffer)) {
+                ReleaseBuffer(reader->buffer);
+            }
+            reader->buffer = ReadBuffer(reader->index, block);
+        }
+        LockBuffer(reader->buffer, BUFFER_LOCK_SHARE);
+        memcpy(out, PageGetContents(BufferGetPage(reader->buffer)) + (i % per_page) * item_size, n * item_size);
+        LockBuffer(reader->buffer, BUFFER_LOCK_UNLOCK);
+
+        out += n * item_size;
+        i += n;
+        count -= n;
+    }
+}
+
+static void dna_fm_reader_release(DnaFmReader *reader)
+{
+    if (BufferIsValid(reader->buffer)) {
+        ReleaseBuffer(reader->buffer);
+        reader->buffer = InvalidBuffer;
+    }
+}
+
+static void dna_fm_read_meta(Relation index, DnaFmMeta *meta)
+{
+    Buffer buffer = ReadBuffer(index, DNA_FM_METAPAGE);
+
+    LockBuffer(buffer, BUFFER_LOCK_SHARE);
+    memcpy(meta, PageGetContents(BufferGetPage(buffer)), sizeof(DnaFmMeta));
+    UnlockReleaseBuffer(buffer);
+
+    if (meta->magic != DNA_FM_MAGIC) {
+        ereport(ERROR, (errcode(ERRCODE_INDEX_CORRUPTED),
+                        errmsg("Index \"%s\" is not a dna_fm index", RelationGetRelationName(index))));
+    }
+}
+
+/**
+ * Appends a TID to the pending list, under the metapage lock: a page of TIDs at a time, chained from the metapage
+ */
+static void dna_fm_add_pending(Relation index, ItemPointer tid)
+{
+    const uint32 per_page = DNA_FM_PAGE_CAPACITY / sizeof(ItemPointerData);
+    Buffer metabuffer = ReadBuffer(index, DNA_FM_METAPAGE);
+    Buffer tailbuffer = InvalidBuffer;
+    Buffer newbuffer = InvalidBuffer;
+    GenericXLogState *state;
+    DnaFmMeta *meta;
+    Page tail = NULL;
+    DnaFmPageOpaque *opaque;
+
+    LockBuffer(metabuffer, BUFFER_LOCK_EXCLUSIVE);
+    state = GenericXLogStart(index);
+    meta = (DnaFmMeta *) PageGetContents(GenericXLogRegisterBuffer(state, metabuffer, 0));
+
+    if (meta->pending_tail != InvalidBlockNumber) {
+        tailbuffer = ReadBuffer(index, meta->pending_tail);
+        LockBuffer(tailbuffer, BUFFER_LOCK_EXCLUSIVE);
+        tail = GenericXLogRegisterBuffer(state, tailbuffer, 0);
+    }
+    if (tail == NULL || DnaFmPageGetOpaque(tail)->count == per_page) {
+        BlockNumber block;
+
+        newbuffer = ExtendBufferedRel(BMR_REL(index), MAIN_FORKNUM, NULL, EB_LOCK_FIRST);
+        block = BufferGetBlockNumber(newbuffer);
+        if (tail != NULL) {
+            DnaFmPageGetOpaque(tail)->next = block;
+        }
+        else {
+            meta->pending_head = block;
+        }
+        meta->pending_tail = block;
+        tail = GenericXLogRegisterBuffer(state, newbuffer, GENERIC_XLOG_FULL_IMAGE);
+        dna_fm_init_page(tail);
+    }
+
+    opaque = DnaFmPageGetOpaque(tail);
+    ((ItemPointerData *) PageGetContents(tail))[opaque->count++] = *tid;
+    dna_fm_set_contents_size(tail, opaque->count * sizeof(ItemPointerData));
+    meta->num_pending++;
+    GenericXLogFinish(state);
+
+    if (BufferIsValid(newbuffer)) {
+        UnlockReleaseBuffer(newbuffer);
+    }
+    if (BufferIsValid(tailbuffer)) {
+        UnlockReleaseBuffer(tailbuffer);
+    }
+    UnlockReleaseBuffer(metabuffer);
+}
+
+typedef struct DnaFmBuildState
+{
+    Relation index;
+    MemoryContext tmp_context;          // Reset after each row
+    MemoryContext partition_context;    // Reset after each partition
+    uint64_t capacity;                  // Nucleotides per partition
+    Dna *sequence;                      // The partition so far, room for capacity nucleotides
+    DnaFmRow *rows;
+    uint64_t num_rows;
+    uint64_t max_rows;
+    DnaFmPartition *partitions;
+    uint32 num_partitions;
+    uint32 max_partitions;
+    ItemPointerData *pending;           // Rows longer than a partition
+    uint64_t num_pending;
+    uint64_t max_pending;
+    uint64_t length;                    // Nucleotides in all partitions
+    double index_tuples;
+} DnaFmBuildState;
+
+static void dna_fm_flush_partition(DnaFmBuildState *state)
+{
+    MemoryContext oldcontext;
+    DnaFmPartition *partition;
+    FmIndex *fm;
+
+    if (state->num_rows == 0) {
+        return;
+    }
+    if (state->num_partitions == state->max_partitions) {
+        state->max_partitions *= 2;
+        state->partitions = (DnaFmPartition *) repalloc(state->partitions, state->max_partitions * sizeof(DnaFmPartition));
+    }
+
+    oldcontext = MemoryContextSwitchTo(state->partition_context);
+    fm = fm_index_build(state->sequence, DNA_FM_SAMPLE_RATE);
+    partition = &state->partitions[state->num_partitions++];
+    partition->fm_start = dna_fm_write_items(state->index, fm, VARSIZE(fm), 1);
+    partition->rows_start = dna_fm_write_items(state->index, state->rows, state->num_rows, sizeof(DnaFmRow));
+    partition->num_rows = (uint32) state->num_rows;
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(state->partition_context);
+
+    // copy_bases() needs the padding past the sequence to be zero
+    memset(state->sequence->bit_sequence, 0, DNA_NUM_WORDS(state->sequence->length) * sizeof(uint64_t));
+    state->length += state->sequence->length;
+    state->sequence->length = 0;
+    state->num_rows = 0;
+}
+
+static void dna_fm_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive,
+                                  void *arg)
+{
+    DnaFmBuildState *state = (DnaFmBuildState *) arg;
+    MemoryContext oldcontext;
+    Dna *dna;
+
+    if (isnull[0]) {
+        return;
+    }
+    oldcontext = MemoryContextSwitchTo(state->tmp_context);
+    dna = (Dna *) PG_DETOAST_DATUM(values[0]);
+
+    if (dna->length > state->capacity) {
+        if (state->num_pending == state->max_pending) {
+            state->max_pending *= 2;
+            state->pending = (ItemPointerData *) repalloc(state->pending, state->max_pending * sizeof(ItemPointerData));
+        }
+        state->pending[state->num_pending++] = *tid;
+    }
+    else {
+        if (state->sequence->length + dna->length > state->capacity) {
+            dna_fm_flush_partition(state);
+        }
+        if (state->num_rows == state->max_rows) {
+            state->max_rows *= 2;
+            state->rows = (DnaFmRow *) repalloc_huge(state->rows, state->max_rows * sizeof(DnaFmRow));
+        }
+        state->rows[state->num_rows].start = (uint32) state->sequence->length;
+        state->rows[state->num_rows].tid = *tid;
+        state->num_rows++;
+        copy_bases(state->sequence->bit_sequence, state->sequence->length, dna->bit_sequence, 0, dna->length);
+        state->sequence->length += dna->length;
+    }
+    state->index_tuples += 1;
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(state->tmp_context);
+}
+
+static IndexBuildResult *dna_fm_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+    IndexBuildResult *result;
+    DnaFmBuildState state;
+    DnaFmMeta *meta;
+    Buffer metabuffer;
+    double heap_tuples;
+
+    if (RelationGetNumberOfBlocks(index) != 0) {
+        elog(ERROR, "index \"%s\" already contains data", RelationGetRelationName(index));
+    }
+    metabuffer = ExtendBufferedRel(BMR_REL(index), MAIN_FORKNUM, NULL, EB_LOCK_FIRST);
+    Assert(BufferGetBlockNumber(metabuffer) == DNA_FM_METAPAGE);
+    dna_fm_init_page(BufferGetPage(metabuffer));
+    MarkBufferDirty(metabuffer);
+    UnlockReleaseBuffer(metabuffer);
+
+    memset(&state, 0, sizeof(state));
+    state.index = index;
+    state.tmp_context = AllocSetContextCreate(CurrentMemoryContext, "dna_fm build row context", ALLOCSET_DEFAULT_SIZES);
+    state.partition_context = AllocSetContextCreate(CurrentMemoryContext, "dna_fm build partition context",
+                                                    ALLOCSET_DEFAULT_SIZES);
+    // fm_index_build() takes about 6 bytes per nucleotide: the text, its suffix array and the FM-index itself
+    state.capacity = Min((uint64_t) maintenance_work_mem * 1024 / 8, DNA_FM_MAX_PARTITION);
+    state.sequence = (Dna *) MemoryContextAllocHuge(CurrentMemoryContext,
+                                                    offsetof(Dna, bit_sequence) + DNA_NUM_WORDS(state.capacity) * sizeof(uint64_t));
+    memset(state.sequence->bit_sequence, 0, DNA_NUM_WORDS(state.capacity) * sizeof(uint64_t));
+    state.sequence->length = 0;
+    state.max_rows = 1024;
+    state.rows = (DnaFmRow *) palloc(state.max_rows * sizeof(DnaFmRow));
+    state.max_partitions = 16;
+    state.partitions = (DnaFmPartition *) palloc(state.max_partitions * sizeof(DnaFmPartition));
+    state.max_pending = 16;
+    state.pending = (ItemPointerData *) palloc(state.max_pending * sizeof(ItemPointerData));
+
+    heap_tuples = table_index_build_scan(heap, index, indexInfo, true, true, dna_fm_build_callback, &state, NULL);
+    dna_fm_flush_partition(&state);
+
+    metabuffer = ReadBuffer(index, DNA_FM_METAPAGE);
+    LockBuffer(metabuffer, BUFFER_LOCK_EXCLUSIVE);
+    meta = (DnaFmMeta *) PageGetContents(BufferGetPage(metabuffer));
+    meta->magic = DNA_FM_MAGIC;
+    meta->num_partitions = state.num_partitions;
+    meta->directory = dna_fm_write_items(index, state.partitions, state.num_partitions, sizeof(DnaFmPartition));
+    meta->pending_head = InvalidBlockNumber;
+    meta->pending_tail = InvalidBlockNumber;
+    meta->num_pending = 0;
+    meta->length = state.length;
+    dna_fm_set_contents_size(BufferGetPage(metabuffer), sizeof(DnaFmMeta));
+    MarkBufferDirty(metabuffer);
+    UnlockReleaseBuffer(metabuffer);
+
+    if (RelationNeedsWAL(index)) {
+        log_newpage_range(index, MAIN_FORKNUM, 0, RelationGetNumberOfBlocks(index), true);
+    }
+    for (uint64_t i = 0; i < state.num_pending; i++) {
+        dna_fm_add_pending(index, &state.pending[i]);
+    }
+
+    MemoryContextDelete(state.tmp_context);
+    MemoryContextDelete(state.partition_context);
+    pfree(state.sequence);
+    pfree(state.rows);
+    pfree(state.partitions);
+    pfree(state.pending);
+
+    result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+    result->heap_tuples = heap_tuples;
+    result->index_tuples = state.index_tuples;
+    return result;
+}
+
+static void dna_fm_buildempty(Relation index)
+{
+    Buffer metabuffer = ExtendBufferedRel(BMR_REL(index), INIT_FORKNUM, NULL, EB_SKIP_EXTENSION_LOCK | EB_LOCK_FIRST);
+    Page page = BufferGetPage(metabuffer);
+    DnaFmMeta *meta;
+
+    START_CRIT_SECTION();
+    dna_fm_init_page(page);
+    meta = (DnaFmMeta *) PageGetContents(page);
+    memset(meta, 0, sizeof(DnaFmMeta));
+    meta->magic = DNA_FM_MAGIC;
+    meta->directory = InvalidBlockNumber;
+    meta->pending_head = InvalidBlockNumber;
+    meta->pending_tail = InvalidBlockNumber;
+    dna_fm_set_contents_size(page, sizeof(DnaFmMeta));
+    MarkBufferDirty(metabuffer);
+    log_newpage_buffer(metabuffer, true);
+    END_CRIT_SECTION();
+    UnlockReleaseBuffer(metabuffer);
+}
+
+static bool dna_fm_insert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid, Relation heapRel,
+                          IndexUniqueCheck checkUnique, bool indexUnchanged, IndexInfo *indexInfo)
+{
+    if (!isnull[0]) {
+        dna_fm_add_pending(index, ht_ctid);
+    }
+    return false;
+}
+
+/**
+ * Marks the rows and pending TIDs the callback says are dead as invalid (or only counts the live ones without
+ * a callback), a page at a time
+ */
+static void dna_fm_vacuum_scan(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback,
+                               void *callback_state)
+{
+    const uint32 rows_per_page = DNA_FM_PAGE_CAPACITY / sizeof(DnaFmRow);
+    Relation index = info->index;
+    DnaFmReader reader = {index, InvalidBuffer};
+    DnaFmMeta meta;
+    BlockNumber block;
+
+    dna_fm_read_meta(index, &meta);
+
+    for (uint32 p = 0; p < meta.num_partitions; p++) {
+        DnaFmPartition partition;
+
+        dna_fm_read_items(&reader, meta.directory, p, sizeof(DnaFmPartition), 1, &partition);
+        for (uint32 first = 0; first < partition.num_rows; first += rows_per_page) {
+            Buffer buffer = ReadBufferExtended(index, MAIN_FORKNUM, partition.rows_start + first / rows_per_page,
+                                               RBM_NORMAL, info->strategy);
+            GenericXLogState *state;
+            DnaFmRow *rows;
+            bool modified = false;
+
+            vacuum_delay_point();
+            LockBuffer(buffer, callback != NULL ? BUFFER_LOCK_EXCLUSIVE : BUFFER_LOCK_SHARE);
+            state = GenericXLogStart(index);
+            rows = (DnaFmRow *) PageGetContents(GenericXLogRegisterBuffer(state, buffer, 0));
+            for (uint32 i = 0; i < Min(rows_per_page, partition.num_rows - first); i++) {
+                if (!ItemPointerIsValid(&rows[i].tid)) {
+                    continue;
+                }
+                if (callback != NULL && callback(&rows[i].tid, callback_state)) {
+                    ItemPointerSetInvalid(&rows[i].tid);
+                    stats->tuples_removed += 1;
+                    modified = true;
+                }
+                else {
+                    stats->num_index_tuples += 1;
+                }
+            }
+            if (modified) {
+                GenericXLogFinish(state);
+            }
+            else {
+                GenericXLogAbort(state);
+            }
+            UnlockReleaseBuffer(buffer);
+        }
+    }
+    dna_fm_reader_release(&reader);
+
+    for (block = meta.pending_head; block != InvalidBlockNumber;) {
+        Buffer buffer = ReadBufferExtended(index, MAIN_FORKNUM, block, RBM_NORMAL, info->strategy);
+        GenericXLogState *state;
+        Page page;
+        ItemPointerData *tids;
+        bool modified = false;
+
+        vacuum_delay_point();
+        LockBuffer(buffer, callback != NULL ? BUFFER_LOCK_EXCLUSIVE : BUFFER_LOCK_SHARE);
+        state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buffer, 0);
+        tids = (ItemPointerData *) PageGetContents(page);
+        for (uint32 i = 0; i < DnaFmPageGetOpaque(page)->count; i++) {
+            if (!ItemPointerIsValid(&tids[i])) {
+                continue;
+            }
+            if (callback != NULL && callback(&tids[i], callback_state)) {
+                ItemPointerSetInvalid(&tids[i]);
+                stats->tuples_removed += 1;
+                modified = true;
+            }
+            else {
+                stats->num_index_tuples += 1;
+            }
+        }
+        block = DnaFmPageGetOpaque(page)->next;
+        if (modified) {
+            GenericXLogFinish(state);
+        }
+        else {
+            GenericXLogAbort(state);
+        }
+        UnlockReleaseBuffer(buffer);
+    }
+}
+
+static IndexBulkDeleteResult *dna_fm_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+                                                IndexBulkDeleteCallback callback, void *callback_state)
+{
+    if (stats == NULL) {
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+    }
+    stats->num_index_tuples = 0;
+    dna_fm_vacuum_scan(info, stats, callback, callback_state);
+    return stats;
+}
+
+static IndexBulkDeleteResult *dna_fm_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+    if (info->analyze_only) {
+        return stats;
+    }
+    if (stats == NULL) {
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+        dna_fm_vacuum_scan(info, stats, NULL, NULL);
+    }
+    stats->num_pages = RelationGetNumberOfBlocks(info->index);
+    return stats;
+}
+
+/**
+ * A lookup costs two rank() page reads per nucleotide of the pattern in every partition, then up to sample_rate
+ * more (a mark word and a block per step) and a binary search of the rows for each occurrence. A pattern of m
+ * nucleotides is taken to occur once plus once every 4^m nucleotides by chance, and one only known at run time
+ * to be 32 nucleotides long: the contsel() selectivity has no idea of the pattern, and short patterns that occur
+ * all over a large index should lose to a sequential scan
+ */
+static void dna_fm_costestimate(PlannerInfo *root, IndexPath *path, double loop_count, Cost *indexStartupCost,
+                                Cost *indexTotalCost, Selectivity *indexSelectivity, double *indexCorrelation,
+                                double *indexPages)
+{
+    IndexOptInfo *index = path->indexinfo;
+    GenericCosts costs;
+    DnaFmMeta meta;
+    ListCell *lc;
+    double pattern_length = 0;
+    bool known_length = true;
+    double occurrences;
+    double reads;
+
+    memset(&costs, 0, sizeof(costs));
+    genericcostestimate(root, path, loop_count, &costs);
+
+    memset(&meta, 0, sizeof(meta));
+    if (!index->hypothetical) {
+        Relation rel = index_open(index->indexoid, AccessShareLock);
+        dna_fm_read_meta(rel, &meta);
+        index_close(rel, AccessShareLock);
+    }
+    else {
+        meta.num_partitions = 1;
+        meta.length = (uint64_t) (index->pages * DNA_FM_PAGE_CAPACITY);
+    }
+
+    foreach(lc, path->indexclauses) {
+        IndexClause *iclause = lfirst_node(IndexClause, lc);
+        ListCell *lc2;
+
+        foreach(lc2, iclause->indexquals) {
+            RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc2);
+            Node *pattern = estimate_expression_value(root, get_rightop(rinfo->clause));
+
+            if (IsA(pattern, Const) && !((Const *) pattern)->constisnull) {
+                Dna *dna = (Dna *) PG_DETOAST_DATUM_SLICE(((Const *) pattern)->constvalue, 0, offsetof(Dna, bit_sequence));
+                pattern_length = Max(pattern_length, (double) dna->length);
+            }
+            else {
+                pattern_length = Max(pattern_length, 32.0);
+                known_length = false;
+            }
+        }
+    }
+
+    occurrences = 1 + (double) meta.length / pow(4.0, pattern_length);
+    reads = meta.num_partitions * 2 * pattern_length
+        + occurrences * (DNA_FM_SAMPLE_RATE + log2(Max(index->tuples / Max(meta.num_partitions, 1), 2.0)));
+
+    *indexPages = Min(reads, Max(index->pages, 1));
+    *indexStartupCost = *indexPages * random_page_cost + reads * cpu_operator_cost
+        + meta.num_pending * cpu_index_tuple_cost;
+    *indexTotalCost = *indexStartupCost + occurrences * cpu_index_tuple_cost;
+    *indexSelectivity = known_length ? Min(occurrences / Max(index->tuples, 1), 1.0) : costs.indexSelectivity;
+    *indexCorrelation = 0;
+}
+
+/**
+ * No storage parameters
+ */
+static bytea *dna_fm_options(Datum reloptions, bool validate)
+{
+    if (validate && DatumGetPointer(reloptions) != NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("dna_fm indexes have no storage parameters")));
+    }
+    return NULL;
+}
+
+/**
+ * dna_fm_ops is the only operator class, created by the extension script with the one strategy and no support functions
+ */
+static bool dna_fm_validate(Oid opclassoid)
+{
+    return true;
+}
+
+static IndexScanDesc dna_fm_beginscan(Relation index, int nkeys, int norderbys)
+{
+    return RelationGetIndexScan(index, nkeys, norderbys);
+}
+
+static void dna_fm_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+    if (keys != NULL && scan->numberOfKeys > 0) {
+        memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+    }
+}
+
+static void dna_fm_endscan(IndexScanDesc scan)
+{
+}
+
+/*
+ * One partition during a scan: the FmIndex header in memory, the rest read from its pages as needed
+ */
+typedef struct DnaFmScanPartition
+{
+    DnaFmReader *reader;
+    DnaFmPartition partition;
+    uint64_t marks;                     // Byte offsets of the sections after the blocks, see FmIndex
+    uint64_t mark_ranks;
+    uint64_t samples;
+    FmIndex fm;
+} DnaFmScanPartition;
+
+static void dna_fm_read_fm(DnaFmScanPartition *part, uint64_t offset, Size size, void *dst)
+{
+    dna_fm_read_items(part->reader, part->partition.fm_start, offset, 1, size, dst);
+}
+
+static void dna_fm_read_block(DnaFmScanPartition *part, uint64_t row, FmBlock *block)
+{
+    dna_fm_read_fm(part, offsetof(FmIndex, data) + row / FM_BLOCK_BASES * sizeof(FmBlock), sizeof(FmBlock), block);
+}
+
+/**
+ * fm_search() over the pages
+ */
+static void dna_fm_search(DnaFmScanPartition *part, const Dna *pattern, uint64_t *lo, uint64_t *hi)
+{
+    *lo = 0;
+    *hi = FM_NUM_ROWS(&part->fm);
+    for (uint64_t i = pattern->length; i > 0 && *lo < *hi; i--) {
+        int c = (int) DNA_BASE_AT(pattern->bit_sequence, i - 1);
+        FmBlock block;
+
+        dna_fm_read_block(part, *lo, &block);
+        *lo = part->fm.counts[c] + fm_block_rank(&block, part->fm.primary, c, *lo);
+        dna_fm_read_block(part, *hi, &block);
+        *hi = part->fm.counts[c] + fm_block_rank(&block, part->fm.primary, c, *hi);
+    }
+}
+
+/**
+ * fm_locate_row() over the pages
+ */
+static uint64_t dna_fm_locate_row(DnaFmScanPartition *part, uint64_t row)
+{
+    uint64_t steps = 0;
+    uint64_t mark;
+    uint32 rank;
+    uint32 sample;
+
+    for (;;) {
+        FmBlock block;
+        int c;
+
+        dna_fm_read_fm(part, part->marks + row / 64 * sizeof(uint64_t), sizeof(uint64_t), &mark);
+        if ((mark >> (row % 64)) & 1) {
+            break;
+        }
+        dna_fm_read_block(part, row, &block);
+        c = FM_BLOCK_BWT_AT(&block, row);
+        row = part->fm.counts[c] + fm_block_rank(&block, part->fm.primary, c, row);
+        steps++;
+    }
+    dna_fm_read_fm(part, part->mark_ranks + row / 64 * sizeof(uint32), sizeof(uint32), &rank);
+    rank += pg_popcount64(mark & ((UINT64CONST(1) << (row % 64)) - 1));
+    dna_fm_read_fm(part, part->samples + (uint64_t) rank * sizeof(uint32), sizeof(uint32), &sample);
+    return sample + steps;
+}
+
+/**
+ * The row holding length nucleotides from pos, by binary search of the row starts. False when they run into the
+ * next row or VACUUM removed the row
+ */
+static bool dna_fm_find_row(DnaFmScanPartition *part, uint64_t pos, uint64_t length, ItemPointer tid)
+{
+    uint32 lo = 0;
+    uint32 hi = part->partition.num_rows;
+    uint64_t end = part->fm.length;
+    DnaFmRow row;
+
+    while (hi - lo > 1) {
+        uint32 mid = lo + (hi - lo) / 2;
+
+        dna_fm_read_items(part->reader, part->partition.rows_start, mid, sizeof(DnaFmRow), 1, &row);
+        if (row.start <= pos) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (hi < part->partition.num_rows) {
+        dna_fm_read_items(part->reader, part->partition.rows_start, hi, sizeof(DnaFmRow), 1, &row);
+        end = row.start;
+    }
+    if (pos + length > end) {
+        return false;
+    }
+    dna_fm_read_items(part->reader, part->partition.rows_start, lo, sizeof(DnaFmRow), 1, &row);
+    *tid = row.tid;
+    return ItemPointerIsValid(tid);
+}
+
+/**
+ * Looks up the longest pattern of the scan keys in every partition. Rows found that way are exact matches,
+ * unless there are other keys to check. Pending rows always get rechecked
+ */
+static int64 dna_fm_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
+{
+    Relation index = scan->indexRelation;
+    DnaFmReader reader = {index, InvalidBuffer};
+    DnaFmMeta meta;
+    Dna *pattern = NULL;
+    bool recheck = scan->numberOfKeys > 1;
+    int64 num_tids = 0;
+    BlockNumber block;
+
+    for (int i = 0; i < scan->numberOfKeys; i++) {
+        ScanKey key = &scan->keyData[i];
+        Dna *dna;
+
+        if (key->sk_flags & SK_ISNULL) {
+            return 0;
+        }
+        Assert(key->sk_strategy == DNA_FM_STRATEGY_CONTAINS);
+        dna = (Dna *) PG_DETOAST_DATUM(key->sk_argument);
+        if (pattern == NULL || dna->length > pattern->length) {
+            pattern = dna;
+        }
+    }
+    if (pattern == NULL) {
+        return 0;
+    }
+
+    dna_fm_read_meta(index, &meta);
+
+    for (uint32 p = 0; p < meta.num_partitions; p++) {
+        DnaFmScanPartition part;
+        uint64_t num_rows;
+        uint64_t lo;
+        uint64_t hi;
+
+        part.reader = &reader;
+        dna_fm_read_items(&reader, meta.directory, p, sizeof(DnaFmPartition), 1, &part.partition);
+        dna_fm_read_fm(&part, 0, offsetof(FmIndex, data), &part.fm);
+        num_rows = FM_NUM_ROWS(&part.fm);
+        part.marks = offsetof(FmIndex, data) + FM_NUM_BLOCKS(num_rows) * sizeof(FmBlock);
+        part.mark_ranks = part.marks + FM_NUM_MARK_WORDS(num_rows) * sizeof(uint64_t);
+        part.samples = part.mark_ranks + FM_NUM_MARK_WORDS(num_rows) * sizeof(uint32);
+
+        dna_fm_search(&part, pattern, &lo, &hi);
+        for (uint64_t row = lo; row < hi; row++) {
+            ItemPointerData tid;
+
+            if (dna_fm_find_row(&part, dna_fm_locate_row(&part, row), pattern->length, &tid)) {
+                tbm_add_tuples(tbm, &tid, 1, recheck);
+                num_tids++;
+            }
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+    dna_fm_reader_release(&reader);
+
+    for (block = meta.pending_head; block != InvalidBlockNumber;) {
+        Buffer buffer = ReadBuffer(index, block);
+        Page page;
+        ItemPointerData *tids;
+
+        LockBuffer(buffer, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buffer);
+        tids = (ItemPointerData *) PageGetContents(page);
+        for (uint32 i = 0; i < DnaFmPageGetOpaque(page)->count; i++) {
+            if (ItemPointerIsValid(&tids[i])) {
+                tbm_add_tuples(tbm, &tids[i], 1, true);
+                num_tids++;
+            }
+        }
+        block = DnaFmPageGetOpaque(page)->next;
+        UnlockReleaseBuffer(buffer);
+    }
+    return num_tids;
+}
+
+PG_FUNCTION_INFO_V1(dna_fm_handler);
+Datum
+dna_fm_handler(PG_FUNCTION_ARGS)
+{
+    IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+    amroutine->amstrategies = 1;
+    amroutine->amsupport = 0;
+    amroutine->amoptsprocnum = 0;
+    amroutine->amcanorder = false;
+    amroutine->amcanorderbyop = false;
+    amroutine->amcanbackward = false;
+    amroutine->amcanunique = false;
+    amroutine->amcanmulticol = false;
+    amroutine->amoptionalkey = false;
+    amroutine->amsearcharray = false;
+    amroutine->amsearchnulls = false;
+    amroutine->amstorage = false;
+    amroutine->amclusterable = false;
+    amroutine->ampredlocks = false;
+    amroutine->amcanparallel = false;
+    amroutine->amcaninclude = false;
+    amroutine->amusemaintenanceworkmem = true;
+    amroutine->amparallelvacuumoptions = VACUUM_OPTION_NO_PARALLEL;
+    amroutine->amkeytype = InvalidOid;
+
+    amroutine->ambuild = dna_fm_build;
+    amroutine->ambuildempty = dna_fm_buildempty;
+    amroutine->aminsert = dna_fm_insert;
+    amroutine->ambulkdelete = dna_fm_bulkdelete;
+    amroutine->amvacuumcleanup = dna_fm_vacuumcleanup;
+    amroutine->amcanreturn = NULL;
+    amroutine->amcostestimate = dna_fm_costestimate;
+    amroutine->amoptions = dna_fm_options;
+    amroutine->amproperty = NULL;
+    amroutine->ambuildphasename = NULL;
+    amroutine->amvalidate = dna_fm_validate;
+    amroutine->amadjustmembers = NULL;
+    amroutine->ambeginscan = dna_fm_beginscan;
+    amroutine->amrescan = dna_fm_rescan;
+    amroutine->amgettuple = NULL;
+    amroutine->amgetbitmap = dna_fm_getbitmap;
+    amroutine->amendscan = dna_fm_endscan;
+    amroutine->ammarkpos = NULL;
+    amroutine->amrestrpos = NULL;
+    amroutine->amestimateparallelscan = NULL;
+    amroutine->aminitparallelscan = NULL;
+    amroutine->amparallelrescan = NULL;
+
+    PG_RETURN_POINTER(amroutine);
+}
+
+/********************************************************************************************
+* Read mapping functions
+*
+* Seed and extend, the way minimap2 does it for short and medium reads: (w, k)-minimizers of the read
+* (the smallest canonical k-mer hash of every w consecutive k-mers) are looked up in a minimizer index of all
+* references, the hits are chained into colinear runs and the read is aligned around the best chain with a
+* banded semi-global alignment.
+*
+* The index is a plain table, filled once with minimizers() and indexed on the minimizer, so mapping a read
+* only probes it for the read's minimizers and then reads the window of the reference it aligns to.
+********************************************************************************************/
+
+#define MAP_MAX_OCCURRENCES 1000    // Minimizers with more hits than this are repeats and not used as seeds
+#define MAP_CHAIN_LOOKBACK 50       // Anchors a chain can extend from
+#define MAP_CHAIN_MAX_GAP 500       // Largest indel (difference between the two gaps) allowed inside a chain
+#define MAP_BAND_SLACK 32           // Added to the band on top of the indels seen in the chain
+
+typedef struct Minimizer
+{
+    uint64_t hash;
+    uint64_t location;      // Position (bits 31..1) and strand (bit 0)
+} Minimizer;
+
+// One row of the minimizer table that matched a minimizer of the read
+typedef struct MapIndexHit
+{
+    uint64_t hash;
+    int64 ref_id;
+    int64 pos;
+    uint32 reverse;
+} MapIndexHit;
+
+typedef struct MapAnchor
+{
+    int64 ref_id;
+    uint32 reverse;         // Read and reference k-mers on opposite strands
+    int64 x;                // Position on the reference
+    int64 y;                // Position on the read, on the reverse complement for reverse anchors
+} MapAnchor;
+
+/*
+ * The two queries map_read() runs for every read, prepared the first time and kept in fn_extra until the query
+ * ends or the tables or columns change
+ */
+typedef struct MapReadPlans
+{
+    Oid refs_relid;
+    Oid minimizers_relid;
+    NameData id_column;
+    NameData sequence_column;
+    SPIPlanPtr probe;               // See map_index_probe()
+    SPIPlanPtr window;              // See map_fetch_window()
+    MemoryContextCallback callback; // Frees the plans along with fn_mcxt
+} MapReadPlans;
+
+/**
+ * Invertible hash of a k-mer code (Thomas Wang's, as in minimap2), so lexicographically small k-mers
+ * like poly-A don't become every minimizer
+ */
+static inline uint64_t minimizer_hash(uint64_t key, uint64_t mask)
+{
+    key = (~key + (key << 21)) & mask;
+    key = key ^ key >> 24;
+    key = ((key + (key << 3)) + (key << 8)) & mask;
+    key = key ^ key >> 14;
+    key = ((key + (key << 2)) + (key << 4)) & mask;
+    key = key ^ key >> 28;
+    key = (key + (key << 31)) & mask;
+    return key;
+}
+
+/**
+ * Appends the (w, k)-minimizers of a sequence: canonical k-mers are rolled 2 bits at a time on both strands,
+ * k-mers that are their own reverse complement are skipped. Ties go to the leftmost k-mer
+ */
+static void minimizers_collect(const Dna *dna, int k, int w, Minimizer **out, uint64_t *num, uint64_t *max)
+{
+    uint64_t mask = (UINT64CONST(1) << (2 * k)) - 1;
+    int shift = 2 * (k - 1);
+    uint64_t fwd = 0;
+    uint64_t rev = 0;
+    Minimizer *window = (Minimizer *) palloc(w * sizeof(Minimizer));
+    int64 *window_pos = (int64 *) palloc(w * sizeof(int64));
+    int64 last_pos = -1;    // Position of the last minimizer added
+    int valid = 0;          // Consecutive nucleotides read since the start
+
+    for (int i = 0; i < w; i++) {
+        window[i].hash = PG_UINT64_MAX;
+        window_pos[i] = -1;
+    }
+
+    for (uint64_t i = 0; i < dna->length; i++) {
+        uint64_t base = DNA_BASE_AT(dna->bit_sequence, i);
+        int64 pos;
+        int slot;
+        int best = -1;
+
+        fwd = (fwd >> 2) | (base << shift);
+        rev = ((rev << 2) | (base ^ 1)) & mask;
+        if (++valid < k) {
+            continue;
+        }
+
+        pos = (int64) i - k + 1;
+        slot = (int) (pos % w);
+        if (fwd == rev) {
+            window[slot].hash = PG_UINT64_MAX;
+            window_pos[slot] = -1;
+        }
+        else {
+            window[slot].hash = minimizer_hash(fwd < rev ? fwd : rev, mask);
+            window[slot].location = ((uint64_t) pos << 1) | (fwd < rev ? 0 : 1);
+            window_pos[slot] = pos;
+        }
+        if (pos < w - 1) {
+            continue;
+        }
+
+        for (int s = 0; s < w; s++) {
+            if (window_pos[s] >= 0 &&
+                (best < 0 || window[s].hash < window[best].hash ||
+                 (window[s].hash == window[best].hash && window_pos[s] < window_pos[best]))) {
+                best = s;
+            }
+        }
+        if (best >= 0 && window_pos[best] != last_pos) {
+            if (*num == *max) {
+                *max = Max(*max * 2, (uint64_t) 64);
+                *out = *out == NULL ? (Minimizer *) MemoryContextAllocHuge(CurrentMemoryContext, *max * sizeof(Minimizer))
+                                    : (Minimizer *) repalloc_huge(*out, *max * sizeof(Minimizer));
+            }
+            (*out)[*num].hash = window[best].hash;
+            (*out)[*num].location = window[best].location;
+            (*num)++;
+            last_pos = window_pos[best];
+        }
+    }
+
+    pfree(window);
+    pfree(window_pos);
+}
+
+static int minimizer_cmp(const void *a, const void *b)
+{
+    const Minimizer *x = (const Minimizer *) a;
+    const Minimizer *y = (const Minimizer *) b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->location > y->location) - (x->location < y->location);
+}
+
+static void map_check_parameters(int32 k, int32 w)
+{
+    if (k < 8 || k > 28) {
+        ereport(ERROR, (errmsg("Invalid k value %d: must be between 8 and 28", k)));
+    }
+    if (w < 1 || w > 255) {
+        ereport(ERROR, (errmsg("Invalid window %d: must be between 1 and 255", w)));
+    }
+}
+
+/**
+ * minimizers(sequence, k, w): the (w, k)-minimizers of a sequence as (minimizer, pos, strand), pos is the 0-based
+ * start of the k-mer and strand tells which of the k-mer and its reverse complement was hashed
+ *
+ * One row per reference and minimizer is the index map_read() probes
+ */
+PG_FUNCTION_INFO_V1(dna_minimizers);
+Datum
+dna_minimizers(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    Minimizer *minimizers;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        Dna *dna;
+        int32 k = PG_GETARG_INT32(1);
+        int32 w = PG_GETARG_INT32(2);
+        TupleDesc tupdesc;
+        uint64_t num = 0;
+        uint64_t max = 0;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        map_check_parameters(k, w);
+        dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        if (dna->length >= (uint64_t) PG_INT32_MAX) {
+            ereport(ERROR, (errmsg("Sequence of %" PRIu64 " nucleotides is too long to be mapped against", dna->length)));
+        }
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        minimizers = NULL;
+        minimizers_collect(dna, k, w, &minimizers, &num, &max);
+        funcctx->user_fctx = minimizers;
+        funcctx->max_calls = num;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    minimizers = (Minimizer *) funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        const Minimizer *m = &minimizers[funcctx->call_cntr];
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+
+        values[0] = Int64GetDatum((int64) m->hash); // At most 56 bits, never negative
+        values[1] = Int64GetDatum((int64) (m->location >> 1));
+        values[2] = PointerGetDatum(cstring_to_text((m->location & 1) ? "-" : "+"));
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+static void map_free_plans(void *arg)
+{
+    MapReadPlans *plans = (MapReadPlans *) arg;
+
+    if (plans->probe != NULL) {
+        SPI_freeplan(plans->probe);
+        plans->probe = NULL;
+    }
+    if (plans->window != NULL) {
+        SPI_freeplan(plans->window);
+        plans->window = NULL;
+    }
+}
+
+/**
+ * The plans for these tables and columns, from fn_extra or freshly made. The ones made here get prepared by
+ * map_prepare_plans() once map_read_internal() is connected to SPI
+ */
+static MapReadPlans *map_read_plans(FunctionCallInfo fcinfo, Oid refs_relid, Oid minimizers_relid,
+                                    const char *id_column, const char *sequence_column)
+{
+    MapReadPlans *plans = (MapReadPlans *) fcinfo->flinfo->fn_extra;
+
+    if (plans == NULL) {
+        plans = (MapReadPlans *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(MapReadPlans));
+        plans->callback.func = map_free_plans;
+        plans->callback.arg = plans;
+        MemoryContextRegisterResetCallback(fcinfo->flinfo->fn_mcxt, &plans->callback);
+        fcinfo->flinfo->fn_extra = plans;
+    }
+    else if (plans->refs_relid == refs_relid && plans->minimizers_relid == minimizers_relid &&
+             strcmp(NameStr(plans->id_column), id_column) == 0 &&
+             strcmp(NameStr(plans->sequence_column), sequence_column) == 0) {
+        return plans;
+    }
+
+    map_free_plans(plans);
+    plans->refs_relid = refs_relid;
+    plans->minimizers_relid = minimizers_relid;
+    namestrcpy(&plans->id_column, id_column);
+    namestrcpy(&plans->sequence_column, sequence_column);
+    return plans;
+}
+
+static char *map_relation_name(Oid relid)
+{
+    char *relname = get_rel_name(relid);
+
+    if (relname == NULL) {
+        ereport(ERROR, (errmsg("Relation with OID %u does not exist", relid)));
+    }
+    return quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)), relname);
+}
+
+/**
+ * Needs an SPI connection. The probe's plan is generic so that its LIMIT is a parameter, which gets it an index
+ * scan that stops there instead of a bitmap scan reading every row of a repeat from the index
+ */
+static void map_prepare_plans(MapReadPlans *plans)
+{
+    Oid probe_argtypes[2] = {INT8ARRAYOID, INT8OID};
+    Oid window_argtypes[1] = {INT8OID};
+
+    map_free_plans(plans);  // In case an error got in between the two last time
+    plans->probe = SPI_prepare_cursor(psprintf("SELECT h.minimizer, m.ref_id::int8, m.pos::int8, m.strand::text = '-' "
+                                               "FROM unnest($1) AS h(minimizer), "
+                                               "LATERAL (SELECT ref_id, pos, strand FROM %s WHERE minimizer = h.minimizer LIMIT $2) AS m",
+                                               map_relation_name(plans->minimizers_relid)),
+                                      2, probe_argtypes, CURSOR_OPT_GENERIC_PLAN);
+    if (plans->probe == NULL) {
+        ereport(ERROR, (errmsg("Could not read minimizer table %s: %s", get_rel_name(plans->minimizers_relid),
+                               SPI_result_code_string(SPI_result))));
+    }
+    SPI_keepplan(plans->probe);
+
+    plans->window = SPI_prepare(psprintf("SELECT %s FROM %s WHERE %s = $1",
+                                         quote_identifier(NameStr(plans->sequence_column)),
+                                         map_relation_name(plans->refs_relid),
+                                         quote_identifier(NameStr(plans->id_column))),
+                                1, window_argtypes);
+    if (plans->window == NULL) {
+        ereport(ERROR, (errmsg("Could not read reference table %s: %s", get_rel_name(plans->refs_relid),
+                               SPI_result_code_string(SPI_result))));
+    }
+    SPI_keepplan(plans->window);
+}
+
+static int map_index_hit_cmp(const void *a, const void *b)
+{
+    const MapIndexHit *x = (const MapIndexHit *) a;
+    const MapIndexHit *y = (const MapIndexHit *) b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if (x->ref_id != y->ref_id) {
+        return x->ref_id < y->ref_id ? -1 : 1;
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/**
+ * Looks the read's minimizers up in the minimizer table (ref_id, minimizer, pos, strand), in one query.
+ * A minimizer with more than MAP_MAX_OCCURRENCES hits gets skipped as a repeat, so the query reads at most one
+ * more of its rows rather than all of them. Needs an SPI connection, the hits come back sorted by minimizer
+ */
+static MapIndexHit *map_index_probe(const MapReadPlans *plans, const Minimizer *seeds, uint64_t num_seeds,
+                                    uint64_t *num_hits)
+{
+    Datum *hashes = (Datum *) palloc(num_seeds * sizeof(Datum));
+    int num_hashes = 0;
+    Datum args[2];
+    MapIndexHit *hits;
+    int ret;
+
+    // Seeds are sorted by hash, every distinct one goes in the array once
+    for (uint64_t s = 0; s < num_seeds; s++) {
+        if (s == 0 || seeds[s].hash != seeds[s - 1].hash) {
+            hashes[num_hashes++] = Int64GetDatum((int64) seeds[s].hash);
+        }
+    }
+    args[0] = PointerGetDatum(construct_array_builtin(hashes, num_hashes, INT8OID));
+    args[1] = Int64GetDatum(MAP_MAX_OCCURRENCES + 1);
+
+    ret = SPI_execute_plan(plans->probe, args, NULL, true, 0);
+    if (ret != SPI_OK_SELECT) {
+        ereport(ERROR, (errmsg("Could not read minimizer table %s", get_rel_name(plans->minimizers_relid))));
+    }
+
+    hits = (MapIndexHit *) palloc(Max(SPI_processed, 1) * sizeof(MapIndexHit));
+    *num_hits = 0;
+    for (uint64 row = 0; row < SPI_processed; row++) {
+        HeapTuple tuple = SPI_tuptable->vals[row];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        bool nulls[4];
+        Datum hash = SPI_getbinval(tuple, tupdesc, 1, &nulls[0]);
+        Datum ref_id = SPI_getbinval(tuple, tupdesc, 2, &nulls[1]);
+        Datum pos = SPI_getbinval(tuple, tupdesc, 3, &nulls[2]);
+        Datum reverse = SPI_getbinval(tuple, tupdesc, 4, &nulls[3]);
+
+        if (nulls[0] || nulls[1] || nulls[2] || nulls[3]) {
+            continue;
+        }
+        hits[*num_hits].hash = (uint64_t) DatumGetInt64(hash);
+        hits[*num_hits].ref_id = DatumGetInt64(ref_id);
+        hits[*num_hits].pos = DatumGetInt64(pos);
+        hits[*num_hits].reverse = DatumGetBool(reverse) ? 1 : 0;
+        (*num_hits)++;
+    }
+    SPI_freetuptable(SPI_tuptable);
+    pfree(hashes);
+
+    if (*num_hits > 0) {
+        qsort(hits, *num_hits, sizeof(MapIndexHit), map_index_hit_cmp);
+    }
+    return hits;
+}
+
+/**
+ * Nucleotide codes of the reference window [*start, *end), clipped to the reference. Needs an SPI connection,
+ * the codes are allocated in the caller's context. References stored out of line and uncompressed are only
+ * read around the window
+ */
+static uint8 *map_fetch_window(const MapReadPlans *plans, Oid dna_type, int64 ref_id, int64 *start, int64 *end)
+{
+    char *relname = get_rel_name(plans->refs_relid);
+    Datum args[1] = {Int64GetDatum(ref_id)};
+    DnaSliceReader reader;
+    Datum sequence;
+    bool isnull;
+    uint8 *codes;
+    int ret;
+
+    ret = SPI_execute_plan(plans->window, args, NULL, true, 2);
+    if (ret != SPI_OK_SELECT) {
+        ereport(ERROR, (errmsg("Could not read reference table %s", relname)));
+    }
+    if (SPI_processed != 1) {
+        ereport(ERROR,
+                (errmsg("Reference %" PRId64 " of the minimizer table is %s %s", ref_id,
+                        SPI_processed == 0 ? "missing from" : "not unique in", relname)));
+    }
+    if (SPI_gettypeid(SPI_tuptable->tupdesc, 1) != dna_type) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("Column \"%s\" of reference table %s must be of type dna", NameStr(plans->sequence_column), relname)));
+    }
+    sequence = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    if (isnull) {
+        ereport(ERROR, (errmsg("Reference %" PRId64 " in %s is NULL", ref_id, relname)));
+    }
+
+    dna_slice_reader_init(&reader, sequence);
+    *start = Max(*start, (int64) 0);
+    *end = Min(*end, (int64) reader.length);
+    codes = (uint8 *) SPI_palloc(Max(*end - *start, 1));
+    for (int64 j = *start; j < *end;) {
+        uint64_t first = (uint64_t) j / 32;
+        uint64_t n = Min((uint64_t) DNA_SLICE_WORDS, DNA_NUM_WORDS(*end) - first);
+        const uint64_t *words = dna_slice_words(&reader, first, n);
+
+        for (; j < *end && (uint64_t) j / 32 < first + n; j++) {
+            codes[j - *start] = (uint8) DNA_BASE_AT(words, j - first * 32);
+        }
+    }
+    SPI_freetuptable(SPI_tuptable);
+    return codes;
+}
+
+/**
+ * Semi-global alignment (whole query, any part of the target) restricted to the diagonals diag - band .. diag + band,
+ * where target position j = query position i + diagonal. Gotoh row by row with one byte of traceback per band cell,
+ * same traceback encoding as align_traceback()
+ */
+static void align_banded_semiglobal(const uint8 *query, int qlen, const uint8 *target, int tlen, int diag, int band,
+                                    const AlignScoring *sc, AlignResult *result)
+{
+    int width = 2 * band + 1;
+    uint8 *dir;
+    int64 *h_prev = (int64 *) palloc((tlen + 2) * sizeof(int64));
+    int64 *f_prev = (int64 *) palloc((tlen + 2) * sizeof(int64));
+    int64 *h_cur = (int64 *) palloc((tlen + 2) * sizeof(int64));
+    int64 *f_cur = (int64 *) palloc((tlen + 2) * sizeof(int64));
+    int64 best = ALIGN_NEG_INF;
+    int best_j = -1;
+    char *ops;
+    int num_ops = 0;
+    int i, j, state;
+    char last_op = 0;
+    int run = 0;
+
+    if ((Size) qlen + 1 > MaxAllocSize / width) {
+        ereport(ERROR, (errmsg("Alignment of %d nucleotides with band %d is too big for a traceback", qlen, band)));
+    }
+    dir = (uint8 *) palloc0(((Size) qlen + 1) * width);
+    for (j = 0; j <= tlen + 1; j++) {
+        h_prev[j] = f_prev[j] = h_cur[j] = f_cur[j] = ALIGN_NEG_INF;
+    }
+
+    // Row 0: the query hasn't started, so anywhere in the band is a free start
+    for (j = Max(0, diag - band); j <= Min(tlen, diag + band); j++) {
+        h_prev[j] = 0;
+        dir[j - (diag - band)] = ALIGN_FROM_ZERO;
+    }
+
+    for (i = 1; i <= qlen; i++) {
+        int lo = Max(0, i + diag - band);
+        int hi = Min(tlen, i + diag + band);
+        int64 e = ALIGN_NEG_INF;
+        int64 h_left = ALIGN_NEG_INF;
+        int64 *swap;
+
+        for (j = lo; j <= hi; j++) {
+            int64 cell = j > 0 ? h_prev[j - 1] + (query[i - 1] == target[j - 1] ? sc->match : -sc->mismatch) : ALIGN_NEG_INF;
+            int64 e_open = h_left - sc->gap_open;
+            int64 e_ext = e - sc->gap_extend;
+            int64 f_open = h_prev[j] - sc->gap_open;
+            int64 f_ext = f_prev[j] - sc->gap_extend;
+            int64 f;
+            uint8 d = ALIGN_FROM_DIAG;
+
+            if (e_ext > e_open) {
+                e = e_ext;
+                d |= ALIGN_E_EXTEND;
+            }
+            else {
+                e = e_open;
+            }
+            if (f_ext > f_open) {
+                f = f_ext;
+                d |= ALIGN_F_EXTEND;
+            }
+            else {
+                f = f_open;
+            }
+
+            if (e > cell) {
+                cell = e;
+                d = (d & ~0x3) | ALIGN_FROM_E;
+            }
+            if (f > cell) {
+                cell = f;
+                d = (d & ~0x3) | ALIGN_FROM_F;
+            }
+
+            h_cur[j] = cell;
+            f_cur[j] = f;
+            h_left = cell;
+            dir[(Size) i * width + (j - (i + diag - band))] = d;
+        }
+        // Outside this row's band for the next row
+        if (lo > 0) {
+            h_cur[lo - 1] = f_cur[lo - 1] = ALIGN_NEG_INF;
+        }
+        h_cur[hi + 1] = f_cur[hi + 1] = ALIGN_NEG_INF;
+
+        swap = h_prev; h_prev = h_cur; h_cur = swap;
+        swap = f_prev; f_prev = f_cur; f_cur = swap;
+    }
+
+    for (j = Max(0, qlen + diag - band); j <= Min(tlen, qlen + diag + band); j++) {
+        if (h_prev[j] > best) {
+            best = h_prev[j];
+            best_j = j;
+        }
+    }
+
+    result->found = best_j >= 0 && best > ALIGN_NEG_INF / 2;
+    result->score = best;
+    result->query_start = 0;
+    result->query_end = qlen;
+    result->target_end = best_j;
+    initStringInfo(&result->cigar);
+
+    ops = (char *) palloc((Size) qlen + tlen + 1);
+    i = qlen;
+    j = best_j;
+    state = ALIGN_FROM_DIAG;
+    while (result->found && i > 0) {
+        uint8 d = dir[(Size) i * width + (j - (i + diag - band))];
+
+        if (state == ALIGN_FROM_DIAG && (d & 0x3) != ALIGN_FROM_DIAG) {
+            state = d & 0x3;
+        }
+        if (state == ALIGN_FROM_DIAG) {
+            ops[num_ops++] = 'M';
+            i--;
+            j--;
+        }
+        else if (state == ALIGN_FROM_E) {
+            ops[num_ops++] = 'D';
+            state = (d & ALIGN_E_EXTEND) ? ALIGN_FROM_E : ALIGN_FROM_DIAG;
+            j--;
+        }
+        else {
+            ops[num_ops++] = 'I';
+            state = (d & ALIGN_F_EXTEND) ? ALIGN_FROM_F : ALIGN_FROM_DIAG;
+            i--;
+        }
+    }
+    result->target_start = j;
+
+    while (num_ops > 0) {
+        cigar_append(&result->cigar, &last_op, &run, ops[--num_ops]);
+    }
+    if (run > 0) {
+        appendStringInfo(&result->cigar, "%d%c", run, last_op);
+    }
+
+    pfree(ops);
+    pfree(dir);
+    pfree(h_prev);
+    pfree(f_prev);
+    pfree(h_cur);
+    pfree(f_cur);
+}
+
+static int map_anchor_cmp(const void *a, const void *b)
+{
+    const MapAnchor *x = (const MapAnchor *) a;
+    const MapAnchor *y = (const MapAnchor *) b;
+
+    if (x->ref_id != y->ref_id) {
+        return x->ref_id < y->ref_id ? -1 : 1;
+    }
+    if (x->reverse != y->reverse) {
+        return x->reverse < y->reverse ? -1 : 1;
+    }
+    if (x->x != y->x) {
+        return x->x < y->x ? -1 : 1;
+    }
+    return (x->y > y->y) - (x->y < y->y);
+}
+
+typedef struct MapHit
+{
+    int64 ref_id;
+    bool reverse;
+    int64 pos;
+    int64 score;
+    char *cigar;
+} MapHit;
+
+/**
+ * Maps one read: minimizer hits become anchors, the best chain by dynamic programming (minimap2's chaining
+ * score: matched bases minus a gap cost) decides reference, strand and band, then the read gets aligned there.
+ * Returns false for unmapped reads
+ */
+static bool map_read_internal(MapReadPlans *plans, Oid dna_type, int k, int w, const Dna *read, const AlignScoring *sc,
+                              MapHit *hit)
+{
+    Minimizer *seeds = NULL;
+    uint64_t num_seeds = 0;
+    uint64_t max_seeds = 0;
+    MapIndexHit *index_hits;
+    uint64_t num_index_hits;
+    uint64_t lo = 0;
+    MapAnchor *anchors = NULL;
+    int num_anchors = 0;
+    int max_anchors = 0;
+    int64 *score;
+    int *parent;
+    int best = -1;
+    int first;
+    int64 min_diag, max_diag, diag0;
+    int64 read_len = (int64) read->length;
+    int64 start, window_start, window_end;
+    int band;
+    uint8 *query;
+    uint8 *target;
+    Dna *oriented;
+    AlignResult result;
+
+    if (read->length >= (uint64_t) PG_INT32_MAX) {
+        ereport(ERROR, (errmsg("Read of %" PRIu64 " nucleotides is too long to map", read->length)));
+    }
+    minimizers_collect(read, k, w, &seeds, &num_seeds, &max_seeds);
+    if (num_seeds == 0) {
+        if (seeds != NULL) {
+            pfree(seeds);
+        }
+        return false;
+    }
+    qsort(seeds, num_seeds, sizeof(Minimizer), minimizer_cmp);
+
+    // Everything until the reference window is fetched lives in the SPI context and goes away with SPI_finish()
+    SPI_connect();
+    if (plans->window == NULL) {
+        map_prepare_plans(plans);
+    }
+    index_hits = map_index_probe(plans, seeds, num_seeds, &num_index_hits);
+
+    // Anchors: every reference occurrence of every read minimizer, both lists are sorted by hash
+    for (uint64_t s = 0; s < num_seeds; s++) {
+        uint64_t end;
+        int64 qpos = (int64) (seeds[s].location >> 1);
+        uint32 qstrand = seeds[s].location & 1;
+
+        while (lo < num_index_hits && index_hits[lo].hash < seeds[s].hash) {
+            lo++;
+        }
+        for (end = lo; end < num_index_hits && index_hits[end].hash == seeds[s].hash; end++);
+        if (end - lo > MAP_MAX_OCCURRENCES) {
+            continue;
+        }
+
+        for (uint64_t m = lo; m < end; m++) {
+            MapAnchor *a;
+
+            if (num_anchors == max_anchors) {
+                max_anchors = Max(max_anchors * 2, 64);
+                anchors = anchors == NULL ? (MapAnchor *) palloc(max_anchors * sizeof(MapAnchor))
+                                          : (MapAnchor *) repalloc(anchors, max_anchors * sizeof(MapAnchor));
+            }
+            a = &anchors[num_anchors++];
+            a->ref_id = index_hits[m].ref_id;
+            a->reverse = qstrand ^ index_hits[m].reverse;
+            a->x = index_hits[m].pos;
+            a->y = a->reverse ? read_len - (qpos + k) : qpos;
+        }
+    }
+    pfree(seeds);
+    if (num_anchors == 0) {
+        SPI_finish();
+        return false;
+    }
+
+    // Chaining
+    qsort(anchors, num_anchors, sizeof(MapAnchor), map_anchor_cmp);
+    score = (int64 *) palloc(num_anchors * sizeof(int64));
+    parent = (int *) palloc(num_anchors * sizeof(int));
+    for (int i = 0; i < num_anchors; i++) {
+        score[i] = k;
+        parent[i] = -1;
+        for (int j = i - 1; j >= 0 && j >= i - MAP_CHAIN_LOOKBACK; j--) {
+            int64 dx = anchors[i].x - anchors[j].x;
+            int64 dy = anchors[i].y - anchors[j].y;
+            int64 gap;
+            int64 s;
+
+            if (anchors[j].ref_id != anchors[i].ref_id || anchors[j].reverse != anchors[i].reverse) {
+                break;
+            }
+            if (dx <= 0 || dy <= 0) {
+                continue;
+            }
+            gap = dx > dy ? dx - dy : dy - dx;
+            if (gap > MAP_CHAIN_MAX_GAP) {
+                continue;
+            }
+            s = score[j] + Min(Min(dx, dy), (int64) k);
+            if (gap > 0) {
+                s -= (int64) (0.01 * k * gap + 0.5 * log2((double) gap));
+            }
+            if (s > score[i]) {
+                score[i] = s;
+                parent[i] = j;
+            }
+        }
+        if (best < 0 || score[i] > score[best]) {
+            best = i;
+        }
+    }
+    // A single anchor isn't evidence enough
+    if (parent[best] < 0) {
+        SPI_finish();
+        return false;
+    }
+
+    // The band has to cover how far the chain's diagonals wander
+    min_diag = max_diag = anchors[best].x - anchors[best].y;
+    for (first = best; parent[first] >= 0; first = parent[first]) {
+        int64 d = anchors[parent[first]].x - anchors[parent[first]].y;
+        min_diag = Min(min_diag, d);
+        max_diag = Max(max_diag, d);
+    }
+    diag0 = anchors[first].x - anchors[first].y;
+    band = (int) (Max(max_diag - diag0, diag0 - min_diag) + MAP_BAND_SLACK);
+
+    hit->ref_id = anchors[best].ref_id;
+    hit->reverse = anchors[best].reverse != 0;
+    start = diag0;  // Where the read starts on the reference if there are no indels before the first anchor
+    window_start = start - band;
+    window_end = start + read_len + band;
+    target = map_fetch_window(plans, dna_type, hit->ref_id, &window_start, &window_end);
+    SPI_finish();
+
+    oriented = hit->reverse ? dna_revcomp_internal(read) : (Dna *) read;
+    query = dna_unpack_codes(oriented);
+    align_banded_semiglobal(query, (int) read_len, target, (int) (window_end - window_start),
+                            (int) (start - window_start), band, sc, &result);
+    hit->pos = window_start + result.target_start;
+    hit->score = result.score;
+    hit->cigar = result.cigar.data;
+
+    if (hit->reverse) {
+        pfree(oriented);
+    }
+    pfree(query);
+    pfree(target);
+    return result.found;
+}
+
+/**
+ * map_read(read, refs, ref_minimizers, k, w, id_column, sequence_column): (ref_id, pos, strand, score, cigar) of the
+ * best mapping, pos is the 0-based start of the alignment on the reference, for '-' the reverse complement of the
+ * read is what got aligned. NULL for unmapped reads.
+ *
+ * ref_minimizers has the minimizers() of every reference of refs (same k and w) with their ref_id, and should be
+ * indexed on minimizer. Each read costs one lookup of its minimizers and one of its reference, both planned once
+ * per query
+ */
+PG_FUNCTION_INFO_V1(dna_map_read);
+Datum
+dna_map_read(PG_FUNCTION_ARGS)
+{
+    Dna *read = (Dna *) PG_GETARG_VARLENA_P(0);
+    Oid refs_relid = PG_GETARG_OID(1);
+    Oid minimizers_relid = PG_GETARG_OID(2);
+    int32 k = PG_GETARG_INT32(3);
+    int32 w = PG_GETARG_INT32(4);
+    char *id_column = NameStr(*PG_GETARG_NAME(5));
+    char *sequence_column = NameStr(*PG_GETARG_NAME(6));
+    AlignScoring sc = {2, 3, 5, 2};  // dna_align()'s defaults
+    MapReadPlans *plans;
+    TupleDesc tupdesc;
+    MapHit hit;
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+
+    map_check_parameters(k, w);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    plans = map_read_plans(fcinfo, refs_relid, minimizers_relid, id_column, sequence_column);
+    if (!map_read_internal(plans, get_fn_expr_argtype(fcinfo->flinfo, 0), k, w, read, &sc, &hit)) {
+        PG_FREE_IF_COPY(read, 0);
+        PG_RETURN_NULL();
+    }
+
+    values[0] = Int64GetDatum(hit.ref_id);
+    values[1] = Int64GetDatum(hit.pos);
+    values[2] = PointerGetDatum(cstring_to_text(hit.reverse ? "-" : "+"));
+    values[3] = Int64GetDatum(hit.score);
+    values[4] = PointerGetDatum(cstring_to_text(hit.cigar));
+
+    PG_FREE_IF_COPY(read, 0);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/********************************************************************************************
+* De Bruijn graph functions
+*
+* Nodes are the distinct k-mers of a set of reads, edges join k-mers overlapping by k - 1 nucleotides. Neighbours
+* aren't stored: the four possible successors of a k-mer are its bits shifted down by one base with each base put
+* last, its predecessors the bits shifted up with each base put first, and looking them up in the k-mer set tells
+* which exist. Unitigs are the maximal paths whose inner nodes have one way in and one way out.
+*
+* With canonical k-mers a k-mer and its reverse complement are one node, so reads from both strands build one graph.
+********************************************************************************************/
+
+typedef struct DbgNode
+{
+    uint64_t key;           // The k-mer, canonical if the graph is
+    uint32 count;           // Occurrences in the reads, 0 for an empty slot
+    bool visited;           // Already part of a unitig
+} DbgNode;
+
+typedef struct DbgGraph
+{
+    int k;
+    bool canonical;
+    uint64_t mask;
+    DbgNode *nodes;         // Open addressing with linear probing
+    uint64_t capacity;      // A power of 2
+    uint64_t num_nodes;
+    uint64_t *first_seen;   // The k-mers as they first appear in the reads, the order unitigs are built in
+} DbgGraph;
+
+typedef struct DbgUnitig
+{
+    Dna *sequence;
+    double coverage;
+} DbgUnitig;
+
+/**
+ * 64-bit finalizer of MurmurHash3, spreads packed k-mers over the hash table slots
+ * (common/hashfn.h only has murmurhash64() from PostgreSQL 17 on)
+ */
+static inline uint64_t hash_bits64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64CONST(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t dbg_key(const DbgGraph *graph, uint64_t kmer)
+{
+    uint64_t rc;
+
+    if (!graph->canonical) {
+        return kmer;
+    }
+    rc = kmer_revcomp_bits(kmer, graph->k);
+    return kmer < rc ? kmer : rc;
+}
+
+static DbgNode *dbg_lookup(const DbgGraph *graph, uint64_t kmer)
+{
+    uint64_t key = dbg_key(graph, kmer);
+    uint64_t slot = hash_bits64(key) & (graph->capacity - 1);
+
+    while (graph->nodes[slot].count > 0) {
+        if (graph->nodes[slot].key == key) {
+            return &graph->nodes[slot];
+        }
+        slot = (slot + 1) & (graph->capacity - 1);
+    }
+    return NULL;
+}
+
+static void dbg_add(DbgGraph *graph, uint64_t kmer)
+{
+    uint64_t key = dbg_key(graph, kmer);
+    uint64_t slot = hash_bits64(key) & (graph->capacity - 1);
+
+    while (graph->nodes[slot].count > 0) {
+        if (graph->nodes[slot].key == key) {
+            if (graph->nodes[slot].count < PG_UINT32_MAX) {
+                graph->nodes[slot].count++;
+            }
+            return;
+        }
+        slot = (slot + 1) & (graph->capacity - 1);
+    }
+    graph->nodes[slot].key = key;
+    graph->nodes[slot].count = 1;
+    graph->first_seen[graph->num_nodes++] = kmer;
+}
+
+/**
+ * The k-mers following (or preceding) a k-mer in the graph, returns how many there are and the last one found
+ */
+static int dbg_successors(const DbgGraph *graph, uint64_t kmer, uint64_t *next)
+{
+    int found = 0;
+
+    for (uint64_t base = 0; base < 4; base++) {
+        uint64_t candidate = (kmer >> 2) | (base << (2 * (graph->k - 1)));
+        if (dbg_lookup(graph, candidate) != NULL) {
+            *next = candidate;
+            found++;
+        }
+    }
+    return found;
+}
+
+static int dbg_predecessors(const DbgGraph *graph, uint64_t kmer, uint64_t *previous)
+{
+    int found = 0;
+
+    for (uint64_t base = 0; base < 4; base++) {
+        uint64_t candidate = ((kmer << 2) | base) & graph->mask;
+        if (dbg_lookup(graph, candidate) != NULL) {
+            *previous = candidate;
+            found++;
+        }
+    }
+    return found;
+}
+
+/**
+ * Next k-mer of the unitig going forward (backward when reverse is set) from kmer, false where the unitig ends:
+ * at a branch, at a k-mer with more than one way in, or at a k-mer already used (which is how cycles stop)
+ */
+static bool dbg_extend(const DbgGraph *graph, uint64_t kmer, bool reverse, uint64_t *next)
+{
+    uint64_t back;
+    DbgNode *node;
+
+    if ((reverse ? dbg_predecessors(graph, kmer, next) : dbg_successors(graph, kmer, next)) != 1) {
+        return false;
+    }
+    if ((reverse ? dbg_successors(graph, *next, &back) : dbg_predecessors(graph, *next, &back)) != 1) {
+        return false;
+    }
+    node = dbg_lookup(graph, *next);
+    return !node->visited;
+}
+
+/**
+ * Builds the graph of the k-mers of the reads and compacts it into unitigs, returns how many there are
+ */
+static uint64_t dbg_build_unitigs(Dna **reads, int num_reads, int k, bool canonical, DbgUnitig **unitigs)
+{
+    DbgGraph graph;
+    uint64_t total = 0;
+    uint64_t num_unitigs = 0;
+    uint64_t max_unitigs = 16;
+    uint64_t *path;
+    uint64_t path_size = 1024;
+
+    graph.k = k;
+    graph.canonical = canonical;
+    graph.mask = k == 32 ? PG_UINT64_MAX : (UINT64CONST(1) << (2 * k)) - 1;
+    graph.num_nodes = 0;
+    for (int r = 0; r < num_reads; r++) {
+        if (reads[r]->length >= (uint64_t) k) {
+            total += reads[r]->length - k + 1;
+        }
+    }
+    // At most half full
+    graph.capacity = 16;
+    while (graph.capacity < 2 * total) {
+        graph.capacity <<= 1;
+    }
+    if (graph.capacity > MaxAllocHugeSize / sizeof(DbgNode)) {
+        ereport(ERROR, (errmsg("Too many k-mers for a de Bruijn graph: %" PRIu64, total)));
+    }
+    graph.nodes = (DbgNode *) MemoryContextAllocHuge(CurrentMemoryContext, graph.capacity * sizeof(DbgNode));
+    memset(graph.nodes, 0, graph.capacity * sizeof(DbgNode));
+    graph.first_seen = (uint64_t *) MemoryContextAllocHuge(CurrentMemoryContext, Max(total, 1) * sizeof(uint64_t));
+
+    for (int r = 0; r < num_reads; r++) {
+        uint64_t kmer = 0;
+
+        for (uint64_t i = 0; i < reads[r]->length; i++) {
+            kmer = (kmer >> 2) | ((uint64_t) DNA_BASE_AT(reads[r]->bit_sequence, i) << (2 * (k - 1)));
+            if (i + 1 >= (uint64_t) k) {
+                dbg_add(&graph, kmer);
+            }
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    *unitigs = (DbgUnitig *) palloc(max_unitigs * sizeof(DbgUnitig));
+    path = (uint64_t *) MemoryContextAllocHuge(CurrentMemoryContext, path_size * sizeof(uint64_t));
+    for (uint64_t n = 0; n < graph.num_nodes; n++) {
+        uint64_t seed = graph.first_seen[n];
+        uint64_t kmer, next;
+        uint64_t length = 0;
+        uint64_t coverage = 0;
+        DbgNode *node = dbg_lookup(&graph, seed);
+        Dna *sequence;
+
+        if (node->visited) {
+            continue;
+        }
+        node->visited = true;
+
+        // Backward from the seed, stored from the end of the path so it comes out in order
+        kmer = seed;
+        while (dbg_extend(&graph, kmer, true, &next)) {
+            if (length + 1 >= path_size) {
+                path_size *= 2;
+                path = (uint64_t *) repalloc_huge(path, path_size * sizeof(uint64_t));
+            }
+            path[length++] = next;
+            dbg_lookup(&graph, next)->visited = true;
+            kmer = next;
+        }
+        for (uint64_t i = 0; i < length / 2; i++) {
+            uint64_t swap = path[i];
+            path[i] = path[length - 1 - i];
+            path[length - 1 - i] = swap;
+        }
+        path[length++] = seed;
+
+        kmer = seed;
+        while (dbg_extend(&graph, kmer, false, &next)) {
+            if (length >= path_size) {
+                path_size *= 2;
+                path = (uint64_t *) repalloc_huge(path, path_size * sizeof(uint64_t));
+            }
+            path[length++] = next;
+            dbg_lookup(&graph, next)->visited = true;
+            kmer = next;
+        }
+
+        // The first k-mer, then the last nucleotide of each following one
+        sequence = dna_alloc(length + k - 1);
+        for (uint64_t i = 0; i < length; i++) {
+            coverage += dbg_lookup(&graph, path[i])->count;
+            for (int b = i == 0 ? 0 : k - 1; b < k; b++) {
+                uint64_t position = i + b;
+                sequence->bit_sequence[position / 32] |= ((path[i] >> (2 * b)) & 0x3) << (2 * (position % 32));
+            }
+        }
+
+        if (num_unitigs == max_unitigs) {
+            max_unitigs *= 2;
+            *unitigs = (DbgUnitig *) repalloc_huge(*unitigs, max_unitigs * sizeof(DbgUnitig));
+        }
+        (*unitigs)[num_unitigs].sequence = sequence;
+        (*unitigs)[num_unitigs].coverage = (double) coverage / length;
+        num_unitigs++;
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    pfree(path);
+    pfree(graph.nodes);
+    pfree(graph.first_seen);
+    return num_unitigs;
+}
+
+/**
+ * dbg_unitigs(reads, k, canonical): the unitigs of the de Bruijn graph of the reads' k-mers, with their coverage
+ * (mean count of their k-mers). NULL reads are skipped
+ */
+PG_FUNCTION_INFO_V1(dna_dbg_unitigs);
+Datum
+dna_dbg_unitigs(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    DbgUnitig *unitigs;
+
+    if (SRF_IS_FIRSTCALL()) {
+        ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+        int32 k = PG_GETARG_INT32(1);
+        bool canonical = PG_GETARG_BOOL(2);
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        Datum *elements;
+        bool *nulls;
+        int num_elements;
+        int num_reads = 0;
+        Dna **reads;
+        int16 typlen;
+        bool typbyval;
+        char typalign;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (k < 1 || k > 32) {
+            ereport(ERROR, (errmsg("Invalid k value %d: must be between 1 and 32", k)));
+        }
+        if (ARR_NDIM(array) > 1) {
+            ereport(ERROR, (errmsg("Reads must be a one-dimensional array")));
+        }
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+        deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval, typalign, &elements, &nulls, &num_elements);
+        reads = (Dna **) palloc(Max(num_elements, 1) * sizeof(Dna *));
+        for (int i = 0; i < num_elements; i++) {
+            if (!nulls[i]) {
+                reads[num_reads++] = (Dna *) PG_DETOAST_DATUM(elements[i]);
+            }
+        }
+
+        funcctx->max_calls = dbg_build_unitigs(reads, num_reads, k, canonical, &unitigs);
+        funcctx->user_fctx = unitigs;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    unitigs = (DbgUnitig *) funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls) {
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        values[0] = PointerGetDatum(unitigs[funcctx->call_cntr].sequence);
+        values[1] = Float8GetDatum(unitigs[funcctx->call_cntr].coverage);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/********************************************************************************************
+* K-mer frequency vector functions
+*
+* Feature vectors for classifiers: the frequency of every k-mer, as a dense float4[] in lexicographic order
+* (AA..A, AA..C, AA..G, AA..T, ..., TT..T). K-mers are rolled over the packed words in that order's 2-bit code
+* (A = 0, C = 1, G = 2, T = 3, first base most significant) so the code is the index to count at.
+*
+* Canonical vectors only have the k-mers that aren't bigger than their reverse complement, still in lexicographic order.
+********************************************************************************************/
+
+#define KMER_FREQUENCY_MAX_K 12
+
+static const uint8 kmer_lexicographic_code[4] = {0, 3, 1, 2};   // A, T, C, G
+
+typedef struct KmerFrequencyState
+{
+    Dna *dna;
+    int k;
+    bool canonical;
+    uint64_t window;
+    uint64_t step;
+    uint64_t start;         // Start of the next window
+    uint32 *counts;         // Counts of the k-mers of the window before it, indexed by lexicographic code
+    uint32 *codes;          // Entries of canonical vectors, NULL for all k-mers
+    uint32 num_codes;
+    bool counted;           // counts holds the previous window, so the next one can slide from it
+} KmerFrequencyState;
+
+/**
+ * Reverse complement of a lexicographic k-mer code: the complement of A/C/G/T is 3 - code
+ */
+static inline uint32 kmer_lexicographic_revcomp(uint32 code, int k)
+{
+    uint32 rc = 0;
+
+    for (int i = 0; i < k; i++) {
+        rc = (rc << 2) | (3 - (code & 0x3));
+        code >>= 2;
+    }
+    return rc;
+}
+
+/**
+ * Adds delta to the count of every k-mer starting in [from, to)
+ */
+static void kmer_frequency_count(const uint64_t *bits, uint64_t from, uint64_t to, int k, bool canonical,
+                                 uint32 *counts, int delta)
+{
+    uint32 mask = (uint32) ((UINT64CONST(1) << (2 * k)) - 1);
+    int shift = 2 * (k - 1);
+    uint32 fwd = 0;
+    uint32 rev = 0;
+    uint64_t end = to + k - 1;     // Last nucleotide read, exclusive
+    uint64_t word = 0;
+
+    if (from >= to) {
+        return;
+    }
+    for (uint64_t i = from; i < end; i++) {
+        uint32 code;
+
+        if (i == from || i % 32 == 0) {
+            word = bits[i / 32] >> (2 * (i % 32));
+        }
+        code = kmer_lexicographic_code[word & 0x3];
+        word >>= 2;
+
+        fwd = ((fwd << 2) | code) & mask;
+        rev = (rev >> 2) | ((3 - code) << shift);
+        if (i >= from + k - 1) {
+            counts[canonical && rev < fwd ? rev : fwd] += delta;
+        }
+    }
+}
+
+/**
+ * Codes of the canonical k-mers in lexicographic order, the entries of a canonical vector
+ */
+static uint32 *kmer_frequency_canonical_codes(int k, uint32 *num_codes)
+{
+    uint32 num_kmers = (uint32) 1 << (2 * k);
+    uint32 *codes = (uint32 *) palloc((num_kmers / 2 + ((uint32) 1 << k)) * sizeof(uint32));
+
+    *num_codes = 0;
+    for (uint32 code = 0; code < num_kmers; code++) {
+        if (kmer_lexicographic_revcomp(code, k) >= code) {
+            codes[(*num_codes)++] = code;
+        }
+    }
+    return codes;
+}
+
+/**
+ * Frequencies of the counted k-mers in an array: all 4^k of them, or only the given codes
+ */
+static ArrayType *kmer_frequency_array(const uint32 *counts, int k, const uint32 *codes, uint32 num_codes)
+{
+    uint32 num_kmers = (uint32) 1 << (2 * k);
+    uint32 n = codes != NULL ? num_codes : num_kmers;
+    uint64_t total = 0;
+    Datum *values = (Datum *) palloc(n * sizeof(Datum));
+
+    for (uint32 code = 0; code < num_kmers; code++) {
+        total += counts[code];
+    }
+    for (uint32 i = 0; i < n; i++) {
+        uint32 count = counts[codes != NULL ? codes[i] : i];
+        values[i] = Float4GetDatum(total == 0 ? 0.0f : (float4) ((double) count / total));
+    }
+    return construct_array_builtin(values, (int) n, FLOAT4OID);
+}
+
+static void kmer_frequency_check_k(int32 k)
+{
+    if (k < 1 || k > KMER_FREQUENCY_MAX_K) {
+        ereport(ERROR, (errmsg("Invalid k value %d: must be between 1 and %d", k, KMER_FREQUENCY_MAX_K)));
+    }
+}
+
+/**
+ * kmer_frequency_vector(dna, k, canonical): frequencies of the k-mers of the whole sequence, summing to 1
+ * (all zeros for sequences shorter than k)
+ */
+PG_FUNCTION_INFO_V1(dna_kmer_frequency_vector);
+Datum
+dna_kmer_frequency_vector(PG_FUNCTION_ARGS)
+{
+    Dna *dna = (Dna *) PG_GETARG_VARLENA_P(0);
+    int32 k = PG_GETARG_INT32(1);
+    bool canonical = PG_GETARG_BOOL(2);
+    uint32 *counts;
+    uint32 *codes = NULL;
+    uint32 num_codes = 0;
+    ArrayType *result;
+
+    kmer_frequency_check_k(k);
+    if (canonical) {
+        codes = kmer_frequency_canonical_codes(k, &num_codes);
+    }
+    counts = (uint32 *) palloc0(((Size) 1 << (2 * k)) * sizeof(uint32));
+    if (dna->length >= (uint64_t) k) {
+        kmer_frequency_count(dna->bit_sequence, 0, dna->length - k + 1, k, canonical, counts, 1);
+    }
+    result = kmer_frequency_array(counts, k, codes, num_codes);
+
+    pfree(counts);
+    PG_FREE_IF_COPY(dna, 0);
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/**
+ * One row (start, frequencies) per window that fits in the sequence. Overlapping windows are slid from the
+ * previous one, removing the k-mers that left and adding the ones that came in
+ */
+PG_FUNCTION_INFO_V1(dna_kmer_frequency_windows);
+Datum
+dna_kmer_frequency_windows(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    KmerFrequencyState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        int32 k = PG_GETARG_INT32(1);
+        int32 window = PG_GETARG_INT32(3);
+        int32 step = PG_NARGS() > 4 ? PG_GETARG_INT32(4) : window;
+
+        kmer_frequency_check_k(k);
+        if (window < k || step <= 0) {
+            ereport(ERROR, (errmsg("Window size must be at least k and step must be positive")));
+        }
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = (KmerFrequencyState *) palloc0(sizeof(KmerFrequencyState));
+        state->dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        state->k = k;
+        state->canonical = PG_GETARG_BOOL(2);
+        state->window = window;
+        state->step = step;
+        state->counts = (uint32 *) palloc0(((Size) 1 << (2 * k)) * sizeof(uint32));
+        if (state->canonical) {
+            state->codes = kmer_frequency_canonical_codes(k, &state->num_codes);
+        }
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (KmerFrequencyState *) funcctx->user_fctx;
+
+    if (state->start + state->window <= state->dna->length)
+    {
+        uint64_t num_starts = state->window - state->k + 1;    // K-mers in a window
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        if (state->counted && state->step < num_starts) {
+            uint64_t previous = state->start - state->step;
+            kmer_frequency_count(state->dna->bit_sequence, previous, state->start, state->k, state->canonical,
+                                 state->counts, -1);
+            kmer_frequency_count(state->dna->bit_sequence, previous + num_starts, state->start + num_starts,
+                                 state->k, state->canonical, state->counts, 1);
+        }
+        else {
+            memset(state->counts, 0, ((Size) 1 << (2 * state->k)) * sizeof(uint32));
+            kmer_frequency_count(state->dna->bit_sequence, state->start, state->start + num_starts, state->k,
+                                 state->canonical, state->counts, 1);
+            state->counted = true;
+        }
+
+        values[0] = Int64GetDatum((int64) state->start);
+        values[1] = PointerGetDatum(kmer_frequency_array(state->counts, state->k, state->codes, state->num_codes));
+        state->start += state->step;
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* Rolling hash functions
+*
+* ntHash (https://doi.org/10.1093/bioinformatics/btw397): the hash of a k-mer is the XOR of a 64-bit seed per
+* nucleotide, each rotated by its distance to the end of the k-mer. Moving to the next k-mer rotates the hash by
+* one and XORs the nucleotide that left out and the one that came in, so any k costs O(1) per k-mer.
+* The reverse complement hash rolls the other way, the canonical hash is the smaller of the two.
+********************************************************************************************/
+
+// Seeds in the order of the 2-bit codes: A, T, C, G (the complement of code b is b ^ 1)
+static const uint64_t nthash_seeds[4] = {
+    UINT64CONST(0x3c8bfbb395c60474), UINT64CONST(0x295549f54be24456),
+    UINT64CONST(0x3193c18562a02b4c), UINT64CONST(0x20323ed082572324)
+};
+
+typedef struct NtHashState
+{
+    Dna *dna;
+    int k;
+    bool canonical;
+    uint64_t position;      // Start of the next k-mer
+    uint64_t forward;       // Hashes of the k-mer before it
+    uint64_t reverse;
+    uint64_t seeds_out[4];  // Seeds rotated by k, to take out the nucleotide leaving the forward hash
+    uint64_t seeds_in[4];   // Complement seeds rotated by k - 1, to add the nucleotide entering the reverse hash
+} NtHashState;
+
+static inline uint64_t rotate_left64(uint64_t x, int n)
+{
+    n &= 63;
+    return n == 0 ? x : (x << n) | (x >> (64 - n));
+}
+
+static inline uint64_t rotate_right64(uint64_t x, int n)
+{
+    return rotate_left64(x, 64 - (n & 63));
+}
+
+/**
+ * generate_kmer_hashes(dna, k, canonical): the ntHash value of every k-mer, for any k up to the sequence length
+ */
+PG_FUNCTION_INFO_V1(generate_kmer_hashes);
+Datum
+generate_kmer_hashes(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    NtHashState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        int32 k = PG_GETARG_INT32(1);
+
+        if (k <= 0) {
+            ereport(ERROR, (errmsg("Invalid k value %d: must be positive", k)));
+        }
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = (NtHashState *) palloc0(sizeof(NtHashState));
+        state->dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        state->k = k;
+        state->canonical = PG_GETARG_BOOL(2);
+        for (int b = 0; b < 4; b++) {
+            state->seeds_out[b] = rotate_left64(nthash_seeds[b], k);
+            state->seeds_in[b] = rotate_left64(nthash_seeds[b ^ 1], k - 1);
+        }
+        // The first k-mer is hashed in full
+        if (state->dna->length >= (uint64_t) k) {
+            for (int i = 0; i < k; i++) {
+                uint64_t base = DNA_BASE_AT(state->dna->bit_sequence, (uint64_t) i);
+                state->forward ^= rotate_left64(nthash_seeds[base], k - 1 - i);
+                state->reverse ^= rotate_left64(nthash_seeds[base ^ 1], i);
+            }
+        }
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (NtHashState *) funcctx->user_fctx;
+
+    if (state->position + state->k <= state->dna->length)
+    {
+        uint64_t hash;
+
+        if (state->position > 0) {
+            uint64_t out = DNA_BASE_AT(state->dna->bit_sequence, state->position - 1);
+            uint64_t in = DNA_BASE_AT(state->dna->bit_sequence, state->position + state->k - 1);
+
+            state->forward = rotate_left64(state->forward, 1) ^ state->seeds_out[out] ^ nthash_seeds[in];
+            state->reverse = rotate_right64(state->reverse ^ nthash_seeds[out ^ 1], 1) ^ state->seeds_in[in];
+        }
+        hash = state->canonical && state->reverse < state->forward ? state->reverse : state->forward;
+        state->position++;
+        SRF_RETURN_NEXT(funcctx, Int64GetDatum((int64) hash));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/********************************************************************************************
+* Clustering functions
+*
+* Greedy clustering like CD-HIT: sequences are taken longest first, each one joins the first representative it is
+* similar enough to, or becomes a new representative. Most representatives are ruled out by counting the short
+* k-mers they share with the sequence (q-gram lemma: d edits destroy at most k * d of its k-mers), only the
+* remaining ones get the banded edit distance. k starts at 8, 6 or 4 by identity and goes down to 4 for queries
+* too short to keep k * d of their longer k-mers.
+********************************************************************************************/
+
+#define DNA_CLUSTER_MIN_K 4
+
+typedef struct DnaClusterState
+{
+    double identity;
+    int num_sequences;
+    int max_sequences;
+    Dna **sequences;        // In input order, NULL for NULL inputs
+} DnaClusterState;
+
+typedef struct DnaClusterOrder
+{
+    uint64_t length;
+    int index;
+} DnaClusterOrder;
+
+typedef struct DnaClusterCandidate
+{
+    int32 shared;           // Distinct k-mers in common
+    int32 representative;
+} DnaClusterCandidate;
+
+static int dna_cluster_order_cmp(const void *a, const void *b)
+{
+    const DnaClusterOrder *x = (const DnaClusterOrder *) a;
+    const DnaClusterOrder *y = (const DnaClusterOrder *) b;
+
+    if (x->length != y->length) {
+        return x->length > y->length ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+static int dna_cluster_candidate_cmp(const void *a, const void *b)
+{
+    const DnaClusterCandidate *x = (const DnaClusterCandidate *) a;
+    const DnaClusterCandidate *y = (const DnaClusterCandidate *) b;
+
+    if (x->shared != y->shared) {
+        return x->shared > y->shared ? -1 : 1;
+    }
+    return x->representative - y->representative;
+}
+
+/**
+ * Postings of the representatives' distinct k-mers for one k
+ */
+typedef struct DnaClusterIndex
+{
+    int k;
+    uint32 mask;
+    int32 **postings;       // Representatives having each k-mer
+    int32 *posting_sizes;
+    int32 *posting_max;
+    uint32 *seen;           // Last call of dna_cluster_kmers() each k-mer was found in
+    uint32 calls;
+} DnaClusterIndex;
+
+static void dna_cluster_index_init(DnaClusterIndex *index, int k)
+{
+    uint32 num_kmers = (uint32) 1 << (2 * k);
+
+    index->k = k;
+    index->mask = num_kmers - 1;
+    index->postings = (int32 **) palloc0(num_kmers * sizeof(int32 *));
+    index->posting_sizes = (int32 *) palloc0(num_kmers * sizeof(int32));
+    index->posting_max = (int32 *) palloc0(num_kmers * sizeof(int32));
+    index->seen = (uint32 *) palloc0(num_kmers * sizeof(uint32));
+    index->calls = 0;
+}
+
+/**
+ * Distinct k-mers of a sequence, written to kmers (room for its length), returns how many
+ */
+static uint64_t dna_cluster_kmers(DnaClusterIndex *index, const Dna *dna, uint32 *kmers)
+{
+    uint64_t num_kmers = 0;
+    uint32 code = 0;
+
+    index->calls++;
+    for (uint64_t i = 0; i < dna->length; i++) {
+        code = ((code << 2) | (uint32) DNA_BASE_AT(dna->bit_sequence, i)) & index->mask;
+        if (i + 1 >= (uint64_t) index->k && index->seen[code] != index->calls) {
+            index->seen[code] = index->calls;
+            kmers[num_kmers++] = code;
+        }
+    }
+    return num_kmers;
+}
+
+static void dna_cluster_index_add(DnaClusterIndex *index, const uint32 *kmers, uint64_t num_kmers,
+                                  int32 representative)
+{
+    for (uint64_t i = 0; i < num_kmers; i++) {
+        uint32 kmer = kmers[i];
+        if (index->posting_sizes[kmer] == index->posting_max[kmer]) {
+            index->posting_max[kmer] = Max(index->posting_max[kmer] * 2, 4);
+            index->postings[kmer] = index->postings[kmer] == NULL
+                ? (int32 *) palloc(index->posting_max[kmer] * sizeof(int32))
+                : (int32 *) repalloc(index->postings[kmer], index->posting_max[kmer] * sizeof(int32));
+        }
+        index->postings[kmer][index->posting_sizes[kmer]++] = representative;
+    }
+}
+
+/**
+ * Cluster of every sequence: the 1-based input position of its representative, -1 for NULL inputs.
+ * A sequence of length n joins a representative within floor((1 - identity) * n) edits of it
+ */
+static void dna_cluster(Dna **sequences, int num_sequences, double identity, int32 *clusters)
+{
+    int max_k = identity >= 0.9 ? 8 : identity >= 0.8 ? 6 : DNA_CLUSTER_MIN_K;
+    DnaClusterIndex indexes[8 - DNA_CLUSTER_MIN_K + 1];    // By k - DNA_CLUSTER_MIN_K
+    DnaClusterOrder *order = (DnaClusterOrder *) palloc(Max(num_sequences, 1) * sizeof(DnaClusterOrder));
+    int num_order = 0;
+    int32 *representatives = (int32 *) palloc(Max(num_sequences, 1) * sizeof(int32));
+    int32 *shared = (int32 *) palloc0(Max(num_sequences, 1) * sizeof(int32));
+    DnaClusterCandidate *candidates = (DnaClusterCandidate *) palloc(Max(num_sequences, 1) * sizeof(DnaClusterCandidate));
+    uint32 *query_kmers = NULL;
+    uint64_t max_query_kmers = 0;
+    int num_representatives = 0;
+    MemoryContext align_context = AllocSetContextCreate(CurrentMemoryContext, "dna_cluster alignments",
+                                                        ALLOCSET_DEFAULT_SIZES);
+
+    for (int k = DNA_CLUSTER_MIN_K; k <= max_k; k++) {
+        dna_cluster_index_init(&indexes[k - DNA_CLUSTER_MIN_K], k);
+    }
+    for (int i = 0; i < num_sequences; i++) {
+        clusters[i] = -1;
+        if (sequences[i] != NULL) {
+            order[num_order].length = sequences[i]->length;
+            order[num_order].index = i;
+            num_order++;
+        }
+    }
+    qsort(order, num_order, sizeof(DnaClusterOrder), dna_cluster_order_cmp);
+
+    for (int o = 0; o < num_order; o++) {
+        int index = order[o].index;
+        Dna *query = sequences[index];
+        int64 max_dist = (int64) floor((1.0 - identity) * query->length + 1e-9);
+        DnaClusterIndex *filter = NULL;
+        uint64_t num_query_kmers = 0;
+        int num_candidates = 0;
+        int kept;
+        int64 threshold = 0;
+
+        if (query->length > max_query_kmers) {
+            max_query_kmers = Max(query->length, max_query_kmers * 2);
+            query_kmers = query_kmers == NULL
+                ? (uint32 *) MemoryContextAllocHuge(CurrentMemoryContext, max_query_kmers * sizeof(uint32))
+                : (uint32 *) repalloc_huge(query_kmers, max_query_kmers * sizeof(uint32));
+        }
+        // The largest k that leaves the filter a positive threshold: short queries at low identity lose all
+        // of their long k-mers to max_dist edits but can still share enough short ones
+        for (int k = max_k; k >= DNA_CLUSTER_MIN_K && threshold <= 0; k--) {
+            filter = &indexes[k - DNA_CLUSTER_MIN_K];
+            num_query_kmers = dna_cluster_kmers(filter, query, query_kmers);
+            threshold = (int64) num_query_kmers - (int64) k * max_dist;
+        }
+
+        if (threshold > 0) {
+            for (uint64_t i = 0; i < num_query_kmers; i++) {
+                int32 *posting = filter->postings[query_kmers[i]];
+                for (int32 p = 0; p < filter->posting_sizes[query_kmers[i]]; p++) {
+                    if (shared[posting[p]]++ == 0) {
+                        candidates[num_candidates++].representative = posting[p];
+                    }
+                }
+            }
+            // Keep the ones sharing enough, most shared first
+            kept = 0;
+            for (int c = 0; c < num_candidates; c++) {
+                int32 r = candidates[c].representative;
+                if (shared[r] >= threshold) {
+                    candidates[kept].representative = r;
+                    candidates[kept].shared = shared[r];
+                    kept++;
+                }
+                shared[r] = 0;
+            }
+            num_candidates = kept;
+            qsort(candidates, num_candidates, sizeof(DnaClusterCandidate), dna_cluster_candidate_cmp);
+        }
+        else {
+            // Too short or too low an identity for even 4-mers to rule anything out
+            for (int r = 0; r < num_representatives; r++) {
+                candidates[num_candidates].representative = r;
+                candidates[num_candidates].shared = 0;
+                num_candidates++;
+            }
+        }
+
+        for (int c = 0; c < num_candidates && clusters[index] < 0; c++) {
+            int representative = representatives[candidates[c].representative];
+            MemoryContext oldcontext = MemoryContextSwitchTo(align_context);
+
+            if (dna_edit_distance_internal(query, sequences[representative], max_dist) <= max_dist) {
+                clusters[index] = representative + 1;
+            }
+            MemoryContextSwitchTo(oldcontext);
+            MemoryContextReset(align_context);
+        }
+
+        if (clusters[index] < 0) {
+            // New representative, indexed for every k a later query may filter with
+            dna_cluster_index_add(filter, query_kmers, num_query_kmers, num_representatives);
+            for (int k = DNA_CLUSTER_MIN_K; k <= max_k; k++) {
+                DnaClusterIndex *postings = &indexes[k - DNA_CLUSTER_MIN_K];
+                if (postings != filter) {
+                    num_query_kmers = dna_cluster_kmers(postings, query, query_kmers);
+                    dna_cluster_index_add(postings, query_kmers, num_query_kmers, num_representatives);
+                }
+            }
+            representatives[num_representatives++] = index;
+            clusters[index] = index + 1;
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    MemoryContextDelete(align_context);
+}
+
+PG_FUNCTION_INFO_V1(dna_cluster_agg_transfn);
+Datum
+dna_cluster_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    MemoryContext oldcontext;
+    DnaClusterState *state;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        ereport(ERROR, (errmsg("dna_cluster_agg_transfn called in non-aggregate context")));
+    }
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaClusterState *) PG_GETARG_POINTER(0);
+
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+    if (state == NULL) {
+        if (PG_ARGISNULL(2) || PG_GETARG_FLOAT8(2) <= 0 || PG_GETARG_FLOAT8(2) > 1) {
+            ereport(ERROR, (errmsg("Identity must be greater than 0 and at most 1")));
+        }
+        state = (DnaClusterState *) palloc0(sizeof(DnaClusterState));
+        state->identity = PG_GETARG_FLOAT8(2);
+        state->max_sequences = 64;
+        state->sequences = (Dna **) palloc(state->max_sequences * sizeof(Dna *));
+    }
+    if (state->num_sequences == PG_INT32_MAX / 2) {
+        ereport(ERROR, (errmsg("Too many sequences to cluster")));
+    }
+    if (state->num_sequences == state->max_sequences) {
+        state->max_sequences *= 2;
+        state->sequences = (Dna **) repalloc(state->sequences, state->max_sequences * sizeof(Dna *));
+    }
+    // NULLs keep their place, so the result lines up with array_agg() of the same rows
+    state->sequences[state->num_sequences++] = PG_ARGISNULL(1) ? NULL : (Dna *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(1));
+    MemoryContextSwitchTo(oldcontext);
+
+    PG_RETURN_POINTER(state);
+}
+
+/**
+ * The cluster of every input, in input order: the 1-based position of the input that represents it
+ * (the longest one of the cluster), NULL for NULL inputs
+ */
+PG_FUNCTION_INFO_V1(dna_cluster_agg_finalfn);
+Datum
+dna_cluster_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    DnaClusterState *state;
+    int32 *clusters;
+    Datum *values;
+    bool *nulls;
+    int dims[1];
+    int lbs[1] = {1};
+
+    state = PG_ARGISNULL(0) ? NULL : (DnaClusterState *) PG_GETARG_POINTER(0);
+    if (state == NULL) {
+        PG_RETURN_NULL();
+    }
+
+    clusters = (int32 *) palloc(state->num_sequences * sizeof(int32));
+    dna_cluster(state->sequences, state->num_sequences, state->identity, clusters);
+
+    values = (Datum *) palloc(state->num_sequences * sizeof(Datum));
+    nulls = (bool *) palloc(state->num_sequences * sizeof(bool));
+    for (int i = 0; i < state->num_sequences; i++) {
+        values[i] = Int32GetDatum(clusters[i]);
+        nulls[i] = clusters[i] < 0;
+    }
+    dims[0] = state->num_sequences;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls, 1, dims, lbs, INT4OID, sizeof(int32), true, TYPALIGN_INT));
+}
+
+/********************************************************************************************
+* 128-bit K-mer functions
+*
+* kmer128 holds k-mers of up to 64 nucleotides in two chunks, with the same I/O, generation, hash and btree
+* operator classes and SP-GiST trie as kmer. Nucleotides are read straight from the chunks with the dna helpers
+* (read_bases, copy_bases, DNA_BASE_AT), so nothing goes through strings except input and output.
+********************************************************************************************/
+
+static Kmer128 *kmer128_make(const char *sequence)
+{
+    Kmer128 *kmer = (Kmer128 *) palloc0(sizeof(Kmer128));
+    int length = strlen(sequence);
+
+    if (length == 0) {
+        ereport(ERROR, (errmsg("K-mer sequence cannot be empty")));
+    }
+    if (length > KMER128_MAX_LENGTH) {
+        ereport(ERROR, (errmsg("K-mer length cannot exceed %d nucleotides", KMER128_MAX_LENGTH)));
+    }
+    for (const char *p = sequence; *p; p++) {
+        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G') {
+            ereport(ERROR, (errmsg("Invalid character in K-mer sequence: '%c'", *p)));
+        }
+    }
+
+    kmer->length = length;
+    encode_dna(sequence, kmer->bit_sequence, length);
+    return kmer;
+}
+
+/**
+ * The length nucleotides of a k-mer starting at from, as a new k-mer (possibly empty)
+ */
+static Kmer128 *kmer128_slice(const Kmer128 *kmer, int from, int length)
+{
+    Kmer128 *result = (Kmer128 *) palloc0(sizeof(Kmer128));
+
+    result->length = length;
+    copy_bases(result->bit_sequence, 0, kmer->bit_sequence, from, length);
+    return result;
+}
+
+/**
+ * Nucleotides in common at the start of a (from a_from on) and b (from b_from on)
+ */
+static int kmer128_common_prefix(const Kmer128 *a, int a_from, const Kmer128 *b, int b_from)
+{
+    int max = Min(a->length - a_from, b->length - b_from);
+    int common = 0;
+
+    while (common < max) {
+        int n = Min(32, max - common);
+        uint64_t diff = read_bases(a->bit_sequence, a_from + common, n) ^ read_bases(b->bit_sequence, b_from + common, n);
+
+        if (diff != 0) {
+            return common + pg_rightmost_one_pos64(diff) / 2;
+        }
+        common += n;
+    }
+    return common;
+}
+
+/**
+ * Does the k-mer start with the first prefix->length nucleotides of prefix
+ */
+static bool kmer128_starts_with_internal(const Kmer128 *kmer, const Kmer128 *prefix)
+{
+    return prefix->length <= kmer->length && kmer128_common_prefix(kmer, 0, prefix, 0) >= prefix->length;
+}
+
+/**
+ * Lexicographic order of the sequences (A < C < G < T, a prefix comes first), like the text they print as
+ */
+static int kmer128_cmp_internal(const Kmer128 *a, const Kmer128 *b)
+{
+    int common = kmer128_common_prefix(a, 0, b, 0);
+
+    if (common < a->length && common < b->length) {
+        uint8 base_a = kmer_lexicographic_code[DNA_BASE_AT(a->bit_sequence, common)];
+        uint8 base_b = kmer_lexicographic_code[DNA_BASE_AT(b->bit_sequence, common)];
+        return base_a < base_b ? -1 : 1;
+    }
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_in);
+Datum
+kmer128_in(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_KMER128_P(kmer128_make(PG_GETARG_CSTRING(0)));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_out);
+Datum
+kmer128_out(PG_FUNCTION_ARGS)
+{
+    Kmer128 *kmer = PG_GETARG_KMER128_P(0);
+    PG_RETURN_CSTRING(decode_dna(kmer->bit_sequence, kmer->length));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_recv);
+Datum
+kmer128_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    Kmer128 *kmer = (Kmer128 *) palloc0(sizeof(Kmer128));
+
+    kmer->length = pq_getmsgint(buf, sizeof(int32));
+    if (kmer->length <= 0 || kmer->length > KMER128_MAX_LENGTH) {
+        ereport(ERROR, (errmsg("Invalid K-mer length: must be between 1 and %d", KMER128_MAX_LENGTH)));
+    }
+    kmer->bit_sequence[0] = pq_getmsgint64(buf);
+    kmer->bit_sequence[1] = pq_getmsgint64(buf);
+
+    // Bits past the length would break equality and hashing
+    if (kmer->length < 32) {
+        kmer->bit_sequence[0] &= (UINT64CONST(1) << (2 * kmer->length)) - 1;
+    }
+    if (kmer->length <= 32) {
+        kmer->bit_sequence[1] = 0;
+    }
+    else if (kmer->length < 64) {
+        kmer->bit_sequence[1] &= (UINT64CONST(1) << (2 * (kmer->length - 32))) - 1;
+    }
+    PG_RETURN_KMER128_P(kmer);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_send);
+Datum
+kmer128_send(PG_FUNCTION_ARGS)
+{
+    Kmer128 *kmer = PG_GETARG_KMER128_P(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint(&buf, kmer->length, sizeof(int32));
+    pq_sendint64(&buf, kmer->bit_sequence[0]);
+    pq_sendint64(&buf, kmer->bit_sequence[1]);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_cast_from_text);
+Datum
+kmer128_cast_from_text(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_KMER128_P(kmer128_make(text_to_cstring(PG_GETARG_TEXT_PP(0))));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_cast_to_text);
+Datum
+kmer128_cast_to_text(PG_FUNCTION_ARGS)
+{
+    Kmer128 *kmer = PG_GETARG_KMER128_P(0);
+    PG_RETURN_TEXT_P(cstring_to_text(decode_dna(kmer->bit_sequence, kmer->length)));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_from_kmer);
+Datum
+kmer128_from_kmer(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = PG_GETARG_KMER_P(0);
+    Kmer128 *result = (Kmer128 *) palloc0(sizeof(Kmer128));
+
+    result->length = kmer->length;
+    result->bit_sequence[0] = kmer->bit_sequence;
+    PG_RETURN_KMER128_P(result);
+}
+
+PG_FUNCTION_INFO_V1(kmer_from_kmer128);
+Datum
+kmer_from_kmer128(PG_FUNCTION_ARGS)
+{
+    Kmer128 *kmer = PG_GETARG_KMER128_P(0);
+    Kmer *result;
+
+    if (kmer->length > 32) {
+        ereport(ERROR, (errmsg("K-mer of %d nucleotides is too long for kmer, the maximum is 32", kmer->length)));
+    }
+    result = (Kmer *) palloc0(sizeof(Kmer));
+    result->length = kmer->length;
+    result->bit_sequence = kmer->bit_sequence[0];
+    PG_RETURN_KMER_P(result);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_length);
+Datum
+kmer128_length(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(PG_GETARG_KMER128_P(0)->length);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_eq);
+Datum
+kmer128_eq(PG_FUNCTION_ARGS)
+{
+    Kmer128 *a = PG_GETARG_KMER128_P(0);
+    Kmer128 *b = PG_GETARG_KMER128_P(1);
+
+    PG_RETURN_BOOL(a->length == b->length && a->bit_sequence[0] == b->bit_sequence[0] &&
+                   a->bit_sequence[1] == b->bit_sequence[1]);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_ne);
+Datum
+kmer128_ne(PG_FUNCTION_ARGS)
+{
+    Kmer128 *a = PG_GETARG_KMER128_P(0);
+    Kmer128 *b = PG_GETARG_KMER128_P(1);
+
+    PG_RETURN_BOOL(a->length != b->length || a->bit_sequence[0] != b->bit_sequence[0] ||
+                   a->bit_sequence[1] != b->bit_sequence[1]);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_cmp);
+Datum
+kmer128_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(kmer128_cmp_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_lt);
+Datum
+kmer128_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer128_cmp_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_le);
+Datum
+kmer128_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer128_cmp_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_gt);
+Datum
+kmer128_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer128_cmp_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_ge);
+Datum
+kmer128_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer128_cmp_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer128_hash);
+Datum
+kmer128_hash(PG_FUNCTION_ARGS)
+{
+    Kmer128 *kmer = PG_GETARG_KMER128_P(0);
+
+    // Same as kmer_hash() for k <= 32, so both types put a k-mer in the same bucket
+    if (kmer->length <= 32) {
+        return hash_any((unsigned char *) &kmer->bit_sequence[0], sizeof(uint64_t));
+    }
+    return hash_any((unsigned char *) kmer->bit_sequence, 2 * sizeof(uint64_t));
+}
+
+PG_FUNCTION_INFO_V1(kmer128_starts_with);
+Datum
+kmer128_starts_with(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer128_starts_with_internal(PG_GETARG_KMER128_P(0), PG_GETARG_KMER128_P(1)));
+}
+
+/**
+ * generate_kmers128(dna, k): every k-mer of the sequence for k up to 64, two read_bases() per k-mer
+ * (one for k <= 32) and no strings
+ */
+PG_FUNCTION_INFO_V1(generate_kmers128);
+Datum
+generate_kmers128(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    Dna *dna;
+    int k;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        k = PG_GETARG_INT32(1);
+        if (k <= 0 || k > KMER128_MAX_LENGTH) {
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and %d", KMER128_MAX_LENGTH)));
+        }
+
+        funcctx->user_fctx = dna;
+        funcctx->max_calls = dna->length >= (uint64_t) k ? dna->length - k + 1 : 0;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    dna = (Dna *) funcctx->user_fctx;
+    k = PG_GETARG_INT32(1);
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Kmer128 *kmer = (Kmer128 *) palloc0(sizeof(Kmer128));
+        uint64_t position = funcctx->call_cntr;
+
+        kmer->length = k;
+        kmer->bit_sequence[0] = read_bases(dna->bit_sequence, position, Min(k, 32));
+        if (k > 32) {
+            kmer->bit_sequence[1] = read_bases(dna->bit_sequence, position + 32, k - 32);
+        }
+        SRF_RETURN_NEXT(funcctx, Kmer128PGetDatum(kmer));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * SP-GiST trie over the nucleotides of kmer128, like spgtextproc.c: inner tuples have an optional prefix (the
+ * nucleotides all their values share) and one node per next nucleotide, labelled with its 2-bit code, or -1 for the
+ * values that end there. -2 is the node that consumes nothing, left over when an allTheSame tuple is split.
+ * Leaves store what is left of the k-mer, reconstructed values are the nucleotides so far
+ */
+
+#define KMER128_LABEL_END -1
+#define KMER128_LABEL_SPLIT -2
+
+PG_FUNCTION_INFO_V1(spgist_kmer128_config);
+Datum
+spgist_kmer128_config(PG_FUNCTION_ARGS)
+{
+    spgConfigOut *cfgout = (spgConfigOut *) PG_GETARG_POINTER(1);
+    Oid kmer128_oid = typenameTypeId(NULL, makeTypeName("kmer128"));
+
+    cfgout->prefixType = kmer128_oid;
+    cfgout->leafType = kmer128_oid;
+    cfgout->labelType = INT2OID;
+    cfgout->canReturnData = true;
+    cfgout->longValuesOK = false;
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer128_choose);
+Datum
+spgist_kmer128_choose(PG_FUNCTION_ARGS)
+{
+    spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+    spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
+    Kmer128 *input = DatumGetKmer128P(in->datum);
+    int common = 0;
+    int16 label;
+    int node;
+
+    if (in->hasPrefix) {
+        Kmer128 *prefix = DatumGetKmer128P(in->prefixDatum);
+
+        common = kmer128_common_prefix(input, in->level, prefix, 0);
+        if (common < prefix->length) {
+            // The value leaves the prefix: split into the common part and a node for the rest of the prefix
+            out->resultType = spgSplitTuple;
+            out->result.splitTuple.prefixHasPrefix = common > 0;
+            if (common > 0) {
+                out->result.splitTuple.prefixPrefixDatum = Kmer128PGetDatum(kmer128_slice(prefix, 0, common));
+            }
+            out->result.splitTuple.prefixNNodes = 1;
+            out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
+            out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum((int16) DNA_BASE_AT(prefix->bit_sequence, common));
+            out->result.splitTuple.childNodeN = 0;
+            out->result.splitTuple.postfixHasPrefix = prefix->length - common > 1;
+            if (prefix->length - common > 1) {
+                out->result.splitTuple.postfixPrefixDatum =
+                    Kmer128PGetDatum(kmer128_slice(prefix, common + 1, prefix->length - common - 1));
+            }
+            PG_RETURN_VOID();
+        }
+    }
+
+    label = input->length > in->level + common ? (int16) DNA_BASE_AT(input->bit_sequence, in->level + common)
+                                               : KMER128_LABEL_END;
+
+    for (node = 0; node < in->nNodes; node++) {
+        if (DatumGetInt16(in->nodeLabels[node]) == label) {
+            break;
+        }
+    }
+
+    if (node < in->nNodes) {
+        int level_add = common + (label != KMER128_LABEL_END ? 1 : 0);
+
+        out->resultType = spgMatchNode;
+        out->result.matchNode.nodeN = node;
+        out->result.matchNode.levelAdd = level_add;
+        out->result.matchNode.restDatum =
+            Kmer128PGetDatum(kmer128_slice(input, in->level + level_add, input->length - in->level - level_add));
+    }
+    else if (in->allTheSame) {
+        out->resultType = spgSplitTuple;
+        out->result.splitTuple.prefixHasPrefix = in->hasPrefix;
+        out->result.splitTuple.prefixPrefixDatum = in->prefixDatum;
+        out->result.splitTuple.prefixNNodes = 1;
+        out->result.splitTuple.prefixNodeLabels = (Datum *) palloc(sizeof(Datum));
+        out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(KMER128_LABEL_SPLIT);
+        out->result.splitTuple.childNodeN = 0;
+        out->result.splitTuple.postfixHasPrefix = false;
+    }
+    else {
+        // Labels are kept sorted
+        for (node = 0; node < in->nNodes && DatumGetInt16(in->nodeLabels[node]) < label; node++);
+        out->resultType = spgAddNode;
+        out->result.addNode.nodeLabel = Int16GetDatum(label);
+        out->result.addNode.nodeN = node;
+    }
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer128_picksplit);
+Datum
+spgist_kmer128_picksplit(PG_FUNCTION_ARGS)
+{
+    spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
+    spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
+    Kmer128 *first = DatumGetKmer128P(in->datums[0]);
+    int common = first->length;
+    int16 labels[5];
+    int num_labels = 0;
+
+    for (int i = 1; i < in->nTuples && common > 0; i++) {
+        common = Min(common, kmer128_common_prefix(first, 0, DatumGetKmer128P(in->datums[i]), 0));
+    }
+
+    out->hasPrefix = common > 0;
+    if (common > 0) {
+        out->prefixDatum = Kmer128PGetDatum(kmer128_slice(first, 0, common));
+    }
+
+    // One node per label in use, in label order
+    for (int16 label = KMER128_LABEL_END; label < 4; label++) {
+        for (int i = 0; i < in->nTuples; i++) {
+            Kmer128 *kmer = DatumGetKmer128P(in->datums[i]);
+            int16 this_label = kmer->length > common ? (int16) DNA_BASE_AT(kmer->bit_sequence, common) : KMER128_LABEL_END;
+            if (this_label == label) {
+                labels[num_labels++] = label;
+                break;
+            }
+        }
+    }
+
+    out->nNodes = num_labels;
+    out->nodeLabels = (Datum *) palloc(num_labels * sizeof(Datum));
+    for (int n = 0; n < num_labels; n++) {
+        out->nodeLabels[n] = Int16GetDatum(labels[n]);
+    }
+    out->mapTuplesToNodes = (int *) palloc(in->nTuples * sizeof(int));
+    out->leafTupleDatums = (Datum *) palloc(in->nTuples * sizeof(Datum));
+
+    for (int i = 0; i < in->nTuples; i++) {
+        Kmer128 *kmer = DatumGetKmer128P(in->datums[i]);
+        int16 label = kmer->length > common ? (int16) DNA_BASE_AT(kmer->bit_sequence, common) : KMER128_LABEL_END;
+        int skip = common + (label != KMER128_LABEL_END ? 1 : 0);
+
+        for (int n = 0; n < num_labels; n++) {
+            if (labels[n] == label) {
+                out->mapTuplesToNodes[i] = n;
+            }
+        }
+        out->leafTupleDatums[i] = Kmer128PGetDatum(kmer128_slice(kmer, skip, kmer->length - skip));
+    }
+
+    PG_RETURN_VOID();
+}
+
+/**
+ * Can a value starting with the nucleotides of reconstructed (and ending right after them if complete) satisfy
+ * the scan key
+ */
+static bool kmer128_spgist_consistent(const Kmer128 *reconstructed, bool complete, StrategyNumber strategy,
+                                      const Kmer128 *query)
+{
+    int common = kmer128_common_prefix(reconstructed, 0, query, 0);
+
+    switch (strategy) {
+        case 1:     // =
+            if (complete) {
+                return reconstructed->length == query->length && common == query->length;
+            }
+            // Leaves below can still be empty, so a value of exactly this length may be there
+            return reconstructed->length <= query->length && common == reconstructed->length;
+        case 2:     // ^@
+            if (common >= query->length) {
+                return true;
+            }
+            return !complete && common == reconstructed->length;
+        default:
+            return false;
+    }
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer128_inner_consistent);
+Datum
+spgist_kmer128_inner_consistent(PG_FUNCTION_ARGS)
+{
+    spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+    spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+    Kmer128 *base = (Kmer128 *) palloc0(sizeof(Kmer128));
+
+    // Nucleotides so far, then the prefix
+    if (in->level > 0) {
+        Kmer128 *reconstructed = DatumGetKmer128P(in->reconstructedValue);
+        copy_bases(base->bit_sequence, 0, reconstructed->bit_sequence, 0, in->level);
+    }
+    base->length = in->level;
+    if (in->hasPrefix) {
+        Kmer128 *prefix = DatumGetKmer128P(in->prefixDatum);
+        copy_bases(base->bit_sequence, base->length, prefix->bit_sequence, 0, prefix->length);
+        base->length += prefix->length;
+    }
+
+    out->nodeNumbers = (int *) palloc(in->nNodes * sizeof(int));
+    out->levelAdds = (int *) palloc(in->nNodes * sizeof(int));
+    out->reconstructedValues = (Datum *) palloc(in->nNodes * sizeof(Datum));
+    out->nNodes = 0;
+
+    for (int i = 0; i < in->nNodes; i++) {
+        int16 label = DatumGetInt16(in->nodeLabels[i]);
+        Kmer128 *value = (Kmer128 *) palloc(sizeof(Kmer128));
+        bool complete = label == KMER128_LABEL_END;
+        bool consistent = true;
+
+        *value = *base;
+        if (label >= 0) {
+            if (value->length >= KMER128_MAX_LENGTH) {
+                continue;
+            }
+            value->bit_sequence[value->length / 32] |= (uint64_t) label << (2 * (value->length % 32));
+            value->length++;
+        }
+
+        for (int j = 0; j < in->nkeys && consistent; j++) {
+            consistent = kmer128_spgist_consistent(value, complete, in->scankeys[j].sk_strategy,
+                                                   DatumGetKmer128P(in->scankeys[j].sk_argument));
+        }
+        if (consistent) {
+            out->nodeNumbers[out->nNodes] = i;
+            out->levelAdds[out->nNodes] = value->length - in->level;
+            out->reconstructedValues[out->nNodes] = Kmer128PGetDatum(value);
+            out->nNodes++;
+        }
+    }
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spgist_kmer128_leaf_consistent);
+Datum
+spgist_kmer128_leaf_consistent(PG_FUNCTION_ARGS)
+{
+    spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+    spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+    Kmer128 *leaf = DatumGetKmer128P(in->leafDatum);
+    Kmer128 *value = (Kmer128 *) palloc0(sizeof(Kmer128));
+    bool consistent = true;
+
+    if (in->level > 0) {
+        copy_bases(value->bit_sequence, 0, DatumGetKmer128P(in->reconstructedValue)->bit_sequence, 0, in->level);
+    }
+    copy_bases(value->bit_sequence, in->level, leaf->bit_sequence, 0, leaf->length);
+    value->length = in->level + leaf->length;
+
+    out->recheck = false;
+    out->leafValue = Kmer128PGetDatum(value);
+    for (int j = 0; j < in->nkeys && consistent; j++) {
+        consistent = kmer128_spgist_consistent(value, true, in->scankeys[j].sk_strategy,
+                                               DatumGetKmer128P(in->scankeys[j].sk_argument));
+    }
+    PG_RETURN_BOOL(consistent);
+}
+
+/********************************************************************************************
+* 8-byte K-mer functions
+*
+* kmer64 is a k-mer of up to 31 nucleotides in a single word passed by value (see Kmer64), so generating, sorting and
+* hashing k-mers never allocates. It has the same functions and operators as kmer128
+********************************************************************************************/
+
+static Kmer64 kmer64_make(const char *sequence)
+{
+    uint64_t bits[1] = {0};
+    int length = strlen(sequence);
+
+    if (length == 0) {
+        ereport(ERROR, (errmsg("K-mer sequence cannot be empty")));
+    }
+    if (length > KMER64_MAX_LENGTH) {
+        ereport(ERROR, (errmsg("K-mer length cannot exceed %d nucleotides", KMER64_MAX_LENGTH)));
+    }
+    for (const char *p = sequence; *p; p++) {
+        if (*p != 'A' && *p != 'T' && *p != 'C' && *p != 'G') {
+            ereport(ERROR, (errmsg("Invalid character in K-mer sequence: '%c'", *p)));
+        }
+    }
+
+    encode_dna(sequence, bits, length);
+    return KMER64_MAKE(bits[0], length);
+}
+
+static char *kmer64_to_str(Kmer64 kmer)
+{
+    uint64_t bits[1];
+
+    bits[0] = KMER64_BITS(kmer);
+    return decode_dna(bits, KMER64_LENGTH(kmer));
+}
+
+/**
+ * Lexicographic order of the sequences, the same as kmer128_cmp_internal()
+ */
+static int kmer64_cmp_internal(Kmer64 a, Kmer64 b)
+{
+    int length_a = KMER64_LENGTH(a);
+    int length_b = KMER64_LENGTH(b);
+    int common = Min(length_a, length_b);
+    uint64_t diff = (a ^ b) & ((UINT64CONST(1) << (2 * common)) - 1);
+
+    if (diff != 0) {
+        int position = pg_rightmost_one_pos64(diff) / 2;
+        uint8 base_a = kmer_lexicographic_code[(a >> (2 * position)) & 3];
+        uint8 base_b = kmer_lexicographic_code[(b >> (2 * position)) & 3];
+        return base_a < base_b ? -1 : 1;
+    }
+    return (length_a > length_b) - (length_a < length_b);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_in);
+Datum
+kmer64_in(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_KMER64(kmer64_make(PG_GETARG_CSTRING(0)));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_out);
+Datum
+kmer64_out(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_CSTRING(kmer64_to_str(PG_GETARG_KMER64(0)));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_recv);
+Datum
+kmer64_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    Kmer64 kmer = (Kmer64) pq_getmsgint64(buf);
+
+    // The marker bit has to be right above a whole number of nucleotides
+    if (kmer == 0 || pg_leftmost_one_pos64(kmer) % 2 != 0 || KMER64_LENGTH(kmer) == 0) {
+        ereport(ERROR, (errmsg("Invalid kmer64 value")));
+    }
+    PG_RETURN_KMER64(kmer);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_send);
+Datum
+kmer64_send(PG_FUNCTION_ARGS)
+{
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint64(&buf, PG_GETARG_KMER64(0));
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_cast_from_text);
+Datum
+kmer64_cast_from_text(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_KMER64(kmer64_make(text_to_cstring(PG_GETARG_TEXT_PP(0))));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_cast_to_text);
+Datum
+kmer64_cast_to_text(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_TEXT_P(cstring_to_text(kmer64_to_str(PG_GETARG_KMER64(0))));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_from_kmer);
+Datum
+kmer64_from_kmer(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer = PG_GETARG_KMER_P(0);
+
+    if (kmer->length > KMER64_MAX_LENGTH) {
+        ereport(ERROR, (errmsg("K-mer of %d nucleotides is too long for kmer64, the maximum is %d",
+                               kmer->length, KMER64_MAX_LENGTH)));
+    }
+    PG_RETURN_KMER64(KMER64_MAKE(kmer->bit_sequence, kmer->length));
+}
+
+PG_FUNCTION_INFO_V1(kmer_from_kmer64);
+Datum
+kmer_from_kmer64(PG_FUNCTION_ARGS)
+{
+    Kmer64 kmer = PG_GETARG_KMER64(0);
+    Kmer *result = (Kmer *) palloc0(sizeof(Kmer));
+
+    result->length = KMER64_LENGTH(kmer);
+    result->bit_sequence = KMER64_BITS(kmer);
+    PG_RETURN_KMER_P(result);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_length);
+Datum
+kmer64_length(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(KMER64_LENGTH(PG_GETARG_KMER64(0)));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_eq);
+Datum
+kmer64_eq(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(PG_GETARG_KMER64(0) == PG_GETARG_KMER64(1));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_ne);
+Datum
+kmer64_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(PG_GETARG_KMER64(0) != PG_GETARG_KMER64(1));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_cmp);
+Datum
+kmer64_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(kmer64_cmp_internal(PG_GETARG_KMER64(0), PG_GETARG_KMER64(1)));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_lt);
+Datum
+kmer64_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer64_cmp_internal(PG_GETARG_KMER64(0), PG_GETARG_KMER64(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_le);
+Datum
+kmer64_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer64_cmp_internal(PG_GETARG_KMER64(0), PG_GETARG_KMER64(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_gt);
+Datum
+kmer64_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer64_cmp_internal(PG_GETARG_KMER64(0), PG_GETARG_KMER64(1)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_ge);
+Datum
+kmer64_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer64_cmp_internal(PG_GETARG_KMER64(0), PG_GETARG_KMER64(1)) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer64_hash);
+Datum
+kmer64_hash(PG_FUNCTION_ARGS)
+{
+    uint64_t bits = KMER64_BITS(PG_GETARG_KMER64(0));
+
+    // Same as kmer_hash() and kmer128_hash()
+    return hash_any((unsigned char *) &bits, sizeof(uint64_t));
+}
+
+PG_FUNCTION_INFO_V1(kmer64_starts_with);
+Datum
+kmer64_starts_with(PG_FUNCTION_ARGS)
+{
+    Kmer64 kmer = PG_GETARG_KMER64(0);
+    Kmer64 prefix = PG_GETARG_KMER64(1);
+    int prefix_length = KMER64_LENGTH(prefix);
+
+    PG_RETURN_BOOL(prefix_length <= KMER64_LENGTH(kmer) &&
+                   ((kmer ^ prefix) & ((UINT64CONST(1) << (2 * prefix_length)) - 1)) == 0);
+}
+
+typedef struct Kmer64GenerateState {
+    Dna *dna;
+    uint64_t bits;              // Codes of the last k-mer returned
+} Kmer64GenerateState;
+
+/**
+ * generate_kmers64(dna, k): every k-mer of the sequence, rolled one nucleotide at a time and returned by value
+ */
+PG_FUNCTION_INFO_V1(generate_kmers64);
+Datum
+generate_kmers64(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    Kmer64GenerateState *state;
+    int k;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        Dna *dna;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        dna = (Dna *) PG_GETARG_VARLENA_P(0);
+        k = PG_GETARG_INT32(1);
+        if (k <= 0 || k > KMER64_MAX_LENGTH) {
+            ereport(ERROR, (errmsg("Invalid k value: must be between 1 and %d", KMER64_MAX_LENGTH)));
+        }
+
+        state = (Kmer64GenerateState *) palloc(sizeof(Kmer64GenerateState));
+        state->dna = dna;
+        state->bits = 0;
+        funcctx->user_fctx = state;
+        funcctx->max_calls = dna->length >= (uint64_t) k ? dna->length - k + 1 : 0;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (Kmer64GenerateState *) funcctx->user_fctx;
+    k = PG_GETARG_INT32(1);
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        uint64_t position = funcctx->call_cntr;
+
+        if (position == 0) {
+            state->bits = read_bases(state->dna->bit_sequence, 0, k);
+        }
+        else {
+            state->bits = (state->bits >> 2) |
+                          ((uint64_t) DNA_BASE_AT(state->dna->bit_sequence, position + k - 1) << (2 * (k - 1)));
+        }
+        SRF_RETURN_NEXT(funcctx, Int64GetDatum((int64) KMER64_MAKE(state->bits, k)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/********************************************************************************************
+* K-mer neighbourhood functions
+*
+* The substitution neighbours of a k-mer are the k-mer XORed with a pattern that has a non-zero 2-bit value (1, 2 or
+* 3) at each substituted position, so they are enumerated as combinations of positions times non-zero digits, closest
+* first, without decoding anything. For read correction the neighbours are probed against a table of solid k-mers,
+* loaded once per query into a hash set.
+********************************************************************************************/
+
+typedef struct KmerNeighborIter
+{
+    uint64_t bits;          // The k-mer the neighbours are of
+    int k;
+    int max_distance;
+    int distance;           // Substitutions in the current pattern, -1 before the first neighbour
+    int positions[32];      // Substituted positions, increasing
+    uint8 digits[32];       // What each substituted nucleotide is XORed with
+} KmerNeighborIter;
+
+static void kmer_neighbors_init(KmerNeighborIter *iter, uint64_t bits, int k, int max_distance)
+{
+    iter->bits = bits;
+    iter->k = k;
+    iter->max_distance = max_distance;
+    iter->distance = -1;
+}
+
+/**
+ * The next neighbour and its distance, false when all the neighbours within max_distance have been returned
+ */
+static bool kmer_neighbors_next(KmerNeighborIter *iter, uint64_t *neighbor, int *distance)
+{
+    int e = iter->distance;
+    int i;
+    uint64_t pattern = 0;
+
+    if (e < 0) {
+        iter->distance = 0;
+        *neighbor = iter->bits;
+        *distance = 0;
+        return true;
+    }
+
+    // Next digits for the same positions, then the next positions, then one more substitution
+    for (i = e - 1; i >= 0 && iter->digits[i] == 3; i--) {
+        iter->digits[i] = 1;
+    }
+    if (i >= 0) {
+        iter->digits[i]++;
+    }
+    else {
+        for (i = e - 1; i >= 0 && iter->positions[i] == iter->k - e + i; i--);
+        if (i >= 0) {
+            iter->positions[i]++;
+            for (int j = i + 1; j < e; j++) {
+                iter->positions[j] = iter->positions[j - 1] + 1;
+            }
+        }
+        else {
+            e = ++iter->distance;
+            if (e > iter->max_distance) {
+                return false;
+            }
+            for (int j = 0; j < e; j++) {
+                iter->positions[j] = j;
+                iter->digits[j] = 1;
+            }
+        }
+    }
+
+    for (int j = 0; j < e; j++) {
+        pattern |= (uint64_t) iter->digits[j] << (2 * iter->positions[j]);
+    }
+    *neighbor = iter->bits ^ pattern;
+    *distance = e;
+    return true;
+}
+
+static void kmer_neighbors_check_distance(const Kmer *kmer, int max_distance)
+{
+    if (max_distance < 0 || max_distance > kmer->length) {
+        ereport(ERROR, (errmsg("Invalid distance %d: must be between 0 and the k-mer length (%d)",
+                               max_distance, kmer->length)));
+    }
+}
+
+/**
+ * kmer_neighbors(kmer, d): every k-mer within Hamming distance d of the k-mer, itself first, by increasing distance
+ */
+PG_FUNCTION_INFO_V1(kmer_neighbors);
+Datum
+kmer_neighbors(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    KmerNeighborIter *iter;
+    uint64_t neighbor;
+    int distance;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        Kmer *kmer = PG_GETARG_KMER_P(0);
+        int32 max_distance = PG_GETARG_INT32(1);
+        TupleDesc tupdesc;
+
+        kmer_neighbors_check_distance(kmer, max_distance);
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            ereport(ERROR, (errmsg("Function returning record called in context that cannot accept type record")));
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        iter = (KmerNeighborIter *) palloc(sizeof(KmerNeighborIter));
+        kmer_neighbors_init(iter, kmer->bit_sequence, kmer->length, max_distance);
+        funcctx->user_fctx = iter;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    iter = (KmerNeighborIter *) funcctx->user_fctx;
+
+    if (kmer_neighbors_next(iter, &neighbor, &distance))
+    {
+        Kmer *result = (Kmer *) palloc0(sizeof(Kmer));
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        result->length = iter->k;
+        result->bit_sequence = neighbor;
+        values[0] = PointerGetDatum(result);
+        values[1] = Int32GetDatum(distance);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+typedef struct KmerSetEntry
+{
+    uint64_t bits;
+    int32 length;           // 0 for an empty slot
+    int64 count;
+} KmerSetEntry;
+
+typedef struct KmerSet
+{
+    Oid relid;
+    AttrNumber kmer_attnum;
+    AttrNumber count_attnum;    // InvalidAttrNumber when every row counts once
+    MemoryContext context;
+    KmerSetEntry *entries;  // Open addressing with linear probing
+    uint64_t capacity;      // A power of 2
+    uint64_t num_entries;
+} KmerSet;
+
+#define KMER_SET_FETCH_ROWS 10000
+
+static inline uint64_t kmer_set_slot(const KmerSet *set, uint64_t bits, int32 length)
+{
+    return (hash_bits64(bits) + (uint64_t) length) & (set->capacity - 1);
+}
+
+static KmerSetEntry *kmer_set_find(const KmerSet *set, uint64_t bits, int32 length)
+{
+    uint64_t slot = kmer_set_slot(set, bits, length);
+
+    while (set->entries[slot].length > 0) {
+        if (set->entries[slot].bits == bits && set->entries[slot].length == length) {
+            return &set->entries[slot];
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    return NULL;
+}
+
+static void kmer_set_resize(KmerSet *set, uint64_t capacity)
+{
+    KmerSetEntry *old_entries = set->entries;
+    uint64_t old_capacity = set->capacity;
+
+    if (capacity > MaxAllocHugeSize / sizeof(KmerSetEntry)) {
+        ereport(ERROR, (errmsg("Too many k-mers for a k-mer set: %" PRIu64, set->num_entries)));
+    }
+    set->entries = (KmerSetEntry *) MemoryContextAllocHuge(set->context, capacity * sizeof(KmerSetEntry));
+    memset(set->entries, 0, capacity * sizeof(KmerSetEntry));
+    set->capacity = capacity;
+
+    for (uint64_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].length > 0) {
+            uint64_t slot = kmer_set_slot(set, old_entries[i].bits, old_entries[i].length);
+            while (set->entries[slot].length > 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            set->entries[slot] = old_entries[i];
+        }
+    }
+    if (old_entries != NULL) {
+        pfree(old_entries);
+    }
+}
+
+/**
+ * Adds count occurrences of a k-mer, the set stays at most half full
+ */
+static void kmer_set_add(KmerSet *set, uint64_t bits, int32 length, int64 count)
+{
+    KmerSetEntry *entry = kmer_set_find(set, bits, length);
+    uint64_t slot;
+
+    if (entry != NULL) {
+        entry->count += count;
+        return;
+    }
+    if (2 * (set->num_entries + 1) > set->capacity) {
+        kmer_set_resize(set, 2 * set->capacity);
+    }
+    slot = kmer_set_slot(set, bits, length);
+    while (set->entries[slot].length > 0) {
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    set->entries[slot].bits = bits;
+    set->entries[slot].length = length;
+    set->entries[slot].count = count;
+    set->num_entries++;
+}
+
+static void kmer_set_init(KmerSet *set, Oid relid, MemoryContext context)
+{
+    set->relid = relid;
+    set->context = context;
+    set->entries = NULL;
+    set->capacity = 0;
+    set->num_entries = 0;
+    kmer_set_resize(set, 1024);
+}
+
+/**
+ * Finds a column of the k-mer table by name, checking it is one of the types we can read
+ */
+static AttrNumber kmer_set_column(Oid relid, const char *column, Oid type1, Oid type2, Oid type3, const char *type_name)
+{
+    AttrNumber attnum = get_attnum(relid, column);
+    Oid type;
+
+    if (attnum <= 0) { // Missing (InvalidAttrNumber) or a system column
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("Column \"%s\" of k-mer table %s does not exist", column, get_rel_name(relid))));
+    }
+    type = get_atttype(relid, attnum);
+    if (type != type1 && type != type2 && type != type3) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("Column \"%s\" of k-mer table %s must be of type %s, not %s", column, get_rel_name(relid), type_name, format_type_be(type))));
+    }
+    return attnum;
+}
+
+/**
+ * Loads the k-mers of a table: kmer_attnum is the k-mer, count_attnum (if any) an integer column with its count,
+ * otherwise every row counts once. Rows with a NULL in either are skipped, repeated k-mers add up
+ */
+static void kmer_set_load(KmerSet *set)
+{
+    char *relname = get_rel_name(set->relid);
+    Portal portal;
+    Oid count_type = InvalidOid;
+
+    if (relname == NULL) {
+        ereport(ERROR, (errmsg("Relation with OID %u does not exist", set->relid)));
+    }
+    if (set->count_attnum != InvalidAttrNumber) {
+        count_type = get_atttype(set->relid, set->count_attnum);
+    }
+
+    SPI_connect();
+    portal = SPI_cursor_open_with_args(NULL,
+                                       psprintf("SELECT %s, %s FROM %s",
+                                                quote_identifier(get_attname(set->relid, set->kmer_attnum, false)),
+                                                set->count_attnum != InvalidAttrNumber
+                                                ? quote_identifier(get_attname(set->relid, set->count_attnum, false)) : "1",
+                                                quote_qualified_identifier(get_namespace_name(get_rel_namespace(set->relid)), relname)),
+                                       0, NULL, NULL, NULL, true, 0);
+    for (;;) {
+        SPI_cursor_fetch(portal, true, KMER_SET_FETCH_ROWS);
+        if (SPI_processed == 0) {
+            break;
+        }
+
+        for (uint64 row = 0; row < SPI_processed; row++) {
+            HeapTuple tuple = SPI_tuptable->vals[row];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool kmer_null;
+            bool count_null = false;
+            Datum kmer = SPI_getbinval(tuple, tupdesc, 1, &kmer_null);
+            int64 count = 1;
+
+            if (count_type != InvalidOid) {
+                Datum value = SPI_getbinval(tuple, tupdesc, 2, &count_null);
+                if (!count_null) {
+                    count = count_type == INT8OID ? DatumGetInt64(value)
+                            : count_type == INT4OID ? DatumGetInt32(value) : DatumGetInt16(value);
+                }
+            }
+            if (kmer_null || count_null) {
+                continue;
+            }
+            kmer_set_add(set, DatumGetKmerP(kmer)->bit_sequence, DatumGetKmerP(kmer)->length, count);
+        }
+        SPI_freetuptable(SPI_tuptable);
+        CHECK_FOR_INTERRUPTS();
+    }
+    SPI_cursor_close(portal);
+    SPI_finish();
+}
+
+/**
+ * kmer_neighbors(kmer, d, kmers, kmer_column, count_column): the k-mers within Hamming distance d of the k-mer that
+ * are in the table kmers, with their distance and count, closest first
+ *
+ * The table is loaded on the first call and kept for the rest of the query, so that the neighbourhoods of all the
+ * k-mers of the reads to correct are probed against one hash set. Materialize mode leaves fn_extra to the set.
+ * Not strict, a NULL count_column means every row counts once
+ */
+PG_FUNCTION_INFO_V1(kmer_neighbors_present);
+Datum
+kmer_neighbors_present(PG_FUNCTION_ARGS)
+{
+    Kmer *kmer;
+    int32 max_distance;
+    Oid relid;
+    AttrNumber kmer_attnum;
+    AttrNumber count_attnum = InvalidAttrNumber;
+    KmerSet *set = (KmerSet *) fcinfo->flinfo->fn_extra;
+    ReturnSetInfo *rsinfo;
+    KmerNeighborIter iter;
+    uint64_t neighbor;
+    int distance;
+    uint64_t probed = 0;
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) {
+        return (Datum) 0;
+    }
+
+    kmer = PG_GETARG_KMER_P(0);
+    max_distance = PG_GETARG_INT32(1);
+    relid = PG_GETARG_OID(2);
+    kmer_neighbors_check_distance(kmer, max_distance);
+
+    kmer_attnum = kmer_set_column(relid, NameStr(*PG_GETARG_NAME(3)),
+                                  get_fn_expr_argtype(fcinfo->flinfo, 0), InvalidOid, InvalidOid, "kmer");
+    if (!PG_ARGISNULL(4)) {
+        count_attnum = kmer_set_column(relid, NameStr(*PG_GETARG_NAME(4)), INT2OID, INT4OID, INT8OID, "smallint, integer or bigint");
+    }
+
+    if (set == NULL || set->relid != relid || set->kmer_attnum != kmer_attnum || set->count_attnum != count_attnum) {
+        MemoryContext oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+        if (set != NULL) {
+            pfree(set->entries);
+            pfree(set);
+            fcinfo->flinfo->fn_extra = NULL;
+        }
+        set = (KmerSet *) palloc(sizeof(KmerSet));
+        kmer_set_init(set, relid, fcinfo->flinfo->fn_mcxt);
+        set->kmer_attnum = kmer_attnum;
+        set->count_attnum = count_attnum;
+        kmer_set_load(set);
+        fcinfo->flinfo->fn_extra = set;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    kmer_neighbors_init(&iter, kmer->bit_sequence, kmer->length, max_distance);
+    while (kmer_neighbors_next(&iter, &neighbor, &distance)) {
+        KmerSetEntry *entry = kmer_set_find(set, neighbor, kmer->length);
+
+        if ((++probed & 0xFFFF) == 0) {
+            CHECK_FOR_INTERRUPTS();
+        }
+        if (entry != NULL) {
+            Kmer *result = (Kmer *) palloc0(sizeof(Kmer));
+            Datum values[3];
+            bool nulls[3] = {false, false, false};
+
+            result->length = kmer->length;
+            result->bit_sequence = neighbor;
+            values[0] = PointerGetDatum(result);
+            values[1] = Int32GetDatum(distance);
+            values[2] = Int64GetDatum(entry->count);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+    }
+
+    return (Datum) 0;
+}
@@ -270,3 +270,691 @@ SELECT * FROM pg_stat_user_indexes WHERE indexrelname = 'spgist_kmer_idx';
 --(1 row)
 
 
+
+-- DNA batches: many (short) sequences in one value
+SELECT dna_batch('ACGT,GGA,TTAC');
+--   dna_batch
+----------------
+-- ACGT,GGA,TTAC
+--(1 row)
+
+SELECT cardinality(dna_batch('ACGT,GGA,TTAC'));
+-- cardinality
+---------------
+--           3
+--(1 row)
+
+SELECT unnest(dna_batch('ACGT,GGA,TTAC'));
+-- unnest
+----------
+-- ACGT
+-- GGA
+-- TTAC
+--(3 rows)
+
+-- K-mers of a batch never span two sequences
+SELECT generate_kmers_batch(dna_batch('ACGT,GGA,TTAC'), 3);
+-- generate_kmers_batch
+-------------------------
+-- ACG
+-- CGT
+-- GGA
+-- TTA
+-- TAC
+--(5 rows)
+
+-- Pack a whole table of reads into one value and get them back
+SELECT cardinality(dna_batch_agg(sequence)) FROM (VALUES (dna('ACGT')), (dna('GGA')), (dna('TTAC'))) AS r(sequence);
+-- cardinality
+---------------
+--           3
+--(1 row)
+
+SELECT count(*) FROM (SELECT unnest(dna_batch_agg(sequence)) FROM dna_sequences) AS r;
+-- count
+---------
+--     1
+--(1 row)
+
+-- DNA references into a .2bit file (e.g. faToTwoBit chrM.fa /tmp/chrM.2bit, chrM starting with GATCACAGGTCT...)
+-- Reading server files needs superuser or pg_read_server_files, same as COPY FROM a file
+SELECT dna_ref('/tmp/chrM.2bit', 'chrM', 0, 12);
+--        dna_ref
+------------------------
+-- /tmp/chrM.2bit:chrM:0-12
+--(1 row)
+
+SELECT length('/tmp/chrM.2bit:chrM:0-12'::dna_ref), dna('/tmp/chrM.2bit:chrM:0-12'::dna_ref);
+-- length |     dna
+----------+--------------
+--     12 | GATCACAGGTCT
+--(1 row)
+
+-- Substrings only move the window, nothing is read until we need the nucleotides
+SELECT substring('/tmp/chrM.2bit:chrM:0-12'::dna_ref, 4, 5), dna(substring('/tmp/chrM.2bit:chrM:0-12'::dna_ref, 4, 5));
+--        substring        |  dna
+---------------------------+-------
+-- /tmp/chrM.2bit:chrM:4-9 | ACAGG
+--(1 row)
+
+SELECT generate_kmers_ref('/tmp/chrM.2bit:chrM:0-6'::dna_ref, 4);
+-- generate_kmers_ref
+-----------------------
+-- GATC
+-- ATCA
+-- TCAC
+--(3 rows)
+
+-- Runs of N (cp data/n_blocks.2bit /tmp/, chr1 is ACGTACGTAC NNNNN GATTACAGG)
+-- dna can't hold N, k-mers spanning them are skipped
+SELECT dna('/tmp/n_blocks.2bit:chr1:8-12'::dna_ref);
+-- ERROR:  Region 8-12 of sequence "chr1" overlaps a run of N at 10-15, which dna cannot store
+-- HINT:  generate_kmers_ref() skips the k-mers spanning N.
+
+SELECT generate_kmers_ref('/tmp/n_blocks.2bit:chr1:6-22'::dna_ref, 4);
+-- generate_kmers_ref
+-----------------------
+-- GTAC
+-- GATT
+-- ATTA
+-- TTAC
+-- TACA
+--(5 rows)
+
+-- Reading FASTA/FASTQ files directly, no preprocessing or COPY needed
+-- /tmp/reads.fa:
+-- >read1 first read
+-- ACGTAC
+-- GTTT
+-- >read2
+-- ggcat
+SELECT * FROM read_fasta('/tmp/reads.fa');
+--       name       |  sequence
+--------------------+------------
+-- read1 first read | ACGTACGTTT
+-- read2            | GGCAT
+--(2 rows)
+
+-- /tmp/reads.fq:
+-- @read1
+-- ACGTA
+-- +
+-- IIIII
+-- @read2
+-- TTG
+-- +
+-- #5I
+SELECT * FROM read_fastq('/tmp/reads.fq');
+-- name  | sequence | quality
+---------+----------+---------
+-- read1 | ACGTA    | IIIII
+-- read2 | TTG      | #5I
+--(2 rows)
+
+-- Reads with N fail the load, unless they're skipped
+-- /tmp/reads_n.fq:
+-- @r1
+-- ACGTA
+-- +
+-- IIIII
+-- @r2 has N
+-- ACNTA
+-- +
+-- IIIII
+-- @r3
+-- TTG
+-- +
+-- #5I
+SELECT * FROM read_fastq('/tmp/reads_n.fq');
+-- ERROR:  Invalid character in DNA sequence: N
+-- DETAIL:  Sequence "r2 has N", line 6 of file "/tmp/reads_n.fq".
+
+SELECT * FROM read_fastq('/tmp/reads_n.fq', skip_invalid => true);
+-- NOTICE:  Skipped 1 record of file "/tmp/reads_n.fq" with characters other than A, C, G and T
+-- name | sequence | quality
+--------+----------+---------
+-- r1   | ACGTA    | IIIII
+-- r3   | TTG      | #5I
+--(2 rows)
+
+-- Loading a whole file into a table
+DROP TABLE IF EXISTS reads;
+CREATE TABLE reads AS SELECT name, sequence FROM read_fastq('/tmp/reads.fq');
+SELECT count(*), sum(length(sequence)) FROM reads;
+-- count | sum
+---------+-----
+--     2 |   8
+--(1 row)
+
+-- Binary COPY round trip, the packed bits are sent as-is so nothing gets re-encoded on the way
+DROP TABLE IF EXISTS dna_binary_bench;
+CREATE TABLE dna_binary_bench AS
+SELECT i AS id, dna(string_agg(substr('ACGT', (random() * 3)::int + 1, 1), '')) AS sequence
+FROM generate_series(1, 1000) AS i, generate_series(1, 10000) AS j
+GROUP BY i;
+
+\timing on
+COPY dna_binary_bench TO '/tmp/dna_binary_bench.txt' WITH (FORMAT text);
+COPY dna_binary_bench TO '/tmp/dna_binary_bench.bin' WITH (FORMAT binary);
+
+DROP TABLE IF EXISTS dna_binary_copy;
+CREATE TABLE dna_binary_copy (LIKE dna_binary_bench);
+COPY dna_binary_copy FROM '/tmp/dna_binary_bench.txt' WITH (FORMAT text);
+TRUNCATE dna_binary_copy;
+COPY dna_binary_copy FROM '/tmp/dna_binary_bench.bin' WITH (FORMAT binary);
+\timing off
+
+SELECT count(*) FROM dna_binary_bench b JOIN dna_binary_copy c USING (id) WHERE b.sequence = c.sequence;
+-- count
+---------
+--  1000
+--(1 row)
+
+-- Reverse complement
+SELECT revcomp(dna('ACGTTGCA')), revcomp('AAAC'::kmer);
+--  revcomp | revcomp
+-----------+---------
+-- TGCAACGT | GTTT
+--(1 row)
+
+-- Reverse complementing twice gives the sequence back
+SELECT count(*) FROM dna_sequences WHERE revcomp(revcomp(sequence)) = sequence;
+-- count
+---------
+--     1
+--(1 row)
+
+-- GC content and base composition, no decoding to text
+SELECT gc_content(dna('ACGTGGCA')), gc_content('GGCA'::kmer);
+-- gc_content | gc_content
+--------------+------------
+--      0.625 |       0.75
+--(1 row)
+
+SELECT * FROM base_counts(dna('ACGTGGCA'));
+-- a | c | g | t
+-----+---+---+---
+-- 2 | 2 | 3 | 1
+--(1 row)
+
+-- GC content in windows of 4, moving 2 nucleotides at a time
+SELECT * FROM gc_content(dna('ACGTGGCAAT'), 4, 2);
+-- start | gc_content
+---------+------------
+--     0 |        0.5
+--     2 |       0.75
+--     4 |       0.75
+--     6 |       0.25
+--(4 rows)
+
+-- Out of line values are read one TOAST slice at a time, so this never detoasts the whole sequence
+SELECT gc_content(sequence), (base_counts(sequence)).* FROM dna_sequences;
+
+-- Approximate search, every place a match with at most 1 edit ends
+SELECT * FROM dna_find_approx(dna('TTACGTTTACTT'), dna('ACGT'), 1);
+-- end_pos | edits
+-----------+-------
+--       5 |     1
+--       6 |     0
+--       7 |     1
+--      11 |     1
+--      12 |     1
+--(5 rows)
+
+-- Best hit of a primer in each sequence
+SELECT d.id, f.end_pos, f.edits
+FROM dna_sequences d,
+     LATERAL (SELECT * FROM dna_find_approx(d.sequence, dna('ACGTACGTACGTACGTACGT'), 3) ORDER BY edits LIMIT 1) AS f;
+
+-- Edit distance, no 255 character limit like levenshtein() from fuzzystrmatch
+SELECT dna_edit_distance(dna('ACGTACGT'), dna('ACTTACG')), dna('ACGTACGT') <~> dna('ACGT');
+-- dna_edit_distance | ?column?
+---------------------+----------
+--                 2 |        4
+--(1 row)
+
+-- With a maximum it gives up early, anything further away comes back as max_dist + 1
+SELECT dna_edit_distance(dna('ACGTACGTACGT'), dna('TTTTTTTTTTTT'), 2);
+-- dna_edit_distance
+---------------------
+--                 3
+--(1 row)
+
+-- Closest sequences to a read
+SELECT id, sequence <~> dna('ACGTACGTACGTACGTACGT') AS distance
+FROM dna_sequences
+ORDER BY sequence <~> dna('ACGTACGTACGTACGTACGT')
+LIMIT 5;
+
+-- Local alignment (Smith-Waterman), coordinates are 0-based and end-exclusive
+SELECT * FROM dna_align(dna('ACGTTGCA'), dna('TTACGTGCATT'));
+-- score | query_start | query_end | target_start | target_end |  cigar
+---------+-------------+-----------+--------------+------------+---------
+--     9 |           0 |         8 |            2 |          9 | 3M1I4M
+--(1 row)
+
+-- Global (Needleman-Wunsch) and semi-global (whole query, any part of the target)
+SELECT * FROM dna_align(dna('ACGTTGCA'), dna('TTACGTGCATT'), 'global');
+-- score | query_start | query_end | target_start | target_end |       cigar
+---------+-------------+-----------+--------------+------------+--------------------
+--    -5 |           0 |         8 |            0 |         11 | 2D3M1I4M2D
+--(1 row)
+
+SELECT score, cigar FROM dna_align(dna('ACGTTGCA'), dna('TTACGTGCATT'), 'semiglobal', match => 1, mismatch => 1, gap_open => 2, gap_extend => 1);
+-- score |  cigar
+---------+---------
+--     5 | 3M1I4M
+--(1 row)
+
+-- Align a read against every sequence, best hits first
+SELECT d.id, a.score, a.target_start, a.cigar
+FROM dna_sequences d, LATERAL dna_align(dna('ACGTACGTACGTACGTACGT'), d.sequence) AS a
+ORDER BY a.score DESC
+LIMIT 5;
+
+-- Hamming distance, XOR + popcount on the packed words
+SELECT hamming(dna('ACGTACGT'), dna('ACCTACGA')), hamming('ACGT'::kmer, 'TCGA'::kmer), hamming_le(dna('ACGTACGT'), dna('ACCTACGA'), 1);
+-- hamming | hamming | hamming_le
+-----------+---------+------------
+--       2 |       2 | f
+--(1 row)
+
+-- Benchmark: matching 100000 random 12 nt barcodes against a whitelist barcode, with at most 1 mismatch
+DROP TABLE IF EXISTS barcodes;
+CREATE TABLE barcodes AS
+SELECT i AS id, string_agg(substr('ACGT', (random() * 3)::int + 1, 1), '') AS barcode_text
+FROM generate_series(1, 100000) AS i, generate_series(1, 12) AS j
+GROUP BY i;
+ALTER TABLE barcodes ADD COLUMN barcode dna;
+UPDATE barcodes SET barcode = dna(barcode_text);
+
+\timing on
+-- Through text, comparing character by character
+SELECT count(*) FROM barcodes
+WHERE (SELECT count(*) FROM generate_series(1, 12) AS p
+       WHERE substr(barcode_text, p, 1) <> substr('ACGTACGTACGT', p, 1)) <= 1;
+-- On the packed words
+SELECT count(*) FROM barcodes WHERE hamming(barcode, dna('ACGTACGTACGT')) <= 1;
+SELECT count(*) FROM barcodes WHERE hamming_le(barcode, dna('ACGTACGTACGT'), 1);
+\timing off
+
+-- Concatenation without decoding
+SELECT dna('ACG') || dna('TTA');
+-- ?column?
+------------
+-- ACGTTA
+--(1 row)
+
+-- Stitching chunks back together in order
+SELECT dna_agg(chunk ORDER BY pos)
+FROM (VALUES (2, dna('GGG')), (1, dna('ACGT')), (3, dna('T'))) AS chunks(pos, chunk);
+-- dna_agg
+------------
+-- ACGTGGGT
+--(1 row)
+
+-- 10000 pieces of 10000 nucleotides into one 100 Mb sequence, linear thanks to the geometric growth
+\timing on
+SELECT length(dna_agg(d.sequence ORDER BY i))
+FROM generate_series(1, 10000) AS i,
+     LATERAL (SELECT dna(string_agg(substr('ACGT', ((i + j) % 4) + 1, 1), '')) AS sequence
+              FROM generate_series(1, 10000) AS j) AS d;
+\timing off
+-- length
+-------------
+-- 100000000
+--(1 row)
+
+-- Translation, codons are read straight from the packed bits
+SELECT translate(dna('ATGGCCATTGTAATGGGCCGCTGAAAGGGTGCCCGATAG'), 1);
+--   translate
+-----------------
+-- MAIVMGR*KGAR*
+--(1 row)
+
+-- Vertebrate mitochondrial code, TGA is tryptophan there
+SELECT translate(dna('ATGGCCATTGTAATGGGCCGCTGAAAGGGTGCCCGATAG'), 1, 2);
+--   translate
+-----------------
+-- MAIVMGRWKGAR*
+--(1 row)
+
+SELECT * FROM six_frame_translate(dna('ATGGCCATTGTAATGGGCCGCTGAAAGGGTGCCCGATAG'));
+-- frame |    protein
+---------+---------------
+--     1 | MAIVMGR*KGAR*
+--     2 | WPL*WAAERVPD
+--     3 | GHCNGPLKGCPI
+--    -1 | LSGTLSAAHYNGH
+--    -2 | YRAPFQRPITMA
+--    -3 | IGHPFSGPLQWP
+--(6 rows)
+
+-- Open reading frames on both strands, the reverse one is reported in forward coordinates
+SELECT * FROM find_orfs(dna('ATGAAATAGTCAGGGCAT'), 6, true);
+-- start | end | frame | strand
+---------+-----+-------+--------
+--     0 |   9 |     1 | +
+--     9 |  18 |    -1 | -
+--(2 rows)
+
+SELECT count(*) FROM dna_sequences, LATERAL find_orfs(sequence, 300, true);
+
+-- Low complexity, a random looking sequence against one with a CA repeat in the middle
+SELECT dust_score(dna('GATTACAGTCCAGTAACGTTAGCATGCAGTCCATGGCATTACGGATCAGCTAGCATCCGAT'));
+--    dust_score
+-------------------
+-- 7.068965517241379
+--(1 row)
+
+SELECT * FROM low_complexity_regions(dna('TGCATGCGTACACACACACACACACACACACACACACACACACACACACAAGTCGATCGT'));
+-- start | end
+---------+-----
+--     9 |  50
+--(1 row)
+
+-- Only the k-mers outside the repeat are left
+SELECT generate_kmers(dna('TGCATGCGTACACACACACACACACACACACACACACACACACACACACAAGTCGATCGT'), 8, 64, 20);
+-- generate_kmers
+------------------
+-- TGCATGCG
+-- GCATGCGT
+-- AGTCGATC
+-- GTCGATCG
+-- TCGATCGT
+--(5 rows)
+
+-- FM-index, built once and kept next to the sequence in a generated column
+CREATE TABLE fm_references (
+  id int PRIMARY KEY,
+  sequence dna,
+  fm fm_index GENERATED ALWAYS AS (dna_fmindex(sequence)) STORED
+);
+INSERT INTO fm_references (id, sequence) VALUES (1, 'GATTACAGATTACA');
+
+SELECT fm, fm_count(fm, 'ATTA'), fm_locate(fm, 'ATTA'), fm_count(fm, 'A') FROM fm_references;
+--                 fm                  | fm_count | fm_locate | fm_count
+---------------------------------------+----------+-----------+----------
+-- fm_index(length=14, sample_rate=32) |        2 | {1,8}     |        6
+--(1 row)
+
+-- Many patterns against one long reference, the index is detoasted once for the whole query
+INSERT INTO fm_references (id, sequence) SELECT 2, sequence FROM dna_sequences LIMIT 1;
+\timing on
+SELECT sum(fm_count(r.fm, dna(substr(t.sequence, i, 20))))
+FROM fm_references r, LATERAL (SELECT r.sequence::text AS sequence) AS t, generate_series(1, 99000, 10) AS i
+WHERE r.id = 2;
+\timing off
+
+-- Substring search over a whole column
+SELECT dna('GATTACAGATTACA') @> 'ACAGAT', dna('GATTACAGATTACA') @> 'ACAGAA';
+-- ?column? | ?column?
+------------+----------
+-- t        | f
+--(1 row)
+
+-- 10M contigs of 1000 nucleotides, looked up by 40-mers through the dna_fm index
+-- (the index takes about an hour to build on one core with PostgreSQL 16, in under 1 GB of memory)
+CREATE TABLE contigs (id int PRIMARY KEY, sequence dna);
+INSERT INTO contigs
+SELECT i, dna(left(translate((SELECT string_agg(md5((i * 32 + j)::text), '' ORDER BY j) FROM generate_series(1, 32) AS j),
+                             '0123456789abcdef', 'ACGTACGTACGTACGT'), 1000))
+FROM generate_series(1, 10000000) AS i;
+
+SET maintenance_work_mem = '1GB';
+\timing on
+CREATE INDEX contigs_sequence_idx ON contigs USING dna_fm (sequence);
+\timing off
+SELECT pg_size_pretty(pg_relation_size('contigs')) AS heap, pg_size_pretty(pg_relation_size('contigs_sequence_idx')) AS index;
+--  heap   |  index
+-----------+---------
+-- 3005 MB | 6299 MB
+--(1 row)
+
+EXPLAIN (ANALYZE, BUFFERS)
+SELECT id FROM contigs WHERE sequence @> (SELECT dna(substr(sequence::text, 301, 40)) FROM contigs WHERE id = 12345);
+
+-- Mapping reads: one with a mismatch, and the reverse complement of one with a deletion
+CREATE TABLE map_references (id int PRIMARY KEY, sequence dna);
+INSERT INTO map_references VALUES
+  (1, 'AATTTGTTGCACGACTCAATGCTATCCGATCTAGCTATGCACACCTATAGTCCATGATAGTTCACTTCGATGGTGAAGACTACGGCATAGGACCCTATGCAGAGAGCACTAAATGGGAAT'),
+  (2, 'TGGTGCTACGAACAGGATACATATATGTTCGGGCCGTGCAGAACCGTCCTGCGGGCGGGTATCATAGTGAAATGTGGGGGTTAACGCAATATAGCAGGGAAGGAAGTATGCGCCTTAAAG');
+CREATE TABLE map_minimizers AS SELECT r.id AS ref_id, m.* FROM map_references r, minimizers(r.sequence) m;
+CREATE INDEX ON map_minimizers (minimizer);
+
+SELECT * FROM minimizers('GCTATCCGATCTAGCTATGCACACC', 15, 10);
+-- minimizer | pos | strand
+-------------+-----+--------
+--    894621 |   0 | -
+--   6382851 |   8 | +
+--(2 rows)
+
+SELECT m.*
+FROM (VALUES (dna('GCTATCCGATCTAGCTATGCACACCTATAGACCATGATAGTTCACTTCGATGGTGAAGAC')),
+             (dna('TCCCTGCTATATTGCGTTAACCCCCACATTTCACATGATACCCGCCCGCAGGACGGTTC')),
+             (dna('ACGTACGTACGTACGTACGTACGTACGT'))) AS r(read),
+     LATERAL map_read(r.read, 'map_references', 'map_minimizers') AS m;
+-- ref_id | pos | strand | score |  cigar
+----------+-----+--------+-------+-----------
+--      1 |  20 | +      |   115 | 60M
+--      2 |  40 | -      |   113 | 25M1D34M
+--        |     |        |       |
+--(3 rows)
+
+-- Unitigs of a de Bruijn graph: a SNP in one of three reads makes a bubble
+SELECT * FROM dbg_unitigs(ARRAY[dna('GATTACAGGCATCTTAG'), dna('GATTACAGGCATCTTAG'), dna('GATTACAGTCATCTTAG')], 5);
+--  unitig   | coverage
+-------------+----------
+-- GATTACAG  |        3
+-- ACAGGCATC |        2
+-- CATCTTAG  |        3
+-- ACAGTCATC |        1
+--(4 rows)
+
+-- Unitigs straight from a table of reads
+SELECT count(*), max(length(unitig::text)), avg(coverage)
+FROM dbg_unitigs((SELECT array_agg(sequence) FROM dna_sequences), 31);
+
+-- K-mer frequency vectors, all 16 dinucleotides and the 10 canonical ones
+SELECT kmer_frequency_vector('ACGTACGT', 2), kmer_frequency_vector('ACGTACGT', 2, true);
+--                       kmer_frequency_vector                        |             kmer_frequency_vector
+----------------------------------------------------------------------+------------------------------------------------
+-- {0,0.2857143,0,0,0,0,0.2857143,0,0,0,0,0.2857143,0.14285715,0,0,0} | {0,0.5714286,0,0,0,0,0.2857143,0,0,0.14285715}
+--(1 row)
+
+SELECT * FROM kmer_frequency_vector('ACGTTTTT', 1, false, 4, 2);
+-- start |      frequencies
+---------+-----------------------
+--     0 | {0.25,0.25,0.25,0.25}
+--     2 | {0,0,0.25,0.75}
+--     4 | {0,0,0,1}
+--(3 rows)
+
+-- Tetranucleotide profiles of every sequence
+\timing on
+SELECT id, kmer_frequency_vector(sequence, 4, true) FROM dna_sequences;
+\timing off
+
+-- ntHash values of the 3-mers of GATTACA, canonical so both strands give the same hashes
+SELECT generate_kmer_hashes('GATTACA', 3, true);
+-- generate_kmer_hashes
+------------------------
+-- -7991993086320528848
+-- -8516248820768645846
+-- -3786313923233604224
+-- -1310247086945127684
+-- -5943741645225835716
+--(5 rows)
+
+SELECT count(*) FROM generate_kmer_hashes('GATTACA', 40);
+-- count
+---------
+--     0
+--(1 row)
+
+-- Rolling hashes against hashing every generated kmer, over the 100k nucleotides of dna_sequences
+-- (best of three on one core with PostgreSQL 16, most of it in count(DISTINCT): 61 ms, 177 ms and 66 ms;
+-- with count() alone, 51 ms for the rolling hashes and 105 ms through generate_kmers())
+\timing on
+SELECT count(DISTINCT h) FROM dna_sequences, generate_kmer_hashes(sequence, 31) AS h;
+SELECT count(DISTINCT kmer_hash(k)) FROM dna_sequences, generate_kmers(sequence, 31) AS k;
+SELECT count(DISTINCT h) FROM dna_sequences, generate_kmer_hashes(sequence, 101, true) AS h;
+\timing off
+
+-- Clustering at 85% identity: each row gets the position of its cluster's representative, the longest sequence in it
+SELECT u.*
+FROM (SELECT array_agg(id ORDER BY id) AS ids, dna_cluster_agg(sequence, 0.85 ORDER BY id) AS clusters
+      FROM (VALUES (1, dna('ACGTACGTTAGCATGCATCGATCGGATC')),
+                   (2, dna('ACGTACGTTAGCATGCATCGATCGGATCA')),
+                   (3, dna('ACGTACGTTAGCTTGCATCGATCGGATC')),
+                   (4, dna('TTGACCATGATTACAGGCATAGCCGATA')),
+                   (5, dna('TTGACCATGATTACAGGCATAGCCG'))) AS r(id, sequence)) AS a,
+     unnest(a.ids, a.clusters) AS u(id, cluster);
+-- id | cluster
+------+---------
+--  1 |       2
+--  2 |       2
+--  3 |       2
+--  4 |       4
+--  5 |       4
+--(5 rows)
+
+-- Clustering a whole table of reads
+\timing on
+SELECT count(DISTINCT c) FROM (SELECT unnest(dna_cluster_agg(sequence, 0.97)) AS c FROM dna_sequences) AS clustered;
+\timing off
+
+-- K-mers longer than 32 nucleotides need kmer128
+SELECT k AS kmer128, length(k) FROM (SELECT 'GATTACAGATTACAGATTACAGATTACAGATTACAGATTACA'::kmer128 AS k) AS t;
+--                  kmer128                   | length
+----------------------------------------------+--------
+-- GATTACAGATTACAGATTACAGATTACAGATTACAGATTACA |     42
+--(1 row)
+
+-- kmer128 sorts like text
+SELECT k FROM unnest(ARRAY['ACT', 'ACGTAC', 'ACGTT', 'ACGTA']::kmer128[]) AS k ORDER BY k;
+--   k
+----------
+-- ACGTA
+-- ACGTAC
+-- ACGTT
+-- ACT
+--(4 rows)
+
+SELECT generate_kmers128('ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTAC', 40);
+--            generate_kmers128
+--------------------------------------------
+-- ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT
+-- CGTACGTACGTACGTACGTACGTACGTACGTACGTACGTA
+-- GTACGTACGTACGTACGTACGTACGTACGTACGTACGTAC
+--(3 rows)
+
+SELECT 'ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT'::kmer128::kmer;
+-- ERROR:  K-mer of 40 nucleotides is too long for kmer, the maximum is 32
+
+-- 48-mers of every sequence, with the btree and SP-GiST indexes
+CREATE TABLE kmer128_data_t AS
+SELECT generate_kmers128(sequence, 48) AS kmer FROM dna_sequences;
+CREATE INDEX kmer128_btree_idx ON kmer128_data_t USING btree (kmer);
+CREATE INDEX kmer128_spgist_idx ON kmer128_data_t USING spgist (kmer);
+ANALYZE kmer128_data_t;
+
+\timing on
+SELECT count(*) FROM kmer128_data_t WHERE kmer = (SELECT kmer FROM kmer128_data_t LIMIT 1);
+SELECT count(*) FROM kmer128_data_t WHERE kmer ^@ 'ACGTACGTAC';
+SELECT kmer, count(*) FROM kmer128_data_t GROUP BY kmer ORDER BY count(*) DESC LIMIT 5;
+\timing off
+
+-- kmer64 is passed by value, k-mers of up to 31 nucleotides
+SELECT k AS generate_kmers64, length(k) FROM generate_kmers64('GATTACA', 4) AS k;
+-- generate_kmers64 | length
+--------------------+--------
+-- GATT             |      4
+-- ATTA             |      4
+-- TTAC             |      4
+-- TACA             |      4
+--(4 rows)
+
+SELECT 'ACGTACGTACGTACGTACGTACGTACGTACGT'::kmer64;
+-- ERROR:  K-mer length cannot exceed 31 nucleotides
+
+-- Same k-mers as kmer, in half the space and without an allocation per k-mer
+CREATE TABLE kmer64_data_t AS
+SELECT generate_kmers64(sequence, 21) AS kmer FROM dna_sequences;
+CREATE TABLE kmer_data_21_t AS
+SELECT generate_kmers(sequence, 21) AS kmer FROM dna_sequences;
+SELECT pg_size_pretty(pg_relation_size('kmer64_data_t')) AS kmer64, pg_size_pretty(pg_relation_size('kmer_data_21_t')) AS kmer;
+
+\timing on
+SELECT count(*) FROM (SELECT k FROM dna_sequences, generate_kmers64(sequence, 21) AS k GROUP BY k) AS distinct_kmers;
+SELECT count(*) FROM (SELECT k FROM dna_sequences, generate_kmers(sequence, 21) AS k GROUP BY k) AS distinct_kmers;
+SELECT kmer, count(*) FROM kmer64_data_t GROUP BY kmer ORDER BY count(*) DESC LIMIT 5;
+\timing off
+
+-- Substitution neighbours of a k-mer, closest first
+SELECT * FROM kmer_neighbors('ACG', 1);
+-- neighbor | distance
+------------+----------
+-- ACG      |        0
+-- TCG      |        1
+-- CCG      |        1
+-- GCG      |        1
+-- AGG      |        1
+-- AAG      |        1
+-- ATG      |        1
+-- ACC      |        1
+-- ACT      |        1
+-- ACA      |        1
+--(10 rows)
+
+-- Only the neighbours in a table of solid k-mers, with their counts
+CREATE TABLE solid_kmers (kmer kmer, count int);
+INSERT INTO solid_kmers VALUES ('ACGTA', 40), ('ACCTA', 3), ('TCGTA', 25), ('GGGGG', 12);
+SELECT * FROM kmer_neighbors('ACGTT', 2, 'solid_kmers', 'kmer', 'count');
+-- neighbor | distance | count
+------------+----------+-------
+-- ACGTA    |        1 |    40
+-- TCGTA    |        2 |    25
+-- ACCTA    |        2 |     3
+--(3 rows)
+
+-- The columns are named, nothing is guessed from the layout of the table
+SELECT * FROM kmer_neighbors('ACGTT', 2, 'solid_kmers', 'kmer', 'kmer');
+-- ERROR:  Column "kmer" of k-mer table solid_kmers must be of type smallint, integer or bigint, not kmer
+
+-- Solid 21-mers (seen at least twice) and the solid neighbours of the 21-mers of the reads
+CREATE TABLE solid_21mers AS
+SELECT k AS kmer, count(*) AS count FROM dna_sequences, generate_kmers(sequence, 21) AS k GROUP BY k HAVING count(*) >= 2;
+\timing on
+SELECT count(*) FROM (SELECT k FROM dna_sequences, generate_kmers(sequence, 21) AS k LIMIT 100000) AS r,
+     kmer_neighbors(r.k, 1, 'solid_21mers', count_column => 'count') AS n;
+\timing off
+
+-- Pattern scan over 100M k-mers (about 4 GB), qkmer @> kmer is a few word operations per row
+-- (on one core with PostgreSQL 16, each scan takes 10 to 14 seconds, against 6.9 seconds for count(*) alone)
+CREATE TABLE kmer_scan_t AS
+SELECT kmer(translate(substr(md5(i::text), 1, 12), '0123456789abcdef', 'ACGTACGTACGTACGT')) AS kmer
+FROM generate_series(1, 100000000) AS i;
+VACUUM ANALYZE kmer_scan_t;
+\timing on
+-- 10.8 s
+SELECT count(*) FROM kmer_scan_t WHERE 'NNRYNNSWNNNN' @> kmer;
+--  count
+-----------
+-- 6248089
+--(1 row)
+
+-- 9.8 s
+SELECT count(*) FROM kmer_scan_t WHERE 'ACGTNNNNNNNN' @> kmer;
+-- count
+----------
+-- 391476
+--(1 row)
+
+-- 13.3 s
+SELECT count(*) FROM kmer_scan_t WHERE 'NNNNNNNNNNNN' @> kmer;
+--   count
+-------------
+-- 100000000
+--(1 row)
+\timing off